@@ -0,0 +1,98 @@
+#include "checksum.h"
+
+// Bitwise implementation, which avoids keeping a 1 KiB table in RAM. The
+// checksums are only computed over small records or while data is already
+// bounded by the speed of the network.
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len) {
+  const uint8_t* bytes = (const uint8_t*) data;
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= bytes[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1u)));
+    }
+  }
+  return ~crc;
+}
+
+uint64_t fnv1a64_update(uint64_t hash, const void* data, size_t len) {
+  const uint8_t* bytes = (const uint8_t*) data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static uint32_t rol32(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+static void sha1_block(uint32_t h[5], const uint8_t block[64]) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) {
+    w[i] = ((uint32_t) block[4 * i] << 24) | ((uint32_t) block[4 * i + 1] << 16) |
+           ((uint32_t) block[4 * i + 2] << 8) | (uint32_t) block[4 * i + 3];
+  }
+  for (int i = 16; i < 80; i++) {
+    w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999u;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1u;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdcu;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6u;
+    }
+    uint32_t t = rol32(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rol32(b, 30);
+    b = a;
+    a = t;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+}
+
+void sha1(const void* data, size_t len, uint8_t digest[SHA1_SIZE]) {
+  const uint8_t* bytes = (const uint8_t*) data;
+  uint32_t h[5] = {
+    0x67452301u, 0xefcdab89u, 0x98badcfeu, 0x10325476u, 0xc3d2e1f0u
+  };
+  size_t done = 0;
+  for (; len - done >= 64; done += 64) {
+    sha1_block(h, &bytes[done]);
+  }
+
+  // Pad the last bytes with a 1 bit, and end with the length in bits.
+  uint8_t block[128] = { 0 };
+  size_t left = len - done;
+  for (size_t i = 0; i < left; i++) {
+    block[i] = bytes[done + i];
+  }
+  block[left] = 0x80;
+  size_t end = left < 56 ? 64 : 128;
+  uint64_t bits = (uint64_t) len * 8;
+  for (int i = 0; i < 8; i++) {
+    block[end - 1 - i] = (uint8_t) (bits >> (8 * i));
+  }
+  for (size_t at = 0; at < end; at += 64) {
+    sha1_block(h, &block[at]);
+  }
+  for (int i = 0; i < SHA1_SIZE; i++) {
+    digest[i] = (uint8_t) (h[i / 4] >> (24 - 8 * (i % 4)));
+  }
+}
@@ -0,0 +1,23 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Standard CRC-32 (zlib / IEEE 802.3 polynomial), such that clients can
+// compute the same value with `zlib.crc32` in Python.
+//
+// Start with a crc of 0 and feed the returned value back to continue the
+// computation over multiple buffers.
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len);
+
+// 64-bit FNV-1a hash, used to identify the content of images. Start with
+// FNV1A64_INIT and feed the returned value back to continue the computation.
+#define FNV1A64_INIT 0xcbf29ce484222325ull
+uint64_t fnv1a64_update(uint64_t hash, const void* data, size_t len);
+
+// SHA-1 digest of the data, as required by the WebSocket handshake.
+#define SHA1_SIZE 20
+void sha1(const void* data, size_t len, uint8_t digest[SHA1_SIZE]);
+
+#endif // !CHECKSUM_H
@@ -3,8 +3,10 @@
 
 import asyncio
 import argparse
+import bisect
 import os
 import time
+import zlib
 from enum import Enum
 
 USB_DEVICES = 64
@@ -27,7 +29,8 @@ usb_status = [
     "DEVICE_ERROR_FLASH_WRITE",
     "DEVICE_ERROR_FLASH_CLOSE",
     "DEVICE_DISCONNECTED",
-    "???", "???", "???", "???", "???", "???", "???",
+    "DEVICE_ERROR_USB_HANG",
+    "???", "???", "???", "???", "???", "???",
     "???", "???"
 ]
 
@@ -41,6 +44,13 @@ flash_timeout = 20 * minute
 # request as some content to be flashed.
 flash_window = 1460 - 4
 
+# With credits, the parts of an image fill buffers of 3 sectors, which the
+# board writes to the device without copying them. The board decodes parts as
+# they arrive, and larger parts save messages, but each part waits for enough
+# credits, thus they span a quarter of the 16 buffers.
+flash_buffer_size = 3 * 512
+flash_part_max_size = 4 * flash_buffer_size
+
 def verbose(s):
     # print(f"verbose: {s}")
     pass
@@ -66,7 +76,7 @@ class AwaitQueue:
         turn = asyncio.Future()
         if self.result_queue != []:
             vid, value = self.result_queue[0]
-            self.result_queue = self.result_queue[:1]
+            self.result_queue = self.result_queue[1:]
             turn.set_result(value)
             return turn
 
@@ -79,7 +89,7 @@ class AwaitQueue:
         if self.result_queue != []:
             vid, value = self.result_queue[0]
             verbose(f"AwaitQueue {self.name}:    {vid}-->: Deque {value}")
-            self.result_queue = self.result_queue[:1]
+            self.result_queue = self.result_queue[1:]
             return value
 
         vid = self.value_count
@@ -134,6 +144,35 @@ class ClientMsg(Enum):
     END_FLASH = 0x05
     REBOOT_FOR_FLASH = 0x06
     REBOOT_SOFT = 0x07
+    START_JOB = 0x08
+    REQUEST_JOB = 0x09
+    REQUEST_PORT_STATS = 0x0a
+    RESET_PORT_STATS = 0x0b
+    REQUEST_SCHEDULE = 0x0c
+    SET_STAGES = 0x0d
+    CACHE_BEGIN = 0x0e
+    CACHE_WRITE = 0x0f
+    CACHE_END = 0x10
+    REQUEST_CACHE = 0x11
+    FLASH_FROM_CACHE = 0x12
+    STORE_IMAGE = 0x13
+    REQUEST_STORE = 0x14
+    LOAD_STORED = 0x15
+    RUN_BATCH = 0x16
+    SET_PATCHES = 0x17
+    CACHE_VARIANT = 0x18
+    CACHE_REUSE = 0x19
+    SET_MANIFEST = 0x1a
+    START_FLASH_COMPRESSED = 0x1b
+    START_FLASH_RAW = 0x1c
+    CACHE_DELTA = 0x1d
+    REQUEST_CACHE_HASHES = 0x1e
+    SET_FAMILY = 0x1f
+    ENABLE_CREDITS = 0x20
+    WRITE_FLASH_PART_AT = 0x21
+    REQUEST_TRANSFER = 0x22
+    REQUEST_CONTROL = 0x23
+    REQUEST_STATUS_SINCE = 0x24
 
 # Equivalent of send_msg_t enum
 class ServerMsg(Enum):
@@ -145,14 +184,91 @@ class ServerMsg(Enum):
     FLASH_END = 0x85
     FLASH_ERROR = 0x86
     DECODE_FAILURE = 0x87
+    UPDATE_JOB = 0x88
+    UPDATE_PORT_STATS = 0x89
+    UPDATE_SCHEDULE = 0x8a
+    UPDATE_CACHE = 0x8b
+    UPDATE_STORE = 0x8c
+    UPDATE_CACHE_HASHES = 0x8d
+    IMAGE_REJECTED = 0x8e
+    UPDATE_CREDITS = 0x8f
+    UPDATE_TRANSFER = 0x90
+    UPDATE_ROLE = 0x91
+    UPDATE_STATUS_CHANGES = 0x92
+
+# Equivalent of job_state_t enum
+JOB_NONE = 0
+JOB_RUNNING = 1
+JOB_COMPLETE = 2
+
+# Equivalent of image_cache_state_t enum
+CACHE_EMPTY = 0
+CACHE_LOADING = 1
+CACHE_READY = 2
+CACHE_INVALID = 3
+
+# Equivalent of image_store_state_t enum
+STORE_DISABLED = 0
+STORE_READY = 1
+STORE_SAVING = 2
+STORE_FAILED = 3
+
+# Equivalent of patch_kind_t enum, with the payload of the HLT instruction which
+# marks where the 32-bit value of each kind is written by the board.
+PATCH_PORT = 0
+PATCH_SERIAL = 1
+PATCH_TIMESTAMP = 2
+patch_hlt_codes = {
+    PATCH_PORT: 0b1010101010101010,
+    PATCH_SERIAL: 0b1010101010101011,
+    PATCH_TIMESTAMP: 0b1010101010101100,
+}
+
+# Equivalent of CACHE_REUSE_PER_MSG and IMAGE_CACHE_MANIFEST_SIZE.
+CACHE_REUSE_PER_MSG = 32
+CACHE_MANIFEST_SIZE = 8
+
+# Equivalent of DECOMPRESS_BLOCK_SIZE and DECOMPRESS_WINDOW.
+DECOMPRESS_BLOCK_SIZE = 1024
+DECOMPRESS_WINDOW = 4096
+
+# Equivalent of uf2_check_error_t enum
+uf2_check_errors = ["valid", "bad magic number", "payload larger than the block",
+                    "block out of order", "inconsistent number of blocks",
+                    "unexpected family ID",
+                    "target address outside of the flash and RAM",
+                    "truncated image", "patched block with an MD5 checksum"]
+
+# Equivalent of UF2_FRAME_PART_SIZE and UF2_FAMILY_RP2040.
+UF2_FRAME_PART_SIZE = 512
+UF2_FAMILY_RP2040 = 0xe48bff56
+
+# Equivalent of port_outcome_t enum
+port_outcomes = ["unknown", "success", "failure", "empty"]
+
+# Equivalent of PORT_STATS_PER_MSG and the size of port_stats_t.
+PORT_STATS_PER_MSG = 16
+PORT_STATS_SIZE = 36
 
 async def tcp_send(tcp, data):
-    tcp.writer.write(bytes(data))
-    await tcp.writer.drain()
+    generation = tcp.generation
+    try:
+        tcp.writer.write(bytes(data))
+        await tcp.writer.drain()
+    except ConnectionError:
+        await tcp.reconnect(generation)
+        raise ConnectionResumed()
 
 async def send_request_status(tcp):
     await tcp_send(tcp, [ClientMsg.REQUEST_STATUS.value])
 
+# Only request the ports whose status changed since the generation known, which
+# is nothing while the board is idle.
+async def send_request_status_since(tcp):
+    msg = [ClientMsg.REQUEST_STATUS_SINCE.value]
+    msg += list(status_generation.to_bytes(4, 'little'))
+    await tcp_send(tcp, msg)
+
 async def send_request_stdout(tcp):
     await tcp_send(tcp, [ClientMsg.REQUEST_STDOUT.value])
 
@@ -168,6 +284,15 @@ async def send_select_device(tcp, device):
 async def send_start_flash(tcp):
     await tcp_send(tcp, [ClientMsg.START_FLASH.value])
 
+async def send_start_flash_compressed(tcp):
+    await tcp_send(tcp, [ClientMsg.START_FLASH_COMPRESSED.value])
+
+async def send_start_flash_raw(tcp, base_addr, family_id, size):
+    msg = [ClientMsg.START_FLASH_RAW.value] + \
+        list(base_addr.to_bytes(4, 'little')) + \
+        list(family_id.to_bytes(4, 'little')) + list(size.to_bytes(4, 'little'))
+    await tcp_send(tcp, msg)
+
 async def send_write_flash_part(tcp, part):
     length = len(part)
     msg = [
@@ -177,16 +302,143 @@ async def send_write_flash_part(tcp, part):
     ] + list(part)
     await tcp_send(tcp, msg)
 
+async def send_write_flash_part_at(tcp, seq, offset, part):
+    length = len(part)
+    msg = [ClientMsg.WRITE_FLASH_PART_AT.value] + \
+        list(seq.to_bytes(4, 'little')) + list(offset.to_bytes(4, 'little')) + \
+        [length & 0xff, length >> 8] + list(part)
+    await tcp_send(tcp, msg)
+
+async def send_request_transfer(tcp):
+    await tcp_send(tcp, [ClientMsg.REQUEST_TRANSFER.value])
+
 async def send_end_flash(tcp):
     await tcp_send(tcp, [ClientMsg.END_FLASH.value])
 
+async def send_start_job(tcp, first, last, size, crc):
+    msg = [
+        ClientMsg.START_JOB.value,
+        first & 0xff,
+        last & 0xff
+    ] + list(size.to_bytes(4, 'little')) + list(crc.to_bytes(4, 'little'))
+    await tcp_send(tcp, msg)
+
+async def send_request_job(tcp):
+    await tcp_send(tcp, [ClientMsg.REQUEST_JOB.value])
+
+async def send_request_port_stats(tcp, first, last):
+    await tcp_send(tcp, [ClientMsg.REQUEST_PORT_STATS.value, first & 0xff, last & 0xff])
+
+async def send_reset_port_stats(tcp, port):
+    await tcp_send(tcp, [ClientMsg.RESET_PORT_STATS.value, port & 0xff])
+
+async def send_request_schedule(tcp, first, last):
+    await tcp_send(tcp, [ClientMsg.REQUEST_SCHEDULE.value, first & 0xff, last & 0xff])
+
+async def send_set_stages(tcp, count):
+    await tcp_send(tcp, [ClientMsg.SET_STAGES.value, count & 0xff])
+
+async def send_cache_begin(tcp, size, crc):
+    msg = [ClientMsg.CACHE_BEGIN.value] + \
+        list(size.to_bytes(4, 'little')) + list(crc.to_bytes(4, 'little'))
+    await tcp_send(tcp, msg)
+
+async def send_cache_write(tcp, part):
+    length = len(part)
+    msg = [
+        ClientMsg.CACHE_WRITE.value,
+        length & 0xff,
+        length >> 8
+    ] + list(part)
+    await tcp_send(tcp, msg)
+
+async def send_cache_end(tcp, offsets):
+    msg = [ClientMsg.CACHE_END.value, len(offsets)]
+    for off in offsets:
+        msg += list(off.to_bytes(4, 'little'))
+    await tcp_send(tcp, msg)
+
+async def send_cache_variant(tcp, size, crc):
+    msg = [ClientMsg.CACHE_VARIANT.value] + \
+        list(size.to_bytes(4, 'little')) + list(crc.to_bytes(4, 'little'))
+    await tcp_send(tcp, msg)
+
+async def send_cache_reuse(tcp, blocks):
+    msg = [ClientMsg.CACHE_REUSE.value, len(blocks)]
+    for header, payload_hash in blocks:
+        msg += list(header) + list(payload_hash.to_bytes(4, 'little'))
+    await tcp_send(tcp, msg)
+
+async def send_set_manifest(tcp, manifest):
+    msg = [ClientMsg.SET_MANIFEST.value, len(manifest)]
+    for first, last, variant in manifest:
+        msg += [first & 0xff, last & 0xff, variant & 0xff]
+    await tcp_send(tcp, msg)
+
+async def send_cache_delta(tcp, size, crc, base_crc):
+    msg = [ClientMsg.CACHE_DELTA.value] + list(size.to_bytes(4, 'little')) + \
+        list(crc.to_bytes(4, 'little')) + list(base_crc.to_bytes(4, 'little'))
+    await tcp_send(tcp, msg)
+
+async def send_request_cache_hashes(tcp, first):
+    await tcp_send(tcp, [ClientMsg.REQUEST_CACHE_HASHES.value, first & 0xff, first >> 8])
+
+async def send_enable_credits(tcp):
+    await tcp_send(tcp, [ClientMsg.ENABLE_CREDITS.value])
+
+async def send_set_family(tcp, family_id):
+    await tcp_send(tcp, [ClientMsg.SET_FAMILY.value] + list(family_id.to_bytes(4, 'little')))
+
+async def send_request_cache(tcp):
+    await tcp_send(tcp, [ClientMsg.REQUEST_CACHE.value])
+
+async def send_flash_from_cache(tcp):
+    await tcp_send(tcp, [ClientMsg.FLASH_FROM_CACHE.value])
+
+async def send_set_patches(tcp, patches, serial_base, timestamp):
+    msg = [ClientMsg.SET_PATCHES.value, len(patches)]
+    msg += list(serial_base.to_bytes(4, 'little'))
+    msg += list(timestamp.to_bytes(4, 'little'))
+    for p in patches:
+        msg += list(p["offset"].to_bytes(4, 'little')) + [p["kind"], p["size"], 0, 0]
+    await tcp_send(tcp, msg)
+
+async def send_store_image(tcp):
+    await tcp_send(tcp, [ClientMsg.STORE_IMAGE.value])
+
+async def send_request_store(tcp):
+    await tcp_send(tcp, [ClientMsg.REQUEST_STORE.value])
+
+async def send_load_stored(tcp, image_hash):
+    msg = [ClientMsg.LOAD_STORED.value] + list(image_hash.to_bytes(8, 'little'))
+    await tcp_send(tcp, msg)
+
+async def send_run_batch(tcp, first, last):
+    await tcp_send(tcp, [ClientMsg.RUN_BATCH.value, first, last])
+
 update_status_msg = AwaitQueue("update_status")
+known_status = [0] * USB_DEVICES
+status_generation = 0
 def recv_update_status(data):
     devices = data[1] + (data[2] << 8)
     status = data[3:3 + devices]
+    known_status[:len(status)] = status
     update_status_msg.received(status)
     return devices + 3
 
+# The changes are applied to the status known, which is then given like the
+# status of UPDATE_STATUS.
+def recv_update_status_changes(data):
+    global status_generation
+    status_generation = int.from_bytes(data[1:5], 'little')
+    count = data[9]
+    for i in range(count):
+        port, code = data[10 + 2 * i], data[11 + 2 * i]
+        if port < USB_DEVICES:
+            known_status[port] = code
+    update_status_msg.received(bytes(known_status))
+    return 10 + 2 * count
+
 update_stdout_msg = AwaitQueue("update_stdout")
 def recv_update_stdout(data):
     length = data[1] + (data[2] << 8)
@@ -214,6 +466,134 @@ def recv_flash_end(data):
     flash_end_msg.received(None)
     return 1
 
+# The image being flashed is not a valid UF2 file, which is reported by the
+# board once, and stops the batch.
+class ImageRejected(Exception):
+    pass
+
+image_rejected = None
+def recv_image_rejected(data):
+    global image_rejected
+    reason = uf2_check_errors[data[1]] if data[1] < len(uf2_check_errors) else data[1]
+    block = int.from_bytes(data[2:6], 'little')
+    image_rejected = f"The image was rejected at block {block}: {reason}."
+    print(image_rejected)
+    return 6
+
+# Bytes of buffers which the parts sent since ENABLE_CREDITS may fill, and which
+# they filled, modulo 2^32 as counted by the board.
+credit_limit = None
+credit_used = 0
+credit_update = asyncio.Event()
+def recv_update_credits(data):
+    global credit_limit
+    credit_limit = int.from_bytes(data[1:5], 'little')
+    credit_update.set()
+    return 5
+
+update_transfer_msg = AwaitQueue("update_transfer")
+def recv_update_transfer(data):
+    transfer = {
+        "active": data[1] != 0,
+        "seq": int.from_bytes(data[2:6], 'little'),
+        "received": int.from_bytes(data[6:10], 'little'),
+        "written": int.from_bytes(data[10:14], 'little'),
+    }
+    update_transfer_msg.received(transfer)
+    return 14
+
+update_role_msg = AwaitQueue("update_role")
+def recv_update_role(data):
+    update_role_msg.received(data[1] != 0)
+    return 2
+
+update_job_msg = AwaitQueue("update_job")
+def recv_update_job(data):
+    job = {
+        "state": data[1],
+        "first": data[2],
+        "last": data[3],
+        "resume": data[4],
+        "size": int.from_bytes(data[5:9], 'little'),
+        "crc": int.from_bytes(data[9:13], 'little'),
+    }
+    update_job_msg.received(job)
+    return 13
+
+update_cache_msg = AwaitQueue("update_cache")
+def recv_update_cache(data):
+    cache = {
+        "state": data[1],
+        "blocks": data[2] + (data[3] << 8),
+        "size": int.from_bytes(data[4:8], 'little'),
+        "crc": int.from_bytes(data[8:12], 'little'),
+        "variants": data[12],
+        "pool_blocks": data[13] + (data[14] << 8),
+        "failed": data[15],
+    }
+    update_cache_msg.received(cache)
+    return 16
+
+update_store_msg = AwaitQueue("update_store")
+def recv_update_store(data):
+    store = {
+        "state": data[1],
+        "count": data[2],
+        "batch": data[3] != 0,
+        "blocks": data[4] + (data[5] << 8),
+        "size": int.from_bytes(data[6:10], 'little'),
+        "crc": int.from_bytes(data[10:14], 'little'),
+        "hash": int.from_bytes(data[14:22], 'little'),
+    }
+    update_store_msg.received(store)
+    return 22
+
+update_cache_hashes_msg = AwaitQueue("update_cache_hashes")
+def recv_update_cache_hashes(data):
+    count = data[3]
+    hashes = [int.from_bytes(data[4 + 4 * i: 8 + 4 * i], 'little')
+              for i in range(count)]
+    update_cache_hashes_msg.received(hashes)
+    return 4 + 4 * count
+
+update_port_stats_msg = AwaitQueue("update_port_stats")
+def recv_update_port_stats(data):
+    first = data[1]
+    count = data[2]
+    ports = []
+    for i in range(count):
+        off = 3 + i * PORT_STATS_SIZE
+        u16 = lambda o: int.from_bytes(data[off + o:off + o + 2], 'little')
+        ports.append({
+            "port": first + i,
+            "attempts": u16(0),
+            "successes": u16(2),
+            "empty": u16(4),
+            "timeouts": u16(6),
+            "consecutive_failures": data[off + 8],
+            "last_outcome": data[off + 9],
+            "failures": [u16(12 + 2 * c) for c in range(8)],
+            "bootsel_ms": u16(28),
+            "mount_ms": u16(30),
+            "flash_ms": int.from_bytes(data[off + 32:off + 36], 'little'),
+        })
+    update_port_stats_msg.received(ports)
+    return 3 + count * PORT_STATS_SIZE
+
+update_schedule_msg = AwaitQueue("update_schedule")
+def recv_update_schedule(data):
+    count = data[1]
+    schedule = []
+    for i in range(count):
+        off = 2 + i * 6
+        schedule.append({
+            "port": data[off],
+            "parked": data[off + 1] != 0,
+            "timeout_ms": int.from_bytes(data[off + 2:off + 6], 'little'),
+        })
+    update_schedule_msg.received(schedule)
+    return 2 + count * 6
+
 
 def tcp_recv(tcp, data):
     msg_id = data[0]
@@ -229,6 +609,28 @@ def tcp_recv(tcp, data):
         return recv_flash_part_written(data)
     elif msg_id == ServerMsg.FLASH_END.value:
         return recv_flash_end(data)
+    elif msg_id == ServerMsg.UPDATE_JOB.value:
+        return recv_update_job(data)
+    elif msg_id == ServerMsg.UPDATE_PORT_STATS.value:
+        return recv_update_port_stats(data)
+    elif msg_id == ServerMsg.UPDATE_SCHEDULE.value:
+        return recv_update_schedule(data)
+    elif msg_id == ServerMsg.UPDATE_CACHE.value:
+        return recv_update_cache(data)
+    elif msg_id == ServerMsg.UPDATE_STORE.value:
+        return recv_update_store(data)
+    elif msg_id == ServerMsg.UPDATE_CACHE_HASHES.value:
+        return recv_update_cache_hashes(data)
+    elif msg_id == ServerMsg.IMAGE_REJECTED.value:
+        return recv_image_rejected(data)
+    elif msg_id == ServerMsg.UPDATE_CREDITS.value:
+        return recv_update_credits(data)
+    elif msg_id == ServerMsg.UPDATE_TRANSFER.value:
+        return recv_update_transfer(data)
+    elif msg_id == ServerMsg.UPDATE_ROLE.value:
+        return recv_update_role(data)
+    elif msg_id == ServerMsg.UPDATE_STATUS_CHANGES.value:
+        return recv_update_status_changes(data)
     elif msg_id == ServerMsg.FLASH_ERROR.value:
         print("tcp: pico: An error occured while flashing the device.\n")
     elif msg_id == ServerMsg.DECODE_FAILURE.value:
@@ -242,8 +644,13 @@ async def tcp_fetch(tcp):
     # while not tcp.writer.is_closing():
     while True:
         # Receive the response from the server
-        data = await tcp.reader.read(n = 2048)
+        try:
+            data = await tcp.reader.read(n = 2048)
+        except ConnectionError:
+            break
         if len(data) == 0:
+            if tcp.reader.at_eof():
+                break
             await asyncio.sleep(0.1)
             continue
         debug(f"client: Received message: {data.hex()}\n")
@@ -265,10 +672,13 @@ async def tcp_fetch(tcp):
 async def update_stdout(tcp, flush):
     text = b""
     while True:
-        prefetch = update_stdout_msg.prefetch()
-        if not prefetch.done():
-            await send_request_stdout(tcp)
-        text += await prefetch
+        try:
+            prefetch = update_stdout_msg.prefetch()
+            if not prefetch.done():
+                await send_request_stdout(tcp)
+            text += await tcp.until(prefetch)
+        except ConnectionResumed:
+            continue
 
         lines = text.split(b'\n')
         # If the text ends with a new line, then text would be empty, otherwise
@@ -343,10 +753,13 @@ async def wait_for_usb_status(tcp, device, expected_status, timeout, msg):
         update_status_msg.clear_outdated()
         async with asyncio.timeout(timeout):
             while True:
-                prefetch = update_status_msg.prefetch()
-                if not prefetch.done():
-                    await send_request_status(tcp)
-                all_status = await prefetch
+                try:
+                    prefetch = update_status_msg.prefetch()
+                    if not prefetch.done():
+                        await send_request_status_since(tcp)
+                    all_status = await tcp.until(prefetch)
+                except ConnectionResumed:
+                    continue
 
                 last_status = current_status
                 current_status = all_status[device]
@@ -366,7 +779,12 @@ async def select_device(tcp, device, cdc_timeout = 0, msc_timeout = 0):
         return
     if cdc_timeout == 0 or msc_timeout == 0:
         return
+    await wait_for_flash_request(tcp, device, cdc_timeout, msc_timeout)
 
+
+# Wait until the selected device switched to its bootloader and requested its
+# image.
+async def wait_for_flash_request(tcp, device, cdc_timeout, msc_timeout):
     await wait_for_usb_status(tcp, device, "DEVICE_SELECTED", 1 * minute,
                               "Timeout while waiting for device selection")
     await wait_for_usb_status(tcp, device, "DEVICE_BOOTSEL_REQUEST", cdc_timeout,
@@ -382,11 +800,10 @@ async def clear_status(tcp):
     await wait_for_usb_status(tcp, 0, "DEVICE_UNKNOWN", 1 * minute, "Timeout while clearing USB status")
 
 
-def locate_uf2_arm_halt(content):
+def locate_uf2_arm_halt(content, code):
     # ARM HLT instruction with a 16-bit payload.
     hlt_op = 0b11010100010
-    mask = 0b1010101010101010
-    pattern = (hlt_op << 21) | (mask << 5)
+    pattern = (hlt_op << 21) | (code << 5)
 
     # Split the pattern into little-endian format (byte order)
     ll = pattern & 0xff
@@ -425,138 +842,901 @@ def locate_uf2_arm_halt(content):
     return offsets
 
 
-async def send_uf2_to(tcp, name, device, content, offsets):
-    # Patch the content with the device index.
-    for off in offsets:
-        print(f"Patching offset {off} with device id {device}.")
-        content[off] = device
-        content[off+1] = 0
-        content[off+2] = 0
-        content[off+3] = 0
-    try:
-        # Switch to the device that we are going to flash.
-        await select_device(tcp, device, cdc_timeout, msc_timeout)
-
+# Locate the values to be written by the board for each device.
+def locate_uf2_patches(content):
+    return [{"offset": off, "kind": kind, "size": 4}
+            for kind, code in patch_hlt_codes.items()
+            for off in locate_uf2_arm_halt(content, code)]
+
+
+def lz4_length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+# Append an LZ4 sequence, made of literals followed by a match of `length` bytes
+# copied from `offset` bytes back, or by no match if the offset is 0.
+def lz4_sequence(out, literals, offset, length):
+    token = min(len(literals), 15) << 4
+    if offset:
+        token |= min(length - 4, 15)
+    out.append(token)
+    if len(literals) >= 15:
+        lz4_length(out, len(literals) - 15)
+    out += literals
+    if offset:
+        out += offset.to_bytes(2, 'little')
+        if length - 4 >= 15:
+            lz4_length(out, length - 4 - 15)
+
+
+# Compress the content in the format decoded by the UF2 Batch Flasher, see
+# decompress.h. Each block is returned with its size, and decodes to at most
+# DECOMPRESS_BLOCK_SIZE bytes, such that it fits in a single message.
+def compress_blocks(content):
+    blocks = []
+    table = {}
+    for start in range(0, len(content), DECOMPRESS_BLOCK_SIZE):
+        end = min(start + DECOMPRESS_BLOCK_SIZE, len(content))
+        out = bytearray()
+        anchor = pos = start
+        while pos + 4 <= end:
+            key = bytes(content[pos: pos + 4])
+            candidate = table.get(key)
+            table[key] = pos
+            if candidate is None or pos - candidate > DECOMPRESS_WINDOW:
+                pos += 1
+                continue
+            length = 4
+            while pos + length < end and content[candidate + length] == content[pos + length]:
+                length += 1
+            lz4_sequence(out, content[anchor: pos], pos - candidate, length)
+            pos += length
+            anchor = pos
+        if anchor < end:
+            lz4_sequence(out, content[anchor: end], 0, 0)
+        blocks.append(len(out).to_bytes(2, 'little') + out)
+    return blocks
+
+
+# Frame a raw binary in UF2 blocks, as done by the board, see uf2_frame.h.
+def uf2_frame(content, base_addr, family_id):
+    num_blocks = (len(content) + 255) // 256
+    out = bytearray()
+    for block in range(num_blocks):
+        out += b"".join([value.to_bytes(4, 'little') for value in [
+            0x0a324655, 0x9e5d5157, 0x2000, base_addr + block * 256, 256,
+            block, num_blocks, family_id]])
+        out += content[block * 256: block * 256 + 256].ljust(476, b"\0")
+        out += (0x0ab16f30).to_bytes(4, 'little')
+    return out
+
+
+# Families whose bootloader erases each 4 KiB sector of the flash before
+# writing its first block, and the flash address range.
+erasing_families = [0xe48bff56, 0xe48bff59, 0xe48bff5a]
+flash_start = 0x10000000
+flash_end = 0x11000000
+flash_sector_size = 4096
+
+# Drop the blocks whose payload is erased flash (all 0xff), and renumber the
+# remaining blocks. A block is only dropped if another block is written in the
+# same sector, which the bootloader erases, such that the flash of the devices
+# is unchanged. Returns the new content and the number of dropped blocks.
+def elide_erased_blocks(content):
+    blocks = [content[off: off + 512] for off in range(0, len(content), 512)]
+    u32 = lambda block, off: int.from_bytes(block[off: off + 4], 'little')
+
+    def erasable(block):
+        return (u32(block, 8) & 0x2001 == 0x2000 and u32(block, 28) in erasing_families and
+                flash_start <= u32(block, 12) < flash_end and u32(block, 16) == 256)
+
+    def erased(block):
+        return erasable(block) and block[32:288] == b"\xff" * 256
+
+    # Concatenated images keep their numbering.
+    if any(len(block) != 512 or u32(block, 24) != len(blocks) for block in blocks):
+        return content, 0
+    written_sectors = {u32(block, 12) // flash_sector_size for block in blocks
+                       if erasable(block) and not erased(block)}
+    kept = [block for block in blocks
+            if not erased(block) or u32(block, 12) // flash_sector_size not in written_sectors]
+    if len(kept) == len(blocks):
+        return content, 0
+
+    out = bytearray()
+    for block_no, block in enumerate(kept):
+        out += block[:20] + block_no.to_bytes(4, 'little') + \
+            len(kept).to_bytes(4, 'little') + block[28:]
+    return out, len(blocks) - len(kept)
+
+
+# Reorder the blocks such that the ones of each sector of the flash follow each
+# other, by address, and renumber them. The bootloader then erases and writes
+# each sector once, in a single burst. Images holding blocks out of the flash,
+# of other families, or concatenated, are left unchanged. Returns the new
+# content and the number of blocks which moved.
+def group_sectors(content):
+    blocks = [content[off: off + 512] for off in range(0, len(content), 512)]
+    u32 = lambda block, off: int.from_bytes(block[off: off + 4], 'little')
+
+    def groupable(block):
+        return (len(block) == 512 and u32(block, 24) == len(blocks) and
+                u32(block, 8) & 0x2001 == 0x2000 and u32(block, 28) in erasing_families and
+                flash_start <= u32(block, 12) < flash_end)
+
+    if not all(groupable(block) for block in blocks):
+        return content, 0
+    ordered = sorted(blocks, key=lambda block: u32(block, 12))
+    moved = sum(1 for block, sorted_block in zip(blocks, ordered) if block is not sorted_block)
+    if moved == 0:
+        return content, 0
+
+    out = bytearray()
+    for block_no, block in enumerate(ordered):
+        out += block[:20] + block_no.to_bytes(4, 'little') + block[24:]
+    return out, moved
+
+
+# Stream an image to the selected device. The image is either sent as is, as
+# compressed blocks, or as a raw binary {"content", "base_addr", "family_id"}
+# framed by the board.
+async def send_image(tcp, content, compressed = None, raw = None):
+    global image_rejected
+    image_rejected = None
+    if raw is not None:
+        print(f"Flashing content: {len(content)} bytes to flash, "
+              f"{len(raw['content'])} bytes of binary.")
+        parts = [raw["content"][sent: sent + UF2_FRAME_PART_SIZE]
+                 for sent in range(0, len(raw["content"]), UF2_FRAME_PART_SIZE)]
+    elif compressed is None:
         print(f"Flashing content: {len(content)} bytes to flash.")
-    
-        prefetch = flash_start_msg.prefetch()
+        parts = [content[sent: sent + flash_part_max_size]
+                 for sent in range(0, len(content), flash_part_max_size)]
+    else:
+        print(f"Flashing content: {len(content)} bytes to flash, "
+              f"{sum([len(part) for part in compressed])} bytes compressed.")
+        parts = compressed
+
+    prefetch = flash_start_msg.prefetch()
+    if raw is not None:
+        await send_start_flash_raw(tcp, raw["base_addr"], raw["family_id"],
+                                   len(raw["content"]))
+    elif compressed is None:
         await send_start_flash(tcp)
-        await prefetch
-
-        sent = 0
-        flash_part_received_msg.clear_outdated()
-        flash_part_written_msg.clear_outdated()
-        
-        # If we were to send all data at once, the UF2 Batch Flasher might run
-        # out of memory. Thus we send it in a limited number of chunks, and wait
-        # until the next chunk is available to send more data. At the beginning
-        # they are all available.
-        sent_queue = [asyncio.Future() for _ in range(16)]
-        for f in sent_queue:
-            f.set_result(True)
-        
-        # Send each chunk without overflowing the server.
-        last_time = time.perf_counter() * 1000
-        while sent < len(content):
-            # Wait until the server queue has an empty slot, and pre-allocate
-            # the reception of the chunk that we are about to send.
-            await sent_queue[0]
-            sent_queue = sent_queue[1:]
-            sent_queue.append(flash_part_written_msg.prefetch())
-
-            # Send the next chunk.
+    else:
+        await send_start_flash_compressed(tcp)
+    await prefetch
+
+    # Keep sending parts as long as the board has room to buffer them, which
+    # it reports with merged credits updates instead of acknowledging each
+    # part, such that the link stays busy.
+    await send_parts(tcp, parts, compressed is not None or raw is not None)
+
+    # Close the file, once the parts sent before are written. The board answers
+    # again when the connection was lost after it closed the file.
+    while True:
+        try:
+            prefetch = flash_end_msg.prefetch()
+            await send_end_flash(tcp)
+            await tcp.until(prefetch)
+            break
+        except ConnectionResumed:
+            pass
+    if image_rejected:
+        raise ImageRejected(image_rejected)
+
+
+async def enable_credits(tcp):
+    global credit_used
+    credit_used = 0
+    credit_update.clear()
+    await send_enable_credits(tcp)
+    await credit_update.wait()
+
+
+async def request_transfer(tcp):
+    prefetch = update_transfer_msg.prefetch()
+    await send_request_transfer(tcp)
+    return await tcp.until(prefetch)
+
+
+# Send the parts of an image within the credits given by the board. Each part
+# fills one buffer per started buffer of content, and compressed or raw parts
+# fill a single buffer.
+#
+# Parts are sent with their offset in the content, such that when the
+# connection is lost, the transfer resumes from the content received by the
+# board.
+async def send_parts(tcp, parts, single_buffer):
+    global credit_used
+    offsets = [0]
+    for part in parts:
+        offsets.append(offsets[-1] + len(part))
+
+    last_time = time.perf_counter() * 1000
+    i = 0
+    while i < len(parts):
+        part = parts[i]
+        cost = flash_buffer_size
+        if not single_buffer:
+            cost *= (len(part) + flash_buffer_size - 1) // flash_buffer_size
+        try:
+            while (credit_limit - credit_used - cost) % 2**32 >= 2**31:
+                credit_update.clear()
+                await tcp.until(credit_update.wait())
+
             now = time.perf_counter() * 1000
-            print(f"(waited {now - last_time:.0f}ms) Sending bytes[{sent}:{sent + flash_window}]")
+            print(f"(waited {now - last_time:.0f}ms) Sending part {i + 1}/{len(parts)}")
+            credit_used = (credit_used + cost) % 2**32
+            await send_write_flash_part_at(tcp, i + 1, offsets[i], part)
+            last_time = now
+        except ConnectionResumed:
+            transfer = await request_transfer(tcp)
+            if not transfer["active"]:
+                raise Exception("The transfer of the image was lost.")
+            received = transfer["received"]
+            print(f"Resume sending the image from byte {received}, "
+                  f"{transfer['written']} bytes written.")
+            i = bisect.bisect_right(offsets, received) - 1
+            continue
+        i += 1
+
+        # Stop sending the image once the board rejected it.
+        if image_rejected:
+            break
+
+
+async def request_cache(tcp):
+    prefetch = update_cache_msg.prefetch()
+    await send_request_cache(tcp)
+    return await prefetch
+
+
+# Hash identifying a payload in the image cache, which is the lower half of its
+# FNV-1a hash.
+def payload_hash(payload):
+    h = 0xcbf29ce484222325
+    for b in payload:
+        h = ((h ^ b) * 0x100000001b3) & 0xffffffffffffffff
+    return h & 0xffffffff
+
+
+# Hashes of the payloads held by the image cache.
+async def request_cache_hashes(tcp):
+    hashes = []
+    while True:
+        prefetch = update_cache_hashes_msg.prefetch()
+        await send_request_cache_hashes(tcp, len(hashes))
+        received = await prefetch
+        if received == []:
+            return hashes
+        hashes += received
+
+
+# Upload an image, or another variant of the cached image, to the image cache.
+# Blocks whose payload is already cached, as listed in `known`, are given by
+# their header and the hash of their payload instead of being uploaded again.
+# With `base_crc`, the image replaces the cached image of this CRC-32.
+async def upload_variant(tcp, content, known, variant, base_crc = None):
+    size = len(content)
+    crc = zlib.crc32(content)
+    prefetch = update_cache_msg.prefetch()
+    if base_crc is not None:
+        await send_cache_delta(tcp, size, crc, base_crc)
+    elif variant:
+        await send_cache_variant(tcp, size, crc)
+    else:
+        await send_cache_begin(tcp, size, crc)
+    cache = await prefetch
+    if cache["state"] != CACHE_LOADING:
+        print("The image cache of the UF2 Batch Flasher is not available.")
+        return False
+
+    # Split the file in runs of blocks to upload, and runs of blocks to reuse.
+    # The board rebuilds reused blocks with zeros after the payload.
+    uf2_block_size = 512
+    uf2_magic_end = (0x0ab16f30).to_bytes(4, 'little')
+    runs = []
+    for off in range(0, size, uf2_block_size):
+        block = content[off: off + uf2_block_size]
+        h = payload_hash(block[32:288])
+        reuse = (h in known and len(block) == uf2_block_size and
+                 not any(block[288:508]) and block[508:] == uf2_magic_end)
+        known.add(h)
+        if not runs or runs[-1][0] != reuse:
+            runs.append((reuse, []))
+        runs[-1][1].append((block, h))
+
+    reused = sum([len(blocks) for reuse, blocks in runs if reuse])
+    print(f"Uploading {size} bytes to the image cache, reusing {reused} cached blocks.")
+    flash_part_received_msg.clear_outdated()
+    for reuse, blocks in runs:
+        if reuse:
+            for i in range(0, len(blocks), CACHE_REUSE_PER_MSG):
+                prefetch = flash_part_received_msg.prefetch()
+                await send_cache_reuse(tcp, [(block[:32], h) for block, h in
+                                             blocks[i: i + CACHE_REUSE_PER_MSG]])
+                await prefetch
+            continue
+        data = b"".join([block for block, h in blocks])
+        for sent in range(0, len(data), flash_window):
             prefetch = flash_part_received_msg.prefetch()
-            await send_write_flash_part(tcp, content[sent: sent + flash_window])
+            await send_cache_write(tcp, data[sent: sent + flash_window])
             await prefetch
 
-            # Wait until the last chunk is received. (optional)
-            sent = sent + flash_window
-            last_time = now
-        
-        # Wait until all have been written.
-        while sent_queue != []:
-            await sent_queue[0]
-            sent_queue = sent_queue[1:]
-        
-        # Close the file.
-        prefetch = flash_end_msg.prefetch()
-        await send_end_flash(tcp)
-        await prefetch
-        
+    prefetch = update_cache_msg.prefetch()
+    await send_cache_end(tcp, [])
+    cache = await prefetch
+    if cache["state"] != CACHE_READY:
+        return False
+    # The images cached before are kept when a delta or a variant cannot be
+    # loaded.
+    if cache["failed"] or cache["crc"] != crc:
+        if base_crc is not None:
+            print("The delta cannot be loaded, the previous image is still cached.")
+        else:
+            print(f"The variant cannot be loaded, {cache['variants']} variants are still cached.")
+        return False
+    print(f"Image cached as {cache['blocks']} blocks, "
+          f"{cache['pool_blocks']} distinct blocks in the cache.")
+    return True
+
+
+# Upload the image once to the image cache of the UF2 Batch Flasher, which then
+# patches it for each device. Returns False if the image cannot be cached.
+async def upload_to_cache(tcp, content):
+    size = len(content)
+    crc = zlib.crc32(content)
+    cache = await request_cache(tcp)
+    if (cache["state"] == CACHE_READY and cache["variants"] == 1 and
+            cache["size"] == size and cache["crc"] == crc):
+        print("Image already in the cache of the UF2 Batch Flasher.")
+        return True
+
+    # Only upload the blocks which differ from the cached image, such as a
+    # previous build of the same firmware.
+    if cache["state"] == CACHE_READY and cache["variants"] == 1:
+        known = set(await request_cache_hashes(tcp))
+        if await upload_variant(tcp, content, known, False, cache["crc"]):
+            return True
+        print("The image cannot be uploaded as a delta, uploading it whole.")
+
+    if not await upload_variant(tcp, content, set(), False):
+        print("The image cannot be cached, it is streamed to each device instead.")
+        return False
+    return True
+
+
+# Upload the variants of an image to the image cache, which stores the payloads
+# they share once, and map each range of ports to its variant. Returns False if
+# the variants cannot be cached.
+async def upload_variants(tcp, stages, port_ranges):
+    if len(stages) > CACHE_MANIFEST_SIZE:
+        print(f"At most {CACHE_MANIFEST_SIZE} port ranges can be cached, images are streamed instead.")
+        return False
+    known = set()
+    for i, stage in enumerate(stages):
+        # The patches are recorded along each variant.
+        await set_stage_patches(tcp, stage)
+        if not await upload_variant(tcp, stage["content"], known, i > 0):
+            print("The variants cannot be cached, they are streamed to each device instead.")
+            return False
+
+    prefetch = update_cache_msg.prefetch()
+    await send_set_manifest(tcp, [(first, last, i) for i, (first, last)
+                                  in enumerate(port_ranges)])
+    cache = await prefetch
+    print(f"{cache['variants']} variants cached as {cache['pool_blocks']} distinct blocks.")
+    return True
+
+
+async def flash_from_cache(tcp):
+    print("Flashing content from the image cache.")
+    flash_start_msg.clear_outdated()
+    flash_end_msg.clear_outdated()
+    await send_flash_from_cache(tcp)
+
+
+async def request_store(tcp):
+    prefetch = update_store_msg.prefetch()
+    await send_request_store(tcp)
+    return await prefetch
+
+
+# Save the cached image in the flash of the UF2 Batch Flasher, such that it can
+# flash it after a reboot without any client.
+async def store_image(tcp):
+    prefetch = update_store_msg.prefetch()
+    await send_store_image(tcp)
+    store = await prefetch
+    if store["state"] == STORE_DISABLED:
+        print("The image store of the UF2 Batch Flasher is disabled.")
+        return False
+    while store["state"] == STORE_SAVING:
+        await asyncio.sleep(0.5)
+        store = await request_store(tcp)
+    if store["state"] != STORE_READY:
+        print("The image could not be saved in the flash of the UF2 Batch Flasher.")
+        return False
+    print(f"Image stored ({store['count']} images, latest: {store['hash']:016x}).")
+    return True
+
+
+async def load_stored(tcp, image_hash):
+    prefetch = update_cache_msg.prefetch()
+    await send_load_stored(tcp, image_hash)
+    cache = await prefetch
+    if cache["state"] != CACHE_READY:
+        print("No stored image to load in the image cache.")
+        return False
+    print(f"Loaded stored image of {cache['size']} bytes in the image cache.")
+    return True
+
+
+# Let the UF2 Batch Flasher flash the cached image on a range of ports on its
+# own, and wait until it is done.
+async def run_batch(tcp, first, last):
+    print(f"Run a batch on USB ports {first}-{last} from the UF2 Batch Flasher.")
+    prefetch = update_store_msg.prefetch()
+    await send_run_batch(tcp, first, last)
+    await prefetch
+    while True:
+        await asyncio.sleep(1)
+        store = await request_store(tcp)
+        if not store["batch"]:
+            break
+
+
+# Stage whose patches were given last to the board.
+patched_stage = None
+
+# Give the board the values to write in the image of a stage, unless they were
+# already given. The serial number is kept by the board for all stages flashed
+# on the same port.
+async def set_stage_patches(tcp, stage):
+    global patched_stage
+    if patched_stage is stage:
+        return
+    patched_stage = stage
+    await send_set_patches(tcp, stage["patches"], stage["serial"], stage["timestamp"])
+
+
+# Stream the image while the device gets ready, which the board holds until the
+# device requests it, such that the network is not idle while the device
+# switches to its bootloader. Stops streaming if the device fails.
+async def send_image_prefetched(tcp, ready, stage):
+    ready = asyncio.ensure_future(ready)
+    sending = asyncio.ensure_future(
+        send_image(tcp, stage["content"], stage.get("compressed"), stage.get("raw")))
+    await asyncio.wait([ready, sending], return_when=asyncio.FIRST_COMPLETED)
+    if sending.done():
+        # The image got written, thus the device was ready even if the status
+        # polls missed it.
+        ready.cancel()
+    else:
+        try:
+            await ready
+        except BaseException:
+            sending.cancel()
+            raise
+    await sending
+
+
+async def send_uf2_to(tcp, name, device, stages, port_timeout = msc_timeout):
+    global all_status
+    try:
+        # Switch to the device that we are going to flash.
+        print(f"Select device {device}")
+        await send_select_device(tcp, device)
+        ready = wait_for_flash_request(tcp, device, cdc_timeout, port_timeout)
+
+        for i, stage in enumerate(stages):
+            if i > 0:
+                # The device rebooted after the previous image, and the board
+                # switches it to BOOTSEL mode again. Forget the status cached
+                # before the previous image was closed.
+                all_status = []
+                ready = wait_for_usb_status(tcp, device, "DEVICE_FLASH_REQUEST", port_timeout,
+                                            f"Timeout while waiting for flash request of stage {i + 1}")
+            await set_stage_patches(tcp, stage)
+
+            # The board patches the image with the values of the device.
+            if stage.get("cached"):
+                await ready
+                await flash_from_cache(tcp)
+                continue
+            await send_image_prefetched(tcp, ready, stage)
+
         await wait_for_usb_status(tcp, device, "DEVICE_FLASH_COMPLETE", flash_timeout,
                                   "Timeout while waiting for flash completion")
+    except ImageRejected:
+        raise
     except Exception as e:
         print(f"Unable to flash device at USB port {device}:\n{e}")
 
 
-async def send_uf2(tcp, name, content, args):
-    # Walk the uf2 content to locate any HALT instruction with a special code to
-    # replace it by the index of the device.
-    offsets = locate_uf2_arm_halt(content)
-    await clear_status(tcp)
+async def request_job(tcp):
+    prefetch = update_job_msg.prefetch()
+    await send_request_job(tcp)
+    return await prefetch
+
+
+async def request_port_stats(tcp, first, last):
+    ports = []
+    while first <= last:
+        prefetch = update_port_stats_msg.prefetch()
+        await send_request_port_stats(tcp, first, last)
+        received = await prefetch
+        if received == []:
+            break
+        ports += received
+        first += len(received)
+    return ports
+
+
+async def request_schedule(tcp, first, last):
+    prefetch = update_schedule_msg.prefetch()
+    await send_request_schedule(tcp, first, last)
+    return await prefetch
+
+
+async def request_status(tcp):
+    prefetch = update_status_msg.prefetch()
+    if not prefetch.done():
+        await send_request_status(tcp)
+    return await prefetch
 
-    devices = []
+
+def print_port_stats(ports):
+    print("port attempts successes empty timeouts failing last     bootsel  mount    flash    failures")
+    for p in ports:
+        if p["attempts"] == 0 and p["empty"] == 0:
+            continue
+        failures = " ".join([f"{usb_status[0x10 + c]}={n}"
+                             for c, n in enumerate(p["failures"]) if n])
+        print(f"{p['port']:4} {p['attempts']:8} {p['successes']:9} {p['empty']:5} "
+              f"{p['timeouts']:8} {p['consecutive_failures']:7} "
+              f"{port_outcomes[p['last_outcome']]:8} "
+              f"{p['bootsel_ms']:6}ms {p['mount_ms']:6}ms {p['flash_ms']:6}ms "
+              f"{failures}")
+
+
+def select_devices(args):
     if args.single:
-        devices = [args.single]
+        return [args.single]
     elif args.start_with and args.end_with:
-        devices = range(args.start_with, args.end_with + 1)
+        return range(args.start_with, args.end_with + 1)
     elif args.start_with and not args.end_with:
-        devices = range(args.start_with, USB_DEVICES)
+        return range(args.start_with, USB_DEVICES)
     elif not args.start_with and args.end_with:
-        devices = range(args.end_with + 1)
+        return range(args.end_with + 1)
+    return range(USB_DEVICES)
+
+
+# Flash the files on each device, in order, or with `port_ranges` flash each file
+# as a variant on its own range of ports.
+async def send_uf2(tcp, name, contents, args, port_ranges = None, raws = None):
+    raws = raws or [None] * len(contents)
+
+    # Blocks out of order would have their sectors erased and written more than
+    # once by the bootloader.
+    contents = list(contents)
+    for i, raw in enumerate(raws):
+        if raw is not None:
+            continue
+        contents[i], moved = group_sectors(contents[i])
+        if moved:
+            print(f"Grouped {moved} blocks by flash sector in image {i + 1}.")
+
+    # Skip the blocks of erased flash, which cost a write on every device for
+    # no change. Raw binaries are framed by the board, and sent whole.
+    if args.elide_erased:
+        for i, raw in enumerate(raws):
+            if raw is not None:
+                continue
+            contents[i], skipped = elide_erased_blocks(contents[i])
+            print(f"Skipped {skipped} blocks of erased flash in image {i + 1}.")
+
+    # Identify the images in the journal of the UF2 Batch Flasher, before they
+    # get patched for each device.
+    image_size = sum([len(content) for content in contents])
+    image_crc = 0
+    for content in contents:
+        image_crc = zlib.crc32(content, image_crc)
+
+    # Walk the uf2 content to locate any HALT instruction with a special code to
+    # replace it by the values of each device, such as the index of its port.
+    timestamp = int(time.time())
+    stages = [{"content": content, "patches": locate_uf2_patches(content),
+               "serial": args.serial_base, "timestamp": timestamp,
+               "raw": raw}
+              for content, raw in zip(contents, raws)]
+
+    # Compress the images once, and decompress them on the board for each
+    # device. Raw binaries are sent as is.
+    if args.compress:
+        for stage in stages:
+            if stage["raw"] is None:
+                stage["compressed"] = compress_blocks(stage["content"])
+
+    # Images flashed in a row on a device.
+    def stages_of(device):
+        if port_ranges is None:
+            return stages
+        return [stage for stage, (first, last) in zip(stages, port_ranges)
+                if first <= device <= last][:1]
+
+    devices = [d for d in select_devices(args) if stages_of(d)]
+
+    # Resume the job recorded by the UF2 Batch Flasher before it rebooted. The
+    # status of the ports which are already flashed are restored by the board.
+    resume = False
+    if args.resume:
+        job = await request_job(tcp)
+        if job["state"] != JOB_RUNNING:
+            print("No interrupted job to resume.")
+        elif job["size"] != image_size or job["crc"] != image_crc:
+            print("The interrupted job was flashing a different image.")
+        else:
+            print(f"Resume job from port {job['resume']} to port {job['last']}.")
+            resume = True
+            devices = [d for d in range(job["first"], job["last"] + 1) if stages_of(d)]
+
+    if len(devices) == 0:
+        return
+    # The job parameters have to match the recorded ones to keep the recorded
+    # outcomes of each port.
+    await send_start_job(tcp, devices[0], devices[-1], image_size, image_crc)
+
+    # Order the ports based on their history, with a timeout for each port.
+    timeouts = {}
+    if args.schedule:
+        schedule = await request_schedule(tcp, devices[0], devices[-1])
+        if args.single:
+            schedule = [s for s in schedule if s["port"] == args.single]
+        devices = []
+        for s in schedule:
+            if args.park and s["parked"]:
+                print(f"Skip USB port {s['port']}: parked after repeated failures.")
+                continue
+            if not stages_of(s["port"]):
+                continue
+            devices.append(s["port"])
+            timeouts[s["port"]] = s["timeout_ms"] / 1000 * sec
+
+    if resume:
+        # Skip the ports which have an outcome restored from the journal.
+        status = await request_status(tcp)
+        devices = [d for d in devices
+                   if (status[d] & 0x0f) != usb_status.index("DEVICE_FLASH_COMPLETE")
+                   and not status[d] & 0x10]
     else:
-        devices = range(USB_DEVICES)
+        await clear_status(tcp)
+
+    # The board rejects images of other families before writing them.
+    await send_set_family(tcp, args.expect_family)
+
+    # Upload the image once, instead of sending it to each device.
+    if (args.cache or args.store or args.run_batch) and len(devices) > 0:
+        if port_ranges is not None:
+            cached = await upload_variants(tcp, stages, port_ranges)
+            for stage in stages:
+                stage["cached"] = cached
+        elif len(stages) > 1:
+            print("Only single images can be cached, images are streamed instead.")
+        else:
+            # The patches are sent once, and recorded along the cached image.
+            await set_stage_patches(tcp, stages[0])
+            stages[0]["cached"] = await upload_to_cache(tcp, stages[0]["content"])
+
+    if stages[0].get("cached"):
+        if args.store:
+            await store_image(tcp)
+        if args.run_batch:
+            await run_batch(tcp, devices[0], devices[-1])
+            return
 
-    for device in devices:
-        await send_uf2_to(tcp, name, device, content, offsets)
-        # await asyncio.sleep(1)
+    # Flash all images in a row on each device.
+    await send_set_stages(tcp, len(stages) if port_ranges is None else 1)
+    try:
+        for device in devices:
+            await send_uf2_to(tcp, name, device, stages_of(device),
+                              timeouts.get(device, msc_timeout))
+            # await asyncio.sleep(1)
+    except ImageRejected:
+        print("Stop flashing: the image is not valid for the devices.")
 
     await select_device(tcp, USB_DEVICES)
 
 
+# Follow the board while another client controls it, printing the stdout and the
+# status of the devices pushed to the monitors, until the connection is lost.
+async def monitor(tcp):
+    async def print_stdout():
+        text = b""
+        while True:
+            lines = (text + await update_stdout_msg.fetch()).split(b'\n')
+            text = lines[-1]
+            for line in lines[:-1]:
+                print(f"pico: {line.decode('utf-8', errors='replace')}")
+
+    async def print_status():
+        last = None
+        while True:
+            status = await update_status_msg.fetch()
+            for device, code in enumerate(status):
+                if last is None or last[device] != code:
+                    print(f"USB {device}: {status_name(code)}")
+            last = status
+
+    tasks = [asyncio.create_task(print_stdout()),
+             asyncio.create_task(print_status())]
+    await asyncio.wait(tasks + [tcp.receiver], return_when = asyncio.FIRST_COMPLETED)
+    for task in tasks:
+        task.cancel()
+    print("Connection lost")
+
+
+# Raised by the requests interrupted by the loss of the connection, once it is
+# opened again.
+class ConnectionResumed(Exception):
+    pass
+
+
 class TCPConn:
     reader = None
     writer = None
+    receiver = None
+    generation = 0
+
+    def __init__(self, host, port):
+        self.host = host
+        self.port = port
+        self.lock = asyncio.Lock()
+
+    async def connect(self):
+        self.reader, self.writer = await asyncio.open_connection(self.host, self.port)
+        # Listen for messages from the server.
+        self.receiver = asyncio.create_task(tcp_fetch(self))
+
+    # Open the connection again, unless it was already since the given
+    # generation, and restore the credits, which the board resets with each
+    # connection.
+    async def reconnect(self, generation):
+        async with self.lock:
+            if generation != self.generation:
+                return
+            print("Connection lost, reconnecting to the UF2 Batch Flasher")
+            self.writer.close()
+            async with asyncio.timeout(1 * minute):
+                while True:
+                    try:
+                        await self.connect()
+                        break
+                    except OSError:
+                        await asyncio.sleep(1)
+            # Take the control back, as the board may not have noticed yet that
+            # the former connection got lost.
+            self.writer.write(bytes([ClientMsg.REQUEST_CONTROL.value, 1]))
+            # The board might have rebooted, and its generations restarted.
+            global status_generation
+            status_generation = 0
+            # Credits are enabled while holding the lock, such that the requests
+            # resumed meanwhile wait for them.
+            global credit_used
+            credit_used = 0
+            credit_update.clear()
+            self.writer.write(bytes([ClientMsg.ENABLE_CREDITS.value]))
+            await self.writer.drain()
+            async with asyncio.timeout(cdc_timeout):
+                await credit_update.wait()
+            self.generation += 1
+            print("Reconnected...")
+
+    # Wait for a reply from the board, or raise ConnectionResumed once the
+    # connection got lost and opened again.
+    async def until(self, awaitable):
+        generation = self.generation
+        receiver = self.receiver
+        task = asyncio.ensure_future(awaitable)
+        await asyncio.wait([task, receiver], return_when = asyncio.FIRST_COMPLETED)
+        if task.done():
+            return task.result()
+        task.cancel()
+        # Failures to decode replies are not recovered.
+        receiver.result()
+        await self.reconnect(generation)
+        raise ConnectionResumed()
+
+
+# Read an image to flash. Raw binaries are framed to locate their patches and
+# identify them in the journal, but only the binary is sent to each device.
+# Returns the UF2 content, and the raw binary if any.
+def read_image(file_path, args):
+    with open(file_path, "rb") as f:
+        content = bytearray(f.read())
+    if not file_path.endswith(".bin"):
+        return content, None
+    if args.base_address % 256 != 0:
+        raise Exception(f"The base address of {file_path} is not aligned on 256 bytes.")
+    raw = {"content": content, "base_addr": args.base_address,
+           "family_id": args.family_id}
+    return uf2_frame(content, args.base_address, args.family_id), raw
 
 
 async def main(args):
     print("Connecting to the UF2 Batch Flasher")
-    reader, writer = await asyncio.open_connection(args.host, args.port)
-    tcp = TCPConn()
-    tcp.reader = reader
-    tcp.writer = writer
-    print("Connected...")
+    tcp = TCPConn(args.host, args.port)
+    await tcp.connect()
+    controller = await update_role_msg.fetch()
+    print("Connected..." if controller else "Connected as a monitor...")
+    if args.monitor:
+        await monitor(tcp)
+        return
+    if not controller:
+        raise Exception("Another client controls the UF2 Batch Flasher, "
+                        "follow it with --monitor.")
 
     flush_stdout = asyncio.Future()
 
-    # Listen for messages from the server.
-    tcp_receiver = asyncio.create_task(tcp_fetch(tcp))
-
     # Monitor the output from the UF2 Batch Flasher.
     stdout_fwd = asyncio.create_task(update_stdout(tcp, flush_stdout))
 
     # Wait until we pull all stdout content from the board.
     await flush_stdout
 
-    # Read the file and send the content to every UF2 device.
-    file_path = args.uf2_file
-    with open(file_path, "rb") as f:
-        content = bytearray(f.read())
-        await send_uf2(tcp, os.path.basename(file_path), content, args)
+    await enable_credits(tcp)
+
+    if args.reset_port_stats is not None:
+        print(f"Reset statistics of USB port {args.reset_port_stats}")
+        await send_reset_port_stats(tcp, args.reset_port_stats)
+
+    if args.port_stats:
+        print_port_stats(await request_port_stats(tcp, 0, USB_DEVICES - 1))
+
+    if args.load_stored is not None:
+        await load_stored(tcp, int(args.load_stored, 16))
+
+    # Read the files and send their content to every UF2 device.
+    if args.run_batch and not args.uf2_files and not args.variant:
+        # Flash the image already held by the UF2 Batch Flasher.
+        devices = select_devices(args)
+        await run_batch(tcp, devices[0], devices[-1])
+    elif args.variant:
+        port_ranges = []
+        contents = []
+        raws = []
+        for spec in args.variant:
+            ports, file_path = spec.split(":", 1)
+            first, _, last = ports.partition("-")
+            port_ranges.append((int(first), int(last or first)))
+            content, raw = read_image(file_path, args)
+            contents.append(content)
+            raws.append(raw)
+        await send_uf2(tcp, os.path.basename(file_path), contents, args, port_ranges, raws)
+    elif args.uf2_files:
+        contents = []
+        raws = []
+        for file_path in args.uf2_files:
+            content, raw = read_image(file_path, args)
+            contents.append(content)
+            raws.append(raw)
+        await send_uf2(tcp, os.path.basename(args.uf2_files[-1]), contents, args, raws = raws)
 
     if args.reboot:
         print("Send soft-reboot command")
         await send_reboot_soft(tcp)
 
     print("Closing the connection")
-    writer.close()
-    await writer.wait_closed()
+    tcp.writer.close()
+    await tcp.writer.wait_closed()
 
-    tcp_receiver.cancel()
+    tcp.receiver.cancel()
     try:
-        await tcp_receiver
+        await tcp.receiver
     except asyncio.CancelledError:
         pass
 
@@ -581,7 +1761,42 @@ if __name__ == '__main__':
                         help='Port of the UF2 batch flasher')
     parser.add_argument('--reboot', action='store_true',
                         help='Reboot once the operations are done')
-    parser.add_argument('uf2_file', help='Path to the UF2 file to flash')
+    parser.add_argument('--resume', action='store_true',
+                        help='Resume the job interrupted by a reboot of the UF2 Batch Flasher')
+    parser.add_argument('--schedule', action='store_true',
+                        help='Order ports and their timeouts based on their history')
+    parser.add_argument('--park', action='store_true',
+                        help='With --schedule, skip ports which keep failing')
+    parser.add_argument('--cache', action='store_true',
+                        help='Upload the image once to the UF2 Batch Flasher instead of once per device')
+    parser.add_argument('--elide-erased', action='store_true',
+                        help='Skip the UF2 blocks of erased flash, which the bootloader leaves erased')
+    parser.add_argument('--compress', action='store_true',
+                        help='Compress the image streamed to each device, which is decompressed by the UF2 Batch Flasher')
+    parser.add_argument('--store', action='store_true',
+                        help='Save the cached image in the flash of the UF2 Batch Flasher, to flash it without any client after a reboot')
+    parser.add_argument('--load-stored', type=str, metavar='HASH',
+                        help='Load an image stored in the flash of the UF2 Batch Flasher, given its hash, or the latest one with 0')
+    parser.add_argument('--run-batch', action='store_true',
+                        help='Let the UF2 Batch Flasher flash the cached or stored image on its own')
+    parser.add_argument('--serial-base', type=int, default=0,
+                        help='First serial number written in the images, where they use the serial marker')
+    parser.add_argument('--base-address', type=lambda v: int(v, 0), default=0x10000000,
+                        help='Address at which .bin files are flashed')
+    parser.add_argument('--family-id', type=lambda v: int(v, 0), default=UF2_FAMILY_RP2040,
+                        help='UF2 family ID of the .bin files')
+    parser.add_argument('--expect-family', type=lambda v: int(v, 0), default=0,
+                        help='UF2 family ID the images must carry, checked by the UF2 Batch Flasher before writing them (any family by default)')
+    parser.add_argument('--variant', action='append', metavar='FIRST-LAST:FILE',
+                        help='Flash a UF2 file on a range of ports, repeated for each variant of the image')
+    parser.add_argument('--port-stats', action='store_true',
+                        help='Print the statistics recorded for each port')
+    parser.add_argument('--reset-port-stats', type=int,
+                        help='Reset the statistics of a serviced port, or of all ports with -1')
+    parser.add_argument('--monitor', action='store_true',
+                        help='Print the output and the status of the devices while another client flashes them')
+    parser.add_argument('uf2_files', nargs='*', metavar='uf2_file',
+                        help='Paths to the UF2 or .bin files to flash, in order, on each device')
     args = parser.parse_args()
 
     asyncio.run(main(args))
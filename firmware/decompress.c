@@ -0,0 +1,130 @@
+#include "decompress.h"
+
+#include <stdio.h>
+
+#define WINDOW_MASK (DECOMPRESS_WINDOW - 1)
+
+_Static_assert((DECOMPRESS_WINDOW & WINDOW_MASK) == 0,
+               "The window is indexed with a mask.");
+
+void decompress_init(decompress_t* d) {
+  d->state = DECOMPRESS_BLOCK_SIZE_LO;
+  d->block_left = 0;
+  d->offset = 0;
+  d->long_match = false;
+  d->literal_left = 0;
+  d->match_left = 0;
+  d->pos = 0;
+}
+
+static void fail(decompress_t* d, const char* reason) {
+  printf("Decompress: %s at %lu.\n", reason, d->pos);
+  d->state = DECOMPRESS_FAILED;
+}
+
+size_t decompress_run(decompress_t* d, const uint8_t* in, size_t in_len,
+                      size_t* consumed, uint8_t* out, size_t out_len) {
+  size_t i = 0, o = 0;
+  while (d->state != DECOMPRESS_FAILED) {
+    // Copy the match from the window, which does not consume any input.
+    if (d->state == DECOMPRESS_MATCH) {
+      for (; d->match_left && o < out_len; d->match_left--) {
+        uint8_t byte = d->window[(d->pos - d->offset) & WINDOW_MASK];
+        d->window[d->pos++ & WINDOW_MASK] = byte;
+        out[o++] = byte;
+      }
+      if (d->match_left) {
+        break;
+      }
+      d->state = DECOMPRESS_TOKEN;
+    }
+    if (d->state == DECOMPRESS_LITERALS && d->literal_left == 0) {
+      d->state = DECOMPRESS_OFFSET_LO;
+    }
+    // Blocks end after a match, or after the literals of their last sequence.
+    if ((d->state == DECOMPRESS_TOKEN || d->state == DECOMPRESS_OFFSET_LO) &&
+        d->block_left == 0) {
+      d->state = DECOMPRESS_BLOCK_SIZE_LO;
+    }
+    if (d->state == DECOMPRESS_LITERALS && o == out_len) {
+      break;
+    }
+    if (i == in_len) {
+      break;
+    }
+    const bool in_block = d->state != DECOMPRESS_BLOCK_SIZE_LO &&
+                          d->state != DECOMPRESS_BLOCK_SIZE_HI;
+    if (in_block) {
+      if (d->block_left == 0) {
+        fail(d, "truncated block");
+        break;
+      }
+      d->block_left--;
+    }
+
+    const uint8_t byte = in[i++];
+    switch (d->state) {
+    case DECOMPRESS_BLOCK_SIZE_LO:
+      d->block_left = byte;
+      d->state = DECOMPRESS_BLOCK_SIZE_HI;
+      break;
+    case DECOMPRESS_BLOCK_SIZE_HI:
+      d->block_left |= (uint16_t) (byte << 8);
+      if (d->block_left == 0) {
+        fail(d, "empty block");
+        break;
+      }
+      d->state = DECOMPRESS_TOKEN;
+      break;
+    case DECOMPRESS_TOKEN:
+      d->literal_left = byte >> 4;
+      d->match_left = (byte & 0x0f) + 4;
+      d->long_match = (byte & 0x0f) == 0x0f;
+      d->state = d->literal_left == 0x0f ? DECOMPRESS_LITERAL_LENGTH
+                                         : DECOMPRESS_LITERALS;
+      break;
+    case DECOMPRESS_LITERAL_LENGTH:
+      d->literal_left += byte;
+      if (byte != 0xff) {
+        d->state = DECOMPRESS_LITERALS;
+      }
+      break;
+    case DECOMPRESS_LITERALS:
+      d->window[d->pos++ & WINDOW_MASK] = byte;
+      out[o++] = byte;
+      d->literal_left--;
+      break;
+    case DECOMPRESS_OFFSET_LO:
+      d->offset = byte;
+      d->state = DECOMPRESS_OFFSET_HI;
+      break;
+    case DECOMPRESS_OFFSET_HI:
+      d->offset |= (uint16_t) (byte << 8);
+      if (d->offset == 0 || d->offset > DECOMPRESS_WINDOW ||
+          d->offset > d->pos) {
+        fail(d, "match out of the window");
+        break;
+      }
+      d->state = d->long_match ? DECOMPRESS_MATCH_LENGTH : DECOMPRESS_MATCH;
+      break;
+    case DECOMPRESS_MATCH_LENGTH:
+      d->match_left += byte;
+      if (byte != 0xff) {
+        d->state = DECOMPRESS_MATCH;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  *consumed = i;
+  return o;
+}
+
+bool decompress_failed(const decompress_t* d) {
+  return d->state == DECOMPRESS_FAILED;
+}
+
+bool decompress_is_complete(const decompress_t* d) {
+  return d->state == DECOMPRESS_BLOCK_SIZE_LO;
+}
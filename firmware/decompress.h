@@ -0,0 +1,64 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming decoder for images compressed by the clients, decoded by the
+// network core while it fills the pipe.
+//
+// The compressed stream is a sequence of blocks, each made of a 16-bit little
+// endian size followed by LZ4 sequences which decode to at most
+// DECOMPRESS_BLOCK_SIZE bytes. Matches can refer to the previous blocks, up to
+// DECOMPRESS_WINDOW bytes back. The last sequence of a block only holds
+// literals. The stream can be split at any offset, and the decoder stops once
+// the output buffer is full.
+
+// Maximum number of bytes decoded from a block.
+#define DECOMPRESS_BLOCK_SIZE 1024
+
+// Maximum distance of the matches, which must be a power of 2.
+#define DECOMPRESS_WINDOW 4096
+
+typedef enum {
+  DECOMPRESS_BLOCK_SIZE_LO = 0,
+  DECOMPRESS_BLOCK_SIZE_HI,
+  DECOMPRESS_TOKEN,
+  DECOMPRESS_LITERAL_LENGTH,
+  DECOMPRESS_LITERALS,
+  DECOMPRESS_OFFSET_LO,
+  DECOMPRESS_OFFSET_HI,
+  DECOMPRESS_MATCH_LENGTH,
+  DECOMPRESS_MATCH,
+  DECOMPRESS_FAILED,
+} decompress_state_t;
+
+typedef struct {
+  decompress_state_t state;
+  // Compressed bytes left in the current block.
+  uint16_t block_left;
+  uint16_t offset;
+  bool long_match;
+  uint32_t literal_left;
+  uint32_t match_left;
+  // Number of bytes decoded, and the last ones which can be matched.
+  uint32_t pos;
+  uint8_t window[DECOMPRESS_WINDOW];
+} decompress_t;
+
+void decompress_init(decompress_t* d);
+
+// Decode the compressed bytes of `in` into `out`, until the input is consumed
+// or the output is full. Returns the number of bytes written, and sets
+// `consumed` to the number of bytes read.
+size_t decompress_run(decompress_t* d, const uint8_t* in, size_t in_len,
+                      size_t* consumed, uint8_t* out, size_t out_len);
+
+// The stream was corrupted, nothing more is decoded.
+bool decompress_failed(const decompress_t* d);
+
+// The stream ends between two blocks.
+bool decompress_is_complete(const decompress_t* d);
+
+#endif // !DECOMPRESS_H
@@ -0,0 +1,158 @@
+#include "device_profile.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h> // strlen, strncmp
+
+#include "pico/platform.h" // count_of
+
+#include "uf2.h"
+
+#define VID_RASPBERRY_PI 0x2e8a
+#define VID_ADAFRUIT 0x239a
+
+// The first matching profile is used, thus more specific entries are listed
+// first. Timings of the RP2040 are the ones measured on our racks, the other
+// families use more conservative values.
+static const device_profile_t profiles[] = {
+  {
+    .name = "RP2350",
+    .vid = VID_RASPBERRY_PI,
+    .pid = 0x000f, // BOOTSEL
+    .inquiry_vendor = "RPI",
+    .inquiry_product = "RP2350",
+    .bootsel = BOOTSEL_CDC_1200_BAUD,
+    .bootsel_settle_ms = 250,
+    .cdc_unmount_ms = 50,
+    .reconnect_ms = 250,
+    .backend = FLASH_BACKEND_CHUNKED,
+    .chunk_size = 8 * 1024,
+    .chunk_delay_us = 32,
+    .sector_size = 4096,
+    .families = {
+      UF2_FAMILY_ABSOLUTE, UF2_FAMILY_DATA, UF2_FAMILY_RP2350_ARM_S,
+      UF2_FAMILY_RP2350_RISCV, UF2_FAMILY_RP2350_ARM_NS,
+    },
+    .file_name = "image.uf2",
+  },
+  {
+    .name = "RP2350",
+    .vid = VID_RASPBERRY_PI,
+    .pid = 0x0009, // Pico SDK stdio over USB
+    .bootsel = BOOTSEL_CDC_1200_BAUD,
+    .bootsel_settle_ms = 250,
+    .cdc_unmount_ms = 50,
+    .reconnect_ms = 250,
+    .backend = FLASH_BACKEND_CHUNKED,
+    .chunk_size = 8 * 1024,
+    .chunk_delay_us = 32,
+    .sector_size = 4096,
+    .families = {
+      UF2_FAMILY_ABSOLUTE, UF2_FAMILY_DATA, UF2_FAMILY_RP2350_ARM_S,
+      UF2_FAMILY_RP2350_RISCV, UF2_FAMILY_RP2350_ARM_NS,
+    },
+    .file_name = "image.uf2",
+  },
+  {
+    // BOOTSEL (0x0003), Pico SDK stdio over USB (0x000a), and any other
+    // firmware using the Raspberry Pi vendor id.
+    .name = "RP2040",
+    .vid = VID_RASPBERRY_PI,
+    .pid = 0,
+    .inquiry_vendor = "RPI",
+    .inquiry_product = "RP2",
+    .bootsel = BOOTSEL_CDC_1200_BAUD,
+    .bootsel_settle_ms = 250,
+    .cdc_unmount_ms = 50,
+    .reconnect_ms = 250,
+    .backend = FLASH_BACKEND_CHUNKED,
+    .chunk_size = 8 * 1024,
+    // = 4096 bytes / 125 MHz
+    .chunk_delay_us = 32,
+    .sector_size = 4096,
+    .families = { UF2_FAMILY_RP2040 },
+    .file_name = "image.uf2",
+  },
+  {
+    // The nRF52 bootloader shares the vendor id with the SAMD one, and is
+    // only told apart by its inquiry product.
+    .name = "Adafruit nRF52",
+    .vid = 0,
+    .pid = 0,
+    .inquiry_vendor = "Adafruit",
+    .inquiry_product = "nRF",
+    .bootsel = BOOTSEL_CDC_1200_BAUD,
+    .bootsel_settle_ms = 250,
+    .cdc_unmount_ms = 50,
+    // The bootloader checks the application before exposing the mass storage.
+    .reconnect_ms = 500,
+    // Erasing a 4 KiB page takes up to 85 ms, thus wait for each write.
+    .backend = FLASH_BACKEND_SYNC,
+    .chunk_size = 4 * 1024,
+    .chunk_delay_us = 0,
+    .sector_size = 4096,
+    .file_name = "image.uf2",
+  },
+  {
+    .name = "Adafruit SAMD",
+    .vid = VID_ADAFRUIT,
+    .pid = 0,
+    .inquiry_vendor = NULL,
+    .inquiry_product = NULL,
+    .bootsel = BOOTSEL_CDC_1200_BAUD,
+    .bootsel_settle_ms = 250,
+    .cdc_unmount_ms = 50,
+    .reconnect_ms = 500,
+    .backend = FLASH_BACKEND_SYNC,
+    .chunk_size = 4 * 1024,
+    .chunk_delay_us = 0,
+    .sector_size = 0,
+    .file_name = "image.uf2",
+  },
+};
+
+// Index of the RP2040 profile, which is what the UF2 Batch Flasher was
+// designed for.
+#define DEFAULT_PROFILE 2
+
+const device_profile_t* device_profile_default() {
+  return &profiles[DEFAULT_PROFILE];
+}
+
+const device_profile_t* device_profile_match_usb(uint16_t vid, uint16_t pid) {
+  for (size_t p = 0; p < count_of(profiles); p++) {
+    const device_profile_t* profile = &profiles[p];
+    if (profile->vid == 0 || profile->vid != vid) {
+      continue;
+    }
+    if (profile->pid != 0 && profile->pid != pid) {
+      continue;
+    }
+    return profile;
+  }
+  return NULL;
+}
+
+static bool match_prefix(const char* prefix, const uint8_t* field, size_t len) {
+  if (prefix == NULL) {
+    return true;
+  }
+  size_t prefix_len = strlen(prefix);
+  return prefix_len <= len &&
+    strncmp(prefix, (const char*) field, prefix_len) == 0;
+}
+
+const device_profile_t* device_profile_match_inquiry(const uint8_t vendor[8],
+                                                     const uint8_t product[16]) {
+  for (size_t p = 0; p < count_of(profiles); p++) {
+    const device_profile_t* profile = &profiles[p];
+    if (profile->inquiry_vendor == NULL && profile->inquiry_product == NULL) {
+      continue;
+    }
+    if (match_prefix(profile->inquiry_vendor, vendor, 8) &&
+        match_prefix(profile->inquiry_product, product, 16)) {
+      return profile;
+    }
+  }
+  return NULL;
+}
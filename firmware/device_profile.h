@@ -0,0 +1,81 @@
+#ifndef DEVICE_PROFILE_H
+#define DEVICE_PROFILE_H
+
+#include <stdint.h>
+
+// Profiles describe how each family of devices is switched to BOOTSEL mode and
+// how fast the image can be written to it. The profile is matched against the
+// USB descriptor of the device when it is mounted, and against the SCSI
+// inquiry strings once its bootloader exposes the mass storage.
+
+typedef enum {
+  // The device is expected to already expose its bootloader.
+  BOOTSEL_NONE = 0,
+  // Opening the CDC serial port at 1200 bauds resets the device into its
+  // bootloader, as done by the Pico SDK and the Arduino cores.
+  BOOTSEL_CDC_1200_BAUD,
+} bootsel_method_t;
+
+typedef enum {
+  // Align writes on chunk_size, and sleep for chunk_delay_us after each chunk
+  // to give the device time to write its flash, as f_sync is not reliable
+  // with the RP2040 bootrom.
+  FLASH_BACKEND_CHUNKED = 0,
+  // Align writes on chunk_size, and wait for f_sync after each chunk, for
+  // bootloaders which only acknowledge writes once they are in the flash.
+  FLASH_BACKEND_SYNC,
+} flash_backend_t;
+
+// Maximum number of UF2 family IDs accepted by the bootloader of a device.
+#define DEVICE_PROFILE_MAX_FAMILIES 6
+
+typedef struct {
+  const char* name;
+
+  // USB descriptor to be matched, a pid of 0 matches any product of the
+  // vendor.
+  uint16_t vid;
+  uint16_t pid;
+
+  // Prefixes of the SCSI inquiry vendor and product identifiers exposed by the
+  // bootloader, or NULL to match any.
+  const char* inquiry_vendor;
+  const char* inquiry_product;
+
+  bootsel_method_t bootsel;
+  // Time for a freshly powered device to watch the baud rate of its CDC.
+  uint16_t bootsel_settle_ms;
+  // Time before forcing the CDC to be unmounted after requesting the reset.
+  uint16_t cdc_unmount_ms;
+  // Time for the device to reboot in its bootloader before the data lines are
+  // connected again.
+  uint16_t reconnect_ms;
+
+  flash_backend_t backend;
+  uint16_t chunk_size;
+  uint16_t chunk_delay_us;
+  // Size of the flash sectors erased by the bootloader. Writes are split when
+  // the blocks move to another sector, instead of every chunk_size bytes,
+  // which is used when 0.
+  uint16_t sector_size;
+  // UF2 family IDs accepted by the bootloader, ended by 0 when fewer than
+  // DEVICE_PROFILE_MAX_FAMILIES. The blocks of other families are not written
+  // to the device, and all blocks are written when the list is empty.
+  uint32_t families[DEVICE_PROFILE_MAX_FAMILIES];
+
+  // Name of the file written on the mass storage, in 8.3 format.
+  const char* file_name;
+} device_profile_t;
+
+// Profile used until a device is matched, tuned for the RP2040.
+const device_profile_t* device_profile_default();
+
+// Return the first profile matching the USB descriptor, or NULL.
+const device_profile_t* device_profile_match_usb(uint16_t vid, uint16_t pid);
+
+// Return the first profile matching the SCSI inquiry identifiers, which are
+// space padded and not NUL terminated, or NULL.
+const device_profile_t* device_profile_match_inquiry(const uint8_t vendor[8],
+                                                     const uint8_t product[16]);
+
+#endif // !DEVICE_PROFILE_H
@@ -0,0 +1,54 @@
+#include "flash_region.h"
+
+#include <stdio.h>
+
+#include "hardware/sync.h"
+#include "pico/multicore.h"
+
+// Pausing the other core is acknowledged through the inter-core FIFO, which is
+// expected to be fast unless the other core is not running.
+#define LOCKOUT_TIMEOUT_US 100000
+
+const uint8_t* flash_region_read(uint32_t offset) {
+  return (const uint8_t*) (XIP_BASE + offset);
+}
+
+// Interrupts are disabled on the current core, as the interrupt handlers might
+// be located in the flash as well.
+static bool flash_region_begin(uint32_t* ints) {
+  if (!multicore_lockout_start_timeout_us(LOCKOUT_TIMEOUT_US)) {
+    printf("Flash: Unable to pause the other core.\n");
+    return false;
+  }
+  *ints = save_and_disable_interrupts();
+  return true;
+}
+
+static void flash_region_end(uint32_t ints) {
+  restore_interrupts(ints);
+  multicore_lockout_end_timeout_us(LOCKOUT_TIMEOUT_US);
+}
+
+bool flash_region_erase(uint32_t offset, size_t len) {
+  uint32_t ints;
+  if (!flash_region_begin(&ints)) {
+    return false;
+  }
+  flash_range_erase(offset, len);
+  flash_region_end(ints);
+  return true;
+}
+
+bool flash_region_program(uint32_t offset, const uint8_t* data, size_t len) {
+  uint32_t ints;
+  if (!flash_region_begin(&ints)) {
+    return false;
+  }
+  flash_range_program(offset, data, len);
+  flash_region_end(ints);
+  return true;
+}
+
+void flash_region_init_core() {
+  multicore_lockout_victim_init();
+}
@@ -0,0 +1,51 @@
+#ifndef FLASH_REGION_H
+#define FLASH_REGION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hardware/flash.h"
+
+// The end of the Pico W flash is not used by the firmware and is reserved for
+// data which has to persist across reboots. All offsets are relative to the
+// start of the flash, and are sector aligned.
+//
+// The job journal uses 2 sectors, such that erasing one never loses the last
+// record written in the other.
+#define FLASH_JOURNAL_SECTORS 2
+#define FLASH_JOURNAL_OFFSET \
+  (PICO_FLASH_SIZE_BYTES - FLASH_JOURNAL_SECTORS * FLASH_SECTOR_SIZE)
+
+// The statistics of each port alternate between 2 sectors, one record each.
+#define FLASH_PORT_STATS_SECTORS 2
+#define FLASH_PORT_STATS_OFFSET \
+  (FLASH_JOURNAL_OFFSET - FLASH_PORT_STATS_SECTORS * FLASH_SECTOR_SIZE)
+
+// Images saved for flashing without any client use the megabyte below. The
+// firmware is expected to end before it, which is checked when the image store
+// is initialized.
+#define FLASH_IMAGE_STORE_SIZE (1024 * 1024)
+#define FLASH_IMAGE_STORE_OFFSET \
+  (FLASH_PORT_STATS_OFFSET - FLASH_IMAGE_STORE_SIZE)
+
+// Return a pointer to read the content of the flash through XIP.
+const uint8_t* flash_region_read(uint32_t offset);
+
+// Erase `len` bytes, sector aligned, starting at `offset`.
+//
+// While the flash is being erased or programmed, the code cannot be executed
+// from the flash. Thus the other core is paused for the duration of the
+// operation, and this function returns false if the other core could not be
+// paused.
+bool flash_region_erase(uint32_t offset, size_t len);
+
+// Program `len` bytes, page aligned, starting at `offset`. The pages should
+// have been erased before.
+bool flash_region_program(uint32_t offset, const uint8_t* data, size_t len);
+
+// Let the other core pause the current core while it is writting to the
+// flash. This should be called once on each core.
+void flash_region_init_core();
+
+#endif // !FLASH_REGION_H
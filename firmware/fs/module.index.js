@@ -49,10 +49,13 @@ async function update_stdout() {
     unlock();
   }
 
-  let console = document.getElementById("console");
   if (out == "\n") return;
+  print_stdout(out.split('\n'));
+}
+function print_stdout(lines) {
+  let console = document.getElementById("console");
   let time = performance.now() / 1000;
-  let text = out.split('\n').map(line => `(${time}) pico: ${line}\n`).join("");
+  let text = lines.map(line => `(${time}) pico: ${line}\n`).join("");
   console.innerText += text;
 }
 function console_log(...args) {
@@ -92,7 +95,8 @@ let usb_status = [
   "DEVICE_ERROR_FLASH_WRITE",
   "DEVICE_ERROR_FLASH_CLOSE",
   "DEVICE_DISCONNECTED",
-  "???", "???", "???", "???", "???", "???", "???",
+  "DEVICE_ERROR_USB_HANG",
+  "???", "???", "???", "???", "???", "???",
   "???", "???"
 ];
 
@@ -101,11 +105,15 @@ const USB_DEVICES = 64;
 // Function which resolves or rejects a promise if the condition is met.
 let last_status = [];
 let wait_for_status = [];
+// Generation of the status known by the page, such that polling only returns
+// the ports which changed since then.
+let status_generation = 0;
 async function update_status(status) {
   let unlock;
+  let polled = !status;
   try {
-    if (!status) {
-      status = await queued_fetch("/status.json");
+    if (polled) {
+      status = await queued_fetch(`/status.cgi?since=${status_generation}`);
     }
 
     unlock = status.unlock;
@@ -114,12 +122,25 @@ async function update_status(status) {
   } finally {
     unlock();
   }
+  if (!polled) {
+    return show_status(status);
+  }
+
+  let changes = status.changes;
+  status_generation = status.generation;
+  status = last_status.length ? [...last_status] : new Array(USB_DEVICES).fill(0);
+  for (let [port, code] of changes) {
+    status[port] = code;
+  }
+  return show_status(status, changes.length > 0);
+}
 
+function show_status(status, changed = true) {
   let dom = document.getElementById("usb_status_list");
-  while (dom.firstElementChild) {
+  while (changed && dom.firstElementChild) {
     dom.removeChild(dom.firstElementChild);
   }
-  for (let s of status) {
+  for (let s of changed ? status : []) {
     let li = document.createElement("li");
     let text = usb_status[s & 0x1f] ?? "???";
     text += " (0x" + s.toString(16) + ")";
@@ -175,7 +196,9 @@ async function wait_for_usb_status(device, expected_status, timeout, msg) {
 
     if (!check_for_expectation(last_status)) {
       wait_for_status.push(check_for_expectation);
-      status_timer = setInterval(update_status, 245, undefined);
+      if (!streaming()) {
+        status_timer = setInterval(update_status, 245, undefined);
+      }
     }
   });
 
@@ -250,14 +273,25 @@ function set_usb_range(min, max) {
   range_max = max;
 }
 
-// Return the list of offsets which would have to be patched before sending the
-// content to each device.
-function locate_uf2_arm_halt(content) {
+// Keep in sync with patch_kind_t in patch.h. Each kind of value written by the
+// board for each device is marked in the image by an HLT instruction with a
+// specific 16 bits payload.
+const PATCH_PORT = 0;
+const PATCH_SERIAL = 1;
+const PATCH_TIMESTAMP = 2;
+const patch_hlt_codes = [
+  [PATCH_PORT, 0b1010101010101010],
+  [PATCH_SERIAL, 0b1010101010101011],
+  [PATCH_TIMESTAMP, 0b1010101010101100],
+];
+
+// Return the list of offsets of the HLT instructions with the given payload,
+// which are replaced by the board for each device.
+function locate_uf2_arm_halt(content, code) {
   // ARM has a HLT instruction which is used for interrupting the program, and
   // which has a 16 bits payload.
   const hlt_op = 0b11010100010;
-  const mask = 0b1010101010101010;
-  const pattern = (hlt_op << 21) | (mask << 5);
+  const pattern = (hlt_op << 21) | (code << 5);
 
   const hh = (pattern >> 24) & 0xff;
   const hl = (pattern >> 16) & 0xff;
@@ -273,13 +307,13 @@ function locate_uf2_arm_halt(content) {
   for (let off = 0; off + 511 < content.length;) {
     // Skip the UF2 header.
     off += 32;
-    // Check and patch the data.
+    // Check the data.
     for (; (off % 512) < 508; off += 4) {
       // NOTE: Little Endian encoding of constants.
-      if (content[off][0] != ll ||
-          content[off][1] != lh ||
-          content[off][2] != hl ||
-          content[off][3] != hh) {
+      if (content[off] != ll ||
+          content[off + 1] != lh ||
+          content[off + 2] != hl ||
+          content[off + 3] != hh) {
         continue;
       }
 
@@ -292,20 +326,197 @@ function locate_uf2_arm_halt(content) {
   return offsets;
 }
 
-async function send_uf2_to(device, name, content, offsets, opts) {
-  if (opts?.handle_status) {
-    stop_status_watchdog();
+// Locate the values to be written by the board for each device.
+function locate_uf2_patches(content) {
+  return patch_hlt_codes.flatMap(([kind, code]) =>
+    locate_uf2_arm_halt(content, code).map(offset => ({ offset, kind, size: 4 })));
+}
+
+// Give the board the values to write in the image of a stage. The serial number
+// is kept by the board for all stages flashed on the same port.
+async function set_stage_patches(stage) {
+  const patches = stage.patches.map(p => `&p=${p.offset}:${p.kind}:${p.size}`).join("");
+  await fetch_job(`/patch.cgi?serial=${stage.serial}&time=${stage.timestamp}${patches}`);
+}
+
+// Wait until the board re-armed the device for its next image, after the
+// previous image has been closed.
+async function wait_for_next_stage(device, timeout) {
+  const flash_request = usb_status.indexOf("DEVICE_FLASH_REQUEST");
+  const deadline = Date.now() + timeout;
+  while (Date.now() < deadline) {
+    let status = await update_status();
+    if (status[device] & 0x10) {
+      throw new Error(`Unexpected status code: 0x${status[device].toString(16)}`);
+    }
+    if ((status[device] & 0x0f) < flash_request) {
+      return;
+    }
+    await sleep(245);
   }
+  throw new Error("Timeout while waiting for the device to reboot");
+}
 
-  // Patch the content with the device index.
-  if (offsets.length) {
-    let buffer = new Uint8Array(content);
-    for (let off in offsets) {
-      buffer[off] = device;
-      buffer[off + 1] = 0;
-      buffer[off + 2] = 0;
-      buffer[off + 3] = 0;
+// Compress the content in the format decoded by the board, see decompress.h.
+// The content is split in blocks of DECOMPRESS_BLOCK_SIZE bytes, each encoded
+// as LZ4 sequences prefixed by their size, with matches up to DECOMPRESS_WINDOW
+// bytes back.
+const DECOMPRESS_BLOCK_SIZE = 1024;
+const DECOMPRESS_WINDOW = 4096;
+function compress_image(content) {
+  content = new Uint8Array(content);
+  let out = [];
+  function push_length(length) {
+    for (; length >= 255; length -= 255) {
+      out.push(255);
+    }
+    out.push(length);
+  }
+  // Literals followed by a match, or by nothing if the offset is 0.
+  function push_sequence(literals, offset, length) {
+    out.push((Math.min(literals.length, 15) << 4) |
+             (offset ? Math.min(length - 4, 15) : 0));
+    if (literals.length >= 15) {
+      push_length(literals.length - 15);
     }
+    out.push(...literals);
+    if (offset) {
+      out.push(offset & 0xff, offset >> 8);
+      if (length - 4 >= 15) {
+        push_length(length - 4 - 15);
+      }
+    }
+  }
+  let table = new Map();
+  for (let start = 0; start < content.length; start += DECOMPRESS_BLOCK_SIZE) {
+    let end = Math.min(start + DECOMPRESS_BLOCK_SIZE, content.length);
+    let size_at = out.length;
+    out.push(0, 0);
+    let anchor = start, pos = start;
+    while (pos + 4 <= end) {
+      let key = (content[pos] | content[pos + 1] << 8 |
+                 content[pos + 2] << 16 | content[pos + 3] << 24) >>> 0;
+      let candidate = table.get(key);
+      table.set(key, pos);
+      if (candidate === undefined || pos - candidate > DECOMPRESS_WINDOW) {
+        pos++;
+        continue;
+      }
+      let length = 4;
+      while (pos + length < end && content[candidate + length] == content[pos + length]) {
+        length++;
+      }
+      push_sequence(content.subarray(anchor, pos), pos - candidate, length);
+      pos += length;
+      anchor = pos;
+    }
+    if (anchor < end) {
+      push_sequence(content.subarray(anchor, end), 0, 0);
+    }
+    let size = out.length - size_at - 2;
+    out[size_at] = size & 0xff;
+    out[size_at + 1] = size >> 8;
+  }
+  return new Uint8Array(out);
+}
+
+// Raw binaries are sent as is, and framed in UF2 blocks by the board, see
+// uf2_frame.h. They are also framed here to locate the patches and identify
+// the image in the journal.
+const UF2_FAMILY_RP2040 = 0xe48bff56;
+let raw_base_addr = 0x10000000;
+let raw_family_id = UF2_FAMILY_RP2040;
+function frame_uf2(content, base_addr, family_id) {
+  content = new Uint8Array(content);
+  const num_blocks = Math.ceil(content.length / 256);
+  let out = new ArrayBuffer(num_blocks * 512);
+  let view = new DataView(out);
+  for (let block = 0; block < num_blocks; block++) {
+    const at = block * 512;
+    const header = [0x0a324655, 0x9e5d5157, 0x2000, base_addr + block * 256,
+                    256, block, num_blocks, family_id];
+    header.forEach((value, i) => view.setUint32(at + 4 * i, value, true));
+    new Uint8Array(out, at + 32, 256).set(content.subarray(block * 256, block * 256 + 256));
+    view.setUint32(at + 508, 0x0ab16f30, true);
+  }
+  return out;
+}
+
+// Drop the blocks whose payload is erased flash (all 0xff), and renumber the
+// remaining blocks. A block is only dropped if another block is written in the
+// same 4 KiB sector, which the bootloader of the RP2040 and RP2350 erases, such
+// that the flash of the devices is unchanged. Returns the new content and the
+// number of dropped blocks.
+const ERASING_FAMILIES = [0xe48bff56, 0xe48bff59, 0xe48bff5a];
+function elide_erased_blocks(content) {
+  const num_blocks = content.byteLength / 512;
+  const view = new DataView(content);
+  const u32 = (block, off) => view.getUint32(block * 512 + off, true);
+  const erasable = block =>
+    (u32(block, 8) & 0x2001) == 0x2000 && ERASING_FAMILIES.includes(u32(block, 28)) &&
+    u32(block, 12) >= 0x10000000 && u32(block, 12) < 0x11000000 && u32(block, 16) == 256;
+  const erased = block =>
+    erasable(block) && new Uint8Array(content, block * 512 + 32, 256).every(b => b == 0xff);
+  const sector = block => Math.floor(u32(block, 12) / 4096);
+
+  let blocks = [...Array(Math.floor(num_blocks)).keys()];
+  // Concatenated images keep their numbering.
+  if (!Number.isInteger(num_blocks) || blocks.some(b => u32(b, 24) != num_blocks)) {
+    return { content, skipped: 0 };
+  }
+  const written = new Set(blocks.filter(b => erasable(b) && !erased(b)).map(sector));
+  const kept = blocks.filter(b => !erased(b) || !written.has(sector(b)));
+  if (kept.length == num_blocks) {
+    return { content, skipped: 0 };
+  }
+  let out = new Uint8Array(kept.length * 512);
+  let out_view = new DataView(out.buffer);
+  kept.forEach((b, i) => {
+    out.set(new Uint8Array(content, b * 512, 512), i * 512);
+    out_view.setUint32(i * 512 + 20, i, true);
+    out_view.setUint32(i * 512 + 24, kept.length, true);
+  });
+  return { content: out.buffer, skipped: num_blocks - kept.length };
+}
+
+// Reorder the blocks such that the ones of each sector of the flash follow each
+// other, by address, and renumber them. The bootloader then erases and writes
+// each sector once, in a single burst. Images holding blocks out of the flash,
+// of other families, or concatenated, are left unchanged. Returns the new
+// content and the number of blocks which moved.
+function group_sectors(content) {
+  const num_blocks = content.byteLength / 512;
+  const view = new DataView(content);
+  const u32 = (block, off) => view.getUint32(block * 512 + off, true);
+  const groupable = block =>
+    u32(block, 24) == num_blocks &&
+    (u32(block, 8) & 0x2001) == 0x2000 && ERASING_FAMILIES.includes(u32(block, 28)) &&
+    u32(block, 12) >= 0x10000000 && u32(block, 12) < 0x11000000;
+
+  let blocks = [...Array(Math.floor(num_blocks)).keys()];
+  if (!Number.isInteger(num_blocks) || !blocks.every(groupable)) {
+    return { content, moved: 0 };
+  }
+  // The sort is stable, thus a block written twice keeps its last payload.
+  const ordered = [...blocks].sort((a, b) => u32(a, 12) - u32(b, 12));
+  const moved = ordered.filter((b, i) => b != i).length;
+  if (moved == 0) {
+    return { content, moved: 0 };
+  }
+  let out = new Uint8Array(content.byteLength);
+  let out_view = new DataView(out.buffer);
+  ordered.forEach((b, i) => {
+    out.set(new Uint8Array(content, b * 512, 512), i * 512);
+    out_view.setUint32(i * 512 + 20, i, true);
+  });
+  return { content: out.buffer, moved };
+}
+
+// Flash all stages in a row on the device, where each stage is an object with
+// the content of an image and the values the board writes for each device.
+async function send_uf2_to(device, stages, opts) {
+  if (opts?.handle_status) {
+    stop_status_watchdog();
   }
 
   try {
@@ -313,25 +524,67 @@ async function send_uf2_to(device, name, content, offsets, opts) {
     // Pico would tell us whether to send or not the uf2 image again.
     await select_device(device, cdc_timeout, msc_timeout);
 
-    // Make a single request which would be split into multiple by TCP
-    // protocol and then throttled by LwIP based on how fast we can forward
-    // the content to the USB device.
-    console_log(`Flashing content: ${content.byteLength} bytes to flash.`);
-    await update_status(await queued_fetch("/flash", {
-      method: "POST",
-      mode: "same-origin",
-      cache: "no-cache",
-      credentials: "same-origin",
-      headers: {
-        "Content-Type": "application/uf2",
-        "Content-Length": content.byteLength,
-      },
-      body: content
-    }));
-
-    // Explicitly wait to avoid sending a status request while the memory is
-    // filled with the content of the image to be flashed.
-    await sleep(1000);
+    for (let i = 0; i < stages.length; i++) {
+      let { content } = stages[i];
+      if (i > 0) {
+        // The device reboots after the previous image, and the board switches
+        // it to BOOTSEL mode again before requesting the next image.
+        await wait_for_next_stage(device, flash_timeout);
+        await wait_for_usb_status(
+          device, "DEVICE_FLASH_REQUEST", msc_timeout,
+          `Timeout while waiting for flash request of stage ${i + 1}`);
+      }
+      if (stages.length > 1) {
+        await set_stage_patches(stages[i]);
+      }
+
+      // The board patches the image with the values of the device.
+      if (stages[i].cached) {
+        console_log("Flashing content from the image cache.");
+        await fetch_job("/cache.cgi?flash=1");
+        continue;
+      }
+
+      if (controlling()) {
+        console_log(`Flashing content over the control socket: ` +
+                    `${content.byteLength} bytes to flash.`);
+        await flash_over_socket(stages[i]);
+        continue;
+      }
+
+      // Make a single request which would be split into multiple by TCP
+      // protocol and then throttled by LwIP based on how fast we can forward
+      // the content to the USB device.
+      let headers = { "Content-Type": "application/uf2" };
+      if (stages[i].raw) {
+        console_log(`Flashing content: ${content.byteLength} bytes to flash, ` +
+                    `${stages[i].raw.byteLength} bytes of binary.`);
+        content = stages[i].raw;
+        headers["Content-Type"] = "application/octet-stream";
+        headers["X-UF2-Base-Address"] = raw_base_addr;
+        headers["X-UF2-Family-ID"] = raw_family_id;
+      } else if (stages[i].compressed) {
+        console_log(`Flashing content: ${content.byteLength} bytes to flash, ` +
+                    `${stages[i].compressed.byteLength} bytes compressed.`);
+        content = stages[i].compressed;
+        headers["Content-Encoding"] = "lz4";
+      } else {
+        console_log(`Flashing content: ${content.byteLength} bytes to flash.`);
+      }
+      headers["Content-Length"] = content.byteLength;
+      await update_status(await queued_fetch("/flash", {
+        method: "POST",
+        mode: "same-origin",
+        cache: "no-cache",
+        credentials: "same-origin",
+        headers,
+        body: content
+      }));
+
+      // Explicitly wait to avoid sending a status request while the memory is
+      // filled with the content of the image to be flashed.
+      await sleep(1000);
+    }
 
     // Flashing the device takes time, and the previous request only completes
     // once the POST buffer is full, which only implies that everything has
@@ -355,20 +608,235 @@ async function send_uf2_to(device, name, content, offsets, opts) {
   }
 }
 
-// content is an array buffer, typed array, blob, json or text.
-async function send_uf2(name, content) {
+// CRC-32 as computed by zlib, used to identify the image recorded in the
+// journal of the board. Give the previous crc to continue the computation over
+// multiple buffers.
+function crc32(content, crc = 0) {
+  crc = ~crc;
+  for (let byte of new Uint8Array(content)) {
+    crc ^= byte;
+    for (let bit = 0; bit < 8; bit++) {
+      crc = (crc >>> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return (~crc) >>> 0;
+}
+
+async function fetch_job(url, opts) {
+  let unlock;
+  try {
+    let queue = await queued_fetch(url, opts);
+    unlock = queue.unlock;
+    let job = await queue.fetch;
+    return await job.json();
+  } finally {
+    unlock();
+  }
+}
+
+// Keep in sync with job_state_t in journal.h
+const JOB_RUNNING = 1;
+
+// Offer to resume the job which got interrupted by a reboot of the board.
+async function check_interrupted_job() {
+  let job = await fetch_job("/job.json");
+  let resume = document.getElementById("resume_job");
+  resume.checked = false;
+  resume.disabled = job.state != JOB_RUNNING;
+  if (job.state == JOB_RUNNING) {
+    console_log(`Interrupted job on ports ${job.first}-${job.last} can be resumed from port ${job.resume}.`);
+  }
+}
+
+// Keep in sync with PORT_PARK_FAILURES in port_stats.h, and with the order of
+// the fields generated for ports.json in web_server.c.
+const PORT_PARK_FAILURES = 3;
+const PORT_ATTEMPTS = 0;
+const PORT_SUCCESSES = 1;
+const PORT_CONSECUTIVE_FAILURES = 4;
+
+// Report the sockets which keep failing and need servicing.
+async function report_port_stats(url = "/ports.json") {
+  let ports = await fetch_job(url);
+  ports.forEach((port, device) => {
+    if (port[PORT_CONSECUTIVE_FAILURES] >= PORT_PARK_FAILURES) {
+      console_log(`USB port ${device} failed ${port[PORT_CONSECUTIVE_FAILURES]} times in a row (${port[PORT_SUCCESSES]}/${port[PORT_ATTEMPTS]} successes), it might need servicing.`);
+    }
+  });
+  return ports;
+}
+
+// Keep in sync with image_cache_state_t in image_cache.h
+const CACHE_READY = 2;
+
+// Upload the image once to the image cache of the board, which then patches it
+// for each device. Returns false if the image cannot be cached.
+async function upload_to_cache(content) {
+  const size = content.byteLength;
+  const crc = crc32(content);
+  let cache = await fetch_job("/cache.json");
+  if (cache.state == CACHE_READY && cache.variants == 1 &&
+      cache.size == size && cache.crc == crc) {
+    console_log("Image already in the cache of the board.");
+    return true;
+  }
+
+  console_log(`Uploading ${size} bytes to the image cache.`);
+  await fetch_job(`/cache.cgi?size=${size}&crc=${crc}`);
+  await fetch_job("/cache", {
+    method: "POST",
+    mode: "same-origin",
+    cache: "no-cache",
+    credentials: "same-origin",
+    headers: {
+      "Content-Type": "application/uf2",
+      "Content-Length": size,
+    },
+    body: content
+  });
+  cache = await fetch_job("/cache.cgi?end=1");
+  if (cache.state != CACHE_READY) {
+    console_log("The image cannot be cached, it is streamed to each device instead.");
+    return false;
+  }
+  console_log(`Image cached as ${cache.blocks} blocks.`);
+  return true;
+}
+
+// Keep in sync with image_store_state_t in image_store.h
+const STORE_DISABLED = 0;
+const STORE_READY = 1;
+const STORE_SAVING = 2;
+
+// Save the cached image in the flash of the board, such that it can flash it
+// after a reboot without any client.
+async function store_image() {
+  let store = await fetch_job("/store.cgi?save=1");
+  if (store.state == STORE_DISABLED) {
+    console_log("The image store of the board is disabled.");
+    return false;
+  }
+  while (store.state == STORE_SAVING) {
+    await sleep(500);
+    store = await fetch_job("/store.json");
+  }
+  if (store.state != STORE_READY) {
+    console_log("The image could not be saved in the flash of the board.");
+    return false;
+  }
+  console_log(`Image stored (${store.count} images, latest: ${store.hash}).`);
+  return true;
+}
+
+// Let the board flash the cached or stored image on a range of ports on its
+// own, and wait until it is done.
+async function run_batch(first = range_min, last = range_max - 1) {
+  console_log(`Run a batch on USB ports ${first}-${last} from the board.`);
+  await fetch_job(`/store.cgi?run=1&first=${first}&last=${last}`);
+  let store;
+  do {
+    await sleep(1000);
+    store = await fetch_job("/store.json");
+  } while (store.batch);
+}
+
+// Flash the files in a row on each device, where each file has a name and a
+// content which is an array buffer.
+async function send_uf2(files) {
   // When sending uf2 content, we want to avoid making too many request as the
   // flashing pico might already be under pressure.
   stop_status_watchdog();
 
+  // Blocks out of order would have their sectors erased and written more than
+  // once by the bootloader.
+  files = files.map(file => {
+    if (file.raw) {
+      return file;
+    }
+    let { content, moved } = group_sectors(file.content);
+    if (moved) {
+      console_log(`Grouped ${moved} blocks by flash sector in ${file.name}.`);
+    }
+    return { ...file, content };
+  });
+
+  // Skip the blocks of erased flash, which cost a write on every device for no
+  // change. Raw binaries are framed by the board, and sent whole.
+  if (document.getElementById("elide_erased").checked) {
+    files = files.map(file => {
+      if (file.raw) {
+        return file;
+      }
+      let { content, skipped } = elide_erased_blocks(file.content);
+      console_log(`Skipped ${skipped} blocks of erased flash in ${file.name}.`);
+      return { ...file, content };
+    });
+  }
+
+  // Identify the images in the journal of the board, before they get patched
+  // for each device.
+  const image_size = files.reduce((size, file) => size + file.content.byteLength, 0);
+  const image_crc = files.reduce((crc, file) => crc32(file.content, crc), 0);
+
   // Walk the uf2 content to locate any HALT instruction with a special code to
-  // replace it by the index of the device.
-  const offsets = locate_uf2_arm_halt(content);
+  // replace it by the values of each device, such as the index of its port.
+  const timestamp = Math.floor(Date.now() / 1000);
+  const stages = files.map(file => ({
+    content: file.content,
+    raw: file.raw,
+    patches: locate_uf2_patches(file.content),
+    serial: 0,
+    timestamp
+  }));
 
-  await clear_status();
+  let first = range_min, last = range_max - 1, start = range_min;
+  let resume = document.getElementById("resume_job");
+  if (resume.checked) {
+    let job = await fetch_job("/job.json");
+    if (job.state != JOB_RUNNING) {
+      console_log("No interrupted job to resume.");
+    } else if (job.size != image_size || job.crc != image_crc) {
+      console_log("The interrupted job was flashing a different image.");
+    } else {
+      console_log(`Resume job from port ${job.resume} to port ${job.last}.`);
+      first = job.first;
+      last = job.last;
+      start = job.resume;
+    }
+  }
+  resume.checked = false;
+  resume.disabled = true;
 
-  for (let device = range_min; device < range_max; device++) {
-    await send_uf2_to(device, name, content, offsets, {});
+  // The job parameters have to match the recorded ones to keep the recorded
+  // outcomes of each port.
+  await fetch_job(`/job.cgi?first=${first}&last=${last}&size=${image_size}&crc=${image_crc}`);
+  if (start == first) {
+    await clear_status();
+  }
+
+  // The patches are sent once, and recorded along the cached image.
+  await set_stage_patches(stages[0]);
+
+  // Upload the image once, instead of sending it to each device.
+  let use_cache = document.getElementById("use_cache");
+  if (use_cache.checked && stages.length == 1) {
+    stages[0].cached = await upload_to_cache(stages[0].content);
+  }
+  if (stages[0].cached && document.getElementById("store_image").checked) {
+    await store_image();
+  }
+
+  // Compress the images once, instead of for each device.
+  if (document.getElementById("compress_image").checked) {
+    for (let stage of stages.filter(stage => !stage.cached && !stage.raw)) {
+      stage.compressed = compress_image(stage.content);
+    }
+  }
+
+  // Flash all images in a row on each device.
+  await fetch_job(`/select.cgi?stages=${stages.length}`);
+  for (let device = start; device <= last; device++) {
+    await send_uf2_to(device, stages, {});
   }
 
   // Restart the periodic timer which is asking for status updates.
@@ -389,21 +857,33 @@ async function dropFilesHandler(ev) {
 
   let dataTransfer = ev.dataTransfer;
   console.log([...dataTransfer.files].map(file => file.name));
-  if ([...dataTransfer.files].length > 1) {
-    console_log("TODO: Multiple files are not supported yet.");
-  }
 
   let filesContent = [];
   for (let file of dataTransfer.files) {
     let buffer = await file.arrayBuffer();
     // UF2 files are divided in fixed sized chunks starting with 'UF2\n'
     //let header = String.fromCharCode(...new Uint8Array(buffer.slice(0, 4)));
+    if (file.name.endsWith(".bin")) {
+      filesContent.push({
+        name: file.name,
+        content: frame_uf2(buffer, raw_base_addr, raw_family_id),
+        raw: buffer
+      });
+      continue;
+    }
     filesContent.push({
       name: file.name,
       content: buffer
     });
   };
 
+  // Multiple files are flashed in a row on each device, in the order of their
+  // names, such as 1-flash_nuke.uf2, 2-firmware.uf2, 3-filesystem.uf2.
+  filesContent.sort((a, b) => a.name.localeCompare(b.name));
+  if (filesContent.length > 1) {
+    console_log(`Stages: ${filesContent.map(file => file.name).join(", ")}`);
+  }
+
   async function clickHandler(ev) {
     console_log("Flashing all files.");
     ev.preventDefault();
@@ -413,9 +893,7 @@ async function dropFilesHandler(ev) {
 
     // Disable the button while we are flashing usb devices.
     flashAll.disabled = false;
-    for (let file of filesContent) {
-      await send_uf2(file.name, file.content);
-    }
+    await send_uf2(filesContent);
     flashAll.disabled = true;
   }
 
@@ -437,9 +915,197 @@ let stdout_timer = null;
 
 function start_status_watchdog() {
   status_timer = setInterval(update_status, 245, undefined);
+  stdout_timer = setInterval(update_stdout, 1000, undefined);
 }
 function stop_status_watchdog() {
   clearInterval(status_timer);
+  clearInterval(stdout_timer);
+  status_timer = stdout_timer = null;
+}
+
+// Follow the status of the devices and the output of the board, which are
+// pushed by the board as they change, instead of polling them. The polling
+// resumes while the stream is down.
+let event_stream = null;
+let stdout_partial = "";
+
+function streaming() {
+  return event_stream && event_stream.readyState == EventSource.OPEN;
+}
+
+function start_event_stream() {
+  event_stream = new EventSource(`http://${location.hostname}:8080/events`);
+  event_stream.addEventListener("open", () => {
+    stop_status_watchdog();
+  });
+  event_stream.addEventListener("error", () => {
+    if (!status_timer) {
+      start_status_watchdog();
+    }
+  });
+  // Only the ports whose status changed are listed, as `port:status`.
+  event_stream.addEventListener("status", ev => {
+    let status = last_status.length ? [...last_status] : new Array(USB_DEVICES).fill(0);
+    for (let change of ev.data.split(",")) {
+      let [port, code] = change.split(":");
+      status[port|0] = code|0;
+    }
+    show_status(status);
+  });
+  // The output is not split on lines, thus keep the last one until it ends.
+  event_stream.addEventListener("out", ev => {
+    let lines = (stdout_partial + ev.data).split('\n');
+    stdout_partial = lines.pop();
+    if (lines.length) {
+      print_stdout(lines);
+    }
+  });
+}
+function stop_event_stream() {
+  if (event_stream) {
+    event_stream.close();
+    event_stream = null;
+  }
+}
+
+// Flash the images over a WebSocket which carries the messages of the TCP
+// server, such that the parts of an image are pipelined instead of being
+// throttled by a single POST request. The POST request is used while the
+// socket is down.
+const START_FLASH = 3;
+const WRITE_FLASH_PART = 4;
+const END_FLASH = 5;
+const START_FLASH_COMPRESSED = 0x1b;
+const START_FLASH_RAW = 0x1c;
+const FLASH_START = 0x82;
+const FLASH_PART_WRITTEN = 0x84;
+const FLASH_END = 0x85;
+const FLASH_ERROR = 0x86;
+const DECODE_FAILURE = 0x87;
+const IMAGE_REJECTED = 0x8e;
+
+// The board holds the parts in its small heap until they are written, thus
+// only a few of them are sent ahead. Keep in sync with SOCKET_PARTS in
+// web_server.c.
+const SOCKET_PART_SIZE = 1024;
+const SOCKET_PARTS = 3;
+
+let control_socket = null;
+let control_replies = [];
+let control_waiters = [];
+
+function controlling() {
+  return control_socket && control_socket.readyState == WebSocket.OPEN;
+}
+
+function start_control_socket() {
+  let socket = new WebSocket(`ws://${location.hostname}:8080/control`);
+  control_socket = socket;
+  socket.binaryType = "arraybuffer";
+  socket.addEventListener("message", ev => {
+    let reply = new DataView(ev.data);
+    let waiter = control_waiters.shift();
+    if (waiter) {
+      waiter.resolve(reply);
+    } else {
+      control_replies.push(reply);
+    }
+  });
+  socket.addEventListener("close", () => {
+    if (control_socket != socket) {
+      return;
+    }
+    for (let waiter of control_waiters) {
+      waiter.reject(new Error("Control socket closed"));
+    }
+    control_waiters = [];
+    control_replies = [];
+    control_socket = null;
+    setTimeout(start_control_socket, 1000);
+  });
+}
+function stop_control_socket() {
+  if (control_socket) {
+    let socket = control_socket;
+    control_socket = null;
+    socket.close();
+  }
+}
+
+// Wait for the next reply of the board, which is an acknowledgement or an
+// error, and throw on the errors.
+async function control_reply(timeout) {
+  let reply = control_replies.shift() || await Promise.race([
+    new Promise((resolve, reject) => control_waiters.push({ resolve, reject })),
+    asyncTimeout(timeout).catch(() => {
+      throw new Error("Timeout while waiting for the board");
+    })
+  ]);
+  switch (reply.getUint8(0)) {
+  case FLASH_ERROR:
+    throw new Error("The board cannot flash the image");
+  case DECODE_FAILURE:
+    throw new Error("The board cannot decode the message");
+  case IMAGE_REJECTED:
+    throw new Error(`The board rejected the image (reason ${reply.getUint8(1)}, ` +
+                    `block ${reply.getUint32(2, true)})`);
+  }
+  return reply.getUint8(0);
+}
+
+async function flash_over_socket(stage) {
+  let start, content = stage.content;
+  if (stage.raw) {
+    content = stage.raw;
+    start = new DataView(new ArrayBuffer(13));
+    start.setUint8(0, START_FLASH_RAW);
+    start.setUint32(1, raw_base_addr, true);
+    start.setUint32(5, raw_family_id, true);
+    start.setUint32(9, content.byteLength, true);
+  } else if (stage.compressed) {
+    content = stage.compressed;
+    start = new Uint8Array([START_FLASH_COMPRESSED]);
+  } else {
+    start = new Uint8Array([START_FLASH]);
+  }
+  control_replies = [];
+  control_waiters = [];
+  control_socket.send(start);
+  if (await control_reply(msc_timeout) != FLASH_START) {
+    throw new Error("Unexpected reply to the start of the image");
+  }
+
+  try {
+    let in_flight = 0;
+    for (let offset = 0; offset < content.byteLength; offset += SOCKET_PART_SIZE) {
+      if (in_flight == SOCKET_PARTS) {
+        await control_reply(flash_timeout);
+        in_flight--;
+      }
+      let part = new Uint8Array(content, offset,
+                                Math.min(SOCKET_PART_SIZE, content.byteLength - offset));
+      let msg = new Uint8Array(3 + part.byteLength);
+      msg[0] = WRITE_FLASH_PART;
+      msg[1] = part.byteLength & 0xff;
+      msg[2] = part.byteLength >> 8;
+      msg.set(part, 3);
+      control_socket.send(msg);
+      in_flight++;
+    }
+    for (; in_flight > 0; in_flight--) {
+      await control_reply(flash_timeout);
+    }
+  } catch(e) {
+    // Close the file on the device, with what was written.
+    if (controlling()) {
+      control_socket.send(new Uint8Array([END_FLASH]));
+    }
+    throw e;
+  }
+
+  control_socket.send(new Uint8Array([END_FLASH]));
+  while (await control_reply(flash_timeout) != FLASH_END) {
+  }
 }
 
 // Hook the current script and attach it to the DOM.
@@ -449,11 +1115,15 @@ function setup() {
   dropzone.addEventListener("drop", dropFilesHandler);
   dropzone.addEventListener("dragover", dropDragOver);
 
-  // Poll the Pico every 500ms to collect new status information about the USB
-  // devices. This is useful to unlock promises which are waiting for changes in
-  // the state of USB devices.
+  // Poll the Pico every 245ms to collect new status information about the USB
+  // devices, until the event stream pushes it. This is useful to unlock
+  // promises which are waiting for changes in the state of USB devices.
   start_status_watchdog();
-  stdout_timer = setInterval(update_stdout, 1000, undefined);
+  start_event_stream();
+  start_control_socket();
+
+  check_interrupted_job();
+  report_port_stats();
 }
 
 function unsetup() {
@@ -462,7 +1132,8 @@ function unsetup() {
   dropzone.removeEventListener("dragover", dropDragOver);
 
   stop_status_watchdog();
-  clearInterval(stdout_timer);
+  stop_event_stream();
+  stop_control_socket();
 
   let flashAll = document.getElementById("flash_all");
   if (flash_all_click_handler) {
@@ -479,11 +1150,27 @@ window.update_status = update_status;
 window.setup = setup;
 window.unsetup = unsetup;
 window.set_usb_range = set_usb_range;
+window.report_port_stats = report_port_stats;
+window.store_image = store_image;
+window.run_batch = run_batch;
+window.reset_port_stats = function reset_port_stats(device = -1) {
+  return report_port_stats(`/ports.cgi?reset=${device|0}`);
+};
 window.set_usb_timeouts = function set_usb_timeouts(cdc, msc, flash) {
   cdc_timeout = cdc|0;
   msc_timeout = msc|0;
   flash_timeout = flash|0;
 };
+// Family ID the images must carry, or 0 for any, checked by the board before
+// writing them.
+window.set_expected_family = async function set_expected_family(family_id) {
+  await queued_fetch(`/select.cgi?family=${family_id >>> 0}`);
+};
+// Address and family of the .bin files dropped next.
+window.set_raw_target = function set_raw_target(base_addr, family_id = UF2_FAMILY_RP2040) {
+  raw_base_addr = base_addr >>> 0;
+  raw_family_id = family_id >>> 0;
+};
 export {
   update_stdout,
   update_status,
@@ -0,0 +1,572 @@
+#include "image_cache.h"
+
+#include <stdio.h>
+#include <string.h> // memcpy, memset
+
+#include "pico/mutex.h"
+
+#include "checksum.h"
+#include "pipe.h"
+#include "uf2_check.h"
+
+typedef struct {
+  image_cache_info_t info;
+  image_layout_t layout;
+  // Index in the pool of the payload of each block.
+  uint16_t refs[IMAGE_CACHE_BLOCKS];
+} image_variant_t;
+
+typedef struct {
+  mutex_t mutex;
+  // State of the cache, which is the state of the variant loaded last.
+  image_cache_state_t state;
+  image_variant_t variants[IMAGE_CACHE_VARIANTS];
+  size_t variant_count;
+  image_manifest_entry_t manifest[IMAGE_CACHE_MANIFEST_SIZE];
+  size_t manifest_count;
+
+  // Variant being uploaded, and variant being written to a device.
+  image_variant_t* loading;
+  const image_variant_t* active;
+
+  // The variant being uploaded replaces the first one once loaded.
+  bool delta;
+
+  // The variant being uploaded is added to a ready cache, or is a delta of
+  // it, which is restored if the upload fails.
+  bool extending;
+  size_t base_pool_blocks;
+  size_t base_manifest_count;
+  // The last upload was dropped and the cache restored.
+  bool load_failed;
+
+  // Upload in progress.
+  uint32_t received;
+  uint32_t received_crc;
+  uint64_t received_hash;
+  uf2_block_t staging;
+  size_t staged;
+  uf2_check_t check;
+
+  // Payloads of the variants, which are either the uploaded ones held in RAM,
+  // or the ones of a stored image.
+  const uint8_t* payload;
+  size_t pool_blocks;
+  uint32_t pool_hashes[IMAGE_CACHE_BLOCKS];
+  uint8_t ram[IMAGE_CACHE_BLOCKS][UF2_PAYLOAD_SIZE];
+} image_cache_t;
+
+static image_cache_t cache;
+
+static void invalidate(const char* reason) {
+  if (cache.state != IMAGE_CACHE_INVALID) {
+    printf("Image cache: %s\n", reason);
+  }
+  if (cache.loading) {
+    cache.loading->info.state = IMAGE_CACHE_INVALID;
+  }
+  if (cache.loading && cache.extending) {
+    // Drop the variant and its payloads, the state is restored last as the
+    // USB core may check it.
+    cache.variant_count--;
+    cache.pool_blocks = cache.base_pool_blocks;
+    cache.manifest_count = cache.base_manifest_count;
+    cache.loading = NULL;
+    cache.delta = false;
+    cache.extending = false;
+    cache.load_failed = true;
+    cache.state = IMAGE_CACHE_READY;
+    printf("Image cache: kept the %u ready variants.\n", cache.variant_count);
+    return;
+  }
+  cache.state = IMAGE_CACHE_INVALID;
+}
+
+void image_cache_init() {
+  mutex_init(&cache.mutex);
+  cache.state = IMAGE_CACHE_EMPTY;
+  cache.payload = &cache.ram[0][0];
+}
+
+// Start loading the next variant. The cache mutex has to be held.
+static void begin_variant(uint32_t size, uint32_t crc) {
+  image_variant_t* variant = &cache.variants[cache.variant_count++];
+  memset(&variant->info, 0, sizeof(variant->info));
+  variant->info.state = IMAGE_CACHE_LOADING;
+  variant->info.size = size;
+  variant->info.crc = crc;
+  variant->layout.run_count = 0;
+  variant->layout.patch_count = 0;
+  cache.loading = variant;
+  cache.delta = false;
+  cache.load_failed = false;
+  cache.state = IMAGE_CACHE_LOADING;
+  cache.received = 0;
+  cache.received_crc = 0;
+  cache.received_hash = FNV1A64_INIT;
+  cache.staged = 0;
+  uf2_check_init(&cache.check);
+
+  if (size > IMAGE_CACHE_BLOCKS * UF2_BLOCK_SIZE) {
+    invalidate("image too large.");
+  }
+}
+
+bool image_cache_begin(uint32_t size, uint32_t crc) {
+  // The USB core holds the cache while writing it to a device.
+  if (!mutex_try_enter(&cache.mutex, NULL)) {
+    printf("Image cache: busy.\n");
+    return false;
+  }
+  cache.variant_count = 0;
+  cache.manifest_count = 0;
+  cache.payload = &cache.ram[0][0];
+  cache.pool_blocks = 0;
+  cache.extending = false;
+  begin_variant(size, crc);
+  mutex_exit(&cache.mutex);
+  return true;
+}
+
+bool image_cache_begin_variant(uint32_t size, uint32_t crc) {
+  if (!mutex_try_enter(&cache.mutex, NULL)) {
+    printf("Image cache: busy.\n");
+    return false;
+  }
+  // New payloads are appended to the pool, which must be held in RAM.
+  bool extensible =
+    cache.state == IMAGE_CACHE_READY &&
+    cache.variant_count < IMAGE_CACHE_VARIANTS &&
+    cache.payload == &cache.ram[0][0];
+  if (extensible) {
+    cache.extending = true;
+    cache.base_pool_blocks = cache.pool_blocks;
+    cache.base_manifest_count = cache.manifest_count;
+    begin_variant(size, crc);
+  }
+  mutex_exit(&cache.mutex);
+  if (!extensible) {
+    printf("Image cache: cannot add a variant.\n");
+  }
+  return extensible;
+}
+
+bool image_cache_begin_delta(uint32_t size, uint32_t crc, uint32_t base_crc) {
+  if (!mutex_try_enter(&cache.mutex, NULL)) {
+    printf("Image cache: busy.\n");
+    return false;
+  }
+  bool based =
+    cache.state == IMAGE_CACHE_READY && cache.variant_count == 1 &&
+    cache.variants[0].info.crc == base_crc;
+  if (based) {
+    // Payloads of a stored image are copied in RAM, where the new ones are
+    // appended.
+    if (cache.payload != &cache.ram[0][0]) {
+      memcpy(cache.ram, cache.payload, cache.pool_blocks * UF2_PAYLOAD_SIZE);
+      cache.payload = &cache.ram[0][0];
+    }
+    cache.extending = true;
+    cache.base_pool_blocks = cache.pool_blocks;
+    cache.base_manifest_count = cache.manifest_count;
+    cache.manifest_count = 0;
+    begin_variant(size, crc);
+    cache.delta = true;
+  }
+  mutex_exit(&cache.mutex);
+  if (!based) {
+    printf("Image cache: the base image is not cached.\n");
+  }
+  return based;
+}
+
+uint32_t image_cache_payload_hash(const uint8_t* payload) {
+  return (uint32_t) fnv1a64_update(FNV1A64_INIT, payload, UF2_PAYLOAD_SIZE);
+}
+
+// Find a payload of the pool, given its hash, and its content if known.
+static bool find_payload(uint32_t hash, const uint8_t* data, uint16_t* index) {
+  for (size_t i = 0; i < cache.pool_blocks; i++) {
+    if (cache.pool_hashes[i] != hash ||
+        (data && memcmp(cache.ram[i], data, UF2_PAYLOAD_SIZE) != 0)) {
+      continue;
+    }
+    *index = (uint16_t) i;
+    return true;
+  }
+  return false;
+}
+
+// Record the payload and target address of a complete UF2 block.
+static void load_block(const uf2_block_t* b) {
+  if (b->magic_start0 != UF2_MAGIC_START0 ||
+      b->magic_start1 != UF2_MAGIC_START1 ||
+      b->magic_end != UF2_MAGIC_END) {
+    invalidate("not a UF2 image.");
+    return;
+  }
+  // Checksums and extension tags are stored next to the payload, and cannot
+  // be rebuilt.
+  if (b->payload_size != UF2_PAYLOAD_SIZE ||
+      (b->flags & ~UF2_FLAG_FAMILY_ID_PRESENT) != 0) {
+    invalidate("unsupported UF2 blocks.");
+    return;
+  }
+
+  image_variant_t* variant = cache.loading;
+  image_layout_t* layout = &variant->layout;
+  size_t block = variant->info.blocks;
+  if (block == 0) {
+    layout->flags = b->flags;
+    layout->file_size = b->file_size;
+  }
+  if (b->block_no != block || b->flags != layout->flags ||
+      b->file_size != layout->file_size || block >= IMAGE_CACHE_BLOCKS) {
+    invalidate("unexpected UF2 block.");
+    return;
+  }
+
+  image_run_t* run =
+    layout->run_count ? &layout->runs[layout->run_count - 1] : NULL;
+  if (!run ||
+      b->target_addr != run->target_addr + run->blocks * UF2_PAYLOAD_SIZE) {
+    if (layout->run_count == IMAGE_CACHE_RUNS) {
+      invalidate("too many address ranges.");
+      return;
+    }
+    run = &layout->runs[layout->run_count++];
+    run->target_addr = b->target_addr;
+    run->first_block = (uint16_t) block;
+    run->blocks = 0;
+  }
+  run->blocks++;
+
+  // Payloads shared with a previous block or variant are stored once.
+  const uint32_t hash = image_cache_payload_hash(b->data);
+  uint16_t index;
+  if (!find_payload(hash, b->data, &index)) {
+    if (cache.pool_blocks == IMAGE_CACHE_BLOCKS) {
+      invalidate("too many distinct blocks.");
+      return;
+    }
+    index = (uint16_t) cache.pool_blocks++;
+    memcpy(cache.ram[index], b->data, UF2_PAYLOAD_SIZE);
+    cache.pool_hashes[index] = hash;
+  }
+  variant->refs[block] = index;
+  variant->info.blocks++;
+}
+
+void image_cache_write(const uint8_t* data, size_t len) {
+  if (cache.state != IMAGE_CACHE_LOADING) {
+    return;
+  }
+  cache.received += len;
+  cache.received_crc = crc32_update(cache.received_crc, data, len);
+  cache.received_hash = fnv1a64_update(cache.received_hash, data, len);
+  if (!uf2_check_run(&cache.check, data, len)) {
+    invalidate(uf2_check_reason(&cache.check));
+    return;
+  }
+
+  uint8_t* staging = (uint8_t*) &cache.staging;
+  while (len && cache.state == IMAGE_CACHE_LOADING) {
+    size_t count = UF2_BLOCK_SIZE - cache.staged;
+    if (count > len) {
+      count = len;
+    }
+    memcpy(&staging[cache.staged], data, count);
+    cache.staged += count;
+    data += count;
+    len -= count;
+
+    if (cache.staged == UF2_BLOCK_SIZE) {
+      load_block(&cache.staging);
+      cache.staged = 0;
+    }
+  }
+}
+
+size_t image_cache_get_hashes(size_t first, uint32_t* hashes, size_t count) {
+  if (cache.state != IMAGE_CACHE_READY || first >= cache.pool_blocks) {
+    return 0;
+  }
+  if (count > cache.pool_blocks - first) {
+    count = cache.pool_blocks - first;
+  }
+  memcpy(hashes, &cache.pool_hashes[first], count * sizeof(*hashes));
+  return count;
+}
+
+void image_cache_reuse(const uint8_t* header, uint32_t payload_hash) {
+  if (cache.state != IMAGE_CACHE_LOADING) {
+    return;
+  }
+  uint16_t index;
+  if (cache.staged != 0 || !find_payload(payload_hash, NULL, &index)) {
+    invalidate("reused block not cached.");
+    return;
+  }
+
+  // Rebuild the uploaded block, such that it is checked against the size and
+  // CRC-32 of the file, and recorded as any other block.
+  static uf2_block_t block;
+  memset(&block, 0, sizeof(block));
+  memcpy(&block, header, UF2_HEADER_SIZE);
+  memcpy(block.data, cache.ram[index], UF2_PAYLOAD_SIZE);
+  block.magic_end = UF2_MAGIC_END;
+  image_cache_write((const uint8_t*) &block, sizeof(block));
+}
+
+// Replace the base image by the image loaded as a delta, and compact the pool
+// to drop the payloads which are no longer referenced. The USB core cannot
+// acquire the cache while it is loading.
+static void replace_base() {
+  memcpy(&cache.variants[0], cache.loading, sizeof(cache.variants[0]));
+  cache.variant_count = 1;
+  cache.delta = false;
+
+  static uint16_t remap[IMAGE_CACHE_BLOCKS];
+  image_variant_t* variant = &cache.variants[0];
+  memset(remap, 0xff, sizeof(remap));
+  for (size_t b = 0; b < variant->info.blocks; b++) {
+    remap[variant->refs[b]] = 0;
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < cache.pool_blocks; i++) {
+    if (remap[i] == 0xffff) {
+      continue;
+    }
+    if (kept != i) {
+      memcpy(cache.ram[kept], cache.ram[i], UF2_PAYLOAD_SIZE);
+      cache.pool_hashes[kept] = cache.pool_hashes[i];
+    }
+    remap[i] = (uint16_t) kept++;
+  }
+  for (size_t b = 0; b < variant->info.blocks; b++) {
+    variant->refs[b] = remap[variant->refs[b]];
+  }
+  printf("Image cache: replaced the base image, dropped %u blocks.\n",
+         cache.pool_blocks - kept);
+  cache.pool_blocks = kept;
+}
+
+bool image_cache_end(const uint32_t* port_offsets, size_t count) {
+  if (cache.state != IMAGE_CACHE_LOADING) {
+    return false;
+  }
+  image_variant_t* variant = cache.loading;
+  if (cache.staged != 0 || cache.received != variant->info.size ||
+      cache.received_crc != variant->info.crc ||
+      !uf2_check_end(&cache.check)) {
+    invalidate("image corrupted during upload.");
+    return false;
+  }
+  image_layout_t* layout = &variant->layout;
+  const size_t blocks = variant->info.blocks;
+  if (blocks == 0 ||
+      layout->runs[0].first_block != 0 ||
+      blocks != layout->runs[layout->run_count - 1].first_block +
+                layout->runs[layout->run_count - 1].blocks) {
+    invalidate("empty image.");
+    return false;
+  }
+
+  // Patches are applied to the rebuilt blocks, which are located at the same
+  // offsets as in the uploaded file.
+  size_t patch_count = patch_get_table(layout->patches);
+  if (patch_count + count > IMAGE_CACHE_PATCHES) {
+    invalidate("too many patches.");
+    return false;
+  }
+  for (size_t p = 0; p < count; p++) {
+    patch_t* patch = &layout->patches[patch_count++];
+    patch->offset = port_offsets[p];
+    patch->kind = PATCH_PORT;
+    patch->size = sizeof(uint32_t);
+    patch->reserved = 0;
+    if (!patch_is_valid(patch)) {
+      invalidate("patched offset outside of the payloads.");
+      return false;
+    }
+  }
+  layout->patch_count = (uint16_t) patch_count;
+
+  variant->info.hash = cache.received_hash;
+  variant->info.state = IMAGE_CACHE_READY;
+  if (cache.delta) {
+    replace_base();
+  }
+  cache.loading = NULL;
+  cache.extending = false;
+  cache.state = IMAGE_CACHE_READY;
+  printf("Image cache: variant %u, %u blocks in %u ranges, %u distinct.\n",
+         cache.variant_count - 1, blocks, layout->run_count,
+         cache.pool_blocks);
+  return true;
+}
+
+bool image_cache_set_manifest(const image_manifest_entry_t* entries,
+                              size_t count) {
+  if (count > IMAGE_CACHE_MANIFEST_SIZE) {
+    return false;
+  }
+  if (!mutex_try_enter(&cache.mutex, NULL)) {
+    printf("Image cache: busy.\n");
+    return false;
+  }
+  memcpy(cache.manifest, entries, count * sizeof(*entries));
+  cache.manifest_count = count;
+  mutex_exit(&cache.mutex);
+  return true;
+}
+
+void image_cache_get_info(image_cache_info_t* info) {
+  memset(info, 0, sizeof(*info));
+  if (cache.variant_count) {
+    memcpy(info, &cache.variants[cache.variant_count - 1].info, sizeof(*info));
+  }
+  info->state = cache.state;
+  info->variants = (uint8_t) cache.variant_count;
+  info->pool_blocks = (uint16_t) cache.pool_blocks;
+  info->load_failed = cache.load_failed;
+}
+
+// Find the variant of a port in the manifest.
+static bool find_variant(uint8_t port, size_t* variant) {
+  if (cache.manifest_count == 0) {
+    *variant = 0;
+    return true;
+  }
+  for (size_t e = 0; e < cache.manifest_count; e++) {
+    const image_manifest_entry_t* entry = &cache.manifest[e];
+    if (entry->first_port <= port && port <= entry->last_port) {
+      *variant = entry->variant;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool image_cache_covers_port(uint8_t port) {
+  size_t variant;
+  mutex_enter_blocking(&cache.mutex);
+  bool covered = find_variant(port, &variant);
+  mutex_exit(&cache.mutex);
+  return covered;
+}
+
+bool image_cache_attach(const image_cache_info_t* info,
+                        const image_layout_t* layout, const uint16_t* refs,
+                        const uint8_t* payload, uint16_t pool_blocks) {
+  if (!mutex_try_enter(&cache.mutex, NULL)) {
+    printf("Image cache: busy.\n");
+    return false;
+  }
+  image_variant_t* variant = &cache.variants[0];
+  memcpy(&variant->info, info, sizeof(variant->info));
+  memcpy(&variant->layout, layout, sizeof(variant->layout));
+  memcpy(variant->refs, refs, info->blocks * sizeof(*refs));
+  variant->info.state = IMAGE_CACHE_READY;
+  cache.variant_count = 1;
+  cache.manifest_count = 0;
+  cache.loading = NULL;
+  cache.extending = false;
+  cache.load_failed = false;
+  cache.payload = payload;
+  cache.pool_blocks = pool_blocks;
+  // Hashes are used to reuse the payloads when a new build is uploaded.
+  for (size_t i = 0; i < pool_blocks; i++) {
+    cache.pool_hashes[i] =
+      image_cache_payload_hash(&payload[i * UF2_PAYLOAD_SIZE]);
+  }
+  cache.staged = 0;
+  cache.state = IMAGE_CACHE_READY;
+  mutex_exit(&cache.mutex);
+  return true;
+}
+
+// Select the variant written to a device. The cache mutex has to be held, and
+// is released if the variant is not ready.
+static bool select_variant(size_t variant) {
+  if (cache.state != IMAGE_CACHE_READY || variant >= cache.variant_count) {
+    mutex_exit(&cache.mutex);
+    return false;
+  }
+  cache.active = &cache.variants[variant];
+  return true;
+}
+
+bool image_cache_acquire(uint8_t port) {
+  size_t variant;
+  mutex_enter_blocking(&cache.mutex);
+  if (!find_variant(port, &variant)) {
+    mutex_exit(&cache.mutex);
+    printf("Image cache: no variant for port %u.\n", port);
+    return false;
+  }
+  return select_variant(variant);
+}
+
+bool image_cache_acquire_variant(size_t variant) {
+  mutex_enter_blocking(&cache.mutex);
+  return select_variant(variant);
+}
+
+void image_cache_release() {
+  mutex_exit(&cache.mutex);
+}
+
+void image_cache_build_block(size_t block, const patch_values_t* values,
+                             uf2_block_t* out) {
+  const image_variant_t* variant = cache.active;
+  const image_layout_t* layout = &variant->layout;
+
+  // Find the run of the block, runs are sorted by blocks.
+  const image_run_t* run = &layout->runs[0];
+  for (size_t r = 1; r < layout->run_count; r++) {
+    if (layout->runs[r].first_block > block) {
+      break;
+    }
+    run = &layout->runs[r];
+  }
+
+  out->magic_start0 = UF2_MAGIC_START0;
+  out->magic_start1 = UF2_MAGIC_START1;
+  out->flags = layout->flags;
+  out->target_addr =
+    run->target_addr + (uint32_t) (block - run->first_block) * UF2_PAYLOAD_SIZE;
+  out->payload_size = UF2_PAYLOAD_SIZE;
+  out->block_no = (uint32_t) block;
+  out->num_blocks = variant->info.blocks;
+  out->file_size = layout->file_size;
+  memcpy(out->data, &cache.payload[variant->refs[block] * UF2_PAYLOAD_SIZE],
+         UF2_PAYLOAD_SIZE);
+  memset(&out->data[UF2_PAYLOAD_SIZE], 0, UF2_DATA_SIZE - UF2_PAYLOAD_SIZE);
+  out->magic_end = UF2_MAGIC_END;
+
+  // Write the values of the device where the client asked for it.
+  const uint32_t offset = (uint32_t) block * UF2_BLOCK_SIZE;
+  patch_apply((uint8_t*) out, UF2_BLOCK_SIZE, offset,
+              layout->patches, layout->patch_count, values);
+}
+
+const image_cache_info_t* image_cache_variant_info() {
+  return &cache.active->info;
+}
+
+const image_layout_t* image_cache_layout() {
+  return &cache.active->layout;
+}
+
+const uint16_t* image_cache_refs() {
+  return cache.active->refs;
+}
+
+const uint8_t* image_cache_payload() {
+  return cache.payload;
+}
+
+void image_cache_recover_core1() {
+  mutex_recover_core1(&cache.mutex);
+}
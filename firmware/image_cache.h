@@ -0,0 +1,191 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "patch.h"
+#include "uf2.h"
+
+// The image cache holds one UF2 image in RAM, uploaded once per batch and then
+// flashed on every port without being transmitted again. Only the 256-byte
+// payloads are stored, along with the runs of contiguous target addresses, and
+// the UF2 blocks are rebuilt while they are written to the device.
+//
+// Payloads are stored by content in a pool shared by up to IMAGE_CACHE_VARIANTS
+// variants of the image, such as images which only differ by a configuration
+// blob. Each variant lists the payloads of its blocks, and identical payloads
+// are stored once. A manifest maps ranges of ports to the variants, such that a
+// rack of devices which need different variants is flashed in a single batch.
+// Payloads which are already cached can be referenced by their hash instead of
+// being uploaded again, including when a new build replaces the cached image,
+// such that only the blocks which changed are uploaded.
+//
+// The image is uploaded by the network core, and read by the USB core. The
+// payloads can also be read from an image saved in the flash of the Pico W, see
+// image_store.h.
+
+// Size of the payloads which can be cached, which is a UF2 file of twice this
+// size. This is bounded by the RAM left by the Wifi driver and the TCP stack.
+#ifndef IMAGE_CACHE_PAYLOAD_SIZE
+#define IMAGE_CACHE_PAYLOAD_SIZE (112 * 1024)
+#endif
+#define IMAGE_CACHE_BLOCKS (IMAGE_CACHE_PAYLOAD_SIZE / UF2_PAYLOAD_SIZE)
+
+// Maximum number of discontiguous address ranges in the image.
+#define IMAGE_CACHE_RUNS 32
+
+// Maximum number of patches applied to the image.
+#define IMAGE_CACHE_PATCHES PATCH_TABLE_SIZE
+
+// Maximum number of variants of the image held at once.
+#define IMAGE_CACHE_VARIANTS 4
+
+// Maximum number of port ranges in the manifest.
+#define IMAGE_CACHE_MANIFEST_SIZE 8
+
+// Consecutive blocks whose target addresses follow each other.
+typedef struct {
+  uint32_t target_addr;
+  uint16_t first_block;
+  uint16_t blocks;
+} image_run_t;
+
+// Everything needed to rebuild the UF2 blocks besides the payloads.
+typedef struct {
+  // Fields which are common to all blocks.
+  uint32_t flags;
+  uint32_t file_size;
+
+  uint16_t run_count;
+  uint16_t patch_count;
+  image_run_t runs[IMAGE_CACHE_RUNS];
+
+  // Patches written while rebuilding each block.
+  patch_t patches[IMAGE_CACHE_PATCHES];
+} image_layout_t;
+
+// Range of ports flashed with a variant of the image.
+typedef struct {
+  uint8_t first_port;
+  uint8_t last_port;
+  uint8_t variant;
+  uint8_t reserved;
+} image_manifest_entry_t;
+
+typedef enum {
+  IMAGE_CACHE_EMPTY = 0,
+  IMAGE_CACHE_LOADING,
+  IMAGE_CACHE_READY,
+  // The uploaded image cannot be cached, either because it is too large, is
+  // corrupted, or uses UF2 features which cannot be rebuilt. Clients should
+  // stream the image instead.
+  IMAGE_CACHE_INVALID,
+} image_cache_state_t;
+
+typedef struct {
+  image_cache_state_t state;
+  uint16_t blocks;
+  // Size and CRC-32 of the UF2 file as uploaded.
+  uint32_t size;
+  uint32_t crc;
+  // FNV-1a hash of the UF2 file, which identifies the image in the store.
+  uint64_t hash;
+  // Number of variants and of distinct payloads held by the cache, only set by
+  // image_cache_get_info.
+  uint8_t variants;
+  uint16_t pool_blocks;
+  // Whether the last variant or delta failed to load, while the image loaded
+  // before is kept, only set by image_cache_get_info.
+  bool load_failed;
+} image_cache_info_t;
+
+void image_cache_init();
+
+// Start loading a new image of the given size and CRC-32, dropping all the
+// variants and the manifest. Returns false if the cache is being read by the
+// USB core.
+bool image_cache_begin(uint32_t size, uint32_t crc);
+
+// Start loading another variant of the image, which shares the payloads of the
+// variants already loaded. Returns false if the cache is being read by the USB
+// core, or cannot hold another variant. The variants already loaded are kept
+// if this one fails to load.
+bool image_cache_begin_variant(uint32_t size, uint32_t crc);
+
+// Start loading a new image which replaces the cached one, given by its
+// CRC-32, while reusing its payloads. The cached image is dropped once the new
+// one is loaded, along with the payloads only it used, and is kept if the new
+// one fails to load. Returns false if the cache is being read by the USB core,
+// or does not hold the base image alone.
+bool image_cache_begin_delta(uint32_t size, uint32_t crc, uint32_t base_crc);
+
+// Append the content of the UF2 file, which can be split at any offset.
+void image_cache_write(const uint8_t* data, size_t len);
+
+// Hash identifying a payload of the pool, which is the lower half of the
+// FNV-1a hash of the 256-byte payload.
+uint32_t image_cache_payload_hash(const uint8_t* payload);
+
+// Copy the hashes of the payloads of the pool, starting at `first`, and return
+// the number of hashes copied.
+size_t image_cache_get_hashes(size_t first, uint32_t* hashes, size_t count);
+
+// Append a UF2 block whose payload is already cached, given the
+// UF2_HEADER_SIZE bytes of its header and the hash of its payload. The rest of
+// the block is zero. Invalidates the variant if no such payload is cached.
+void image_cache_reuse(const uint8_t* header, uint32_t payload_hash);
+
+// Validate the loaded image against the announced size and CRC-32, and record
+// the patch table along with the offsets within the UF2 file at which the
+// index of the device is written as a 32-bit little endian value.
+bool image_cache_end(const uint32_t* port_offsets, size_t count);
+
+// Map ranges of ports to the variants of the image. Ports outside of the
+// ranges are not flashed, unless the manifest is empty, in which case every
+// port is flashed with the first variant. Returns false if the cache is being
+// read by the USB core, or if the manifest is too large.
+bool image_cache_set_manifest(const image_manifest_entry_t* entries,
+                              size_t count);
+
+// Report the state of the cache, and the size and CRC-32 of the variant loaded
+// last.
+void image_cache_get_info(image_cache_info_t* info);
+
+// Whether the manifest gives a variant for the port.
+bool image_cache_covers_port(uint8_t port);
+
+// Replace the cached image by a ready image with a single variant, whose block
+// payloads are `pool_blocks` payloads read from `payload` at the indices given
+// by `refs`, such as an image saved in the flash and read through XIP. Returns
+// false if the cache is being read by the USB core.
+bool image_cache_attach(const image_cache_info_t* info,
+                        const image_layout_t* layout, const uint16_t* refs,
+                        const uint8_t* payload, uint16_t pool_blocks);
+
+// Lock the cache while the variant of the port is written to a device.
+// Executed by the USB core, returns false if no image is ready for the port.
+bool image_cache_acquire(uint8_t port);
+
+// Lock the cache and select one of its variants, returns false if no such
+// variant is ready.
+bool image_cache_acquire_variant(size_t variant);
+void image_cache_release();
+
+// Rebuild a UF2 block of the acquired variant, patched with the values of the
+// device. The cache has to be acquired.
+void image_cache_build_block(size_t block, const patch_values_t* values,
+                             uf2_block_t* out);
+
+// Description, layout and payload indices of the acquired variant, and the
+// payloads of the pool, valid while the cache is acquired.
+const image_cache_info_t* image_cache_variant_info();
+const image_layout_t* image_cache_layout();
+const uint16_t* image_cache_refs();
+const uint8_t* image_cache_payload();
+
+// Release the cache if it was held by core 1 when it got reset.
+void image_cache_recover_core1();
+
+#endif // !IMAGE_CACHE_H
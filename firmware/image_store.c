@@ -0,0 +1,366 @@
+#include "image_store.h"
+
+#include <stdio.h>
+#include <string.h> // memcpy, memset
+
+#include "pico/mutex.h"
+
+#include "checksum.h"
+#include "flash_region.h"
+#include "image_cache.h"
+#include "pipe.h"
+#include "usb_host.h"
+
+// Each entry starts on a sector boundary with a header of 2 pages, followed by
+// the index of the payload of each block, and the distinct payloads of the
+// image. The header is programmed last, such that an entry interrupted by a
+// power loss is never valid. Entries are appended after the latest one, and
+// wrap to the start of the region once they reach its end.
+#define IMAGE_STORE_MAGIC 0x32464255 // "UBF2"
+#define IMAGE_STORE_HEADER_SIZE (2 * FLASH_PAGE_SIZE)
+
+// Each entry uses at least one sector.
+#define IMAGE_STORE_ENTRIES (FLASH_IMAGE_STORE_SIZE / FLASH_SECTOR_SIZE)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t sequence;
+  uint64_t hash;
+  // Size and CRC-32 of the UF2 file.
+  uint32_t size;
+  uint32_t crc;
+  uint16_t blocks;
+  uint16_t pool_blocks;
+  // CRC-32 of the indices and payloads which follow the header.
+  uint32_t payload_crc;
+  image_layout_t layout;
+  uint8_t padding[IMAGE_STORE_HEADER_SIZE - 8 * sizeof(uint32_t) -
+                  sizeof(image_layout_t) - sizeof(uint32_t)];
+  // CRC-32 of all the previous fields.
+  uint32_t header_crc;
+} store_header_t;
+
+_Static_assert(sizeof(store_header_t) == IMAGE_STORE_HEADER_SIZE,
+               "Image store headers are written as whole flash pages.");
+
+typedef struct {
+  mutex_t mutex;
+  image_store_state_t state;
+  // Offsets of the valid entries within the region, oldest first.
+  uint32_t entries[IMAGE_STORE_ENTRIES];
+  size_t count;
+  // Offset and sequence number of the next entry.
+  uint32_t head;
+  uint32_t sequence;
+} image_store_t;
+
+static image_store_t store;
+
+static const store_header_t* read_header(uint32_t offset) {
+  return (const store_header_t*) flash_region_read(
+      FLASH_IMAGE_STORE_OFFSET + offset);
+}
+
+// Size of the indices of the payloads, which are programmed as whole pages.
+static uint32_t refs_length(uint16_t blocks) {
+  uint32_t len = blocks * sizeof(uint16_t);
+  return (len + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1);
+}
+
+static const uint16_t* read_refs(uint32_t offset) {
+  return (const uint16_t*) flash_region_read(
+      FLASH_IMAGE_STORE_OFFSET + offset + IMAGE_STORE_HEADER_SIZE);
+}
+
+static const uint8_t* read_payload(uint32_t offset) {
+  return flash_region_read(FLASH_IMAGE_STORE_OFFSET + offset +
+                           IMAGE_STORE_HEADER_SIZE +
+                           refs_length(read_header(offset)->blocks));
+}
+
+// Size of the indices and payloads following the header.
+static uint32_t data_length(uint16_t blocks, uint16_t pool_blocks) {
+  return refs_length(blocks) + pool_blocks * UF2_PAYLOAD_SIZE;
+}
+
+static uint32_t entry_length(const store_header_t* header) {
+  uint32_t len = IMAGE_STORE_HEADER_SIZE +
+                 data_length(header->blocks, header->pool_blocks);
+  return (len + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+}
+
+static uint32_t header_crc(const store_header_t* header) {
+  return crc32_update(0, header, offsetof(store_header_t, header_crc));
+}
+
+static bool is_valid_entry(uint32_t offset) {
+  const store_header_t* header = read_header(offset);
+  if (header->magic != IMAGE_STORE_MAGIC ||
+      header->header_crc != header_crc(header)) {
+    return false;
+  }
+  if (header->blocks == 0 || header->blocks > IMAGE_CACHE_BLOCKS ||
+      header->pool_blocks == 0 || header->pool_blocks > header->blocks ||
+      offset + entry_length(header) > FLASH_IMAGE_STORE_SIZE) {
+    return false;
+  }
+  const uint8_t* data = (const uint8_t*) read_refs(offset);
+  return header->payload_crc ==
+    crc32_update(0, data, data_length(header->blocks, header->pool_blocks));
+}
+
+// Insert an entry in the index, which is sorted by sequence numbers.
+static void index_entry(uint32_t offset) {
+  uint32_t sequence = read_header(offset)->sequence;
+  size_t at = store.count;
+  while (at > 0) {
+    uint32_t previous = read_header(store.entries[at - 1])->sequence;
+    if ((int32_t) (sequence - previous) >= 0) {
+      break;
+    }
+    store.entries[at] = store.entries[at - 1];
+    at--;
+  }
+  store.entries[at] = offset;
+  store.count++;
+}
+
+// Remove the entries overlapping the sectors which are about to be erased.
+static void forget_entries(uint32_t offset, uint32_t len) {
+  size_t kept = 0;
+  for (size_t e = 0; e < store.count; e++) {
+    uint32_t start = store.entries[e];
+    uint32_t end = start + entry_length(read_header(start));
+    if (start < offset + len && offset < end) {
+      continue;
+    }
+    store.entries[kept++] = start;
+  }
+  store.count = kept;
+}
+
+// Find the latest entry with the given hash, or the latest entry if the hash
+// is 0. The store mutex has to be held.
+static bool find_entry(uint64_t hash, uint32_t* offset) {
+  for (size_t e = store.count; e-- > 0; ) {
+    if (hash == 0 || read_header(store.entries[e])->hash == hash) {
+      *offset = store.entries[e];
+      return true;
+    }
+  }
+  return false;
+}
+
+void image_store_init() {
+  mutex_init(&store.mutex);
+  store.count = 0;
+  store.head = 0;
+  store.sequence = 0;
+
+  // Provided by the linker script of the Pico SDK.
+  extern char __flash_binary_end;
+  uint32_t binary_end = (uint32_t) ((uintptr_t) &__flash_binary_end - XIP_BASE);
+  if (binary_end > FLASH_IMAGE_STORE_OFFSET) {
+    printf("Image store: Disabled, the firmware ends at %lu.\n", binary_end);
+    store.state = IMAGE_STORE_DISABLED;
+    return;
+  }
+  store.state = IMAGE_STORE_READY;
+
+  uint32_t offset = 0;
+  while (offset < FLASH_IMAGE_STORE_SIZE) {
+    if (!is_valid_entry(offset)) {
+      offset += FLASH_SECTOR_SIZE;
+      continue;
+    }
+    index_entry(offset);
+    offset += entry_length(read_header(offset));
+  }
+
+  if (store.count == 0) {
+    printf("Image store: No image stored.\n");
+    return;
+  }
+  uint32_t latest = store.entries[store.count - 1];
+  const store_header_t* header = read_header(latest);
+  store.head = latest + entry_length(header);
+  store.sequence = header->sequence + 1;
+  printf("Image store: %u images, latest: %lu bytes (crc32: %08lx).\n",
+         store.count, header->size, header->crc);
+
+  // Flash the latest image unless a client uploads another one.
+  image_store_load(0);
+}
+
+// Append the image held by the image cache to the log. The cache has to be
+// acquired.
+static bool write_entry() {
+  image_cache_info_t cached;
+  image_cache_get_info(&cached);
+  if (cached.variants != 1) {
+    printf("Image store: Images with variants cannot be stored.\n");
+    return false;
+  }
+  image_cache_info_t info = *image_cache_variant_info();
+
+  uint32_t offset;
+  mutex_enter_blocking(&store.mutex);
+  bool stored = find_entry(info.hash, &offset) &&
+                read_header(offset)->size == info.size;
+  mutex_exit(&store.mutex);
+  if (stored) {
+    printf("Image store: Image already stored.\n");
+    return true;
+  }
+
+  // The indices are copied to a whole number of pages, followed by the pool of
+  // payloads shared by the blocks.
+  static uint16_t refs[IMAGE_CACHE_BLOCKS + FLASH_PAGE_SIZE / sizeof(uint16_t)];
+  const uint32_t refs_len = refs_length(info.blocks);
+  memset(refs, 0xff, refs_len);
+  memcpy(refs, image_cache_refs(), info.blocks * sizeof(uint16_t));
+  const uint8_t* payload = image_cache_payload();
+  const uint32_t payload_len = cached.pool_blocks * UF2_PAYLOAD_SIZE;
+
+  // The stack of core 1 is too small to hold the header.
+  static store_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = IMAGE_STORE_MAGIC;
+  header.sequence = store.sequence;
+  header.hash = info.hash;
+  header.size = info.size;
+  header.crc = info.crc;
+  header.blocks = info.blocks;
+  header.pool_blocks = cached.pool_blocks;
+  header.payload_crc = crc32_update(crc32_update(0, refs, refs_len), payload,
+                                    payload_len);
+  memcpy(&header.layout, image_cache_layout(), sizeof(header.layout));
+  header.header_crc = header_crc(&header);
+
+  const uint32_t len = entry_length(&header);
+  offset = store.head;
+  if (offset + len > FLASH_IMAGE_STORE_SIZE) {
+    offset = 0;
+  }
+
+  // The network core might read the entries which are about to be erased.
+  mutex_enter_blocking(&store.mutex);
+  forget_entries(offset, len);
+  mutex_exit(&store.mutex);
+
+  // Erase and program one sector at a time, such that the network core is
+  // only paused briefly, and report progress to the supervisor of the USB core.
+  const uint32_t base = FLASH_IMAGE_STORE_OFFSET + offset;
+  for (uint32_t s = 0; s < len; s += FLASH_SECTOR_SIZE) {
+    usb_host_beat();
+    if (!flash_region_erase(base + s, FLASH_SECTOR_SIZE)) {
+      return false;
+    }
+  }
+  const uint32_t data = base + IMAGE_STORE_HEADER_SIZE;
+  if (!flash_region_program(data, (const uint8_t*) refs, refs_len)) {
+    return false;
+  }
+  for (uint32_t p = 0; p < payload_len; p += FLASH_SECTOR_SIZE) {
+    usb_host_beat();
+    uint32_t count = payload_len - p;
+    if (count > FLASH_SECTOR_SIZE) {
+      count = FLASH_SECTOR_SIZE;
+    }
+    if (!flash_region_program(data + refs_len + p, &payload[p], count)) {
+      return false;
+    }
+  }
+  if (!flash_region_program(base, (const uint8_t*) &header, sizeof(header))) {
+    return false;
+  }
+  if (!is_valid_entry(offset)) {
+    printf("Image store: Failed to verify the image at %lu.\n", offset);
+    return false;
+  }
+
+  mutex_enter_blocking(&store.mutex);
+  index_entry(offset);
+  store.head = offset + len;
+  store.sequence++;
+  mutex_exit(&store.mutex);
+  printf("Image store: Saved %u blocks (%u distinct) at %lu.\n",
+         info.blocks, cached.pool_blocks, offset);
+  return true;
+}
+
+static void save_cb(void* arg) {
+  (void) arg;
+  bool saved = false;
+  if (image_cache_acquire_variant(0)) {
+    saved = write_entry();
+    image_cache_release();
+  } else {
+    printf("Image store: No image to save.\n");
+  }
+
+  mutex_enter_blocking(&store.mutex);
+  store.state = saved ? IMAGE_STORE_READY : IMAGE_STORE_FAILED;
+  mutex_exit(&store.mutex);
+}
+
+void image_store_save() {
+  mutex_enter_blocking(&store.mutex);
+  if (store.state == IMAGE_STORE_DISABLED ||
+      store.state == IMAGE_STORE_SAVING) {
+    mutex_exit(&store.mutex);
+    return;
+  }
+  store.state = IMAGE_STORE_SAVING;
+  mutex_exit(&store.mutex);
+
+  queue_usb_task(&save_cb, NULL);
+}
+
+bool image_store_load(uint64_t hash) {
+  // The store mutex is held while attaching the image, such that the entry
+  // cannot be forgotten and erased in the mean time.
+  uint32_t offset;
+  mutex_enter_blocking(&store.mutex);
+  if (!find_entry(hash, &offset)) {
+    mutex_exit(&store.mutex);
+    printf("Image store: No such image.\n");
+    return false;
+  }
+
+  const store_header_t* header = read_header(offset);
+  image_cache_info_t info = {
+    .state = IMAGE_CACHE_READY,
+    .blocks = header->blocks,
+    .size = header->size,
+    .crc = header->crc,
+    .hash = header->hash,
+  };
+  bool loaded = image_cache_attach(&info, &header->layout, read_refs(offset),
+                                   read_payload(offset), header->pool_blocks);
+  mutex_exit(&store.mutex);
+  if (loaded) {
+    printf("Image store: Loaded %lu bytes (crc32: %08lx).\n",
+           info.size, info.crc);
+  }
+  return loaded;
+}
+
+void image_store_get_info(image_store_info_t* info) {
+  memset(info, 0, sizeof(*info));
+  mutex_enter_blocking(&store.mutex);
+  info->state = store.state;
+  info->count = (uint8_t) (store.count > UINT8_MAX ? UINT8_MAX : store.count);
+  if (store.count) {
+    const store_header_t* header = read_header(store.entries[store.count - 1]);
+    info->blocks = header->blocks;
+    info->size = header->size;
+    info->crc = header->crc;
+    info->hash = header->hash;
+  }
+  mutex_exit(&store.mutex);
+}
+
+void image_store_recover_core1() {
+  mutex_recover_core1(&store.mutex);
+}
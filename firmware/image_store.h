@@ -0,0 +1,54 @@
+#ifndef IMAGE_STORE_H
+#define IMAGE_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The image store saves the image of the image cache in the flash of the Pico
+// W, such that batches can be flashed after a reboot without any client.
+//
+// Images are identified by the FNV-1a hash of their UF2 file, and saving an
+// image which is already stored does not write the flash. Entries are appended
+// to a log which wraps around the flash region, erasing the oldest entries.
+// Stored images are not copied back to RAM, the image cache reads their
+// payloads through XIP. Only caches holding a single variant can be stored.
+
+typedef enum {
+  // The firmware overlaps the flash region of the store.
+  IMAGE_STORE_DISABLED = 0,
+  IMAGE_STORE_READY,
+  IMAGE_STORE_SAVING,
+  // The last image could not be saved.
+  IMAGE_STORE_FAILED,
+} image_store_state_t;
+
+typedef struct {
+  image_store_state_t state;
+  // Number of images stored.
+  uint8_t count;
+  // Latest image stored.
+  uint16_t blocks;
+  uint32_t size;
+  uint32_t crc;
+  uint64_t hash;
+} image_store_info_t;
+
+// Scan the flash for stored images, and load the latest one in the image cache.
+// Executed before the USB core starts.
+void image_store_init();
+
+// Queue saving the image of the image cache in the flash.
+void image_store_save();
+
+// Load a stored image in the image cache, identified by its hash, or the latest
+// one if the hash is 0. Returns false if no such image is stored or if the
+// cache is busy.
+bool image_store_load(uint64_t hash);
+
+void image_store_get_info(image_store_info_t* info);
+
+// Release the store if it was held by core 1 when it got reset.
+void image_store_recover_core1();
+
+#endif // !IMAGE_STORE_H
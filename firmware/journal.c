@@ -0,0 +1,259 @@
+#include "journal.h"
+
+#include <stdio.h>
+#include <string.h> // memcpy, memcmp
+
+#include "pico/mutex.h"
+
+#include "checksum.h"
+#include "flash_region.h"
+#include "pipe.h"
+
+// Each commit writes a full record in the next flash page of the journal
+// sectors. The record with the highest sequence number and a valid checksum is
+// the current one. Sectors are only erased once all their pages have been
+// written, which spreads the wear over FLASH_JOURNAL_SECTORS * 16 commits.
+#define JOURNAL_MAGIC 0x4a464255 // "UBFJ"
+#define JOURNAL_SLOTS \
+  (FLASH_JOURNAL_SECTORS * FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+#define JOURNAL_SLOTS_PER_SECTOR (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t sequence;
+  uint8_t state;
+  uint8_t first_port;
+  uint8_t last_port;
+  uint8_t reserved;
+  uint32_t image_size;
+  uint32_t image_crc;
+  uint8_t outcome[USB_DEVICES];
+  uint8_t padding[FLASH_PAGE_SIZE - 5 * sizeof(uint32_t) - USB_DEVICES -
+                  sizeof(uint32_t)];
+  // CRC-32 of all the previous fields.
+  uint32_t crc;
+} journal_record_t;
+
+_Static_assert(sizeof(journal_record_t) == FLASH_PAGE_SIZE,
+               "Journal records are written one flash page at a time.");
+
+typedef struct {
+  mutex_t mutex;
+  journal_record_t record;
+  // Slot where the next record would be written.
+  size_t next_slot;
+  // Job parameters received from the network, waiting to be recorded by the
+  // USB core.
+  journal_record_t pending;
+} journal_t;
+
+static journal_t journal;
+
+static uint32_t record_crc(const journal_record_t* rec) {
+  return crc32_update(0, rec, offsetof(journal_record_t, crc));
+}
+
+static const journal_record_t* read_slot(size_t slot) {
+  return (const journal_record_t*) flash_region_read(
+      FLASH_JOURNAL_OFFSET + (uint32_t) (slot * FLASH_PAGE_SIZE));
+}
+
+static bool is_valid_record(const journal_record_t* rec) {
+  return rec->magic == JOURNAL_MAGIC && rec->crc == record_crc(rec);
+}
+
+static bool is_outcome(usb_status_t status) {
+  status &= ~DEVICE_IS_MOUNTED;
+  return status == DEVICE_FLASH_COMPLETE || (status & DEVICE_IS_ERROR);
+}
+
+static uint8_t find_resume_port(const journal_record_t* rec) {
+  for (size_t port = rec->first_port; port <= rec->last_port; port++) {
+    if (rec->outcome[port] == DEVICE_UNKNOWN) {
+      return (uint8_t) port;
+    }
+  }
+  return USB_DEVICES;
+}
+
+// Write the record in the next slot. A slot which fails to be programmed, for
+// example after a power loss while writing it, is skipped.
+static void write_record(journal_record_t* rec) {
+  rec->magic = JOURNAL_MAGIC;
+  rec->crc = record_crc(rec);
+
+  for (size_t attempt = 0; attempt < JOURNAL_SLOTS; attempt++) {
+    size_t slot = journal.next_slot;
+    journal.next_slot = (slot + 1) % JOURNAL_SLOTS;
+    uint32_t offset = FLASH_JOURNAL_OFFSET + (uint32_t) (slot * FLASH_PAGE_SIZE);
+
+    if (slot % JOURNAL_SLOTS_PER_SECTOR == 0) {
+      uint32_t sector = offset & ~(FLASH_SECTOR_SIZE - 1);
+      if (!flash_region_erase(sector, FLASH_SECTOR_SIZE)) {
+        return;
+      }
+    }
+    if (!flash_region_program(offset, (const uint8_t*) rec, sizeof(*rec))) {
+      return;
+    }
+    if (memcmp(read_slot(slot), rec, sizeof(*rec)) == 0) {
+      return;
+    }
+    printf("Journal: Failed to write slot %u, skipping it.\n", slot);
+  }
+}
+
+void journal_init() {
+  mutex_init(&journal.mutex);
+  memset(&journal.record, 0, sizeof(journal.record));
+  journal.next_slot = 0;
+
+  const journal_record_t* last = NULL;
+  for (size_t slot = 0; slot < JOURNAL_SLOTS; slot++) {
+    const journal_record_t* rec = read_slot(slot);
+    if (!is_valid_record(rec)) {
+      continue;
+    }
+    if (last && (int32_t) (rec->sequence - last->sequence) < 0) {
+      continue;
+    }
+    last = rec;
+    journal.next_slot = (slot + 1) % JOURNAL_SLOTS;
+  }
+
+  if (!last) {
+    printf("Journal: No job recorded.\n");
+    return;
+  }
+  memcpy(&journal.record, last, sizeof(journal.record));
+
+  if (journal.record.state == JOB_RUNNING) {
+    printf("Journal: Interrupted job on ports %u-%u (image: %lu bytes, "
+           "crc32: %08lx) can be resumed from port %u.\n",
+           journal.record.first_port, journal.record.last_port,
+           journal.record.image_size, journal.record.image_crc,
+           find_resume_port(&journal.record));
+  }
+}
+
+void journal_get_job(job_info_t* job) {
+  mutex_enter_blocking(&journal.mutex);
+  job->state = (job_state_t) journal.record.state;
+  job->first_port = journal.record.first_port;
+  job->last_port = journal.record.last_port;
+  job->resume_port = journal.record.state == JOB_COMPLETE ?
+    USB_DEVICES : find_resume_port(&journal.record);
+  job->image_size = journal.record.image_size;
+  job->image_crc = journal.record.image_crc;
+  mutex_exit(&journal.mutex);
+}
+
+usb_status_t journal_port_outcome(size_t port) {
+  if (port >= USB_DEVICES) {
+    return DEVICE_UNKNOWN;
+  }
+  mutex_enter_blocking(&journal.mutex);
+  usb_status_t status = DEVICE_UNKNOWN;
+  if (journal.record.state != JOB_NONE) {
+    status = journal.record.outcome[port];
+  }
+  mutex_exit(&journal.mutex);
+  return status;
+}
+
+static void start_job_cb(void* arg) {
+  (void) arg;
+  journal_record_t rec;
+
+  mutex_enter_blocking(&journal.mutex);
+  const journal_record_t* next = &journal.pending;
+  bool resume =
+    journal.record.state == JOB_RUNNING &&
+    journal.record.first_port == next->first_port &&
+    journal.record.last_port == next->last_port &&
+    journal.record.image_size == next->image_size &&
+    journal.record.image_crc == next->image_crc;
+  if (resume) {
+    printf("Journal: Resume job from port %u.\n",
+           find_resume_port(&journal.record));
+    mutex_exit(&journal.mutex);
+    return;
+  }
+
+  memcpy(&rec, next, sizeof(rec));
+  rec.sequence = journal.record.sequence + 1;
+  rec.state = JOB_RUNNING;
+  memset(rec.outcome, DEVICE_UNKNOWN, sizeof(rec.outcome));
+  memcpy(&journal.record, &rec, sizeof(rec));
+  mutex_exit(&journal.mutex);
+
+  printf("Journal: Start job on ports %u-%u.\n", rec.first_port, rec.last_port);
+  write_record(&rec);
+}
+
+void journal_start_job(uint8_t first_port, uint8_t last_port,
+                       uint32_t image_size, uint32_t image_crc) {
+  if (last_port >= USB_DEVICES) {
+    last_port = USB_DEVICES - 1;
+  }
+  if (first_port > last_port) {
+    first_port = last_port;
+  }
+
+  mutex_enter_blocking(&journal.mutex);
+  memset(&journal.pending, 0, sizeof(journal.pending));
+  journal.pending.first_port = first_port;
+  journal.pending.last_port = last_port;
+  journal.pending.image_size = image_size;
+  journal.pending.image_crc = image_crc;
+  mutex_exit(&journal.mutex);
+
+  queue_usb_task(&start_job_cb, NULL);
+}
+
+void journal_commit_port(size_t port, usb_status_t status) {
+  journal_record_t rec;
+  status &= ~DEVICE_IS_MOUNTED;
+
+  mutex_enter_blocking(&journal.mutex);
+  if (journal.record.state != JOB_RUNNING ||
+      port < journal.record.first_port || port > journal.record.last_port ||
+      !is_outcome(status) || journal.record.outcome[port] == status) {
+    mutex_exit(&journal.mutex);
+    return;
+  }
+
+  journal.record.outcome[port] = (uint8_t) status;
+  journal.record.sequence += 1;
+  if (find_resume_port(&journal.record) == USB_DEVICES) {
+    journal.record.state = JOB_COMPLETE;
+  }
+  memcpy(&rec, &journal.record, sizeof(rec));
+  mutex_exit(&journal.mutex);
+
+  // The flash is written outside the mutex, as the other core is paused while
+  // the flash is written and it might hold the mutex at that time.
+  write_record(&rec);
+}
+
+void journal_complete_job() {
+  journal_record_t rec;
+
+  mutex_enter_blocking(&journal.mutex);
+  if (journal.record.state != JOB_RUNNING) {
+    mutex_exit(&journal.mutex);
+    return;
+  }
+  journal.record.state = JOB_COMPLETE;
+  journal.record.sequence += 1;
+  memcpy(&rec, &journal.record, sizeof(rec));
+  mutex_exit(&journal.mutex);
+
+  printf("Journal: Job on ports %u-%u complete.\n", rec.first_port,
+         rec.last_port);
+  write_record(&rec);
+}
+
+void journal_recover_core1() {
+  mutex_recover_core1(&journal.mutex);
+}
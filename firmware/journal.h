@@ -0,0 +1,62 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usb_host.h"
+
+// The journal records the parameters of the job being flashed and the outcome
+// of each port in the flash memory of the Pico W, such that a batch which got
+// interrupted by a reboot can be resumed from the first unfinished port.
+
+typedef enum {
+  JOB_NONE = 0,
+  JOB_RUNNING,
+  JOB_COMPLETE,
+} job_state_t;
+
+typedef struct {
+  job_state_t state;
+  // Range of ports, inclusive, which are flashed by the job.
+  uint8_t first_port;
+  uint8_t last_port;
+  // First port of the range which has no recorded outcome, or USB_DEVICES if
+  // the job is complete.
+  uint8_t resume_port;
+  // Identify the image being flashed, such that clients can verify that the
+  // resumed job is flashing the same image.
+  uint32_t image_size;
+  uint32_t image_crc;
+} job_info_t;
+
+// Load the last record of the journal from the flash, and report any job which
+// got interrupted. This should be called before the USB host is started.
+void journal_init();
+
+// Copy the information of the last recorded job.
+void journal_get_job(job_info_t* job);
+
+// Recorded outcome of the given port for the last job, or DEVICE_UNKNOWN.
+usb_status_t journal_port_outcome(size_t port);
+
+// Queue the recording of a new job on the USB core. If the job matches the
+// parameters of the interrupted job, then the recorded outcomes are kept and
+// the job is resumed.
+void journal_start_job(uint8_t first_port, uint8_t last_port,
+                       uint32_t image_size, uint32_t image_crc);
+
+// Record the final status of a port, if it is part of the running job. This is
+// executed by the USB core once the port is no longer selected.
+void journal_commit_port(size_t port, usb_status_t status);
+
+// Record that the running job ended, even though the ports it skipped have no
+// outcome, such that it is not resumed after a reboot. This is executed by the
+// USB core.
+void journal_complete_job();
+
+// Release the journal if it was held by core 1 when it got reset.
+void journal_recover_core1();
+
+#endif // !JOURNAL_H
@@ -105,7 +105,13 @@
 //#define TCP_SND_QUEUELEN                  (8 * 4)
 //#define MEMP_NUM_TCP_SEG                  (8 * 4)
 
-//#define LWIP_HTTPD_POST_MANUAL_WND 1
+// The TCP window of a POST request is opened again once its content is
+// written, which throttles the sender, see free_postmsg.
+# define LWIP_HTTPD_POST_MANUAL_WND 1
+
+// ------ Connections of the event streams, along with the ones of the HTTP
+// server.
+# define MEMP_NUM_TCP_PCB 12
 
 // ------ Reply with statically listed files.
 // use generated fsdata
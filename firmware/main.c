@@ -14,6 +14,12 @@
 #include "web_server.h"
 #include "pipe.h"
 #include "stdio_web.h"
+#include "flash_region.h"
+#include "journal.h"
+#include "port_stats.h"
+#include "image_cache.h"
+#include "image_store.h"
+#include "patch.h"
 
 #include "input.h"
 
@@ -34,6 +40,18 @@ int main() {
   // Initialize pipe communication between the 2 cores.
   pipes_init();
   printf("Pipes across cores initialized!\n");
+  image_cache_init();
+  patch_init();
+
+  // Load the journal of the last job, before the USB host restores the status
+  // of the ports from it, and the statistics of the ports.
+  flash_region_init_core();
+  journal_init();
+  port_stats_init();
+
+  // Load the latest stored image in the image cache, to flash it without any
+  // client.
+  image_store_init();
 
   // Setup USB devices.
   usb_host_setup();
@@ -0,0 +1,131 @@
+#include "patch.h"
+
+#include <stdio.h>
+#include <string.h> // memcpy
+
+#include "pico/mutex.h"
+
+#include "pipe.h"
+#include "uf2.h"
+#include "usb_host.h"
+
+typedef struct {
+  mutex_t mutex;
+  patch_t table[PATCH_TABLE_SIZE];
+  size_t count;
+
+  uint32_t serial_base;
+  uint32_t serial_next;
+  uint32_t timestamp;
+
+  // Port of the device being flashed, and its values.
+  size_t port;
+  patch_values_t values;
+} patch_engine_t;
+
+static patch_engine_t engine;
+
+void patch_init() {
+  mutex_init(&engine.mutex);
+  engine.count = 0;
+  engine.port = USB_DEVICES;
+}
+
+bool patch_is_valid(const patch_t* patch) {
+  uint32_t in_block = patch->offset % UF2_BLOCK_SIZE;
+  return patch->kind < PATCH_KINDS &&
+    patch->size >= 1 && patch->size <= sizeof(uint32_t) &&
+    in_block >= UF2_HEADER_SIZE &&
+    in_block + patch->size <= UF2_HEADER_SIZE + UF2_PAYLOAD_SIZE;
+}
+
+bool patch_set_table(const patch_t* patches, size_t count,
+                     uint32_t serial_base, uint32_t timestamp) {
+  if (count > PATCH_TABLE_SIZE) {
+    printf("Patch: Too many patches (%u).\n", count);
+    return false;
+  }
+  for (size_t p = 0; p < count; p++) {
+    if (!patch_is_valid(&patches[p])) {
+      printf("Patch: Invalid patch at offset %lu.\n", patches[p].offset);
+      return false;
+    }
+  }
+
+  mutex_enter_blocking(&engine.mutex);
+  memcpy(engine.table, patches, count * sizeof(patch_t));
+  engine.count = count;
+  if (serial_base != engine.serial_base || timestamp != engine.timestamp) {
+    engine.serial_base = serial_base;
+    engine.serial_next = serial_base;
+    engine.timestamp = timestamp;
+    engine.port = USB_DEVICES;
+  }
+  mutex_exit(&engine.mutex);
+  printf("Patch: %u patches, serial from %lu.\n", count, serial_base);
+  return true;
+}
+
+size_t patch_get_table(patch_t* patches) {
+  mutex_enter_blocking(&engine.mutex);
+  size_t count = engine.count;
+  memcpy(patches, engine.table, count * sizeof(patch_t));
+  mutex_exit(&engine.mutex);
+  return count;
+}
+
+bool patch_in_block(uint32_t offset) {
+  bool found = false;
+  mutex_enter_blocking(&engine.mutex);
+  for (size_t p = 0; p < engine.count && !found; p++) {
+    found = engine.table[p].offset / UF2_BLOCK_SIZE == offset / UF2_BLOCK_SIZE;
+  }
+  mutex_exit(&engine.mutex);
+  return found;
+}
+
+void patch_next_device(size_t port) {
+  mutex_enter_blocking(&engine.mutex);
+  if (port != engine.port) {
+    engine.port = port;
+    engine.values.values[PATCH_SERIAL] = engine.serial_next++;
+  }
+  engine.values.values[PATCH_PORT] = (uint32_t) port;
+  engine.values.values[PATCH_TIMESTAMP] = engine.timestamp;
+  mutex_exit(&engine.mutex);
+}
+
+void patch_get_values(patch_values_t* values) {
+  mutex_enter_blocking(&engine.mutex);
+  memcpy(values, &engine.values, sizeof(*values));
+  mutex_exit(&engine.mutex);
+}
+
+void patch_apply(uint8_t* data, size_t len, uint32_t offset,
+                 const patch_t* patches, size_t count,
+                 const patch_values_t* values) {
+  const uint32_t end = offset + (uint32_t) len;
+  for (size_t p = 0; p < count; p++) {
+    const patch_t* patch = &patches[p];
+    if (patch->offset >= end || patch->offset + patch->size <= offset) {
+      continue;
+    }
+    uint32_t value = values->values[patch->kind];
+    for (uint32_t b = 0; b < patch->size; b++) {
+      uint32_t at = patch->offset + b;
+      if (at >= offset && at < end) {
+        data[at - offset] = (uint8_t) (value >> (8 * b));
+      }
+    }
+  }
+}
+
+void patch_stream(uint8_t* data, size_t len, uint32_t offset) {
+  mutex_enter_blocking(&engine.mutex);
+  patch_apply(data, len, offset, engine.table, engine.count, &engine.values);
+  mutex_exit(&engine.mutex);
+}
+
+void patch_recover_core1() {
+  mutex_recover_core1(&engine.mutex);
+}
@@ -0,0 +1,83 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The patch engine writes the values which differ for each device in the image
+// being flashed, such as the index of the port. Clients send the table of
+// patches once, as offsets within the UF2 file, and the board computes the
+// values of each device, both while streaming the image and while rebuilding
+// it from the image cache.
+
+typedef enum {
+  // Index of the port being flashed.
+  PATCH_PORT = 0,
+  // Serial number, incremented for each device flashed.
+  PATCH_SERIAL,
+  // Time of the batch given by the client, as the board has no clock.
+  PATCH_TIMESTAMP,
+  PATCH_KINDS,
+} patch_kind_t;
+
+// Serialized as is in SET_PATCHES messages (little endian).
+typedef struct {
+  // Offset within the UF2 file, within the payload of a block.
+  uint32_t offset;
+  uint8_t kind;
+  // Number of bytes of the value written, in little endian, from 1 to 4.
+  uint8_t size;
+  uint16_t reserved;
+} patch_t;
+
+_Static_assert(sizeof(patch_t) == 8, "patch_t is serialized as is.");
+
+// Maximum number of patches in the table.
+#define PATCH_TABLE_SIZE 16
+
+typedef struct {
+  uint32_t values[PATCH_KINDS];
+} patch_values_t;
+
+void patch_init();
+
+// Whether the patch only writes the payload of a single UF2 block.
+bool patch_is_valid(const patch_t* patch);
+
+// Replace the table of patches. The serial numbers restart from serial_base
+// unless the base and the timestamp are the same as the previous table, such
+// that clients can set the patches of each image flashed in a row. Returns
+// false if any patch is invalid.
+bool patch_set_table(const patch_t* patches, size_t count,
+                     uint32_t serial_base, uint32_t timestamp);
+
+// Copy the table of patches, and return the number of patches.
+size_t patch_get_table(patch_t* patches);
+
+// Whether a patch of the table writes the UF2 block located at `offset` within
+// the UF2 file.
+bool patch_in_block(uint32_t offset);
+
+// Compute the values of the device flashed next on the given port. The serial
+// number is kept while the same port is flashed again, such as when flashing
+// multiple images in a row.
+void patch_next_device(size_t port);
+
+// Copy the values of the device being flashed.
+void patch_get_values(patch_values_t* values);
+
+// Write the values of the patches which overlap `len` bytes located at
+// `offset` within the UF2 file. A value can be split across calls.
+void patch_apply(uint8_t* data, size_t len, uint32_t offset,
+                 const patch_t* patches, size_t count,
+                 const patch_values_t* values);
+
+// Apply the table of patches with the values of the device being flashed to a
+// part of the streamed image.
+void patch_stream(uint8_t* data, size_t len, uint32_t offset);
+
+// Release the patch table if it was held by core 1 when it got reset.
+void patch_recover_core1();
+
+#endif // !PATCH_H
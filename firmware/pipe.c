@@ -2,6 +2,7 @@
 #include <pico/mutex.h>
 #include <stdio.h>
 #include "pipe.h"
+#include "stdio_web.h"
 
 //#define DEBUG(...) printf(__VA_ARGS__)
 #define DEBUG(...)
@@ -142,6 +143,13 @@ void exec_web_task() {
   cb(arg);
 }
 
+bool has_web_task() {
+  mutex_enter_blocking(&web_tasks.mutex);
+  bool res = web_tasks.start != web_tasks.end;
+  mutex_exit(&web_tasks.mutex);
+  return res;
+}
+
 bool has_usb_task() {
   mutex_enter_blocking(&usb_tasks.mutex);
   bool res = usb_tasks.start != usb_tasks.end;
@@ -197,3 +205,16 @@ void pipes_init() {
   usb_tasks.end = 0;
   usb_tasks.count = 0;
 }
+
+void mutex_recover_core1(mutex_t* m) {
+  if (m->owner == 1) {
+    mutex_init(m);
+  }
+}
+
+void pipes_recover_core1() {
+  mutex_recover_core1(&stream.mutex);
+  mutex_recover_core1(&web_tasks.mutex);
+  mutex_recover_core1(&usb_tasks.mutex);
+  stdio_web_recover_core1();
+}
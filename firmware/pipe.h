@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <pico/mutex.h>
+
 typedef void (*task_t)(void* arg);
 
 // Return how many bytes are free.
@@ -27,6 +29,9 @@ bool queue_web_task(task_t cb, void *arg);
 // Execute one of the queued task for the web server.
 void exec_web_task();
 
+// Returns whether a task is queued for the web server.
+bool has_web_task();
+
 // Returns whether a USB task is queued.
 bool has_usb_task();
 
@@ -39,4 +44,11 @@ void exec_usb_task();
 // Initialize all pipes.
 void pipes_init();
 
+// Re-initialize a mutex which was held by core 1 when it got reset, as it would
+// never be released otherwise.
+void mutex_recover_core1(mutex_t* m);
+
+// Release the pipes held by core 1 after it got reset.
+void pipes_recover_core1();
+
 #endif // !PIPE_H
@@ -0,0 +1,322 @@
+#include "port_stats.h"
+
+#include <stdio.h>
+#include <string.h> // memcpy, memset
+
+#include "pico/mutex.h"
+#include "pico/time.h"
+
+#include "checksum.h"
+#include "flash_region.h"
+#include "pipe.h"
+
+// The statistics of all ports are saved as a single record, alternating
+// between the 2 sectors reserved for it, such that a power loss while saving
+// never loses the previous record.
+#define PORT_STATS_MAGIC 0x53464255 // "UBFS"
+#define PORT_STATS_HEADER_SIZE (4 * sizeof(uint32_t))
+#define PORT_STATS_PAGES \
+  ((PORT_STATS_HEADER_SIZE + USB_DEVICES * sizeof(port_stats_t) + \
+    FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE)
+
+// Save the statistics after this number of commits, even if the job is not
+// over yet.
+#define PORT_STATS_SAVE_COMMITS 8
+
+// Timeout used to wait for the device to be mounted, when the port has not
+// enough history, and bounds of the learned timeouts.
+#define PORT_DEFAULT_TIMEOUT_MS 60000
+#define PORT_MIN_TIMEOUT_MS 5000
+#define PORT_LEARN_SUCCESSES 2
+
+typedef struct {
+  uint32_t magic;
+  uint32_t sequence;
+  uint32_t reserved;
+  // CRC-32 of the statistics of all ports.
+  uint32_t crc;
+  port_stats_t ports[USB_DEVICES];
+  uint8_t padding[PORT_STATS_PAGES * FLASH_PAGE_SIZE - PORT_STATS_HEADER_SIZE -
+                  USB_DEVICES * sizeof(port_stats_t)];
+} port_stats_record_t;
+
+_Static_assert(sizeof(port_stats_record_t) <= FLASH_SECTOR_SIZE,
+               "Port statistics are saved in a single sector.");
+
+typedef struct {
+  mutex_t mutex;
+  port_stats_record_t record;
+  size_t next_sector;
+  bool dirty;
+  size_t commits;
+
+  // Phases of the port being flashed.
+  size_t port;
+  absolute_time_t selected_at;
+  absolute_time_t bootsel_at;
+  absolute_time_t request_at;
+  absolute_time_t complete_at;
+  usb_status_t reached;
+} port_stats_state_t;
+
+static port_stats_state_t stats;
+
+static const port_stats_record_t* read_sector(size_t sector) {
+  return (const port_stats_record_t*) flash_region_read(
+      FLASH_PORT_STATS_OFFSET + (uint32_t) (sector * FLASH_SECTOR_SIZE));
+}
+
+static uint32_t record_crc(const port_stats_record_t* rec) {
+  return crc32_update(0, rec->ports, sizeof(rec->ports));
+}
+
+void port_stats_init() {
+  mutex_init(&stats.mutex);
+  memset(&stats.record, 0, sizeof(stats.record));
+  stats.port = USB_DEVICES;
+  stats.next_sector = 0;
+
+  const port_stats_record_t* last = NULL;
+  for (size_t sector = 0; sector < FLASH_PORT_STATS_SECTORS; sector++) {
+    const port_stats_record_t* rec = read_sector(sector);
+    if (rec->magic != PORT_STATS_MAGIC || rec->crc != record_crc(rec)) {
+      continue;
+    }
+    if (last && (int32_t) (rec->sequence - last->sequence) < 0) {
+      continue;
+    }
+    last = rec;
+    stats.next_sector = (sector + 1) % FLASH_PORT_STATS_SECTORS;
+  }
+
+  if (last) {
+    memcpy(&stats.record, last, sizeof(stats.record));
+    printf("Port statistics loaded.\n");
+  }
+}
+
+void port_stats_flush() {
+  mutex_enter_blocking(&stats.mutex);
+  if (!stats.dirty) {
+    mutex_exit(&stats.mutex);
+    return;
+  }
+  stats.dirty = false;
+  stats.commits = 0;
+  stats.record.magic = PORT_STATS_MAGIC;
+  stats.record.sequence += 1;
+  stats.record.crc = record_crc(&stats.record);
+  memset(stats.record.padding, 0xff, sizeof(stats.record.padding));
+  size_t sector = stats.next_sector;
+  stats.next_sector = (sector + 1) % FLASH_PORT_STATS_SECTORS;
+  mutex_exit(&stats.mutex);
+
+  // Only core 1 writes the record, thus it can be read without the mutex which
+  // cannot be held while the other core is paused.
+  uint32_t offset =
+    FLASH_PORT_STATS_OFFSET + (uint32_t) (sector * FLASH_SECTOR_SIZE);
+  if (flash_region_erase(offset, FLASH_SECTOR_SIZE)) {
+    flash_region_program(offset, (const uint8_t*) &stats.record,
+                         sizeof(stats.record));
+  }
+}
+
+void port_stats_begin(size_t port) {
+  stats.port = port;
+  stats.selected_at = get_absolute_time();
+  stats.bootsel_at = nil_time;
+  stats.request_at = nil_time;
+  stats.complete_at = nil_time;
+  stats.reached = DEVICE_SELECTED;
+}
+
+void port_stats_phase(size_t port, usb_status_t status) {
+  if (port != stats.port) {
+    return;
+  }
+  status &= ~DEVICE_IS_MOUNTED;
+  if (status & DEVICE_IS_ERROR) {
+    return;
+  }
+
+  absolute_time_t now = get_absolute_time();
+  switch (status) {
+  case DEVICE_BOOTSEL_COMPLETE:
+    stats.bootsel_at = now;
+    break;
+  case DEVICE_FLASH_REQUEST:
+    // Devices which are already in BOOTSEL mode skip the BOOTSEL phase.
+    if (is_nil_time(stats.bootsel_at)) {
+      stats.bootsel_at = now;
+    }
+    // Only the first image counts when multiple images are flashed in a row.
+    if (is_nil_time(stats.request_at)) {
+      stats.request_at = now;
+    }
+    break;
+  case DEVICE_FLASH_COMPLETE:
+    stats.complete_at = now;
+    break;
+  default:
+    break;
+  }
+  if (status > stats.reached) {
+    stats.reached = status;
+  }
+}
+
+static uint32_t elapsed_ms(absolute_time_t from, absolute_time_t to) {
+  return (uint32_t) (absolute_time_diff_us(from, to) / 1000);
+}
+
+static uint32_t moving_average(uint32_t average, uint32_t sample) {
+  if (average == 0) {
+    return sample;
+  }
+  return (3 * average + sample) / 4;
+}
+
+static uint16_t saturate_u16(uint32_t value) {
+  return value > UINT16_MAX ? UINT16_MAX : (uint16_t) value;
+}
+
+void port_stats_commit(size_t port, usb_status_t status) {
+  if (port != stats.port || port >= USB_DEVICES) {
+    return;
+  }
+  stats.port = USB_DEVICES;
+  status &= ~DEVICE_IS_MOUNTED;
+
+  mutex_enter_blocking(&stats.mutex);
+  port_stats_t* p = &stats.record.ports[port];
+  if (status == DEVICE_FLASH_COMPLETE) {
+    p->attempts++;
+    p->successes++;
+    p->consecutive_failures = 0;
+    p->last_outcome = PORT_OUTCOME_SUCCESS;
+    p->bootsel_ms = saturate_u16(moving_average(
+        p->bootsel_ms, elapsed_ms(stats.selected_at, stats.bootsel_at)));
+    p->mount_ms = saturate_u16(moving_average(
+        p->mount_ms, elapsed_ms(stats.bootsel_at, stats.request_at)));
+    p->flash_ms = moving_average(
+        p->flash_ms, elapsed_ms(stats.request_at, stats.complete_at));
+  } else if (status & DEVICE_IS_ERROR) {
+    p->attempts++;
+    p->failures[(status - DEVICE_ERROR_BOOTSEL_MISS) % PORT_ERROR_CLASSES]++;
+    if (p->consecutive_failures < UINT8_MAX) {
+      p->consecutive_failures++;
+    }
+    p->last_outcome = PORT_OUTCOME_FAILURE;
+  } else if (stats.reached > DEVICE_SELECTED) {
+    p->attempts++;
+    p->timeouts++;
+    if (p->consecutive_failures < UINT8_MAX) {
+      p->consecutive_failures++;
+    }
+    p->last_outcome = PORT_OUTCOME_FAILURE;
+  } else {
+    p->empty++;
+    p->last_outcome = PORT_OUTCOME_EMPTY;
+  }
+  stats.dirty = true;
+  stats.commits++;
+  bool save = stats.commits >= PORT_STATS_SAVE_COMMITS;
+  mutex_exit(&stats.mutex);
+
+  if (save) {
+    port_stats_flush();
+  }
+}
+
+void port_stats_get(size_t port, port_stats_t* out) {
+  if (port >= USB_DEVICES) {
+    memset(out, 0, sizeof(*out));
+    return;
+  }
+  mutex_enter_blocking(&stats.mutex);
+  memcpy(out, &stats.record.ports[port], sizeof(*out));
+  mutex_exit(&stats.mutex);
+}
+
+static void reset_cb(void* arg) {
+  size_t port = (size_t) (uintptr_t) arg;
+  mutex_enter_blocking(&stats.mutex);
+  if (port < USB_DEVICES) {
+    memset(&stats.record.ports[port], 0, sizeof(port_stats_t));
+  } else {
+    memset(stats.record.ports, 0, sizeof(stats.record.ports));
+  }
+  stats.dirty = true;
+  mutex_exit(&stats.mutex);
+  port_stats_flush();
+}
+
+void port_stats_reset(size_t port) {
+  queue_usb_task(&reset_cb, (void*) (uintptr_t) port);
+}
+
+// Reliable ports are flashed first, then the ports never seen, then the ports
+// which were empty last time and finally the ports which failed last time.
+static uint32_t schedule_rank(const port_stats_t* p, size_t port) {
+  static const uint8_t outcome_rank[] = {
+    [PORT_OUTCOME_UNKNOWN] = 1,
+    [PORT_OUTCOME_SUCCESS] = 0,
+    [PORT_OUTCOME_FAILURE] = 3,
+    [PORT_OUTCOME_EMPTY] = 2,
+  };
+  uint32_t failure_permille = 0;
+  if (p->attempts) {
+    failure_permille =
+      (uint32_t) (p->attempts - p->successes) * 1000 / p->attempts;
+  }
+  uint8_t rank = p->last_outcome < count_of(outcome_rank)
+    ? outcome_rank[p->last_outcome] : 1;
+  return ((uint32_t) rank << 24) | (failure_permille << 8) | (uint32_t) port;
+}
+
+static uint32_t schedule_timeout_ms(const port_stats_t* p) {
+  if (p->successes < PORT_LEARN_SUCCESSES || p->mount_ms == 0) {
+    return PORT_DEFAULT_TIMEOUT_MS;
+  }
+  // Leave a large margin over the average, as the average hides the variance.
+  uint32_t timeout = 4 * (uint32_t) p->mount_ms + 2000;
+  if (timeout < PORT_MIN_TIMEOUT_MS) {
+    timeout = PORT_MIN_TIMEOUT_MS;
+  }
+  if (timeout > PORT_DEFAULT_TIMEOUT_MS) {
+    timeout = PORT_DEFAULT_TIMEOUT_MS;
+  }
+  return timeout;
+}
+
+size_t port_stats_schedule(uint8_t first_port, uint8_t last_port,
+                           port_schedule_t* schedule) {
+  uint32_t ranks[USB_DEVICES];
+  size_t count = 0;
+  if (last_port >= USB_DEVICES) {
+    last_port = USB_DEVICES - 1;
+  }
+
+  mutex_enter_blocking(&stats.mutex);
+  for (size_t port = first_port; port <= last_port; port++) {
+    const port_stats_t* p = &stats.record.ports[port];
+    uint32_t rank = schedule_rank(p, port);
+
+    // Insertion sort, as we have at most USB_DEVICES entries.
+    size_t i = count++;
+    for (; i > 0 && ranks[i - 1] > rank; i--) {
+      ranks[i] = ranks[i - 1];
+      schedule[i] = schedule[i - 1];
+    }
+    ranks[i] = rank;
+    schedule[i].port = (uint8_t) port;
+    schedule[i].parked = p->consecutive_failures >= PORT_PARK_FAILURES;
+    schedule[i].timeout_ms = schedule_timeout_ms(p);
+  }
+  mutex_exit(&stats.mutex);
+  return count;
+}
+
+void port_stats_recover_core1() {
+  mutex_recover_core1(&stats.mutex);
+}
@@ -0,0 +1,96 @@
+#ifndef PORT_STATS_H
+#define PORT_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usb_host.h"
+
+// Statistics recorded for each port across runs, and persisted in the flash
+// of the Pico W. They are used to schedule the ports of a job, and to find the
+// sockets which need servicing.
+
+// Number of error classes, indexed by (status & 0x0f) of DEVICE_ERROR_* codes.
+#define PORT_ERROR_CLASSES 8
+
+typedef enum {
+  PORT_OUTCOME_UNKNOWN = 0,
+  PORT_OUTCOME_SUCCESS,
+  PORT_OUTCOME_FAILURE,
+  // Nothing answered on the port, the socket is likely empty.
+  PORT_OUTCOME_EMPTY,
+} port_outcome_t;
+
+// Serialized as is in UPDATE_PORT_STATS messages (little endian).
+typedef struct {
+  uint16_t attempts;
+  uint16_t successes;
+  // Number of times nothing answered on the port.
+  uint16_t empty;
+  // Number of times the device started answering but never reached an
+  // outcome before being unselected, usually because the client timed out.
+  uint16_t timeouts;
+  uint8_t consecutive_failures;
+  uint8_t last_outcome;
+  uint16_t reserved;
+  // Failures by error class.
+  uint16_t failures[PORT_ERROR_CLASSES];
+  // Moving average of the duration of each phase, in milliseconds: from the
+  // selection to the BOOTSEL mode, from the BOOTSEL mode to the first flash
+  // request and from the first flash request to the completion of the last
+  // image.
+  uint16_t bootsel_ms;
+  uint16_t mount_ms;
+  uint32_t flash_ms;
+} port_stats_t;
+
+_Static_assert(sizeof(port_stats_t) == 36, "port_stats_t is serialized as is.");
+
+typedef struct {
+  uint8_t port;
+  // The port keeps failing, and should be skipped until it is serviced.
+  bool parked;
+  // Time to wait for the device to be mounted once in BOOTSEL mode.
+  uint32_t timeout_ms;
+} port_schedule_t;
+
+// Number of consecutive failures after which a port is parked.
+#define PORT_PARK_FAILURES 3
+
+// Load the statistics from the flash.
+void port_stats_init();
+
+// Start recording the phases of a port selected to be flashed. Executed by the
+// USB core.
+void port_stats_begin(size_t port);
+
+// Record the time at which the active port reached a given status. This is
+// executed by the USB core each time the status changes.
+void port_stats_phase(size_t port, usb_status_t status);
+
+// Account for the outcome of a port once it is no longer selected. Executed by
+// the USB core.
+void port_stats_commit(size_t port, usb_status_t status);
+
+// Write the statistics to the flash if they changed. Executed by the USB core
+// once no device is selected.
+void port_stats_flush();
+
+// Release the statistics if they were held by core 1 when it got reset.
+void port_stats_recover_core1();
+
+// Copy the statistics of a port.
+void port_stats_get(size_t port, port_stats_t* stats);
+
+// Queue the reset of the statistics of a port after servicing it, or of all
+// ports if port is USB_DEVICES or larger.
+void port_stats_reset(size_t port);
+
+// Order the ports from first_port to last_port, inclusive, such that the
+// reliable ports are flashed first and the failing ones last, and compute the
+// timeout of each port based on its history. Returns the number of entries.
+size_t port_stats_schedule(uint8_t first_port, uint8_t last_port,
+                           port_schedule_t* schedule);
+
+#endif // !PORT_STATS_H
@@ -3,6 +3,9 @@
 #include <pico/time.h>
 #include <pico/mutex.h>
 
+#include "pipe.h"
+#include "stdio_web.h"
+
 #define OUT_SIZE 32 * 1024
 
 typedef struct {
@@ -47,7 +50,7 @@ uint16_t stdout_ssi(char *insert_at, int ins_len)
     stdout.start += len;
   }
   mutex_exit(&stdout.mutex);
-  return (uint16_t) len;
+  return (uint16_t) (half + len);
 }
 
 void stdio_web_out_chars(const char *buf, int length)
@@ -105,3 +108,8 @@ bool stdio_init_web(void)
   stdio_set_driver_enabled(&stdio_web, true);
   return true;
 }
+
+void stdio_web_recover_core1(void)
+{
+  mutex_recover_core1(&stdout.mutex);
+}
@@ -13,4 +13,7 @@ uint16_t stdout_ssi(char *insert_at, int ins_len);
 // as a backend for printing functions.
 bool stdio_init_web(void);
 
+// Release the stdout buffer if it was held by core 1 when it got reset.
+void stdio_web_recover_core1(void);
+
 #endif // !STDIO_WEB_H
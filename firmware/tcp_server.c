@@ -1,4 +1,6 @@
 #if defined(USE_TCP_SERVER)
+#include <string.h> // memcpy
+
 #include "hardware/watchdog.h"  // watchdog_reboot
 #include "pico/bootrom.h" // reset_usb_boot
 
@@ -18,6 +20,26 @@
 // Collect references to callback tasks.
 #include "usb_host.h"
 
+// Record jobs to resume them after a reboot, and the reliability of ports.
+#include "journal.h"
+#include "port_stats.h"
+
+// Image uploaded once and flashed on every device, and saved in the flash.
+#include "image_cache.h"
+#include "image_store.h"
+
+// Values written in the image for each device.
+#include "patch.h"
+
+// Images compressed by the client.
+#include "decompress.h"
+
+// Raw binaries framed in UF2 blocks by the board.
+#include "uf2_frame.h"
+
+// Reject corrupted images before they are written to the devices.
+#include "uf2_check.h"
+
 // Some debugging
 #include "input.h"
 
@@ -31,26 +53,155 @@
 // Number of 
 #define BUF_QUEUE_SIZE 16
 
+// Number of clients connected at once, one of which controls the board while
+// the others monitor it.
+#define TCP_MAX_CLIENTS 4
+
+// Bytes of stdout kept for the clients which did not read them yet.
+#define STDOUT_LOG_SIZE 2048
+
+// Maximum bytes of stdout sent in a single UPDATE_STDOUT message.
+#define STDOUT_MSG_SIZE 512
+
+// Delay between the updates pushed to the monitors.
+#define MONITOR_PUSH_MS 200
+
+
+// Size of the buffers which hold the content until it is written. This is a
+// multiple of the sector size, such that the buffers filled by the parts keep
+// the file sector aligned, and FatFs writes them straight from the buffer to
+// the device instead of copying them through its own sector buffer.
+#define BUF_SIZE (3 * 512)
+
+_Static_assert(BUF_SIZE >= TCP_MSS,
+               "A compressed part decodes to a single buffer.");
+_Static_assert(BUF_SIZE >= 2 * UF2_BLOCK_SIZE,
+               "A raw part of UF2_FRAME_PART_SIZE frames to a single buffer.");
+
 typedef struct {
   void *conn; // tcp_server_t pointer.
-  uint8_t buf[TCP_MSS];
+  uint8_t buf[BUF_SIZE] __attribute__((aligned(4)));
   uint16_t len;
+  // Whether the buffer was charged to its part, and is given back once
+  // written. Content decoded beyond the buffers charged is not.
+  bool charged;
 } buffer_t;
 
+typedef struct {
+  void *server; // tcp_server_t pointer.
+  // NULL when the slot is free.
+  struct tcp_pcb *pcb;
+
+  // Start of a message split between the segments received.
+  struct pbuf *pending;
+
+  // Position in the stdout log of the next bytes sent to the client, and the
+  // version of the status snapshot last pushed to it.
+  uint32_t stdout_read;
+  uint32_t status_pushed;
+
+  // Bytes left of a message reserved to the controller, which a monitor sent
+  // and which are dropped as they arrive.
+  uint32_t denied_left;
+} tcp_client_t;
+
 typedef struct {
   struct tcp_pcb *server_pcb;
-  struct tcp_pcb *client_pcb;
+
+  // Connected clients, the one which flashes the devices, and the one whose
+  // message is being decoded, to which the replies are sent.
+  tcp_client_t clients[TCP_MAX_CLIENTS];
+  tcp_client_t *controller;
+  tcp_client_t *reply;
+
+  // Snapshots shared by the clients: the last UPDATE_STATUS message along with
+  // the generation of the status it holds, and the stdout read from
+  // stdio_web, where stdout_end counts the bytes ever read.
+  uint8_t status_msg[3 + USB_DEVICES];
+  uint32_t status_version;
+  char stdout_log[STDOUT_LOG_SIZE];
+  uint32_t stdout_end;
+  absolute_time_t next_push;
 
   // Information to transmit to USB callbacks.
   void* usb_context;
+  // Whether the selected device requested an image which is not streamed
+  // yet, with the context of its request, and whether FLASH_FROM_CACHE waits
+  // for such a request. Cleared once used, when another device is selected,
+  // when the device goes away and when a flash completes.
+  bool flash_requested;
+  void* requested_usb_context;
+  bool cache_flash_pending;
+
+  // Port selected by the client, whose values are patched in the image.
+  uint8_t selected_device;
 
   buffer_t recv_queue[BUF_QUEUE_SIZE];
   uint8_t live_buf;  // Count number of live pbuf.
   uint8_t last_buf;  // Where to insert pbuf.
   // Total number of bytes received to be flashed, between FLASH_START and FLASH_END.
   size_t total_flashed;
+
+  // Whether the parts of the image are compressed, and their decoder.
+  bool compressed;
+  decompress_t decoder;
+
+  // Whether the parts are a raw binary, and the generator of its UF2 blocks.
+  bool raw;
+  uf2_frame_t framer;
+
+  // Validator of the image, and whether the image got rejected, in which case
+  // the next parts are dropped.
+  uf2_check_t check;
+  bool rejected;
+
+  // Whether the image is streamed before the device requested it, in which
+  // case its parts are held in the queue from held_first until the device is
+  // mounted, along with the end of the image.
+  bool prefetching;
+  uint8_t held_first;
+  uint8_t held_parts;
+  bool held_end;
+  // FLASH_START was sent when the prefetch started.
+  bool start_acked;
+
+  // Whether the parts are acknowledged with UPDATE_CREDITS instead of one
+  // FLASH_PART_RECEIVED and FLASH_PART_WRITTEN each. The client may send parts
+  // until their buffers reach credit_limit bytes, counted since the credits
+  // were enabled, and the limit grows by BUF_SIZE for each buffer written.
+  bool credits;
+  uint32_t credit_limit;
+  bool credits_changed;
+
+  // Content of the WRITE_FLASH_PART being received, which is decoded as it
+  // arrives into the buffer at last_buf, filled with part_fill bytes. The
+  // number of buffers queued for the part, and whether it failed to decode.
+  uint16_t part_left;
+  uint16_t part_fill;
+  uint8_t part_buffers;
+  bool part_failed;
+  // Buffers charged to the credits for the part, and the bytes of the part
+  // received before, which are skipped.
+  uint8_t part_charge;
+  uint16_t part_skip;
+
+  // Transfer of the image, which outlives the connection such that a client
+  // can resume it: the bytes of content received since START_FLASH, the
+  // sequence number of the last WRITE_FLASH_PART_AT, the bytes of the file
+  // written on the device, and the buffers queued and not written yet.
+  bool transfer_active;
+  uint32_t received;
+  uint32_t last_seq;
+  uint32_t written;
+  uint8_t buffers_out;
 } tcp_server_t;
 
+// Connection whose credits are sent by the main loop.
+static tcp_server_t *credits_state = NULL;
+
+// Server whose monitors are updated by the main loop.
+static tcp_server_t *monitored_state = NULL;
+
 static tcp_server_t *tcp_server_init(void) {
   tcp_server_t *state = calloc(1, sizeof(tcp_server_t));
   if (!state) {
@@ -60,26 +211,67 @@ static tcp_server_t *tcp_server_init(void) {
   for (size_t i = 0; i < BUF_QUEUE_SIZE; i++) {
     state->recv_queue[i].conn = state;
   }
+  for (size_t i = 0; i < TCP_MAX_CLIENTS; i++) {
+    state->clients[i].server = state;
+  }
   return state;
 }
 
-static err_t tcp_server_close(tcp_server_t *state) {
-  err_t err = ERR_OK;
+static void end_part(tcp_server_t *state);
 
-  // Clear state attached to listen to client connections.
-  if (state->client_pcb != NULL) {
-    tcp_arg(state->client_pcb, NULL);
-    tcp_poll(state->client_pcb, NULL, 0);
-    tcp_sent(state->client_pcb, NULL);
-    tcp_recv(state->client_pcb, NULL);
-    tcp_err(state->client_pcb, NULL);
-    err = tcp_close(state->client_pcb);
+// Forget the controller, while the transfer of the image goes on with the parts
+// already received, until a client resumes it.
+static void release_control(tcp_server_t *state) {
+  state->controller = NULL;
+  if (state->part_left) {
+    // The rest of the part is sent again at its offset.
+    state->part_left = 0;
+    end_part(state);
+  }
+  if (credits_state == state) {
+    credits_state = NULL;
+  }
+  state->credits = false;
+}
+
+static err_t tcp_client_close(tcp_client_t *client) {
+  tcp_server_t *state = (tcp_server_t*) client->server;
+  err_t err = ERR_OK;
+  if (client->pcb != NULL) {
+    tcp_arg(client->pcb, NULL);
+    tcp_sent(client->pcb, NULL);
+    tcp_recv(client->pcb, NULL);
+    tcp_err(client->pcb, NULL);
+    err = tcp_close(client->pcb);
     if (err != ERR_OK) {
       printf("close failed %d, calling abort\n", err);
-      tcp_abort(state->client_pcb);
+      tcp_abort(client->pcb);
       err = ERR_ABRT;
     }
-    state->client_pcb = NULL;
+    client->pcb = NULL;
+  }
+  if (client->pending) {
+    pbuf_free(client->pending);
+    client->pending = NULL;
+  }
+  if (state->reply == client) {
+    state->reply = NULL;
+  }
+  if (state->controller == client) {
+    release_control(state);
+  }
+  return err;
+}
+
+static err_t tcp_server_close(tcp_server_t *state) {
+  err_t err = ERR_OK;
+  for (size_t i = 0; i < TCP_MAX_CLIENTS; i++) {
+    if (state->clients[i].pcb) {
+      err = tcp_client_close(&state->clients[i]);
+    }
+  }
+  if (monitored_state == state) {
+    monitored_state = NULL;
   }
 
   // Clear state attached to server listenning port.
@@ -101,28 +293,47 @@ static err_t tcp_server_result(tcp_server_t *state, int status) {
   return tcp_server_close(state);
 }
 
-// Send data to the connected client.
-static err_t tcp_server_send_data(tcp_server_t *state, uint8_t *buf, uint16_t len) {
+// Send data to a connected client.
+static err_t tcp_client_send(tcp_client_t *client, const uint8_t *buf, uint16_t len) {
   // this method is callback from lwIP, so cyw43_arch_lwip_begin is not
   // required, however you can use this method to cause an assertion in debug
   // mode, if this method is called when cyw43_arch_lwip_begin IS needed
   cyw43_arch_lwip_check();
 
-  err_t err = tcp_write(state->client_pcb, buf, len, TCP_WRITE_FLAG_COPY);
+  // Replies to a client which got disconnected are lost, and the client asks
+  // for the state of the transfer once it reconnects.
+  if (client == NULL || client->pcb == NULL) {
+    return ERR_CONN;
+  }
+
+  // A lost connection is reported by the keepalive, thus failures to send are
+  // not fatal.
+  err_t err = tcp_write(client->pcb, buf, len, TCP_WRITE_FLAG_COPY);
   if (err != ERR_OK) {
     printf("Failed to write data %d\n", err);
-    return tcp_server_result(state, -1);
+    return err;
   }
 
   // Drain the content in a TCP packet.
-  err = tcp_output(state->client_pcb);
+  err = tcp_output(client->pcb);
   if (err != ERR_OK) {
     printf("Failed to write data %d\n", err);
-    return tcp_server_result(state, -1);
+    return err;
   }
   return ERR_OK;
 }
 
+// Client to which the messages are sent: the one whose request is being
+// decoded, else the controller, which receives the acknowledgements of the
+// USB thread.
+static tcp_client_t *reply_client(tcp_server_t *state) {
+  return state->reply ? state->reply : state->controller;
+}
+
+static err_t tcp_server_send_data(tcp_server_t *state, uint8_t *buf, uint16_t len) {
+  return tcp_client_send(reply_client(state), buf, len);
+}
+
 static void send_ack(tcp_server_t *state, uint8_t ack) {
   uint8_t buffer[1] = { ack };
   tcp_server_send_data(state, buffer, 1);
@@ -131,18 +342,90 @@ static void send_ack(tcp_server_t *state, uint8_t ack) {
 // ---------------------------------------------------------
 // Callbacks exposed to the USB thread.
 
-static void* last_usb_context = NULL;
+static void release_part(tcp_server_t *state);
+
+// Stream which is prefetched until the device requests it.
+static tcp_server_t* prefetch_state = NULL;
+
+// Open the file on the device which just got mounted, and write the parts
+// received meanwhile.
+static void release_prefetch(tcp_server_t *state, void *usb_context) {
+  printf("Flash %u prefetched parts.\n", state->held_parts);
+  prefetch_state = NULL;
+  state->prefetching = false;
+  state->usb_context = usb_context;
+  queue_usb_task(&open_file, &state->recv_queue[state->held_first]);
+  for (uint8_t i = 0; i < state->held_parts; i++) {
+    uint8_t held = (state->held_first + i) % BUF_QUEUE_SIZE;
+    queue_usb_task(&write_file_content, &state->recv_queue[held]);
+  }
+  if (state->held_end) {
+    queue_usb_task(&close_file, &state->recv_queue[state->last_buf]);
+  }
+}
+
+// Forget the parts held for a device which got unselected before requesting
+// its image.
+static void drop_prefetch(tcp_server_t *state) {
+  printf("Drop %u prefetched parts.\n", state->held_parts);
+  for (uint8_t i = 0; i < state->held_parts; i++) {
+    buffer_t *p = &state->recv_queue[(state->held_first + i) % BUF_QUEUE_SIZE];
+    p->len = 0;
+    state->buffers_out--;
+    if (p->charged) {
+      release_part(state);
+    }
+  }
+  state->transfer_active = false;
+  prefetch_state = NULL;
+  state->prefetching = false;
+  state->start_acked = false;
+}
+
+static void start_flash_from_cache(tcp_server_t *state, void *usb_context) {
+  state->cache_flash_pending = false;
+  state->usb_context = usb_context;
+  queue_usb_task(&flash_from_cache, &state->recv_queue[state->last_buf]);
+}
+
+// Take the request of the selected device if it is still mounted, and forget
+// it in any case.
+static bool take_flash_request(tcp_server_t *state, void **usb_context) {
+  bool requested = state->flash_requested &&
+    (get_usb_device_status(state->selected_device) & DEVICE_MSC_MOUNTED);
+  *usb_context = state->requested_usb_context;
+  state->flash_requested = false;
+  state->requested_usb_context = NULL;
+  return requested;
+}
+
+static void clear_flash_request(tcp_server_t *state) {
+  state->flash_requested = false;
+  state->requested_usb_context = NULL;
+  state->cache_flash_pending = false;
+}
+
 void request_flash(void* arg)
 {
-  // state is not available...
-  //send_ack(state, FLASH_READY);
-  last_usb_context = arg;
+  tcp_server_t *state = monitored_state;
+  if (prefetch_state) {
+    release_prefetch(prefetch_state, arg);
+  } else if (state && state->cache_flash_pending) {
+    start_flash_from_cache(state, arg);
+  } else if (state) {
+    state->flash_requested = true;
+    state->requested_usb_context = arg;
+  }
 }
 
 void report_file_opened(void* arg)
 {
   buffer_t *p = (buffer_t*) arg;
   tcp_server_t *state = (tcp_server_t*) p->conn;
+  if (state->start_acked) {
+    state->start_acked = false;
+    return;
+  }
   send_ack(state, FLASH_START);
 }
 
@@ -150,6 +433,7 @@ void report_file_closed(void* arg)
 {
   buffer_t *p = (buffer_t*) arg;
   tcp_server_t *state = (tcp_server_t*) p->conn;
+  clear_flash_request(state);
   send_ack(state, FLASH_END);
 }
 
@@ -157,6 +441,7 @@ void write_error(void* arg)
 {
   buffer_t *p = (buffer_t*) arg;
   tcp_server_t *state = (tcp_server_t*) p->conn;
+  clear_flash_request(state);
   send_ack(state, FLASH_ERROR);
 }
 
@@ -182,56 +467,560 @@ void *get_postmsg_usb_info(void* arg)
 void free_postmsg(void* arg)
 {
   buffer_t *p = (buffer_t*) arg;
-  p->len = 0;
   tcp_server_t *state = (tcp_server_t*) p->conn;
+  state->written += p->len;
+  state->buffers_out--;
+  p->len = 0;
   state->live_buf--;
-  send_ack(state, FLASH_PART_WRITTEN);
+  if (p->charged) {
+    release_part(state);
+  }
 }
 
 // ---------------------------------------------------------
 // State machine which manages how are interpreted buffers
 // which are received.
 
-static void send_status(tcp_server_t *state) {
-  const size_t len = USB_DEVICES + 1 + sizeof(uint16_t);
-  uint8_t buffer[USB_DEVICES + 1 + sizeof(uint16_t)];
+// Rebuild the UPDATE_STATUS message shared by the clients, once the status
+// changed.
+static void refresh_status(tcp_server_t *state) {
+  if (state->status_version == get_usb_status_generation() &&
+      state->status_msg[0] == UPDATE_STATUS) {
+    return;
+  }
+  usb_status_snapshot_t snapshot;
+  get_usb_status_snapshot(&snapshot);
+  uint8_t *buffer = state->status_msg;
   buffer[0] = UPDATE_STATUS;
   buffer[1] = USB_DEVICES & 0xff;
   buffer[2] = (USB_DEVICES >> 8) & 0xff;
-  uint8_t *status = &buffer[3];
-  for (size_t device = 0; device < USB_DEVICES; device++) {
-    status[device] = get_usb_device_status(device);
+  memcpy(&buffer[3], snapshot.status, USB_DEVICES);
+  state->status_version = snapshot.generation;
+}
+
+static void send_status(tcp_server_t *state) {
+  refresh_status(state);
+  tcp_server_send_data(state, state->status_msg, sizeof(state->status_msg));
+}
+
+// Move the stdout buffered by stdio_web to the log, from which every client
+// reads at its own position. The bytes which a client did not read yet are
+// kept, and the rest stays buffered by stdio_web.
+static void pull_stdout(tcp_server_t *state) {
+  uint32_t oldest = state->stdout_end;
+  for (size_t i = 0; i < TCP_MAX_CLIENTS; i++) {
+    tcp_client_t *client = &state->clients[i];
+    if (client->pcb && state->stdout_end - client->stdout_read < STDOUT_LOG_SIZE &&
+        state->stdout_end - client->stdout_read > state->stdout_end - oldest) {
+      oldest = client->stdout_read;
+    }
+  }
+  uint32_t room = STDOUT_LOG_SIZE - (state->stdout_end - oldest);
+  while (room) {
+    uint32_t at = state->stdout_end % STDOUT_LOG_SIZE;
+    uint32_t len = STDOUT_LOG_SIZE - at < room ? STDOUT_LOG_SIZE - at : room;
+    len = stdout_ssi(&state->stdout_log[at], (int) len);
+    if (len == 0) {
+      return;
+    }
+    state->stdout_end += len;
+    room -= len;
   }
+}
 
-  tcp_server_send_data(state, buffer, len);
+// Bytes of the log which the client did not read yet, skipping the ones which
+// got overwritten.
+static uint16_t stdout_unread(tcp_server_t *state, tcp_client_t *client) {
+  if (state->stdout_end - client->stdout_read > STDOUT_LOG_SIZE) {
+    client->stdout_read = state->stdout_end - STDOUT_LOG_SIZE;
+  }
+  uint32_t unread = state->stdout_end - client->stdout_read;
+  uint32_t at = client->stdout_read % STDOUT_LOG_SIZE;
+  if (unread > STDOUT_LOG_SIZE - at) {
+    unread = STDOUT_LOG_SIZE - at;
+  }
+  return unread < STDOUT_MSG_SIZE ? (uint16_t) unread : STDOUT_MSG_SIZE;
 }
 
-static void send_stdout(tcp_server_t *state) {
-  char buffer[512 + 1 + sizeof(uint16_t)];
+static err_t send_stdout_to(tcp_server_t *state, tcp_client_t *client, uint16_t len) {
+  uint8_t buffer[STDOUT_MSG_SIZE + 1 + sizeof(uint16_t)];
   buffer[0] = UPDATE_STDOUT;
-  uint16_t len = stdout_ssi(&buffer[3], sizeof(buffer) - 3);
-  if (len == 1) {
+  buffer[1] = (uint8_t) (len & 0xff);
+  buffer[2] = (uint8_t) ((len >> 8) & 0xff);
+  memcpy(&buffer[3], &state->stdout_log[client->stdout_read % STDOUT_LOG_SIZE], len);
+  err_t err = tcp_client_send(client, buffer, len + 3);
+  if (err == ERR_OK) {
+    client->stdout_read += len;
+  }
+  return err;
+}
+
+static void send_stdout(tcp_server_t *state) {
+  tcp_client_t *client = reply_client(state);
+  if (client == NULL) {
     return;
   }
-  buffer[1] = (char) (len & 0xff);
-  buffer[2] = (char) ((len >> 8) & 0xff);
-  tcp_server_send_data(state, (uint8_t*) buffer, len + 3);
+  pull_stdout(state);
+  send_stdout_to(state, client, stdout_unread(state, client));
 }
 
 static void send_decode_failure(tcp_server_t *state) {
   send_ack(state, DECODE_FAILURE);
 }
 
-static uint16_t recv_select_device(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+static void send_role(tcp_server_t *state) {
+  uint8_t buffer[2];
+  buffer[0] = UPDATE_ROLE;
+  buffer[1] = state->reply != NULL && state->reply == state->controller;
+  tcp_server_send_data(state, buffer, sizeof(buffer));
+}
+
+// Give the control to the client which asked for it, when no other client has
+// it, or when forced, as by a client which lost its connection and resumes
+// its transfer before the former one got noticed.
+static uint16_t recv_request_control(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  if (buf->tot_len - offset < 2) {
+    return 0;
+  }
+  bool force = pbuf_get_at(buf, offset + 1) != 0;
+  tcp_client_t *client = state->reply;
+  if (client != state->controller && (state->controller == NULL || force)) {
+    if (state->controller) {
+      printf("Client takes over the control.\n");
+      tcp_client_close(state->controller);
+    }
+    state->controller = client;
+  }
+  send_role(state);
+  return 2;
+}
+
+static void put_u32(uint8_t *buffer, uint32_t value);
+
+// Report how far the image was received and written, such that a client which
+// got disconnected resumes sending it.
+static void send_transfer(tcp_server_t *state) {
+  uint8_t buffer[2 + 3 * sizeof(uint32_t)];
+  buffer[0] = UPDATE_TRANSFER;
+  buffer[1] = state->transfer_active;
+  put_u32(&buffer[2], state->last_seq);
+  put_u32(&buffer[6], state->received);
+  put_u32(&buffer[10], state->written);
+  tcp_server_send_data(state, buffer, sizeof(buffer));
+}
+
+static void put_u32(uint8_t *buffer, uint32_t value) {
+  buffer[0] = value & 0xff;
+  buffer[1] = (value >> 8) & 0xff;
+  buffer[2] = (value >> 16) & 0xff;
+  buffer[3] = (value >> 24) & 0xff;
+}
+
+static uint32_t get_u32(struct pbuf *buf, uint16_t offset) {
+  return
+    ((uint32_t) pbuf_get_at(buf, offset)) |
+    ((uint32_t) pbuf_get_at(buf, offset + 1) << 8) |
+    ((uint32_t) pbuf_get_at(buf, offset + 2) << 16) |
+    ((uint32_t) pbuf_get_at(buf, offset + 3) << 24);
+}
+
+// Send the ports whose status changed after the generation known by the
+// client, which is nothing but the header while the rack is idle.
+static uint16_t recv_request_status_since(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  const uint16_t len = 1 + sizeof(uint32_t);
+  if (buf->tot_len - offset < len) {
+    return 0;
+  }
+  usb_status_snapshot_t snapshot;
+  get_usb_status_snapshot(&snapshot);
+  uint8_t buffer[10 + 2 * USB_DEVICES];
+  size_t count = get_usb_status_changes(&snapshot, get_u32(buf, offset + 1),
+                                        (uint8_t (*)[2]) &buffer[10]);
+  buffer[0] = UPDATE_STATUS_CHANGES;
+  put_u32(&buffer[1], snapshot.generation);
+  put_u32(&buffer[5], snapshot.changed_ms);
+  buffer[9] = (uint8_t) count;
+  tcp_server_send_data(state, buffer, (uint16_t) (10 + 2 * count));
+  return len;
+}
+
+static void send_job(tcp_server_t *state) {
+  job_info_t job;
+  journal_get_job(&job);
+
+  uint8_t buffer[5 + 2 * sizeof(uint32_t)];
+  buffer[0] = UPDATE_JOB;
+  buffer[1] = (uint8_t) job.state;
+  buffer[2] = job.first_port;
+  buffer[3] = job.last_port;
+  buffer[4] = job.resume_port;
+  put_u32(&buffer[5], job.image_size);
+  put_u32(&buffer[9], job.image_crc);
+  tcp_server_send_data(state, buffer, sizeof(buffer));
+}
+
+static uint16_t recv_request_port_stats(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  if (buf->tot_len - offset < 3) {
+    return 0;
+  }
+
+  uint8_t first_port = pbuf_get_at(buf, offset + 1);
+  uint8_t last_port = pbuf_get_at(buf, offset + 2);
+  uint8_t count = 0;
+  if (first_port <= last_port && first_port < USB_DEVICES) {
+    if (last_port >= USB_DEVICES) {
+      last_port = USB_DEVICES - 1;
+    }
+    count = last_port - first_port + 1;
+    if (count > PORT_STATS_PER_MSG) {
+      count = PORT_STATS_PER_MSG;
+    }
+  }
+
+  uint8_t buffer[3 + PORT_STATS_PER_MSG * sizeof(port_stats_t)];
+  buffer[0] = UPDATE_PORT_STATS;
+  buffer[1] = first_port;
+  buffer[2] = count;
+  for (uint8_t i = 0; i < count; i++) {
+    port_stats_t stats;
+    port_stats_get(first_port + i, &stats);
+    memcpy(&buffer[3 + i * sizeof(port_stats_t)], &stats, sizeof(stats));
+  }
+  tcp_server_send_data(state, buffer, 3 + count * sizeof(port_stats_t));
+  return 3;
+}
+
+static uint16_t recv_reset_port_stats(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  if (buf->tot_len - offset < 2) {
+    return 0;
+  }
+
+  uint8_t port = pbuf_get_at(buf, offset + 1);
+  printf("Queue reset port statistics: %u\n", port);
+  port_stats_reset(port);
+  return 2;
+}
+
+static uint16_t recv_request_schedule(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  if (buf->tot_len - offset < 3) {
+    return 0;
+  }
+
+  uint8_t first_port = pbuf_get_at(buf, offset + 1);
+  uint8_t last_port = pbuf_get_at(buf, offset + 2);
+  port_schedule_t schedule[USB_DEVICES];
+  size_t count = port_stats_schedule(first_port, last_port, schedule);
+
+  const size_t entry_len = 2 + sizeof(uint32_t);
+  uint8_t buffer[2 + USB_DEVICES * (2 + sizeof(uint32_t))];
+  buffer[0] = UPDATE_SCHEDULE;
+  buffer[1] = (uint8_t) count;
+  for (size_t i = 0; i < count; i++) {
+    uint8_t *entry = &buffer[2 + i * entry_len];
+    entry[0] = schedule[i].port;
+    entry[1] = schedule[i].parked;
+    put_u32(&entry[2], schedule[i].timeout_ms);
+  }
+  tcp_server_send_data(state, buffer, 2 + count * entry_len);
+  return 3;
+}
+
+static void send_cache(tcp_server_t *state) {
+  image_cache_info_t info;
+  image_cache_get_info(&info);
+
+  uint8_t buffer[8 + 2 * sizeof(uint32_t)];
+  buffer[0] = UPDATE_CACHE;
+  buffer[1] = (uint8_t) info.state;
+  buffer[2] = info.blocks & 0xff;
+  buffer[3] = (info.blocks >> 8) & 0xff;
+  put_u32(&buffer[4], info.size);
+  put_u32(&buffer[8], info.crc);
+  buffer[12] = info.variants;
+  buffer[13] = info.pool_blocks & 0xff;
+  buffer[14] = (info.pool_blocks >> 8) & 0xff;
+  buffer[15] = info.load_failed;
+  tcp_server_send_data(state, buffer, sizeof(buffer));
+}
+
+static uint16_t recv_cache_begin(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  const uint16_t len = 1 + 2 * sizeof(uint32_t);
+  if (buf->tot_len - offset < len) {
+    return 0;
+  }
+
+  uint32_t image_size = get_u32(buf, offset + 1);
+  uint32_t image_crc = get_u32(buf, offset + 5);
+  printf("Image cache: loading %lu bytes.\n", image_size);
+  image_cache_begin(image_size, image_crc);
+  send_cache(state);
+  return len;
+}
+
+static uint16_t recv_cache_variant(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  const uint16_t len = 1 + 2 * sizeof(uint32_t);
+  if (buf->tot_len - offset < len) {
+    return 0;
+  }
+
+  uint32_t image_size = get_u32(buf, offset + 1);
+  uint32_t image_crc = get_u32(buf, offset + 5);
+  printf("Image cache: loading a variant of %lu bytes.\n", image_size);
+  image_cache_begin_variant(image_size, image_crc);
+  send_cache(state);
+  return len;
+}
+
+static uint16_t recv_cache_delta(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  const uint16_t len = 1 + 3 * sizeof(uint32_t);
+  if (buf->tot_len - offset < len) {
+    return 0;
+  }
+
+  uint32_t image_size = get_u32(buf, offset + 1);
+  uint32_t image_crc = get_u32(buf, offset + 5);
+  uint32_t base_crc = get_u32(buf, offset + 9);
+  printf("Image cache: loading %lu bytes over the image %08lx.\n", image_size,
+         base_crc);
+  image_cache_begin_delta(image_size, image_crc, base_crc);
+  send_cache(state);
+  return len;
+}
+
+static uint16_t recv_request_cache_hashes(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  if (buf->tot_len - offset < 3) {
+    return 0;
+  }
+
+  uint16_t first = (uint16_t) (pbuf_get_at(buf, offset + 1) |
+                               (pbuf_get_at(buf, offset + 2) << 8));
+  uint32_t hashes[CACHE_HASHES_PER_MSG];
+  size_t count = image_cache_get_hashes(first, hashes, CACHE_HASHES_PER_MSG);
+
+  uint8_t buffer[4 + CACHE_HASHES_PER_MSG * sizeof(uint32_t)];
+  buffer[0] = UPDATE_CACHE_HASHES;
+  buffer[1] = first & 0xff;
+  buffer[2] = (first >> 8) & 0xff;
+  buffer[3] = (uint8_t) count;
+  for (size_t i = 0; i < count; i++) {
+    put_u32(&buffer[4 + i * sizeof(uint32_t)], hashes[i]);
+  }
+  tcp_server_send_data(state, buffer, 4 + count * sizeof(uint32_t));
+  return 3;
+}
+
+static uint16_t recv_cache_write(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  if (buf->tot_len - offset < 3) {
+    return 0;
+  }
+  uint16_t len = (uint16_t) (pbuf_get_at(buf, offset + 1) |
+                             (pbuf_get_at(buf, offset + 2) << 8));
+  if (len > TCP_MSS) {
+    printf("recv_cache_write: part of %u bytes is too large.\n", len);
+    send_decode_failure(state);
+    return 1;
+  }
+  if (buf->tot_len - offset < 3 + len) {
+    return 0;
+  }
+
+  // The payload might be split across multiple pbufs, which are appended to
+  // the cache one after the other.
+  struct pbuf *q = buf;
+  uint16_t skip = offset + 3;
+  while (len && skip >= q->len) {
+    skip -= q->len;
+    q = q->next;
+  }
+  for (uint16_t left = len; left; q = q->next, skip = 0) {
+    uint16_t piece = q->len - skip < left ? q->len - skip : left;
+    image_cache_write((const uint8_t*) q->payload + skip, piece);
+    left -= piece;
+  }
+  send_ack(state, FLASH_PART_RECEIVED);
+  return len + 3;
+}
+
+static uint16_t recv_cache_reuse(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  if (buf->tot_len - offset < 2) {
+    return 0;
+  }
+  const uint16_t entry_len = UF2_HEADER_SIZE + sizeof(uint32_t);
+  uint8_t count = pbuf_get_at(buf, offset + 1);
+  const uint16_t len = 2 + count * entry_len;
+  if (count > CACHE_REUSE_PER_MSG) {
+    send_decode_failure(state);
+    return 1;
+  }
+  if (buf->tot_len - offset < len) {
+    printf("recv_cache_reuse: incomplete message (%d < %d)",
+           buf->tot_len - offset, len);
+    return 0;
+  }
+
+  for (uint8_t b = 0; b < count; b++) {
+    const uint16_t entry = offset + 2 + b * entry_len;
+    uint8_t header[UF2_HEADER_SIZE];
+    pbuf_copy_partial(buf, header, UF2_HEADER_SIZE, entry);
+    image_cache_reuse(header, get_u32(buf, entry + UF2_HEADER_SIZE));
+  }
+  send_ack(state, FLASH_PART_RECEIVED);
+  return len;
+}
+
+static uint16_t recv_cache_end(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  if (buf->tot_len - offset < 2) {
+    return 0;
+  }
+  uint8_t count = pbuf_get_at(buf, offset + 1);
+  const uint16_t len = 2 + count * sizeof(uint32_t);
+  if (count > IMAGE_CACHE_PATCHES) {
+    send_decode_failure(state);
+    return 1;
+  }
+  if (buf->tot_len - offset < len) {
+    return 0;
+  }
+
+  uint32_t patches[IMAGE_CACHE_PATCHES];
+  for (uint8_t p = 0; p < count; p++) {
+    patches[p] = get_u32(buf, offset + 2 + p * sizeof(uint32_t));
+  }
+  image_cache_end(patches, count);
+  send_cache(state);
+  return len;
+}
+
+static uint16_t recv_set_manifest(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
   if (buf->tot_len - offset < 2) {
+    return 0;
+  }
+  uint8_t count = pbuf_get_at(buf, offset + 1);
+  const uint16_t len = 2 + count * 3;
+  if (count > IMAGE_CACHE_MANIFEST_SIZE) {
     send_decode_failure(state);
     return 1;
   }
+  if (buf->tot_len - offset < len) {
+    return 0;
+  }
+
+  image_manifest_entry_t entries[IMAGE_CACHE_MANIFEST_SIZE];
+  for (uint8_t e = 0; e < count; e++) {
+    entries[e].first_port = pbuf_get_at(buf, offset + 2 + e * 3);
+    entries[e].last_port = pbuf_get_at(buf, offset + 3 + e * 3);
+    entries[e].variant = pbuf_get_at(buf, offset + 4 + e * 3);
+    entries[e].reserved = 0;
+  }
+  if (!image_cache_set_manifest(entries, count)) {
+    send_decode_failure(state);
+    return len;
+  }
+  send_cache(state);
+  return len;
+}
+
+static void recv_flash_from_cache(tcp_server_t *state) {
+  state->total_flashed = 0;
+  patch_next_device(state->selected_device);
+  void *usb_context;
+  if (!take_flash_request(state, &usb_context)) {
+    printf("Flash from cache once the device requests its image.\n");
+    state->cache_flash_pending = true;
+    return;
+  }
+  start_flash_from_cache(state, usb_context);
+}
+
+static void send_store(tcp_server_t *state) {
+  image_store_info_t info;
+  image_store_get_info(&info);
+
+  uint8_t buffer[6 + 4 * sizeof(uint32_t)];
+  buffer[0] = UPDATE_STORE;
+  buffer[1] = (uint8_t) info.state;
+  buffer[2] = info.count;
+  buffer[3] = is_batch_running() ? 1 : 0;
+  buffer[4] = info.blocks & 0xff;
+  buffer[5] = (info.blocks >> 8) & 0xff;
+  put_u32(&buffer[6], info.size);
+  put_u32(&buffer[10], info.crc);
+  put_u32(&buffer[14], (uint32_t) info.hash);
+  put_u32(&buffer[18], (uint32_t) (info.hash >> 32));
+  tcp_server_send_data(state, buffer, sizeof(buffer));
+}
+
+static void recv_store_image(tcp_server_t *state) {
+  printf("Queue image store save.\n");
+  image_store_save();
+  send_store(state);
+}
+
+static uint16_t recv_load_stored(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  const uint16_t len = 1 + 2 * sizeof(uint32_t);
+  if (buf->tot_len - offset < len) {
+    return 0;
+  }
+
+  uint64_t hash = get_u32(buf, offset + 1) |
+                  ((uint64_t) get_u32(buf, offset + 5) << 32);
+  image_store_load(hash);
+  send_cache(state);
+  return len;
+}
+
+static uint16_t recv_run_batch(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  if (buf->tot_len - offset < 3) {
+    return 0;
+  }
+
+  uint8_t first_port = pbuf_get_at(buf, offset + 1);
+  uint8_t last_port = pbuf_get_at(buf, offset + 2);
+  printf("Queue batch: ports %u-%u\n", first_port, last_port);
+  uintptr_t ports = first_port | ((uintptr_t) last_port << 8);
+  queue_usb_task(&run_batch_cb, (void*) ports);
+  send_store(state);
+  return 3;
+}
+
+static uint16_t recv_set_patches(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  if (buf->tot_len - offset < 2) {
+    return 0;
+  }
+  uint8_t count = pbuf_get_at(buf, offset + 1);
+  const uint16_t len = 2 + 2 * sizeof(uint32_t) + count * sizeof(patch_t);
+  if (count > PATCH_TABLE_SIZE) {
+    send_decode_failure(state);
+    return 1;
+  }
+  if (buf->tot_len - offset < len) {
+    return 0;
+  }
+
+  uint32_t serial_base = get_u32(buf, offset + 2);
+  uint32_t timestamp = get_u32(buf, offset + 6);
+  patch_t patches[PATCH_TABLE_SIZE];
+  pbuf_copy_partial(buf, patches, count * sizeof(patch_t), offset + 10);
+  if (!patch_set_table(patches, count, serial_base, timestamp)) {
+    send_decode_failure(state);
+  }
+  return len;
+}
+
+static uint16_t recv_select_device(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  if (buf->tot_len - offset < 2) {
+    return 0;
+  }
 
   int8_t device = (int8_t) pbuf_get_at(buf, offset + 1);
-  
+  if (state->prefetching) {
+    drop_prefetch(state);
+  }
+  clear_flash_request(state);
+
   if (device >= 0) {
     printf("Queue USB select_device: %d\n", device);
+    state->selected_device = (uint8_t) device;
     queue_usb_task(&select_device_cb, (void*) (intptr_t) device);
   } else {
     printf("Queue reset all USB status (%d)\n", device);
@@ -240,6 +1029,32 @@ static uint16_t recv_select_device(tcp_server_t *state, struct pbuf *buf, uint16
   return 2;
 }
 
+static uint16_t recv_set_stages(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  if (buf->tot_len - offset < 2) {
+    return 0;
+  }
+
+  uint8_t count = pbuf_get_at(buf, offset + 1);
+  printf("Queue USB set_stage_count: %u\n", count);
+  queue_usb_task(&set_stage_count_cb, (void*) (uintptr_t) count);
+  return 2;
+}
+
+static uint16_t recv_start_job(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  const uint16_t len = 3 + 2 * sizeof(uint32_t);
+  if (buf->tot_len - offset < len) {
+    return 0;
+  }
+
+  uint8_t first_port = pbuf_get_at(buf, offset + 1);
+  uint8_t last_port = pbuf_get_at(buf, offset + 2);
+  uint32_t image_size = get_u32(buf, offset + 3);
+  uint32_t image_crc = get_u32(buf, offset + 7);
+  printf("Queue start job: ports %u-%u\n", first_port, last_port);
+  journal_start_job(first_port, last_port, image_size, image_crc);
+  return len;
+}
+
 static void recv_reboot_for_flash(tcp_server_t *state) {
   // Reboot in order to flash a new image.
   tcp_server_close(state);
@@ -253,50 +1068,355 @@ static void recv_reboot_soft(tcp_server_t *state) {
   watchdog_enable(0, true);
 }
 
-static void recv_start_flash(tcp_server_t *state) {
+static void recv_start_flash(tcp_server_t *state, bool compressed) {
   buffer_t *p = &state->recv_queue[state->last_buf];
   state->total_flashed = 0;
-  state->usb_context = last_usb_context;
+  state->transfer_active = true;
+  state->received = 0;
+  state->last_seq = 0;
+  state->written = 0;
+  state->compressed = compressed;
+  state->raw = false;
+  uf2_check_init(&state->check);
+  state->rejected = false;
+  if (compressed) {
+    decompress_init(&state->decoder);
+  }
+  patch_next_device(state->selected_device);
+
+  // Stream the image while the device switches to its bootloader and gets
+  // mounted, such that the first writes start as soon as it is ready.
+  void *usb_context;
+  if (!take_flash_request(state, &usb_context)) {
+    printf("Prefetch the image until the device requests it.\n");
+    state->prefetching = true;
+    state->held_first = state->last_buf;
+    state->held_parts = 0;
+    state->held_end = false;
+    state->start_acked = true;
+    prefetch_state = state;
+    send_ack(state, FLASH_START);
+    return;
+  }
+  state->usb_context = usb_context;
   queue_usb_task(&open_file, p);
 }
 
-static uint16_t recv_write_flash_part(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
-  buffer_t *p = &state->recv_queue[state->last_buf];
-  uint16_t len = TCP_MSS;
-  if (buf->tot_len < 3) {
-    printf("recv_write_flash_part: incomplete header (%d < %d)",
-           buf->tot_len - offset, 3);
+// Report the block at which the image got rejected, and why.
+static void send_image_rejected(tcp_server_t *state) {
+  uint8_t buffer[2 + sizeof(uint32_t)];
+  buffer[0] = IMAGE_REJECTED;
+  buffer[1] = (uint8_t) state->check.error;
+  put_u32(&buffer[2], uf2_check_failed_block(&state->check));
+  tcp_server_send_data(state, buffer, sizeof(buffer));
+}
+
+static uint16_t recv_set_family(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  const uint16_t len = 1 + sizeof(uint32_t);
+  if (buf->tot_len - offset < len) {
     return 0;
   }
-  uint8_t lo = pbuf_get_at(buf, offset + 1);
-  uint8_t hi = pbuf_get_at(buf, offset + 2);
-  uint16_t actual_len = (uint16_t) (lo + (hi << 8));
-  if (actual_len < len) {
-    len = actual_len;
-  }
-  // If the message is incomplete leave it for the next time.
-  if (offset + 3 + len < buf->tot_len) {
-    printf("recv_write_flash_part: incomplete message (%d < %d)",
-           buf->tot_len - offset - 3, len);
+  uf2_check_set_family(get_u32(buf, offset + 1));
+  return len;
+}
+
+static uint16_t recv_start_flash_raw(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  const uint16_t len = 1 + 3 * sizeof(uint32_t);
+  if (buf->tot_len - offset < len) {
     return 0;
   }
-  uint16_t recv = pbuf_copy_partial(buf, (void*) p->buf, len, offset + 3);
+
+  uint32_t base_addr = get_u32(buf, offset + 1);
+  uint32_t family_id = get_u32(buf, offset + 5);
+  uint32_t size = get_u32(buf, offset + 9);
+  recv_start_flash(state, false);
+  state->raw = true;
+  if (!uf2_frame_init(&state->framer, base_addr, family_id, size)) {
+    // Nothing is written, and every part is reported as an error.
+    printf("recv_start_flash_raw: invalid address 0x%08lx.\n", base_addr);
+    uf2_frame_init(&state->framer, 0, family_id, 0);
+    send_ack(state, FLASH_ERROR);
+    return len;
+  }
+  printf("Framing %lu bytes at 0x%08lx in %lu bytes of UF2.\n", size, base_addr,
+         uf2_frame_file_size(&state->framer));
+  return len;
+}
+
+// Give back the buffer of a part once it is written, or when it is not written
+// such as the parts of a rejected image.
+static void release_part(tcp_server_t *state) {
+  if (state->credits) {
+    state->credit_limit += BUF_SIZE;
+    state->credits_changed = true;
+  } else {
+    send_ack(state, FLASH_PART_WRITTEN);
+  }
+}
+
+// Validate and patch the content of the buffer p, and queue it to be written
+// on the device, or hold it until the device is mounted.
+static void queue_part(tcp_server_t *state, buffer_t *p, uint16_t recv) {
+  // Parts of a rejected image are acknowledged without being written, until
+  // the client ends the file.
+  if (!state->rejected && !uf2_check_run(&state->check, p->buf, recv)) {
+    state->rejected = true;
+    send_image_rejected(state);
+  }
+  if (state->rejected) {
+    if (p->charged) {
+      release_part(state);
+    }
+    return;
+  }
+  patch_stream(p->buf, recv, (uint32_t) state->total_flashed);
   p->len = recv;
   state->live_buf--;
   state->last_buf += 1;
   state->last_buf %= BUF_QUEUE_SIZE;
   state->total_flashed += recv;
-  send_ack(state, FLASH_PART_RECEIVED);
+  state->buffers_out++;
+  if (state->prefetching) {
+    state->held_parts++;
+    return;
+  }
   queue_usb_task(&write_file_content, (void*) p);
-  return recv + 3;
+}
+
+// Queue the buffer filled by the part being received.
+static void queue_filled(tcp_server_t *state) {
+  buffer_t *p = &state->recv_queue[state->last_buf];
+  p->charged = state->part_buffers < state->part_charge;
+  queue_part(state, p, state->part_fill);
+  state->part_fill = 0;
+  state->part_buffers++;
+}
+
+// Whether the part can go on filling the buffer at last_buf, which is still
+// queued when every buffer is, such as when a part decodes to more buffers
+// than it was charged for. The part is then refused.
+static bool part_has_buffer(tcp_server_t *state) {
+  if (state->part_fill || state->buffers_out < BUF_QUEUE_SIZE) {
+    return true;
+  }
+  printf("recv_write_flash_part: no buffer left for the part.\n");
+  send_ack(state, FLASH_ERROR);
+  state->part_failed = true;
+  return false;
+}
+
+// Decode a piece of a compressed or raw part in the buffers.
+static void decode_piece(tcp_server_t *state, const uint8_t *in, size_t len) {
+  while (!state->part_failed && part_has_buffer(state)) {
+    buffer_t *p = &state->recv_queue[state->last_buf];
+    uint8_t *out = &p->buf[state->part_fill];
+    const size_t room = sizeof(p->buf) - state->part_fill;
+    size_t used, recv;
+    if (state->compressed) {
+      recv = decompress_run(&state->decoder, in, len, &used, out, room);
+    } else {
+      recv = uf2_frame_run(&state->framer, in, len, &used, out, room);
+    }
+    in += used;
+    len -= used;
+    state->part_fill += recv;
+    // The decoder may hold more content once the buffer is full.
+    if (state->part_fill == sizeof(p->buf)) {
+      queue_filled(state);
+      continue;
+    }
+    if (len == 0) {
+      return;
+    }
+    if ((used == 0 && recv == 0) ||
+        (state->compressed && decompress_failed(&state->decoder))) {
+      printf("recv_write_flash_part: cannot decode the part.\n");
+      send_ack(state, FLASH_ERROR);
+      state->part_failed = true;
+    }
+  }
+}
+
+// End the last buffer of the part, and give back the buffers it was charged
+// for but did not fill, as when it was skipped or could not be decoded.
+static void end_part(tcp_server_t *state) {
+  if (state->part_fill) {
+    queue_filled(state);
+  }
+  for (; state->part_buffers < state->part_charge; state->part_buffers++) {
+    release_part(state);
+  }
+}
+
+// Decode the content of the part received so far, whatever the number of
+// segments it spans.
+static uint16_t recv_part_content(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  uint16_t count = buf->tot_len - offset;
+  if (count > state->part_left) {
+    count = state->part_left;
+  }
+  if (state->part_skip) {
+    if (count > state->part_skip) {
+      count = state->part_skip;
+    }
+    state->part_skip -= count;
+    state->part_left -= count;
+    if (state->part_left == 0) {
+      end_part(state);
+      if (!state->credits) {
+        send_ack(state, FLASH_PART_RECEIVED);
+      }
+    }
+    return count;
+  }
+  if (count && (state->compressed || state->raw)) {
+    struct pbuf *q = buf;
+    uint16_t skip = offset;
+    while (skip >= q->len) {
+      skip -= q->len;
+      q = q->next;
+    }
+    for (uint16_t left = count; left; q = q->next, skip = 0) {
+      uint16_t len = q->len - skip < left ? q->len - skip : left;
+      decode_piece(state, (const uint8_t*) q->payload + skip, len);
+      left -= len;
+    }
+  } else if (!state->compressed && !state->raw) {
+    for (uint16_t copied = 0; copied < count && !state->part_failed;) {
+      if (!part_has_buffer(state)) {
+        break;
+      }
+      buffer_t *p = &state->recv_queue[state->last_buf];
+      uint16_t len = sizeof(p->buf) - state->part_fill;
+      if (len > count - copied) {
+        len = count - copied;
+      }
+      pbuf_copy_partial(buf, &p->buf[state->part_fill], len, offset + copied);
+      state->part_fill += len;
+      copied += len;
+      if (state->part_fill == sizeof(p->buf)) {
+        queue_filled(state);
+      }
+    }
+  }
+
+  state->part_left -= count;
+  state->received += count;
+  if (state->part_left == 0) {
+    end_part(state);
+    if (!state->credits) {
+      send_ack(state, FLASH_PART_RECEIVED);
+    }
+  }
+  return count;
+}
+
+// Start receiving a part of len bytes, given at offset of the content.
+static void start_part(tcp_server_t *state, uint32_t offset, uint16_t len) {
+  state->part_left = len;
+  state->part_fill = 0;
+  state->part_buffers = 0;
+  state->part_failed = false;
+  // Parts fill one buffer per started buffer of content, and compressed or
+  // raw parts a single buffer, as counted by the credits.
+  state->part_charge = state->compressed || state->raw
+                         ? 1 : (uint8_t) ((len + BUF_SIZE - 1) / BUF_SIZE);
+  state->part_skip = 0;
+  if (offset < state->received) {
+    uint32_t skip = state->received - offset;
+    state->part_skip = skip < len ? (uint16_t) skip : len;
+  } else if (offset > state->received) {
+    printf("recv_write_flash_part: missing content from %lu to %lu.\n",
+           state->received, offset);
+    state->part_skip = len;
+    send_transfer(state);
+  }
+}
+
+static uint16_t recv_write_flash_part(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  // If the header is incomplete leave it for the next time, the content is
+  // decoded as it arrives.
+  if (buf->tot_len - offset < 3) {
+    return 0;
+  }
+  uint8_t lo = pbuf_get_at(buf, offset + 1);
+  uint8_t hi = pbuf_get_at(buf, offset + 2);
+  start_part(state, state->received, (uint16_t) (lo + (hi << 8)));
+  if (state->part_left == 0) {
+    recv_part_content(state, buf, offset + 3);
+  }
+  return 3;
+}
+
+static uint16_t recv_write_flash_part_at(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  const uint16_t len = 1 + 2 * sizeof(uint32_t) + sizeof(uint16_t);
+  if (buf->tot_len - offset < len) {
+    return 0;
+  }
+  state->last_seq = get_u32(buf, offset + 1);
+  uint32_t part_offset = get_u32(buf, offset + 5);
+  uint8_t lo = pbuf_get_at(buf, offset + 9);
+  uint8_t hi = pbuf_get_at(buf, offset + 10);
+  start_part(state, part_offset, (uint16_t) (lo + (hi << 8)));
+  if (state->part_left == 0) {
+    recv_part_content(state, buf, offset + len);
+  }
+  return len;
 }
 
 static void recv_end_flash(tcp_server_t *state) {
   buffer_t *p = &state->recv_queue[state->last_buf];
+  // The client resumed a transfer which had ended, but missed FLASH_END.
+  if (!state->transfer_active) {
+    send_ack(state, FLASH_END);
+    return;
+  }
+  state->transfer_active = false;
   printf("POST finished: received %u bytes.\n", state->total_flashed);
+  if (state->compressed && !decompress_is_complete(&state->decoder)) {
+    printf("POST finished: truncated compressed image.\n");
+  }
+  if (state->raw && !uf2_frame_is_complete(&state->framer)) {
+    printf("POST finished: truncated binary.\n");
+  }
+  if (!state->rejected && !uf2_check_end(&state->check)) {
+    state->rejected = true;
+    send_image_rejected(state);
+  }
+  if (state->prefetching) {
+    state->held_end = true;
+    return;
+  }
   queue_usb_task(&close_file, p);
 }
 
+static void send_credits(tcp_server_t *state) {
+  uint8_t buffer[1 + sizeof(uint32_t)];
+  buffer[0] = UPDATE_CREDITS;
+  put_u32(&buffer[1], state->credit_limit);
+  state->credits_changed = false;
+  tcp_server_send_data(state, buffer, sizeof(buffer));
+}
+
+static void recv_enable_credits(tcp_server_t *state) {
+  printf("Acknowledge parts with credits of %u bytes.\n",
+         BUF_QUEUE_SIZE * BUF_SIZE);
+  state->credits = true;
+  // Buffers still queued from a previous connection are not free.
+  state->credit_limit = (BUF_QUEUE_SIZE - state->buffers_out) * BUF_SIZE;
+  credits_state = state;
+  send_credits(state);
+}
+
+// Send the credits given back by the buffers written since the last update,
+// once the queued tasks are done, such that a single message acknowledges all
+// the parts written in a row.
+static void flush_credits() {
+  if (credits_state && credits_state->credits_changed && !has_web_task()) {
+    send_credits(credits_state);
+  }
+}
+
 // TCP is a stream protocol, this function will convert the stream into
 // messages. It will return how many bytes are read for each message.
 static uint16_t tcp_recv_message(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
@@ -322,19 +1442,254 @@ static uint16_t tcp_recv_message(tcp_server_t *state, struct pbuf *buf, uint16_t
     recv_reboot_soft(state);
     return 1;
   case START_FLASH:
-    recv_start_flash(state);
+    recv_start_flash(state, false);
     return 1;
+  case START_FLASH_COMPRESSED:
+    recv_start_flash(state, true);
+    return 1;
+  case START_FLASH_RAW:
+    return recv_start_flash_raw(state, buf, offset);
   case WRITE_FLASH_PART:
     return recv_write_flash_part(state, buf, offset);
   case END_FLASH:
     recv_end_flash(state);
     return 1;
+  case START_JOB:
+    return recv_start_job(state, buf, offset);
+  case REQUEST_JOB:
+    send_job(state);
+    return 1;
+  case REQUEST_PORT_STATS:
+    return recv_request_port_stats(state, buf, offset);
+  case RESET_PORT_STATS:
+    return recv_reset_port_stats(state, buf, offset);
+  case REQUEST_SCHEDULE:
+    return recv_request_schedule(state, buf, offset);
+  case SET_STAGES:
+    return recv_set_stages(state, buf, offset);
+  case CACHE_BEGIN:
+    return recv_cache_begin(state, buf, offset);
+  case CACHE_WRITE:
+    return recv_cache_write(state, buf, offset);
+  case CACHE_END:
+    return recv_cache_end(state, buf, offset);
+  case REQUEST_CACHE:
+    send_cache(state);
+    return 1;
+  case FLASH_FROM_CACHE:
+    recv_flash_from_cache(state);
+    return 1;
+  case STORE_IMAGE:
+    recv_store_image(state);
+    return 1;
+  case REQUEST_STORE:
+    send_store(state);
+    return 1;
+  case LOAD_STORED:
+    return recv_load_stored(state, buf, offset);
+  case RUN_BATCH:
+    return recv_run_batch(state, buf, offset);
+  case SET_PATCHES:
+    return recv_set_patches(state, buf, offset);
+  case CACHE_VARIANT:
+    return recv_cache_variant(state, buf, offset);
+  case CACHE_REUSE:
+    return recv_cache_reuse(state, buf, offset);
+  case SET_MANIFEST:
+    return recv_set_manifest(state, buf, offset);
+  case CACHE_DELTA:
+    return recv_cache_delta(state, buf, offset);
+  case REQUEST_CACHE_HASHES:
+    return recv_request_cache_hashes(state, buf, offset);
+  case WRITE_FLASH_PART_AT:
+    return recv_write_flash_part_at(state, buf, offset);
+  case REQUEST_TRANSFER:
+    send_transfer(state);
+    return 1;
+  case ENABLE_CREDITS:
+    recv_enable_credits(state);
+    return 1;
+  case SET_FAMILY:
+    return recv_set_family(state, buf, offset);
+  case REQUEST_CONTROL:
+    return recv_request_control(state, buf, offset);
+  case REQUEST_STATUS_SINCE:
+    return recv_request_status_since(state, buf, offset);
   default:
     send_decode_failure(state);
     return 1;
   }
 }
 
+// Length of the controller message at offset, which is known once its header
+// is received. Returns false while the header is incomplete, and sets len to 0
+// for messages of unknown length.
+static bool controller_message_length(struct pbuf *buf, uint16_t offset, uint32_t *len) {
+  uint16_t avail = buf->tot_len - offset;
+  uint8_t msg_id = pbuf_get_at(buf, offset);
+  uint16_t size;
+  uint8_t count;
+
+  switch (msg_id) {
+  case REBOOT_FOR_FLASH:
+  case REBOOT_SOFT:
+  case START_FLASH:
+  case START_FLASH_COMPRESSED:
+  case END_FLASH:
+  case FLASH_FROM_CACHE:
+  case STORE_IMAGE:
+  case ENABLE_CREDITS:
+    *len = 1;
+    return true;
+  case SELECT_DEVICE:
+  case RESET_PORT_STATS:
+  case SET_STAGES:
+    *len = 2;
+    return true;
+  case RUN_BATCH:
+    *len = 3;
+    return true;
+  case SET_FAMILY:
+    *len = 1 + sizeof(uint32_t);
+    return true;
+  case CACHE_BEGIN:
+  case CACHE_VARIANT:
+  case LOAD_STORED:
+    *len = 1 + 2 * sizeof(uint32_t);
+    return true;
+  case START_JOB:
+    *len = 3 + 2 * sizeof(uint32_t);
+    return true;
+  case CACHE_DELTA:
+  case START_FLASH_RAW:
+    *len = 1 + 3 * sizeof(uint32_t);
+    return true;
+  case CACHE_WRITE:
+  case WRITE_FLASH_PART:
+    if (avail < 3) {
+      return false;
+    }
+    size = (uint16_t) (pbuf_get_at(buf, offset + 1) |
+                       (pbuf_get_at(buf, offset + 2) << 8));
+    *len = 3 + size;
+    return true;
+  case WRITE_FLASH_PART_AT:
+    if (avail < 1 + 2 * sizeof(uint32_t) + sizeof(uint16_t)) {
+      return false;
+    }
+    size = (uint16_t) (pbuf_get_at(buf, offset + 9) |
+                       (pbuf_get_at(buf, offset + 10) << 8));
+    *len = 1 + 2 * sizeof(uint32_t) + sizeof(uint16_t) + size;
+    return true;
+  case CACHE_REUSE:
+  case CACHE_END:
+  case SET_MANIFEST:
+  case SET_PATCHES:
+    if (avail < 2) {
+      return false;
+    }
+    count = pbuf_get_at(buf, offset + 1);
+    if (msg_id == CACHE_REUSE) {
+      *len = 2 + count * (UF2_HEADER_SIZE + sizeof(uint32_t));
+    } else if (msg_id == CACHE_END) {
+      *len = 2 + count * sizeof(uint32_t);
+    } else if (msg_id == SET_MANIFEST) {
+      *len = 2 + count * 3;
+    } else {
+      *len = 2 + 2 * sizeof(uint32_t) + count * sizeof(patch_t);
+    }
+    return true;
+  default:
+    *len = 0;
+    return true;
+  }
+}
+
+// Decode the messages of a client which does not control the board, which can
+// only query its state. The messages reserved to the controller are skipped,
+// possibly across several segments, such that the next ones still decode.
+static uint16_t monitor_recv_message(tcp_server_t *state, struct pbuf *buf, uint16_t offset) {
+  tcp_client_t *client = state->reply;
+  uint16_t avail = buf->tot_len - offset;
+  if (avail < 1) {
+    return 0;
+  }
+  if (client->denied_left) {
+    uint16_t skip = client->denied_left < avail ? (uint16_t) client->denied_left : avail;
+    client->denied_left -= skip;
+    return skip;
+  }
+  uint8_t msg_id = pbuf_get_at(buf, offset);
+
+  switch (msg_id) {
+  case REQUEST_STATUS:
+  case REQUEST_STDOUT:
+  case REQUEST_JOB:
+  case REQUEST_PORT_STATS:
+  case REQUEST_SCHEDULE:
+  case REQUEST_CACHE:
+  case REQUEST_STORE:
+  case REQUEST_CACHE_HASHES:
+  case REQUEST_TRANSFER:
+  case REQUEST_CONTROL:
+  case REQUEST_STATUS_SINCE:
+    return tcp_recv_message(state, buf, offset);
+  default: {
+    uint32_t len;
+    if (!controller_message_length(buf, offset, &len)) {
+      return 0;
+    }
+    printf("Monitor sent message %u reserved to the controller.\n", msg_id);
+    send_role(state);
+    if (len == 0) {
+      // The length of an unknown message is unknown too, thus the rest of
+      // what was received is dropped.
+      return avail;
+    }
+    client->denied_left = len;
+    return monitor_recv_message(state, buf, offset);
+  }
+  }
+}
+
+// Push the status and stdout to the monitors, from the snapshots shared by
+// all of them, as long as their connection has room for it.
+static void push_monitors() {
+  tcp_server_t *state = monitored_state;
+  if (!state || !time_reached(state->next_push)) {
+    return;
+  }
+  state->next_push = make_timeout_time_ms(MONITOR_PUSH_MS);
+
+  bool monitored = false;
+  for (size_t i = 0; i < TCP_MAX_CLIENTS; i++) {
+    tcp_client_t *client = &state->clients[i];
+    monitored |= client->pcb && client != state->controller;
+  }
+  if (!monitored) {
+    return;
+  }
+  refresh_status(state);
+  pull_stdout(state);
+
+  for (size_t i = 0; i < TCP_MAX_CLIENTS; i++) {
+    tcp_client_t *client = &state->clients[i];
+    if (!client->pcb || client == state->controller) {
+      continue;
+    }
+    if (client->status_pushed != state->status_version &&
+        tcp_sndbuf(client->pcb) >= sizeof(state->status_msg) &&
+        tcp_client_send(client, state->status_msg,
+                        sizeof(state->status_msg)) == ERR_OK) {
+      client->status_pushed = state->status_version;
+    }
+    uint16_t len = stdout_unread(state, client);
+    if (len && tcp_sndbuf(client->pcb) >= len + 3) {
+      send_stdout_to(state, client, len);
+    }
+  }
+}
+
 // ---------------------------------------------------------
 //  All callback for managing the state of the connection
 //  and data transfers.
@@ -345,44 +1700,66 @@ static err_t tcp_server_sent_cb(void *arg, struct tcp_pcb *tpcb, u16_t len) {
 
 static err_t tcp_server_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p,
                                 err_t err) {
-  tcp_server_t *state = (tcp_server_t*) arg;
+  tcp_client_t *client = (tcp_client_t*) arg;
+  tcp_server_t *state = (tcp_server_t*) client->server;
   if (!p) {
-    return tcp_server_result(state, -1);
+    printf("Client disconnected\n");
+    return tcp_client_close(client);
   }
   // this method is callback from lwIP, so cyw43_arch_lwip_begin is not
   // required, however you can use this method to cause an assertion in debug
   // mode, if this method is called when cyw43_arch_lwip_begin IS needed
   cyw43_arch_lwip_check();
 
+  // Messages can be split between segments, thus keep the end of the previous
+  // segments which is not decoded yet.
+  if (client->pending) {
+    pbuf_cat(client->pending, p);
+    p = client->pending;
+    client->pending = NULL;
+  }
+
   uint16_t recv = 0;
-  while (recv < p->tot_len) {
+  state->reply = client;
+  while (recv < p->tot_len && state->reply == client) {
     // printf("tcp_server_recv %d err %d\n", p->tot_len, err);
 
     // free the buffer once everything is consumed.
-    uint16_t processed = tcp_recv_message(state, p, recv);
+    uint16_t processed;
+    if (client != state->controller) {
+      processed = monitor_recv_message(state, p, recv);
+    } else if (state->part_left) {
+      processed = recv_part_content(state, p, recv);
+    } else {
+      processed = tcp_recv_message(state, p, recv);
+    }
     recv += processed;
     if (processed == 0) {
       break;
     }
   }
+  state->reply = NULL;
 
-  tcp_recved(tpcb, recv);
-  pbuf_free(p);
+  if (client->pcb) {
+    tcp_recved(tpcb, recv);
+  }
+  if (recv < p->tot_len && client->pcb) {
+    client->pending = pbuf_free_header(p, recv);
+  } else {
+    pbuf_free(p);
+  }
   return ERR_OK;
 }
 
-static err_t tcp_server_poll_cb(void *arg, struct tcp_pcb *tpcb) {
-  tcp_server_t *state = (tcp_server_t*) arg;
-  printf("tcp_server_poll_fn\n");
-  return tcp_server_result(state, -1); // no response is an error?
-}
-
+// The connection got reset, or the keepalive found the client unreachable, and
+// lwIP already freed the pcb.
 static void tcp_server_err_cb(void *arg, err_t err) {
-  tcp_server_t *state = (tcp_server_t*) arg;
+  tcp_client_t *client = (tcp_client_t*) arg;
   if (err != ERR_ABRT) {
     printf("tcp_client_err_fn %d\n", err);
-    tcp_server_result(state, err);
   }
+  client->pcb = NULL;
+  tcp_client_close(client);
 }
 
 // ---------------------------------------------------------
@@ -396,17 +1773,48 @@ static err_t tcp_server_accept_cb(void *arg, struct tcp_pcb *client_pcb,
     tcp_server_result(state, err);
     return ERR_VAL;
   }
-  printf("Client connected\n");
-
-  state->client_pcb = client_pcb;
+  tcp_client_t *client = NULL;
+  for (size_t i = 0; i < TCP_MAX_CLIENTS && !client; i++) {
+    if (!state->clients[i].pcb) {
+      client = &state->clients[i];
+    }
+  }
+  if (!client) {
+    printf("Too many clients\n");
+    tcp_abort(client_pcb);
+    return ERR_ABRT;
+  }
+  client->pcb = client_pcb;
+  // The stdout buffered before the client connected is still sent to it, as it
+  // only gets moved to the log once read.
+  client->stdout_read = state->stdout_end;
+  client->status_pushed = state->status_version - 1;
+  client->denied_left = 0;
+
+  // The first client controls the board, and the next ones monitor it until
+  // they request the control.
+  if (!state->controller) {
+    state->controller = client;
+  }
+  printf("Client connected as %s\n",
+         state->controller == client ? "controller" : "monitor");
+
+  // The client may stay silent while devices switch to their bootloader, thus
+  // probe it with keepalives instead of closing idle connections, such that a
+  // lost client is noticed within 10 seconds.
+  ip_set_option(client_pcb, SOF_KEEPALIVE);
+  client_pcb->keep_idle = 5000; // 5000ms
   client_pcb->keep_intvl = 1000; // 1000ms
-  const uint8_t poll_time_s = 1;
+  client_pcb->keep_cnt = 5;
   // Setup the callback and the tcp_server_t* argument given to all callbacks.
-  tcp_arg(client_pcb, state);
+  tcp_arg(client_pcb, client);
   tcp_sent(client_pcb, tcp_server_sent_cb);
   tcp_recv(client_pcb, tcp_server_recv_cb);
-  tcp_poll(client_pcb, tcp_server_poll_cb, poll_time_s * 2);
   tcp_err(client_pcb, tcp_server_err_cb);
+
+  state->reply = client;
+  send_role(state);
+  state->reply = NULL;
   return ERR_OK;
 }
 
@@ -426,7 +1834,7 @@ static bool tcp_server_open(tcp_server_t *state) {
     return false;
   }
 
-  state->server_pcb = tcp_listen_with_backlog(pcb, 1);
+  state->server_pcb = tcp_listen_with_backlog(pcb, TCP_MAX_CLIENTS);
   if (!state->server_pcb) {
     printf("failed to listen\n");
     if (pcb) {
@@ -476,6 +1884,7 @@ bool tcp_server_setup() {
     return false;
   }
 
+  monitored_state = state;
   printf("TCP Server initialized.\n");
   return true;
 }
@@ -484,6 +1893,9 @@ void tcp_server_loop() {
   while (true) {
     cyw43_arch_poll();
     exec_web_task();
+    flush_credits();
+    push_monitors();
+    usb_host_supervise();
   }
 }
 
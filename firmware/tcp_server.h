@@ -1,5 +1,5 @@
 
-#if !defined(TCP_SERVER_H) && defined(USE_TCP_SERVER)
+#if !defined(TCP_SERVER_H)
 #define TCP_SERVER_H
 
 #include <stdbool.h>
@@ -15,11 +15,15 @@ typedef enum {
   SELECT_DEVICE,
 
   // START_FLASH will open the file on the selected device and reply with
-  // FLASH_START.
+  // FLASH_START. When the device did not request its image yet, FLASH_START is
+  // sent right away, and the parts are held until the device is mounted, up to
+  // the 16 parts which are not acknowledged with FLASH_PART_WRITTEN.
   START_FLASH,
 
-  // WRITE_FLASH_PART will write part of the file on the flash and acknowledged
-  // with FLASH_PART_RECEIVED and FLASH_PART_WRITTEN.
+  // WRITE_FLASH_PART [len u16, content] will write part of the file on the
+  // flash and acknowledged with FLASH_PART_RECEIVED and FLASH_PART_WRITTEN. The
+  // content is decoded as it arrives, in buffers of 1536 bytes, thus parts
+  // can span any number of TCP segments.
   WRITE_FLASH_PART,
 
   // END_FLASH will close the file on the flash and acknowledge with FLASH_END.
@@ -29,7 +33,142 @@ typedef enum {
   REBOOT_FOR_FLASH,
 
   // Reboot the uf2-batch-flasher to reset it state.
-  REBOOT_SOFT
+  REBOOT_SOFT,
+
+  // START_JOB records the range of ports and the image to be flashed in the
+  // journal, such that the job can be resumed after a reboot.
+  START_JOB,
+
+  // REQUEST_JOB is answered with UPDATE_JOB.
+  REQUEST_JOB,
+
+  // REQUEST_PORT_STATS is answered with UPDATE_PORT_STATS, for at most
+  // PORT_STATS_PER_MSG ports starting at the first requested port.
+  REQUEST_PORT_STATS,
+
+  // Reset the statistics of a port once it has been serviced, or of all ports
+  // if the port is 0xff.
+  RESET_PORT_STATS,
+
+  // REQUEST_SCHEDULE is answered with UPDATE_SCHEDULE.
+  REQUEST_SCHEDULE,
+
+  // SET_STAGES sets the number of images flashed in a row on each device,
+  // without unselecting it. The status of the device goes back to
+  // DEVICE_SELECTED after each FLASH_END, until the last image is flashed.
+  SET_STAGES,
+
+  // CACHE_BEGIN starts uploading an image to the image cache, given its size
+  // and CRC-32, and is answered with UPDATE_CACHE.
+  CACHE_BEGIN,
+
+  // CACHE_WRITE appends part of the image to the image cache, and is
+  // acknowledged with FLASH_PART_RECEIVED.
+  CACHE_WRITE,
+
+  // CACHE_END gives the offsets to patch with the index of the device, and is
+  // answered with UPDATE_CACHE.
+  CACHE_END,
+
+  // REQUEST_CACHE is answered with UPDATE_CACHE.
+  REQUEST_CACHE,
+
+  // FLASH_FROM_CACHE writes the cached image on the selected device, replacing
+  // START_FLASH, WRITE_FLASH_PART and END_FLASH. It replies with FLASH_START
+  // and FLASH_END.
+  FLASH_FROM_CACHE,
+
+  // STORE_IMAGE saves the cached image in the flash of the Pico W, unless it is
+  // already stored, and is answered with UPDATE_STORE. The state of the store
+  // stays IMAGE_STORE_SAVING until the image is written.
+  STORE_IMAGE,
+
+  // REQUEST_STORE is answered with UPDATE_STORE.
+  REQUEST_STORE,
+
+  // LOAD_STORED loads the stored image with the given 64-bit hash in the image
+  // cache, or the latest one if the hash is 0, and is answered with
+  // UPDATE_CACHE.
+  LOAD_STORED,
+
+  // RUN_BATCH flashes the cached image on a range of ports without any client,
+  // and is answered with UPDATE_STORE.
+  RUN_BATCH,
+
+  // SET_PATCHES gives the table of values written by the board in the images
+  // for each device, with the first serial number and the time of the batch.
+  // It is answered with DECODE_FAILURE if the table is rejected.
+  SET_PATCHES,
+
+  // CACHE_VARIANT starts uploading another variant of the cached image, given
+  // its size and CRC-32, and is answered with UPDATE_CACHE. The variant is then
+  // uploaded with CACHE_WRITE, CACHE_REUSE and CACHE_END.
+  CACHE_VARIANT,
+
+  // CACHE_REUSE appends at most CACHE_REUSE_PER_MSG blocks whose payloads are
+  // already cached, each given by the header of the UF2 block and the 32-bit
+  // hash of its payload, and is acknowledged with FLASH_PART_RECEIVED.
+  CACHE_REUSE,
+
+  // SET_MANIFEST gives the variant flashed on each range of ports, as triplets
+  // of the first port, the last port and the variant, and is answered with
+  // UPDATE_CACHE, or DECODE_FAILURE if the manifest is rejected.
+  SET_MANIFEST,
+
+  // START_FLASH_COMPRESSED replaces START_FLASH for images compressed as
+  // described in decompress.h. Each WRITE_FLASH_PART then holds whole blocks
+  // which decode to at most TCP_MSS bytes.
+  START_FLASH_COMPRESSED,
+
+  // START_FLASH_RAW [base_addr u32, family_id u32, size u32] replaces
+  // START_FLASH for raw binaries, which the board frames in UF2 blocks as
+  // described in uf2_frame.h. Each WRITE_FLASH_PART then holds at most
+  // UF2_FRAME_PART_SIZE bytes of the binary.
+  START_FLASH_RAW,
+
+  // CACHE_DELTA starts uploading an image which replaces the cached one, given
+  // its size and CRC-32 followed by the CRC-32 of the cached image, and is
+  // answered with UPDATE_CACHE. Blocks whose payload did not change are given
+  // with CACHE_REUSE, the others with CACHE_WRITE, followed by CACHE_END.
+  CACHE_DELTA,
+
+  // REQUEST_CACHE_HASHES is answered with UPDATE_CACHE_HASHES, for at most
+  // CACHE_HASHES_PER_MSG payloads of the cache starting at the first requested
+  // one (u16).
+  REQUEST_CACHE_HASHES,
+
+  // SET_FAMILY gives the family ID expected in the next images (u32), or 0 to
+  // accept any family, see uf2_check.h.
+  SET_FAMILY,
+
+  // ENABLE_CREDITS replaces FLASH_PART_RECEIVED and FLASH_PART_WRITTEN with
+  // UPDATE_CREDITS for the rest of the connection, and is answered with
+  // UPDATE_CREDITS.
+  ENABLE_CREDITS,
+
+  // WRITE_FLASH_PART_AT [seq u32, offset u32, len u16, content] replaces
+  // WRITE_FLASH_PART with the offset of the part in the content sent since
+  // START_FLASH, and a sequence number reported by UPDATE_TRANSFER. Content
+  // received before is skipped, and a part after missing content is dropped
+  // and answered with UPDATE_TRANSFER.
+  WRITE_FLASH_PART_AT,
+
+  // REQUEST_TRANSFER is answered with UPDATE_TRANSFER. The transfer of an image
+  // goes on when the client gets disconnected, such that it can reconnect and
+  // resume sending the image from the content received.
+  REQUEST_TRANSFER,
+
+  // REQUEST_CONTROL [force u8] is answered with UPDATE_ROLE. Up to 4 clients
+  // can be connected, the first one controls the board and the next ones
+  // monitor it: they are pushed UPDATE_STATUS and UPDATE_STDOUT, and can only
+  // send the REQUEST_* messages. A monitor gets the control when no client has
+  // it, or when forced, which disconnects the controller.
+  REQUEST_CONTROL,
+
+  // REQUEST_STATUS_SINCE [generation u32] is answered with UPDATE_STATUS_CHANGES
+  // for the ports whose status changed after the generation, or all ports for
+  // the generation 0.
+  REQUEST_STATUS_SINCE
 } client_msg_t;
 
 typedef enum {
@@ -61,9 +200,71 @@ typedef enum {
   FLASH_ERROR,
 
   // Replied when a message has not been decoded properly.
-  DECODE_FAILURE
+  DECODE_FAILURE,
+
+  // Send the last job recorded in the journal and the port to resume it from.
+  UPDATE_JOB,
+
+  // Send the statistics recorded for a range of ports.
+  UPDATE_PORT_STATS,
+
+  // Send the order in which the ports should be flashed, with the timeout to
+  // use for each port and whether it should be skipped.
+  UPDATE_SCHEDULE,
+
+  // Send the state of the image cache, the number of blocks and the size and
+  // CRC-32 of the cached image, followed by the number of variants and of
+  // distinct payloads held by the cache, and whether the last variant or delta
+  // failed to load while the image loaded before is kept.
+  UPDATE_CACHE,
+
+  // Send the state of the image store, the number of stored images, whether a
+  // batch is running, and the number of blocks, size, CRC-32 and hash of the
+  // latest stored image.
+  UPDATE_STORE,
+
+  // Send the hashes of a range of payloads of the image cache, as the index of
+  // the first one (u16) and the number of hashes, which is 0 past the end.
+  UPDATE_CACHE_HASHES,
+
+  // Report that the image being flashed is not a valid UF2 file, with the
+  // uf2_check_error_t reason and the number of the rejected block (u32). The
+  // following parts are acknowledged without being written.
+  IMAGE_REJECTED,
+
+  // Send the credits of the client (u32): parts can be sent as long as the
+  // buffers they fill since ENABLE_CREDITS stay within this number of bytes.
+  // A part fills one buffer of 1536 bytes per started 1536 bytes of its
+  // content, and compressed and raw parts fill a single buffer. A part which
+  // decodes to more buffers than the board has free is answered with
+  // FLASH_ERROR. Updates are merged, and sent once the board is idle.
+  UPDATE_CREDITS,
+
+  // Send the state of the transfer of the image, whether it is active (u8),
+  // the sequence number of the last part (u32), the bytes of content received
+  // since START_FLASH (u32), and the bytes of the file written on the device
+  // (u32).
+  UPDATE_TRANSFER,
+
+  // Send whether the client controls the board (u8). Sent when the client
+  // connects, and when a monitor sends a message reserved to the controller.
+  UPDATE_ROLE,
+
+  // Send the generation of the status (u32), the time of its last change in ms
+  // since boot (u32), and the number of changed ports (u8) followed by the port
+  // (u8) and status (u8) of each of them.
+  UPDATE_STATUS_CHANGES
 } server_msg_t;
 
+// Maximum number of ports sent in a single UPDATE_PORT_STATS message.
+#define PORT_STATS_PER_MSG 16
+
+// Maximum number of blocks given in a single CACHE_REUSE message.
+#define CACHE_REUSE_PER_MSG 32
+
+// Maximum number of payload hashes sent in a single UPDATE_CACHE_HASHES message.
+#define CACHE_HASHES_PER_MSG 64
+
 // Functions which are used to expose the internal buffer containing the content
 // to be flashed. They can be executed from any thread.
 uint8_t* get_postmsg_buffer(void* arg);
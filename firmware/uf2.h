@@ -0,0 +1,51 @@
+#ifndef UF2_H
+#define UF2_H
+
+#include <stdint.h>
+
+// Layout of the blocks of a UF2 file, see https://github.com/microsoft/uf2
+
+#define UF2_BLOCK_SIZE 512
+#define UF2_PAYLOAD_SIZE 256
+#define UF2_DATA_SIZE 476
+
+#define UF2_MAGIC_START0 0x0a324655 // "UF2\n"
+#define UF2_MAGIC_START1 0x9e5d5157
+#define UF2_MAGIC_END 0x0ab16f30
+
+#define UF2_FLAG_NOT_MAIN_FLASH 0x00000001
+#define UF2_FLAG_FILE_CONTAINER 0x00001000
+#define UF2_FLAG_FAMILY_ID_PRESENT 0x00002000
+#define UF2_FLAG_MD5_PRESENT 0x00004000
+#define UF2_FLAG_EXTENSION_TAGS_PRESENT 0x00008000
+
+// Family IDs of the Raspberry Pi chips, the RP2040 one being used by default by
+// the clients. The RP2350 bootloader also accepts the absolute and data
+// families, which are not tied to an architecture.
+#define UF2_FAMILY_RP2040 0xe48bff56
+#define UF2_FAMILY_ABSOLUTE 0xe48bff57
+#define UF2_FAMILY_DATA 0xe48bff58
+#define UF2_FAMILY_RP2350_ARM_S 0xe48bff59
+#define UF2_FAMILY_RP2350_RISCV 0xe48bff5a
+#define UF2_FAMILY_RP2350_ARM_NS 0xe48bff5b
+
+typedef struct {
+  uint32_t magic_start0;
+  uint32_t magic_start1;
+  uint32_t flags;
+  uint32_t target_addr;
+  uint32_t payload_size;
+  uint32_t block_no;
+  uint32_t num_blocks;
+  // File size, or family id when UF2_FLAG_FAMILY_ID_PRESENT is set.
+  uint32_t file_size;
+  uint8_t data[UF2_DATA_SIZE];
+  uint32_t magic_end;
+} uf2_block_t;
+
+_Static_assert(sizeof(uf2_block_t) == UF2_BLOCK_SIZE, "UF2 blocks are 512 bytes.");
+
+// Offset of the data within a block.
+#define UF2_HEADER_SIZE 32
+
+#endif // !UF2_H
@@ -0,0 +1,188 @@
+#include "uf2_check.h"
+
+#include <stdio.h>
+#include <string.h> // memcpy
+
+#include "patch.h"
+
+// Memory which can be written by the bootloader of a family.
+typedef struct {
+  uint32_t family_id;
+  uint32_t flash_start, flash_end;
+  uint32_t ram_start, ram_end;
+} uf2_family_t;
+
+static const uf2_family_t families[] = {
+  // RP2040, with up to 16 MiB of flash.
+  { UF2_FAMILY_RP2040, 0x10000000, 0x11000000, 0x20000000, 0x20042000 },
+  // RP2350, ARM and RISC-V images.
+  { UF2_FAMILY_RP2350_ARM_S, 0x10000000, 0x11000000, 0x20000000, 0x20082000 },
+  { UF2_FAMILY_RP2350_RISCV, 0x10000000, 0x11000000, 0x20000000, 0x20082000 },
+};
+
+static uint32_t expected_family = 0;
+
+void uf2_check_set_family(uint32_t family_id) {
+  expected_family = family_id;
+}
+
+uint32_t uf2_check_get_family() {
+  return expected_family;
+}
+
+void uf2_check_init(uf2_check_t* c) {
+  c->family_id = expected_family;
+  c->block_no = 0;
+  c->num_blocks = 0;
+  c->blocks = 0;
+  c->offset = 0;
+  c->error = UF2_CHECK_OK;
+}
+
+static uint32_t field(const uint8_t* bytes) {
+  uint32_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+static bool fail(uf2_check_t* c, uf2_check_error_t error) {
+  c->error = error;
+  printf("UF2 check: block %lu rejected, %s.\n", c->blocks, uf2_check_reason(c));
+  return false;
+}
+
+// Check the header of a block, once received.
+static bool check_header(uf2_check_t* c) {
+  const uf2_block_t* b = (const uf2_block_t*) c->header;
+  if (b->magic_start0 != UF2_MAGIC_START0 ||
+      b->magic_start1 != UF2_MAGIC_START1) {
+    return fail(c, UF2_CHECK_MAGIC);
+  }
+  if (b->payload_size > UF2_DATA_SIZE) {
+    return fail(c, UF2_CHECK_PAYLOAD_SIZE);
+  }
+
+  // Blocks are numbered from 0, and a new image can start after the last
+  // block of the previous one. Bundles hold one image per family, thus the
+  // family is learnt again for each image.
+  if (c->block_no == c->num_blocks) {
+    c->block_no = 0;
+    c->num_blocks = b->num_blocks;
+    c->family_id = expected_family;
+  }
+  if (b->block_no != c->block_no) {
+    return fail(c, UF2_CHECK_BLOCK_NO);
+  }
+  if (b->num_blocks != c->num_blocks || b->num_blocks == 0) {
+    return fail(c, UF2_CHECK_NUM_BLOCKS);
+  }
+  // Devices would reject the block once patched.
+  if ((b->flags & UF2_FLAG_MD5_PRESENT) &&
+      patch_in_block(c->blocks * UF2_BLOCK_SIZE)) {
+    return fail(c, UF2_CHECK_PATCHED_MD5);
+  }
+
+  if (b->flags & UF2_FLAG_FAMILY_ID_PRESENT) {
+    if (c->family_id == 0) {
+      c->family_id = b->file_size;
+    }
+    if (b->file_size != c->family_id) {
+      return fail(c, UF2_CHECK_FAMILY);
+    }
+    // Blocks which are not meant for the flash are ignored by bootloaders.
+    for (size_t f = 0; f < sizeof(families) / sizeof(families[0]); f++) {
+      const uf2_family_t* family = &families[f];
+      if (family->family_id != b->file_size ||
+          (b->flags & UF2_FLAG_NOT_MAIN_FLASH)) {
+        continue;
+      }
+      const uint64_t end = (uint64_t) b->target_addr + b->payload_size;
+      bool in_flash =
+        b->target_addr >= family->flash_start && end <= family->flash_end;
+      bool in_ram =
+        b->target_addr >= family->ram_start && end <= family->ram_end;
+      if ((!in_flash && !in_ram) || b->target_addr % UF2_PAYLOAD_SIZE != 0) {
+        return fail(c, UF2_CHECK_ADDRESS);
+      }
+    }
+  }
+  return true;
+}
+
+bool uf2_check_run(uf2_check_t* c, const uint8_t* data, size_t len) {
+  if (c->error != UF2_CHECK_OK) {
+    return false;
+  }
+  while (len) {
+    size_t count = UF2_BLOCK_SIZE - c->offset;
+    if (count > len) {
+      count = len;
+    }
+    // Only the header and the end magic are kept.
+    const size_t end = c->offset + count;
+    if (c->offset < UF2_HEADER_SIZE) {
+      size_t n = (end < UF2_HEADER_SIZE ? end : UF2_HEADER_SIZE) - c->offset;
+      memcpy(&c->header[c->offset], data, n);
+      if (c->offset + n == UF2_HEADER_SIZE && !check_header(c)) {
+        return false;
+      }
+    }
+    const size_t magic_at = UF2_BLOCK_SIZE - sizeof(c->magic_end);
+    if (end > magic_at) {
+      size_t from = c->offset > magic_at ? c->offset : magic_at;
+      memcpy(&c->magic_end[from - magic_at], &data[from - c->offset],
+             end - from);
+    }
+    c->offset = end;
+    data += count;
+    len -= count;
+
+    if (c->offset == UF2_BLOCK_SIZE) {
+      if (field(c->magic_end) != UF2_MAGIC_END) {
+        return fail(c, UF2_CHECK_MAGIC);
+      }
+      c->offset = 0;
+      c->block_no++;
+      c->blocks++;
+    }
+  }
+  return true;
+}
+
+bool uf2_check_end(uf2_check_t* c) {
+  if (c->error != UF2_CHECK_OK) {
+    return false;
+  }
+  if (c->offset != 0 || c->block_no != c->num_blocks || c->blocks == 0) {
+    return fail(c, UF2_CHECK_TRUNCATED);
+  }
+  return true;
+}
+
+uint32_t uf2_check_failed_block(const uf2_check_t* c) {
+  return c->blocks;
+}
+
+const char* uf2_check_reason(const uf2_check_t* c) {
+  switch (c->error) {
+  case UF2_CHECK_OK:
+    return "valid";
+  case UF2_CHECK_MAGIC:
+    return "bad magic number";
+  case UF2_CHECK_PAYLOAD_SIZE:
+    return "payload larger than the block";
+  case UF2_CHECK_BLOCK_NO:
+    return "block out of order";
+  case UF2_CHECK_NUM_BLOCKS:
+    return "inconsistent number of blocks";
+  case UF2_CHECK_FAMILY:
+    return "unexpected family ID";
+  case UF2_CHECK_ADDRESS:
+    return "target address outside of the flash and RAM";
+  case UF2_CHECK_TRUNCATED:
+    return "truncated image";
+  case UF2_CHECK_PATCHED_MD5:
+    return "patched block with an MD5 checksum";
+  }
+  return "unknown error";
+}
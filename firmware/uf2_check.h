@@ -0,0 +1,68 @@
+#ifndef UF2_CHECK_H
+#define UF2_CHECK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "uf2.h"
+
+// Streaming validator of the UF2 images received by the network core, such
+// that a corrupted or wrong image is rejected on its first bad block instead
+// of being written to every device.
+//
+// Each block must carry the magic numbers, a payload which fits in the block,
+// and the number of the previous block plus one, out of the same total number
+// of blocks. A new image may start once the previous one is complete, as done
+// by tools which prepend a block to the image, or bundle images of several
+// families. Blocks must carry the expected family ID, or when any family is
+// expected the same one as the first block of their image.
+// Blocks of the families whose memory map is known must target their flash or
+// RAM. Blocks carrying an MD5 checksum must not be written by the patches, as
+// the checksum is not computed again.
+
+typedef enum {
+  UF2_CHECK_OK = 0,
+  UF2_CHECK_MAGIC,
+  UF2_CHECK_PAYLOAD_SIZE,
+  UF2_CHECK_BLOCK_NO,
+  UF2_CHECK_NUM_BLOCKS,
+  UF2_CHECK_FAMILY,
+  UF2_CHECK_ADDRESS,
+  UF2_CHECK_TRUNCATED,
+  UF2_CHECK_PATCHED_MD5,
+} uf2_check_error_t;
+
+typedef struct {
+  uint32_t family_id;
+  // Block expected next, out of num_blocks, or 0 of 0 between images.
+  uint32_t block_no;
+  uint32_t num_blocks;
+  // Number of blocks checked.
+  uint32_t blocks;
+  // Offset within the block being received, and the fields checked.
+  size_t offset;
+  uint8_t header[UF2_HEADER_SIZE];
+  uint8_t magic_end[sizeof(uint32_t)];
+  uf2_check_error_t error;
+} uf2_check_t;
+
+// Family ID expected in the images, or 0 to accept any family. Set by the
+// clients, and used by the validators initialized afterwards.
+void uf2_check_set_family(uint32_t family_id);
+uint32_t uf2_check_get_family();
+
+void uf2_check_init(uf2_check_t* c);
+
+// Check the next bytes of the image, which can be split at any offset.
+// Returns false once a block is rejected.
+bool uf2_check_run(uf2_check_t* c, const uint8_t* data, size_t len);
+
+// Check that the image ends with a complete block of a complete image.
+bool uf2_check_end(uf2_check_t* c);
+
+// Number of the block at which the image got rejected, and why.
+uint32_t uf2_check_failed_block(const uf2_check_t* c);
+const char* uf2_check_reason(const uf2_check_t* c);
+
+#endif // !UF2_CHECK_H
@@ -0,0 +1,89 @@
+#include "uf2_frame.h"
+
+#include <string.h> // memcpy, memset
+
+static uint32_t num_blocks(uint32_t size) {
+  return size / UF2_PAYLOAD_SIZE + (size % UF2_PAYLOAD_SIZE != 0);
+}
+
+// Fill the header of the block holding the payload which starts at `pos`.
+static void start_block(uf2_frame_t* f) {
+  uf2_block_t* b = &f->block;
+  memset(b, 0, sizeof(*b));
+  b->magic_start0 = UF2_MAGIC_START0;
+  b->magic_start1 = UF2_MAGIC_START1;
+  b->flags = UF2_FLAG_FAMILY_ID_PRESENT;
+  b->target_addr = f->base_addr + f->pos;
+  b->payload_size = UF2_PAYLOAD_SIZE;
+  b->block_no = f->pos / UF2_PAYLOAD_SIZE;
+  b->num_blocks = num_blocks(f->size);
+  b->file_size = f->family_id;
+  b->magic_end = UF2_MAGIC_END;
+  f->emitted = UF2_BLOCK_SIZE;
+}
+
+bool uf2_frame_init(uf2_frame_t* f, uint32_t base_addr, uint32_t family_id,
+                    uint32_t size) {
+  f->base_addr = base_addr;
+  f->family_id = family_id;
+  f->size = size;
+  f->pos = 0;
+  start_block(f);
+  // Addresses of the padded payloads should not wrap around.
+  const uint64_t end = (uint64_t) base_addr +
+                       (uint64_t) num_blocks(size) * UF2_PAYLOAD_SIZE;
+  return base_addr % UF2_PAYLOAD_SIZE == 0 && end <= (uint64_t) UINT32_MAX + 1;
+}
+
+uint32_t uf2_frame_file_size(const uf2_frame_t* f) {
+  return num_blocks(f->size) * UF2_BLOCK_SIZE;
+}
+
+size_t uf2_frame_run(uf2_frame_t* f, const uint8_t* in, size_t in_len,
+                     size_t* consumed, uint8_t* out, size_t out_len) {
+  size_t i = 0, o = 0;
+  while (true) {
+    // Write the block whose payload is complete.
+    if (f->emitted < UF2_BLOCK_SIZE) {
+      size_t n = UF2_BLOCK_SIZE - f->emitted;
+      if (n > out_len - o) {
+        n = out_len - o;
+      }
+      memcpy(out + o, (const uint8_t*) &f->block + f->emitted, n);
+      f->emitted += n;
+      o += n;
+      if (f->emitted < UF2_BLOCK_SIZE) {
+        break;
+      }
+      if (f->pos == f->size) {
+        break;
+      }
+      start_block(f);
+    }
+    if (i == in_len || f->pos == f->size) {
+      break;
+    }
+
+    // Append the input to the payload of the current block.
+    size_t filled = f->pos % UF2_PAYLOAD_SIZE;
+    size_t n = UF2_PAYLOAD_SIZE - filled;
+    if (n > in_len - i) {
+      n = in_len - i;
+    }
+    if (n > f->size - f->pos) {
+      n = f->size - f->pos;
+    }
+    memcpy(f->block.data + filled, in + i, n);
+    i += n;
+    f->pos += n;
+    if (f->pos % UF2_PAYLOAD_SIZE == 0 || f->pos == f->size) {
+      f->emitted = 0;
+    }
+  }
+  *consumed = i;
+  return o;
+}
+
+bool uf2_frame_is_complete(const uf2_frame_t* f) {
+  return f->pos == f->size && f->emitted == UF2_BLOCK_SIZE;
+}
@@ -0,0 +1,51 @@
+#ifndef UF2_FRAME_H
+#define UF2_FRAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "uf2.h"
+
+// Streaming generator of UF2 blocks for raw binaries sent by the clients, run
+// by the network core while it fills the pipe. Clients then send the 256-byte
+// payloads only, along with the address of the binary and its family ID.
+//
+// Each payload is framed in a 512-byte block as soon as it is complete, and the
+// last one is padded with zeros. The stream can be split at any offset, and the
+// framer stops once the output buffer is full.
+
+// Largest part of a raw binary which is framed in at most 2 blocks, whatever
+// its offset within the binary.
+#define UF2_FRAME_PART_SIZE (2 * UF2_PAYLOAD_SIZE)
+
+typedef struct {
+  uint32_t base_addr;
+  uint32_t family_id;
+  // Size of the raw binary, and the number of bytes received.
+  uint32_t size;
+  uint32_t pos;
+  // Bytes of the current block already written in the output, or
+  // UF2_BLOCK_SIZE while its payload is being received.
+  uint32_t emitted;
+  uf2_block_t block;
+} uf2_frame_t;
+
+// Prepare the framing of a binary of `size` bytes, written at `base_addr`.
+// Returns false if the binary does not fit in the address space.
+bool uf2_frame_init(uf2_frame_t* f, uint32_t base_addr, uint32_t family_id,
+                    uint32_t size);
+
+// Size of the UF2 file generated for the binary.
+uint32_t uf2_frame_file_size(const uf2_frame_t* f);
+
+// Frame the bytes of `in` into `out`, until the input is consumed or the output
+// is full. Returns the number of bytes written, and sets `consumed` to the
+// number of bytes read. Bytes beyond the size of the binary are not consumed.
+size_t uf2_frame_run(uf2_frame_t* f, const uint8_t* in, size_t in_len,
+                     size_t* consumed, uint8_t* out, size_t out_len);
+
+// All blocks of the binary have been written in the output.
+bool uf2_frame_is_complete(const uf2_frame_t* f);
+
+#endif // !UF2_FRAME_H
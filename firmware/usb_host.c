@@ -11,8 +11,18 @@
 // machinery.
 #include "pico/time.h"
 
+// Memory barriers of the sequence lock of the status, and spin locks released
+// when core 1 is reset.
+#include "hardware/sync.h"
+
 #include "pio_usb.h"
+#include "pio_usb_ll.h" // pio_port, to release the PIO when core 1 is reset.
+#include "usb_tx.pio.h"
+#include "usb_rx.pio.h"
 #include "host/usbh.h" // Config ID for tuh_config.
+#include "host/hcd.h" // hcd_init, to restart the PIO USB port on core 1.
+#include "hardware/dma.h"
+#include "hardware/pio.h"
 
 // Needed to transfer files.
 #include "class/msc/msc_host.h"
@@ -41,6 +51,21 @@
 // Some debugging
 #include "input.h"
 
+// Record the outcome of each port, to resume interrupted jobs.
+#include "flash_region.h"
+#include "journal.h"
+#include "port_stats.h"
+
+// Timings and strategies of each family of devices.
+#include "device_profile.h"
+
+// Image uploaded once and flashed on every device.
+#include "image_cache.h"
+#include "image_store.h"
+
+// Values written in the image for each device.
+#include "patch.h"
+
 #include "usb_host.h"
 
 //#define LOG_DEBUG(...) printf(__VA_ARGS__)
@@ -73,6 +98,9 @@ static const uint PIN_SEL5 = 7;
 static const uint PIN_ENABLE_DATA = 8;
 static const uint PIN_ENABLE_POWER = 9;
 
+// Button starting a standalone batch, active low.
+static const uint PIN_BATCH_BUTTON = 15;
+
 void init_select_pin(uint pin) {
   gpio_init(pin);
   gpio_set_dir(pin, GPIO_OUT);
@@ -110,22 +138,92 @@ void usb_gpio_init() {
   init_enable_pin(PIN_ENABLE_POWER);
   bi_decl_if_func_used(bi_1pin_with_name(PIN_ENABLE_POWER, "EN_Power"));
 
+  bi_decl_if_func_used(bi_program_feature("Standalone batch"));
+  gpio_init(PIN_BATCH_BUTTON);
+  gpio_set_dir(PIN_BATCH_BUTTON, GPIO_IN);
+  gpio_pull_up(PIN_BATCH_BUTTON);
+  bi_decl_if_func_used(bi_1pin_with_name(PIN_BATCH_BUTTON, "Batch"));
+
   printf("USB GPIO initialized!\n");
 }
 
 // Aggregate the abstract status of all devices.
 static usb_status_t usb_status[USB_DEVICES];
 
+// Sequence lock of the status, written by core 1 and read by core 0. The
+// sequence is odd while the status is being updated, and readers retry until
+// they copy it between two identical even sequences. Each change of a port
+// increments the generation, and records it for the port, such that clients
+// can be sent the ports which changed since the generation they know. The
+// generation starts at 1, as 0 stands for clients which know nothing yet.
+static volatile uint32_t status_seq = 0;
+static volatile uint32_t status_generation = 1;
+static uint32_t status_changed_ms = 0;
+static uint32_t status_port_generation[USB_DEVICES];
+
+static void status_write_begin() {
+  status_seq++;
+  __dmb();
+}
+
+static void status_write_end() {
+  __dmb();
+  status_seq++;
+}
+
+// Record the status of a port, between status_write_begin and
+// status_write_end.
+static void store_status(size_t d, usb_status_t status) {
+  if (usb_status[d] == status) {
+    return;
+  }
+  usb_status[d] = status;
+  status_port_generation[d] = ++status_generation;
+  status_changed_ms = to_ms_since_boot(get_absolute_time());
+}
+
+static void set_status(size_t d, usb_status_t status) {
+  status_write_begin();
+  store_status(d, status);
+  status_write_end();
+}
+
 // Index of the active device, if none, then this is equal to USB_DEVICES.
 size_t active_device = USB_DEVICES;
 
+// Incremented by core 1 each time it makes progress, and watched by core 0 to
+// detect when the USB host is stuck. See usb_host_supervise.
+static volatile uint32_t usb_heartbeat = 0;
+
+// Profile of the device connected on the active port, matched when it gets
+// mounted.
+static const device_profile_t* active_profile = NULL;
+
+static void use_device_profile(const device_profile_t* profile) {
+  if (profile == NULL || profile == active_profile) {
+    return;
+  }
+  active_profile = profile;
+  printf("Device profile: %s\n", profile->name);
+}
+
+// Number of images flashed in a row on each device, and number of images
+// already flashed on the active device.
+static uint8_t stage_count = 1;
+static uint8_t stage = 0;
+
+void usb_host_beat() {
+  usb_heartbeat++;
+}
+
 void report_status(usb_status_t st) {
   if (active_device >= USB_DEVICES) {
     return;
   }
   usb_status_t status = usb_status[active_device];
   status = (status & DEVICE_IS_MOUNTED) | st;
-  usb_status[active_device] = status;
+  set_status(active_device, status);
+  port_stats_phase(active_device, st);
   LOG_DEBUG("usb[%d] = %x\n", active_device, status);
 }
 
@@ -134,23 +232,25 @@ void set_mount_status(usb_status_t st, bool set) {
     return;
   }
   if (set) {
-    usb_status[active_device] |= st;
+    set_status(active_device, usb_status[active_device] | st);
   } else {
-    usb_status[active_device] &= ~st;
+    set_status(active_device, usb_status[active_device] & ~st);
   }
   LOG_DEBUG("usb[%d] = %x\n", active_device, usb_status[active_device]);
 }
 
 void reset_status() {
-  usb_status[active_device] = DEVICE_UNKNOWN;
+  set_status(active_device, DEVICE_UNKNOWN);
   LOG_DEBUG("usb[%d] = %x\n", active_device, usb_status[active_device]);
 }
 
 void reset_all_status() {
   // By default we do not know anything about any of the plugged devices.
+  status_write_begin();
   for(size_t d = 0; d < USB_DEVICES; d++) {
-    usb_status[d] = DEVICE_UNKNOWN;
+    store_status(d, DEVICE_UNKNOWN);
   }
+  status_write_end();
   printf("Reset all USB status\n");
 }
 
@@ -161,11 +261,52 @@ usb_status_t get_usb_device_status(size_t d) {
   return usb_status[d];
 }
 
+uint32_t get_usb_status_generation() {
+  return status_generation;
+}
+
+void get_usb_status_snapshot(usb_status_snapshot_t* snapshot) {
+  uint32_t seq;
+  do {
+    while ((seq = status_seq) & 1) {
+      tight_loop_contents();
+    }
+    __dmb();
+    snapshot->generation = status_generation;
+    snapshot->changed_ms = status_changed_ms;
+    for (size_t d = 0; d < USB_DEVICES; d++) {
+      snapshot->status[d] = (uint8_t) usb_status[d];
+      snapshot->port_generation[d] = status_port_generation[d];
+    }
+    __dmb();
+  } while (status_seq != seq);
+}
+
+size_t get_usb_status_changes(const usb_status_snapshot_t* snapshot,
+                              uint32_t since, uint8_t changes[][2]) {
+  // A generation ahead of the snapshot comes from before a reboot.
+  bool all = since == 0 || since > snapshot->generation;
+  size_t count = 0;
+  for (size_t d = 0; d < USB_DEVICES; d++) {
+    if (all || snapshot->port_generation[d] > since) {
+      changes[count][0] = (uint8_t) d;
+      changes[count][1] = snapshot->status[d];
+      count++;
+    }
+  }
+  return count;
+}
+
 usb_status_t get_current_usb_device_status() {
   return get_usb_device_status(active_device);
 }
 
 bool is_status_error() {
+  if (active_device >= USB_DEVICES) {
+    // The device got unselected while a task was pending, such as when core 1
+    // got restarted.
+    return true;
+  }
   return (usb_status[active_device] & 0x10) != 0;
 }
 
@@ -204,6 +345,11 @@ void select_device(size_t device) {
       tuh_task();
     }
 
+    // The device is no longer connected, record the outcome of the port if it
+    // is part of the running job.
+    journal_commit_port(active_device, usb_status[active_device]);
+    port_stats_commit(active_device, usb_status[active_device]);
+
     // Clear all pins used for selecting a device.
     const uint select_mask =
       (1 << PIN_SEL0) |
@@ -216,6 +362,8 @@ void select_device(size_t device) {
   }
 
   active_device = device;
+  active_profile = device_profile_default();
+  stage = 0;
 
   // Connect the power and data pins of the selected device.
   if (active_device < USB_DEVICES) {
@@ -237,9 +385,24 @@ void select_device(size_t device) {
     sleep_ms(1);
     enable_usb_data();
     printf("Select USB device: %d\n", active_device);
+  } else {
+    // The batch is over, save the statistics gathered while flashing it.
+    port_stats_flush();
   }
 }
 
+void set_stage_count_cb(void* arg) {
+  size_t count = (size_t) (uintptr_t) arg;
+  if (count < 1) {
+    count = 1;
+  }
+  if (count > UINT8_MAX) {
+    count = UINT8_MAX;
+  }
+  stage_count = (uint8_t) count;
+  printf("Flash %u images on each device.\n", stage_count);
+}
+
 void clear_usb_status_cb(void* arg) {
   reset_all_status();
 }
@@ -251,6 +414,11 @@ void select_device_cb(void* arg) {
     device = USB_DEVICES;
   }
   select_device(device);
+  if (device < USB_DEVICES) {
+    // Only account for the ports selected by the client, not the ones cycled
+    // through when testing the power at boot.
+    port_stats_begin(device);
+  }
   //led_put(false);
 }
 
@@ -266,6 +434,7 @@ void test_usb_power() {
 void tuh_sleep_ms(size_t wait_ms) {
   absolute_time_t timeout = make_timeout_time_ms(wait_ms);
   while (absolute_time_diff_us(get_absolute_time(), timeout) > 0) {
+    usb_host_beat();
     tuh_task();
   }
 }
@@ -311,7 +480,8 @@ static void wait_for_disk_io(BYTE pdrv)
       break;
     }
 
-    // Watch for USB acknowledgement.
+    // Watch for USB acknowledgement. The loop is bounded by the timeout above.
+    usb_host_beat();
     tuh_task();
   }
 }
@@ -415,6 +585,9 @@ DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
 
 static scsi_inquiry_resp_t inquiry_resp;
 
+// Drive of the active device, used when flashing without any client.
+static uint8_t mounted_drive = 0;
+
 bool inquiry_complete_cb(uint8_t dev_addr,
                          tuh_msc_complete_data_t const* cb_data)
 {
@@ -431,6 +604,8 @@ bool inquiry_complete_cb(uint8_t dev_addr,
   // Print out Vendor ID, Product ID and Rev
   printf("Vendor: %.8s\nProduct: %.16s\nRev: %.4s\n", inquiry_resp.vendor_id,
          inquiry_resp.product_id, inquiry_resp.product_rev);
+  use_device_profile(device_profile_match_inquiry(inquiry_resp.vendor_id,
+                                                  inquiry_resp.product_id));
 
   // Get capacity of device
   uint32_t const block_count = tuh_msc_get_block_count(dev_addr, cbw->lun);
@@ -442,6 +617,7 @@ bool inquiry_complete_cb(uint8_t dev_addr,
 
   // For simplicity: we only mount 1 LUN per device
   uint8_t const drive_num = dev_addr - 1;
+  mounted_drive = drive_num;
   char drive_path[3] = "0:";
   drive_path[0] += drive_num;
 
@@ -465,21 +641,48 @@ bool inquiry_complete_cb(uint8_t dev_addr,
 
 static size_t written_bytes = 0;
 
-void open_file(void* net_arg)
+// Offset of the image received for the opened file, the header of the block
+// being received, and whether the block is dropped as the device does not
+// accept its family.
+static size_t received_bytes = 0;
+static uint8_t header_carry[UF2_HEADER_SIZE];
+static bool block_dropped = false;
+static size_t dropped_blocks = 0;
+
+// Flash sector of the blocks written last.
+static uint32_t written_sector = UINT32_MAX;
+
+// Create the file to be flashed on the mounted drive. Returns false and reports
+// the error status on failure.
+static bool open_image_file(uint8_t drive_num)
 {
   // TODO: We should somehow get the filename across the web server to here, in
   // order to flash files with the proper name. For example, we do not want to
   // be flashing *.py files as *.uf2 files.
-  void *usb_arg = get_postmsg_usb_info(net_arg);
-  uint8_t const drive_num = (uint8_t) (uintptr_t) usb_arg;
   written_bytes = 0;
+  received_bytes = 0;
+  block_dropped = false;
+  dropped_blocks = 0;
+  written_sector = UINT32_MAX;
 
-  char file_path[13] = "0:/image.uf2";
-  file_path[0] += drive_num;
+  char file_path[3 + 12 + 1];
+  snprintf(file_path, sizeof(file_path), "%u:/%s", drive_num,
+           active_profile->file_name);
 
   if (f_open(&file[drive_num], file_path, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
     printf("USB: open_file(%u): failure.\n", (size_t) drive_num);
     report_status(DEVICE_ERROR_FLASH_OPEN);
+    return false;
+  }
+  return true;
+}
+
+void open_file(void* net_arg)
+{
+  void *usb_arg = get_postmsg_usb_info(net_arg);
+  uint8_t const drive_num = (uint8_t) (uintptr_t) usb_arg;
+
+  if (!open_image_file(drive_num)) {
     queue_web_task(&write_error, net_arg);
     return;
   }
@@ -487,26 +690,16 @@ void open_file(void* net_arg)
   queue_web_task(&report_file_opened, net_arg);
 }
 
-// This function writes content provided by the HTTPD stack as a single chunk to
-// be written and free it as soon as the data is written down.
+// Write content to the opened file, for devices whose flash sectors are not
+// known. Returns false and reports the error status on failure.
 //
 // It writes the data in 2 times in order to align the cached content with the
 // content manipulated by the device, and also gives some time to the device to
 // write this content back to the flash either by sleeping or waiting on f_sync
 // completion.
-void write_file_content(void* net_arg)
+static bool write_image_chunks(uint8_t drive_num, const uint8_t* buf, size_t len)
 {
-  void *usb_arg = get_postmsg_usb_info(net_arg);
-  uint8_t const drive_num = (uint8_t) (uintptr_t) usb_arg;
-  uint8_t* buf = get_postmsg_buffer(net_arg);
-  size_t len = get_postmsg_length(net_arg);
   UINT count = len;
-
-  if (is_status_error()) {
-    queue_web_task(&free_postmsg, net_arg);
-    return;
-  }
-
   size_t offset = 0;
 
 #define WRITE_FILE_CONTENT_USE_FSYNC 1
@@ -519,8 +712,9 @@ void write_file_content(void* net_arg)
   // flash of the raspberry Pi Pico devices connected to the UF2 Batch flasher.
   //
   // To avoid triggering a flush of incomplete pages from the buffered f_write
-  // calls. We simply split our calls to f_write based on the chunk_size.
-  const size_t chunk_size = 8 * 1024;
+  // calls. We simply split our calls to f_write based on the chunk_size of the
+  // device profile, which is a power of 2.
+  const size_t chunk_size = active_profile->chunk_size;
   size_t written_next = written_bytes + count;
   size_t chunk_overflow = written_next & (chunk_size - 1);
   if (chunk_overflow < count) {
@@ -536,31 +730,27 @@ void write_file_content(void* net_arg)
     FRESULT res = f_write(&file[drive_num], &buf[offset], align_write, &align_write);
     if (res != FR_OK) {
       printf("USB: write_file_content: write chunk failure (err = %d).\n", res);
-      queue_web_task(&free_postmsg, net_arg);
       report_status(DEVICE_ERROR_FLASH_WRITE);
-      queue_web_task(&write_error, net_arg);
-      return;
+      return false;
     }
     written_bytes += align_write;
     offset += align_write;
 
-    // Conservative estimate of the time needed to flash the QSPI flash.
-# define US_PER_FLASH_SECTOR 32 // = 4096 bytes / 125 MHz
-# ifdef US_PER_FLASH_SECTOR
-    sleep_us(US_PER_FLASH_SECTOR);
-# else
-    // NOTE: f_sync does not seems to work with Raspberry Pi Pico devices. While
-    // this is good for flash drives, this induces write failures later one.
-    LOG_DEBUG("f_sync:\n");
-    res = f_sync(&file[drive_num]);
-    if (res != FR_OK) {
-      printf("USB: write_file_content: sync failure (err = %d).\n", res);
-      queue_web_task(&free_postmsg, net_arg);
-      report_status(DEVICE_ERROR_FLASH_WRITE);
-      queue_web_task(&write_error, net_arg);
-      return;
+    if (active_profile->backend == FLASH_BACKEND_CHUNKED) {
+      // Conservative estimate of the time needed to flash the QSPI flash.
+      sleep_us(active_profile->chunk_delay_us);
+    } else {
+      // NOTE: f_sync does not seems to work with Raspberry Pi Pico devices.
+      // While this is good for flash drives, this induces write failures later
+      // one.
+      LOG_DEBUG("f_sync:\n");
+      res = f_sync(&file[drive_num]);
+      if (res != FR_OK) {
+        printf("USB: write_file_content: sync failure (err = %d).\n", res);
+        report_status(DEVICE_ERROR_FLASH_WRITE);
+        return false;
+      }
     }
-# endif
   }
 #endif
 
@@ -569,19 +759,273 @@ void write_file_content(void* net_arg)
     FRESULT res = f_write(&file[drive_num], &buf[offset], count, &count);
     if (res != FR_OK) {
       printf("USB: write_file_content: write overflow failure (err = %d).\n", res);
-      queue_web_task(&free_postmsg, net_arg);
       report_status(DEVICE_ERROR_FLASH_WRITE);
-      queue_web_task(&write_error, net_arg);
-      return;
+      return false;
     }
     written_bytes += count;
   }
 
+  return true;
+}
+
+// Append content to the opened file. Returns false and reports the error status
+// on failure.
+static bool append_image_data(uint8_t drive_num, const uint8_t* buf, size_t len)
+{
+  if (len == 0) {
+    return true;
+  }
+  if (active_profile->sector_size == 0) {
+    return write_image_chunks(drive_num, buf, len);
+  }
+  UINT count = len;
+  LOG_DEBUG("f_write: %u bytes\n", count);
+  FRESULT res = f_write(&file[drive_num], buf, count, &count);
+  if (res != FR_OK) {
+    printf("USB: write_file_content: write failure (err = %d).\n", res);
+    report_status(DEVICE_ERROR_FLASH_WRITE);
+    return false;
+  }
+  written_bytes += count;
+  return true;
+}
+
+// Give the device time to write the sector which was sent.
+static bool wait_sector_written(uint8_t drive_num)
+{
+  if (active_profile->backend == FLASH_BACKEND_CHUNKED) {
+    sleep_us(active_profile->chunk_delay_us);
+    return true;
+  }
+  LOG_DEBUG("f_sync:\n");
+  FRESULT res = f_sync(&file[drive_num]);
+  if (res != FR_OK) {
+    printf("USB: write_file_content: sync failure (err = %d).\n", res);
+    report_status(DEVICE_ERROR_FLASH_WRITE);
+    return false;
+  }
+  return true;
+}
+
+static uint32_t header_field(const uint8_t* header, size_t offset)
+{
+  uint32_t value;
+  memcpy(&value, &header[offset], sizeof(value));
+  return value;
+}
+
+// Whether the bootloader of the device keeps the block. Blocks without family
+// are kept, as are all blocks when the profile does not list its families.
+static bool accepts_block(const uint8_t* header)
+{
+  const uint32_t* families = active_profile->families;
+  if (families[0] == 0 ||
+      !(header_field(header, offsetof(uf2_block_t, flags)) &
+        UF2_FLAG_FAMILY_ID_PRESENT)) {
+    return true;
+  }
+  const uint32_t family_id = header_field(header, offsetof(uf2_block_t, file_size));
+  for (size_t i = 0; i < DEVICE_PROFILE_MAX_FAMILIES && families[i]; i++) {
+    if (families[i] == family_id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether the block moves to another sector than the blocks written last.
+static bool changes_sector(const uint8_t* header)
+{
+  if (active_profile->sector_size == 0) {
+    return false;
+  }
+  const uint32_t sector =
+    header_field(header, offsetof(uf2_block_t, target_addr)) /
+    active_profile->sector_size;
+  bool changed = written_sector != UINT32_MAX && sector != written_sector;
+  written_sector = sector;
+  return changed;
+}
+
+// Write content to the opened file. Returns false and reports the error status
+// on failure.
+//
+// The bootloaders erase and write the flash one sector at a time, thus the
+// writes are split where the blocks move to another sector, which gives the
+// device time to write the previous one. Clients group the blocks of each
+// sector, such that every sector is written in a single burst.
+//
+// Bundles hold images for several families, and each bootloader ignores the
+// blocks of the families it does not run. These blocks are dropped instead of
+// being written to the device. Each family of a bundle is numbered on its own,
+// thus the remaining blocks need no renumbering.
+//
+// The header of a block split between 2 writes is held until it is complete.
+static bool write_image_data(uint8_t drive_num, const uint8_t* buf, size_t len)
+{
+  if (active_profile->sector_size == 0 && active_profile->families[0] == 0) {
+    return write_image_chunks(drive_num, buf, len);
+  }
+
+  // Bytes from start to i are appended at once.
+  size_t start = 0, i = 0;
+  while (i < len) {
+    const size_t in_block = received_bytes % UF2_BLOCK_SIZE;
+    if (in_block >= UF2_HEADER_SIZE) {
+      size_t count = UF2_BLOCK_SIZE - in_block;
+      if (count > len - i) {
+        count = len - i;
+      }
+      if (block_dropped) {
+        if (!append_image_data(drive_num, &buf[start], i - start)) {
+          return false;
+        }
+        start = i + count;
+      }
+      i += count;
+      received_bytes += count;
+      continue;
+    }
+
+    size_t count = UF2_HEADER_SIZE - in_block;
+    if (count > len - i) {
+      count = len - i;
+    }
+    const size_t header_start = i;
+    const uint8_t* header = &buf[i];
+    const bool split = count < UF2_HEADER_SIZE;
+    if (split) {
+      if (!append_image_data(drive_num, &buf[start], i - start)) {
+        return false;
+      }
+      memcpy(&header_carry[in_block], &buf[i], count);
+      header = header_carry;
+      start = i + count;
+    }
+    i += count;
+    received_bytes += count;
+    if (in_block + count < UF2_HEADER_SIZE) {
+      break;
+    }
+
+    block_dropped = !accepts_block(header);
+    if (block_dropped) {
+      dropped_blocks++;
+      if (!split) {
+        if (!append_image_data(drive_num, &buf[start], header_start - start)) {
+          return false;
+        }
+        start = i;
+      }
+      continue;
+    }
+    if (changes_sector(header)) {
+      if (!split) {
+        if (!append_image_data(drive_num, &buf[start], header_start - start)) {
+          return false;
+        }
+        start = header_start;
+      }
+      if (!wait_sector_written(drive_num)) {
+        return false;
+      }
+    }
+    if (split && !append_image_data(drive_num, header_carry, UF2_HEADER_SIZE)) {
+      return false;
+    }
+  }
+  return append_image_data(drive_num, &buf[start], len - start);
+}
+
+// This function writes content provided by the HTTPD stack as a single chunk to
+// be written and free it as soon as the data is written down.
+void write_file_content(void* net_arg)
+{
+  void *usb_arg = get_postmsg_usb_info(net_arg);
+  uint8_t const drive_num = (uint8_t) (uintptr_t) usb_arg;
+  uint8_t* buf = get_postmsg_buffer(net_arg);
+  size_t len = get_postmsg_length(net_arg);
+
+  if (is_status_error()) {
+    queue_web_task(&free_postmsg, net_arg);
+    return;
+  }
+
+  bool written = write_image_data(drive_num, buf, len);
   queue_web_task(&free_postmsg, net_arg);
+  if (!written) {
+    queue_web_task(&write_error, net_arg);
+    return;
+  }
   LOG_DEBUG("USB: write_file_content: %u bytes (%u total)\n", len, written_bytes);
   printf("USB: write_file_content: %u bytes (%u total)\n", len, written_bytes);
 }
 
+// Number of UF2 blocks rebuilt from the image cache for each write.
+#define CACHE_BLOCKS_PER_WRITE 2
+
+// Write the variant of the image cache acquired for the device to the opened
+// file.
+static bool write_cached_image(uint8_t drive_num)
+{
+  // The stack of core 1 is too small to hold the blocks.
+  static uf2_block_t blocks[CACHE_BLOCKS_PER_WRITE];
+  const size_t image_blocks = image_cache_variant_info()->blocks;
+  patch_values_t values;
+  patch_get_values(&values);
+  for (size_t b = 0; b < image_blocks; b += CACHE_BLOCKS_PER_WRITE) {
+    size_t count = image_blocks - b;
+    if (count > CACHE_BLOCKS_PER_WRITE) {
+      count = CACHE_BLOCKS_PER_WRITE;
+    }
+    for (size_t i = 0; i < count; i++) {
+      image_cache_build_block(b + i, &values, &blocks[i]);
+    }
+    if (!write_image_data(drive_num, (const uint8_t*) blocks,
+                          count * UF2_BLOCK_SIZE)) {
+      return false;
+    }
+  }
+  printf("USB: %u cached blocks written.\n", image_blocks);
+  return true;
+}
+
+void flash_from_cache(void* net_arg)
+{
+  void *usb_arg = get_postmsg_usb_info(net_arg);
+  uint8_t const drive_num = (uint8_t) (uintptr_t) usb_arg;
+
+  if (is_status_error()) {
+    queue_web_task(&write_error, net_arg);
+    return;
+  }
+
+  // Prevent the network core from loading another image while this one is
+  // being written.
+  if (!image_cache_acquire((uint8_t) active_device)) {
+    printf("USB: flash_from_cache: no cached image.\n");
+    report_status(DEVICE_ERROR_FLASH_OPEN);
+    queue_web_task(&write_error, net_arg);
+    return;
+  }
+
+  if (!open_image_file(drive_num)) {
+    image_cache_release();
+    queue_web_task(&write_error, net_arg);
+    return;
+  }
+  queue_web_task(&report_file_opened, net_arg);
+
+  bool written = write_cached_image(drive_num);
+  image_cache_release();
+  if (!written) {
+    queue_web_task(&write_error, net_arg);
+    return;
+  }
+
+  close_file(net_arg);
+}
+
 // This function takes over the USB core, and move content from the pipe to the
 // created file. Adding a new usb task will kill this streaming process unless
 // there is still some data to be written.
@@ -595,6 +1039,7 @@ void stream_file_content(void* arg)
 
   while(true) {
     // TinyUSB Host tasks.
+    usb_host_beat();
     tuh_task();
 
     // Write file content.
@@ -646,29 +1091,45 @@ void stream_file_content(void* arg)
   printf("USB: stream_file_content: %u bytes written.\n", total);
 }
 
-void close_file(void* net_arg)
+// Flush and close the written file, and move the active device to its next
+// stage. Returns false and reports the error status on failure.
+static bool close_image_file(uint8_t drive_num)
 {
-  if (is_status_error()) {
-    return;
+  // The end of a truncated image.
+  const size_t in_block = received_bytes % UF2_BLOCK_SIZE;
+  if (in_block && in_block < UF2_HEADER_SIZE) {
+    append_image_data(drive_num, header_carry, in_block);
+  }
+  if (dropped_blocks) {
+    printf("USB: close_file: %u blocks of other families dropped.\n",
+           dropped_blocks);
   }
-
-  void *usb_arg = get_postmsg_usb_info(net_arg);
-  uint8_t const drive_num = (uint8_t) (uintptr_t) usb_arg;
 
   LOG_DEBUG("f_sync:\n");
   if (f_sync(&file[drive_num]) != FR_OK) {
     printf("USB: close_file: sync failure.\n");
     report_status(DEVICE_ERROR_FLASH_CLOSE);
-    queue_web_task(&write_error, net_arg);
-    return;
+    return false;
   }
 
   LOG_DEBUG("f_close:\n");
   if (f_close(&file[drive_num]) != FR_OK) {
     printf("USB: close_file: close failure.\n");
     report_status(DEVICE_ERROR_FLASH_CLOSE);
-    queue_web_task(&write_error, net_arg);
-    return;
+    return false;
+  }
+
+  stage++;
+  if (stage < stage_count) {
+    printf("USB: close_file: Stage %u/%u complete. (%u bytes written)\n",
+           stage, stage_count, written_bytes);
+
+    // The device reboots once the image is written, either in its bootloader
+    // or in the flashed program. Re-arm the port such that the mount callbacks
+    // switch it to BOOTSEL mode again and request the next image, without
+    // unselecting the port.
+    report_status(DEVICE_SELECTED);
+    return true;
   }
 
   printf("USB: close_file: Flashing complete. (%u bytes written)\n",
@@ -677,6 +1138,26 @@ void close_file(void* net_arg)
   // Once flashing is complete, the device might automatically reboot, and
   // listen to CDC once more.
   report_status(DEVICE_FLASH_COMPLETE);
+  return true;
+}
+
+void close_file(void* net_arg)
+{
+  if (is_status_error()) {
+    // The error is already reported by the status of the device. Acknowledge
+    // the end of the transfer such that the client can move to the next
+    // device.
+    queue_web_task(&report_file_closed, net_arg);
+    return;
+  }
+
+  void *usb_arg = get_postmsg_usb_info(net_arg);
+  uint8_t const drive_num = (uint8_t) (uintptr_t) usb_arg;
+
+  if (!close_image_file(drive_num)) {
+    queue_web_task(&write_error, net_arg);
+    return;
+  }
   queue_web_task(&report_file_closed, net_arg);
 }
 
@@ -722,7 +1203,7 @@ void force_unmount_cdc(void* arg) {
   (void) arg;
 
   // Wait before disabling the data lines.
-  tuh_sleep_ms(50);
+  tuh_sleep_ms(active_profile->cdc_unmount_ms);
 
   // Disable data pins, and reenable data pins once the cdc_umount callback is
   // registered. Disabling is used to work-around an issue where the host
@@ -739,11 +1220,24 @@ void force_unmount_cdc(void* arg) {
 
 void select_bootsel(void* arg) {
   uint8_t idx = (uint8_t) (uintptr_t) arg;
+
+  // The CDC interface is mounted before the device as a whole, thus match the
+  // profile here as tuh_mount_cb might not have been called yet.
+  tuh_itf_info_t info;
+  uint16_t vid, pid;
+  if (tuh_cdc_itf_get_info(idx, &info) &&
+      tuh_vid_pid_get(info.daddr, &vid, &pid)) {
+    use_device_profile(device_profile_match_usb(vid, pid));
+  }
+  if (active_profile->bootsel == BOOTSEL_NONE) {
+    printf("No BOOTSEL method for %s devices (%u)\n", active_profile->name, idx);
+    return;
+  }
   report_status(DEVICE_BOOTSEL_REQUEST);
 
   // Give a bit of time to the powered device to be able to fully setup the
   // baud-rate watcher.
-  tuh_sleep_ms(250);
+  tuh_sleep_ms(active_profile->bootsel_settle_ms);
 
   // If reached, then set the baud rate such that if this is a Raspberry PI Pico
   // (RP2040), then the switch of the baud rate will reset the board in bootset
@@ -773,7 +1267,7 @@ void restore_usb_data(void* arg) {
   // the device is in the process of rebooting and that it might not yet answer
   // correctly to TinyUSB requests. Thus we wait a bit before restoring the data
   // lines.
-  tuh_sleep_ms(250);
+  tuh_sleep_ms(active_profile->reconnect_ms);
 
   printf("Re-enable data connection.\n");
   enable_usb_data();
@@ -784,8 +1278,9 @@ void tuh_cdc_mount_cb(uint8_t idx)
   printf("tuh_cdc_mount_cb: %u\n", idx);
   set_mount_status(DEVICE_CDC_MOUNTED, true);
 
-  // Only switch to BOOTSEL mode if the device has been selected recently, not
-  // not if the device rebooted after being flashed.
+  // Only switch to BOOTSEL mode if the device has been selected recently, or
+  // is waiting for its next image, not if the device rebooted after being
+  // flashed.
   if ((get_current_usb_device_status() & 0x1f) == DEVICE_SELECTED) {
     queue_usb_task(&select_bootsel, (void*) (uintptr_t) idx);
   }
@@ -809,8 +1304,12 @@ void tuh_mount_cb(uint8_t dev_addr)
 
   // TODO: Turn on the notification LED from the Raspberry PI Pico.
 
-  // TODO: Query information about the connected device.
-  //tuh_descriptor_get_device(daddr, &desc_device, 18, print_device_descriptor, 0);
+  // Select the timings and strategies based on the device descriptor.
+  uint16_t vid, pid;
+  if (tuh_vid_pid_get(dev_addr, &vid, &pid)) {
+    printf("Device %04x:%04x\n", vid, pid);
+    use_device_profile(device_profile_match_usb(vid, pid));
+  }
 }
 
 // The device dev_addr is now unplugged.
@@ -823,13 +1322,189 @@ void tuh_umount_cb(uint8_t dev_addr)
   // TODO: Turn off the notification LED from the Raspberry PI Pico.
 }
 
+//---------------------------------------------------------------------
+// Standalone batch
+//
+// Flash the image held by the image cache on every port, without any client,
+// in the order scheduled by the statistics of the ports. The batch is started
+// by the batch button or by the network, and is stepped by the USB host loop
+// between TinyUSB tasks.
+
+// Time the button has to be held to start a batch.
+#define BATCH_BUTTON_DEBOUNCE_MS 50
+
+// Time given to a port to switch to BOOTSEL mode, on top of the scheduled time
+// to get mounted once in BOOTSEL mode.
+#define BATCH_BOOTSEL_TIMEOUT_MS 5000
+
+static struct {
+  volatile bool running;
+  // Whether the batch resumes the job recorded by the journal, in which case
+  // the ports already flashed are skipped.
+  bool resume;
+  port_schedule_t schedule[USB_DEVICES];
+  size_t count;
+  size_t next;
+  absolute_time_t deadline;
+} batch;
+
+static void batch_start(uint8_t first_port, uint8_t last_port) {
+  if (batch.running) {
+    printf("Batch: Already running.\n");
+    return;
+  }
+  if (last_port >= USB_DEVICES) {
+    last_port = USB_DEVICES - 1;
+  }
+  image_cache_info_t info;
+  image_cache_get_info(&info);
+  if (info.state != IMAGE_CACHE_READY) {
+    printf("Batch: No image to flash.\n");
+    return;
+  }
+
+  job_info_t job;
+  journal_get_job(&job);
+  batch.resume =
+    job.state == JOB_RUNNING &&
+    job.first_port == first_port && job.last_port == last_port &&
+    job.image_size == info.size && job.image_crc == info.crc;
+  journal_start_job(first_port, last_port, info.size, info.crc);
+
+  batch.count = port_stats_schedule(first_port, last_port, batch.schedule);
+  batch.next = 0;
+  batch.running = true;
+
+  // Each port is flashed once with the cached image.
+  stage_count = 1;
+  printf("Batch: Flash ports %u-%u.\n", first_port, last_port);
+}
+
+void run_batch_cb(void* arg) {
+  uintptr_t ports = (uintptr_t) arg;
+  batch_start(ports & 0xff, (ports >> 8) & 0xff);
+}
+
+bool is_batch_running() {
+  return batch.running;
+}
+
+static void batch_poll_button() {
+  static bool held = false;
+  static bool handled = false;
+  static absolute_time_t held_since;
+
+  if (gpio_get(PIN_BATCH_BUTTON)) {
+    held = false;
+    return;
+  }
+  if (!held) {
+    held = true;
+    handled = false;
+    held_since = get_absolute_time();
+    return;
+  }
+  if (handled ||
+      absolute_time_diff_us(held_since, get_absolute_time()) <
+      BATCH_BUTTON_DEBOUNCE_MS * 1000) {
+    return;
+  }
+  handled = true;
+  batch_start(0, USB_DEVICES - 1);
+}
+
+// Select the next port of the schedule, or unselect the last one once the
+// batch is complete.
+static void batch_next_port() {
+  while (batch.next < batch.count) {
+    const port_schedule_t* entry = &batch.schedule[batch.next++];
+    if (entry->parked) {
+      printf("Batch: Skip parked port %u.\n", entry->port);
+      continue;
+    }
+    if (!image_cache_covers_port(entry->port)) {
+      printf("Batch: Skip port %u, which has no variant.\n", entry->port);
+      continue;
+    }
+    if (batch.resume &&
+        journal_port_outcome(entry->port) == DEVICE_FLASH_COMPLETE) {
+      continue;
+    }
+    select_device_cb((void*) (uintptr_t) entry->port);
+    batch.deadline =
+      make_timeout_time_ms(BATCH_BOOTSEL_TIMEOUT_MS + entry->timeout_ms);
+    return;
+  }
+
+  select_device(USB_DEVICES);
+  batch.running = false;
+  // The parked ports and the ports without a variant have no outcome.
+  journal_complete_job();
+
+  size_t flashed = 0;
+  for (size_t i = 0; i < batch.count; i++) {
+    usb_status_t status = usb_status[batch.schedule[i].port];
+    if ((status & ~DEVICE_IS_MOUNTED) == DEVICE_FLASH_COMPLETE) {
+      flashed++;
+    }
+  }
+  printf("Batch: Complete, %u/%u ports flashed.\n", flashed, batch.count);
+}
+
+// Open the file, write the cached image and close the file on the mounted
+// drive of the active device, reporting the outcome in its status.
+static void flash_cached_image() {
+  patch_next_device(active_device);
+  if (!image_cache_acquire((uint8_t) active_device)) {
+    printf("Batch: No cached image.\n");
+    report_status(DEVICE_ERROR_FLASH_OPEN);
+    return;
+  }
+  bool written =
+    open_image_file(mounted_drive) && write_cached_image(mounted_drive);
+  image_cache_release();
+  if (written) {
+    close_image_file(mounted_drive);
+  }
+}
+
+static void batch_step() {
+  batch_poll_button();
+  if (!batch.running) {
+    return;
+  }
+  if (active_device >= USB_DEVICES) {
+    batch_next_port();
+    return;
+  }
+
+  usb_status_t status = get_current_usb_device_status() & ~DEVICE_IS_MOUNTED;
+  if (status == DEVICE_FLASH_REQUEST) {
+    flash_cached_image();
+    status = get_current_usb_device_status() & ~DEVICE_IS_MOUNTED;
+  }
+  if (status == DEVICE_FLASH_COMPLETE || (status & DEVICE_IS_ERROR)) {
+    batch_next_port();
+    return;
+  }
+  if (time_reached(batch.deadline)) {
+    printf("Batch: Port %u timed out.\n", active_device);
+    batch_next_port();
+  }
+}
+
 void usb_host_loop() {
   while(true) {
+    usb_host_beat();
+
     // TinyUSB Host tasks.
     tuh_task();
 
     // Task requested by the web server.
     exec_usb_task();
+
+    // Flash without any client.
+    batch_step();
   }
 }
 
@@ -838,14 +1513,47 @@ void usb_host_loop() {
 // aliased.
 static semaphore_t usb_host_initialized;
 
+// Configuration of the PIO USB port. The alarm pool which is used to generate
+// the USB frames is owned by us, such that it can be released if core 1 has to
+// be reset.
+static pio_usb_configuration_t pio_cfg = PIO_USB_DEFAULT_CONFIG;
+static alarm_pool_t* usb_alarm_pool = NULL;
+#define PIO_USB_ALARM_NUM 2
+
+// Port which was selected when core 1 got reset, to be recorded as failed once
+// core 1 is restarted.
+static size_t recovered_device = USB_DEVICES;
+
+static bool usb_host_configure() {
+  // The alarm pool has to be created on core 1, as the USB frames have to be
+  // generated by the core which handles the USB host.
+  usb_alarm_pool = alarm_pool_create(PIO_USB_ALARM_NUM, 1);
+  pio_cfg.alarm_pool = usb_alarm_pool;
+  return tuh_configure(BOARD_TUH_RHPORT, TUH_CFGID_RPI_PIO_USB_CONFIGURATION, &pio_cfg);
+}
+
 void usb_host_main() {
+  flash_region_init_core();
+  active_profile = device_profile_default();
   usb_gpio_init();
   reset_all_status();
   test_usb_power();
   sleep_ms(10);
 
+  // Restore the outcome of the ports recorded by an interrupted job, such that
+  // clients resuming the job can see which ports are already flashed. Ports of
+  // a completed job are reported as unknown, as after any other reboot.
+  job_info_t last_job;
+  journal_get_job(&last_job);
+  if (last_job.state == JOB_RUNNING) {
+    status_write_begin();
+    for (size_t d = 0; d < USB_DEVICES; d++) {
+      store_status(d, journal_port_outcome(d));
+    }
+    status_write_end();
+  }
+
   bi_decl_if_func_used(bi_program_feature("USB host"));
-  pio_usb_configuration_t pio_cfg = PIO_USB_DEFAULT_CONFIG;
   // NOTE: PIO_USB_DEFAULT_CONFIGURATION uses PIO_USB_DP_PIN_DEFAULT which
   // coincidentally happen to be the same as PIN_USB_DP, but we keep the
   // following line in case we want to setup a different pin.
@@ -853,7 +1561,7 @@ void usb_host_main() {
   bi_decl_if_func_used(bi_2pins_with_names(PIN_USB_DP, "USB Host D+", PIN_USB_DM, "USB Host D-"));
 
   // Initialize TinyUSB Host stack.
-  if (!tuh_configure(BOARD_TUH_RHPORT, TUH_CFGID_RPI_PIO_USB_CONFIGURATION, &pio_cfg)) {
+  if (!usb_host_configure()) {
     printf("TinyUSB failed to configure PIO USB port.\n");
     return;
   }
@@ -870,6 +1578,141 @@ void usb_host_main() {
   usb_host_loop();
 }
 
+// Entry point of core 1 after it got reset by usb_host_supervise. TinyUSB
+// software state is kept as is, only the host controller is restarted. The
+// device which was selected is now powered off, and TinyUSB would notice its
+// removal from the USB frames.
+static void usb_host_restart() {
+  flash_region_init_core();
+
+  if (!usb_host_configure()) {
+    printf("TinyUSB failed to reconfigure PIO USB port.\n");
+    return;
+  }
+  hcd_init(BOARD_TUH_RHPORT);
+  hcd_int_enable(BOARD_TUH_RHPORT);
+  printf("TinyUSB Host port restarted.\n");
+
+  journal_commit_port(recovered_device, DEVICE_ERROR_USB_HANG);
+  port_stats_commit(recovered_device, DEVICE_ERROR_USB_HANG);
+  recovered_device = USB_DEVICES;
+
+  usb_host_loop();
+}
+
+// Release the PIO state machines, programs and DMA channel claimed by the PIO
+// USB port, as well as our alarm pool, such that they can be claimed again by
+// usb_host_restart.
+static void usb_host_release_pio() {
+  pio_port_t* pp = &pio_port[0];
+  pio_sm_set_enabled(pp->pio_usb_tx, pp->sm_tx, false);
+  pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_rx, false);
+  pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_eop, false);
+  pio_remove_program(pp->pio_usb_tx, &usb_tx_dpdm_program, pp->offset_tx);
+  pio_remove_program(pp->pio_usb_rx, &usb_nrzi_decoder_program, pp->offset_rx);
+  pio_remove_program(pp->pio_usb_rx, &usb_edge_detector_program, pp->offset_eop);
+  if (pio_sm_is_claimed(pp->pio_usb_tx, pp->sm_tx)) {
+    pio_sm_unclaim(pp->pio_usb_tx, pp->sm_tx);
+  }
+  if (pio_sm_is_claimed(pp->pio_usb_rx, pp->sm_rx)) {
+    pio_sm_unclaim(pp->pio_usb_rx, pp->sm_rx);
+  }
+  if (pio_sm_is_claimed(pp->pio_usb_rx, pp->sm_eop)) {
+    pio_sm_unclaim(pp->pio_usb_rx, pp->sm_eop);
+  }
+
+  dma_channel_abort(pp->tx_ch);
+  if (dma_channel_is_claimed(pp->tx_ch)) {
+    dma_channel_unclaim(pp->tx_ch);
+  }
+
+  if (usb_alarm_pool) {
+    alarm_pool_destroy(usb_alarm_pool);
+    usb_alarm_pool = NULL;
+  }
+}
+
+// Release the hardware spin locks which core 1 held when it got reset, such as
+// the ones of the mutexes and queues shared with core 0. Core 0 holds none of
+// them while supervising core 1 from its main loop.
+static void release_core1_spin_locks() {
+  for (uint i = 0; i < NUM_SPIN_LOCKS; i++) {
+    spin_lock_t* lock = spin_lock_instance(i);
+    if (is_spin_locked(lock)) {
+      spin_unlock_unsafe(lock);
+    }
+  }
+}
+
+// Reset core 1 and restart the USB host. Only the selected device is lost, the
+// network session on core 0 is kept alive and the client moves on to the next
+// device as soon as it sees the error status.
+static void usb_host_recover() {
+  size_t device = active_device;
+  printf("USB host on core 1 is not responding, restart it (device: %d).\n",
+         device);
+
+  // Core 1 might be stopped within a critical section, then the spin lock it
+  // held is released, and the mutexes it owned are initialized again.
+  multicore_reset_core1();
+  release_core1_spin_locks();
+  pipes_recover_core1();
+  journal_recover_core1();
+  port_stats_recover_core1();
+  image_cache_recover_core1();
+  image_store_recover_core1();
+  patch_recover_core1();
+  // Complete the update of the status interrupted by the reset, such that the
+  // readers do not wait for it.
+  if (status_seq & 1) {
+    status_write_end();
+  }
+
+  // Disconnect the device which was being flashed and mark it as failed.
+  disable_usb_data();
+  disable_usb_power();
+  const uint select_mask =
+    (1 << PIN_SEL0) |
+    (1 << PIN_SEL1) |
+    (1 << PIN_SEL2) |
+    (1 << PIN_SEL3) |
+    (1 << PIN_SEL4) |
+    (1 << PIN_SEL5);
+  gpio_clr_mask(select_mask);
+  if (device < USB_DEVICES) {
+    set_status(device, DEVICE_ERROR_USB_HANG);
+  }
+  active_device = USB_DEVICES;
+  recovered_device = device;
+
+  usb_host_release_pio();
+  multicore_launch_core1(usb_host_restart);
+}
+
+// Time without progress after which core 1 is considered to be stuck. This is
+// larger than any of the timeouts used while waiting on devices.
+#define USB_HOST_HANG_TIMEOUT_MS 5000
+
+void usb_host_supervise() {
+  static uint32_t last_beat = 0;
+  static absolute_time_t deadline;
+  static bool started = false;
+
+  uint32_t beat = usb_heartbeat;
+  if (!started || beat != last_beat) {
+    started = true;
+    last_beat = beat;
+    deadline = make_timeout_time_ms(USB_HOST_HANG_TIMEOUT_MS);
+    return;
+  }
+  if (!time_reached(deadline)) {
+    return;
+  }
+
+  usb_host_recover();
+  deadline = make_timeout_time_ms(USB_HOST_HANG_TIMEOUT_MS);
+}
+
 void usb_host_setup() {
   sem_init(&usb_host_initialized, 0, 1);
 
@@ -2,6 +2,7 @@
 #define USB_HOST_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define USB_DEVICES 64
@@ -39,6 +40,10 @@ typedef enum {
   // terminated properly with DEVICE_FLASH_COMPLETE.
   DEVICE_DISCONNECTED,
 
+  // Set when the USB host stopped making progress while the device was
+  // selected, and had to be restarted.
+  DEVICE_ERROR_USB_HANG,
+
   // Bit flags.
   DEVICE_IS_ERROR = 0x10,
   DEVICE_TUH_MOUNTED = 0x20,
@@ -50,6 +55,30 @@ typedef enum {
 
 usb_status_t get_usb_device_status(size_t d);
 
+// Consistent copy of the status of all ports, published by the USB core.
+typedef struct {
+  // Incremented on each change of the status of a port.
+  uint32_t generation;
+  // Time of the last change, in ms since boot.
+  uint32_t changed_ms;
+  uint8_t status[USB_DEVICES];
+  // Generation of the last change of each port.
+  uint32_t port_generation[USB_DEVICES];
+} usb_status_snapshot_t;
+
+// Generation of the status, which is cheap to compare with the generation of
+// the last snapshot to skip unchanged status.
+uint32_t get_usb_status_generation();
+
+// Copy the status of all ports, as published by the USB core, from any core.
+void get_usb_status_snapshot(usb_status_snapshot_t* snapshot);
+
+// Fill changes with the (port, status) pairs which changed after the given
+// generation, or with all ports for the generation 0 or a generation unknown
+// to the snapshot. Returns the number of pairs, at most USB_DEVICES.
+size_t get_usb_status_changes(const usb_status_snapshot_t* snapshot,
+                              uint32_t since, uint8_t changes[][2]);
+
 // Clear all recorded status in order to start on a fresh ground.
 void clear_usb_status_cb(void* arg);
 
@@ -58,10 +87,33 @@ void clear_usb_status_cb(void* arg);
 // device.
 void select_device_cb(void* arg);
 
+// Given an uintptr_t as argument, set the number of images flashed in a row on
+// each selected device. Once an image which is not the last one is written, the
+// device is expected to reboot, and is switched to BOOTSEL mode again to
+// request the next image.
+void set_stage_count_cb(void* arg);
+
+// Given an uintptr_t as argument, holding the first port in its low byte and
+// the last port in the next byte, flash the cached image on these ports without
+// any client. A batch over all ports is also started by the batch button.
+void run_batch_cb(void* arg);
+
+// Whether a batch started by run_batch_cb or by the batch button is running.
+bool is_batch_running();
+
 // This function will setup the USB device based on pio pins and would block the
 // thread it is spawned on.
 void usb_host_setup();
 
+// Check that the USB host on core 1 is still making progress. If not, reset
+// core 1, mark the selected device as failed and restart the USB host. This is
+// executed periodically by the main loop of core 0.
+void usb_host_supervise();
+
+// Report progress of long tasks executed by the USB core outside of the USB
+// host loop, such that usb_host_supervise does not restart it.
+void usb_host_beat();
+
 void usb_copy_file_chunk(const uint8_t* buf, size_t len);
 
 // -------------------------------------------------------------------
@@ -77,4 +129,8 @@ void stream_file_content(void*);
 // Close the file once the flash request is ended.
 void close_file(void*);
 
+// Open the file, write the image held by the image cache and close the file,
+// reporting the same events as open_file and close_file.
+void flash_from_cache(void*);
+
 #endif // !USB_HOST_H
@@ -5,6 +5,15 @@
 
 // Handle TCP and HTTP stacks.
 #include "lwip/apps/httpd.h"
+#include "lwip/def.h" // lwip_strnstr
+#include "lwip/tcp.h"
+#include "lwip/priv/tcp_priv.h" // tcp_active_pcbs
+
+// Messages of the binary protocol carried by the WebSocket.
+#include "tcp_server.h"
+
+// SHA-1 of the WebSocket handshake.
+#include "checksum.h"
 
 // Handle Wifi network setup.
 #include "pico/cyw43_arch.h"
@@ -18,6 +27,26 @@
 // Collect references to callback tasks.
 #include "usb_host.h"
 
+// Record jobs to resume them after a reboot, and the reliability of ports.
+#include "journal.h"
+#include "port_stats.h"
+
+// Image uploaded once and flashed on every device, and saved in the flash.
+#include "image_cache.h"
+#include "image_store.h"
+
+// Values written in the image for each device.
+#include "patch.h"
+
+// Images compressed by the client.
+#include "decompress.h"
+
+// Raw binaries framed in UF2 blocks by the board.
+#include "uf2_frame.h"
+
+// Reject corrupted images before they are written to the devices.
+#include "uf2_check.h"
+
 // Some debugging
 #include "input.h"
 
@@ -26,6 +55,9 @@
 // ---------------------------------------------------------
 //  Dynamically Processed Content (CGI / GET request)
 
+// Port selected by the client, whose values are patched in the image.
+static size_t selected_device = 0;
+
 // Handle GET query, by giving the ?aaa=bb parameters as an array of params and
 // values strings.
 const char *select_cgi(int index, int num_params, char *params[], char *values[]) {
@@ -37,11 +69,22 @@ const char *select_cgi(int index, int num_params, char *params[], char *values[]
       intptr_t idx = (intptr_t) atoi(value);
       if (idx >= 0) {
         printf("Queue USB select_device: %u\n", idx);
+        selected_device = (size_t) idx;
         queue_usb_task(&select_device_cb, (void*) idx);
       } else {
         printf("Queue reset all USB status\n");
         queue_usb_task(&clear_usb_status_cb, (void*) 0);
       }
+    } else if (strcmp(param, "stages") == 0) {
+      // Number of images flashed in a row on each device.
+      uintptr_t count = (uintptr_t) atoi(value);
+      printf("Queue USB set_stage_count: %u\n", count);
+      queue_usb_task(&set_stage_count_cb, (void*) count);
+    } else if (strcmp(param, "family") == 0) {
+      // Family ID expected in the next images, or 0 for any.
+      uint32_t family_id = (uint32_t) strtoul(value, NULL, 0);
+      printf("Expect the family 0x%08lx.\n", family_id);
+      uf2_check_set_family(family_id);
     }
   }
   return "/status.json";
@@ -71,11 +114,203 @@ const char *reboot_cgi(int index, int num_params, char *params[], char *values[]
   return "/status.json";
 }
 
+// Record the job in the journal, given the range of ports and the size and
+// CRC-32 of the image to be flashed.
+const char *job_cgi(int index, int num_params, char *params[], char *values[]) {
+  uint8_t first_port = 0;
+  uint8_t last_port = USB_DEVICES - 1;
+  uint32_t image_size = 0;
+  uint32_t image_crc = 0;
+  for (int p = 0; p < num_params; p++) {
+    const char *param = params[p];
+    const char *value = values[p];
+    if (strcmp(param, "first") == 0) {
+      first_port = (uint8_t) atoi(value);
+    } else if (strcmp(param, "last") == 0) {
+      last_port = (uint8_t) atoi(value);
+    } else if (strcmp(param, "size") == 0) {
+      image_size = (uint32_t) strtoul(value, NULL, 10);
+    } else if (strcmp(param, "crc") == 0) {
+      image_crc = (uint32_t) strtoul(value, NULL, 10);
+    }
+  }
+  printf("Queue start job: ports %u-%u\n", first_port, last_port);
+  journal_start_job(first_port, last_port, image_size, image_crc);
+  return "/job.json";
+}
+
+// Reset the statistics of a port once it has been serviced, or of all ports if
+// no port is given.
+const char *ports_cgi(int index, int num_params, char *params[], char *values[]) {
+  for (int p = 0; p < num_params; p++) {
+    const char *param = params[p];
+    const char *value = values[p];
+    if (strcmp(param, "reset") == 0) {
+      int port = atoi(value);
+      if (port < 0) {
+        port = USB_DEVICES;
+      }
+      printf("Queue reset port statistics: %d\n", port);
+      port_stats_reset((size_t) port);
+    }
+  }
+  return "/ports.json";
+}
+
+// Generation of the status known by the client, whose changes are listed by
+// changes.json.
+static uint32_t status_since = 0;
+
+// Answer with the ports whose status changed after the given generation,
+// such that clients polling the status only get what changed.
+const char *status_cgi(int index, int num_params, char *params[], char *values[]) {
+  status_since = 0;
+  for (int p = 0; p < num_params; p++) {
+    if (strcmp(params[p], "since") == 0) {
+      status_since = (uint32_t) strtoul(values[p], NULL, 10);
+    }
+  }
+  return "/changes.json";
+}
+
+// Forward declaration, as the USB context is given with the POST requests.
+static void* current_usb_context;
+
+// Drive the image cache: start loading an image given its size and CRC-32, or
+// another variant of it with variant=1, which is then uploaded with a POST
+// request to /cache, end loading it with the offsets to patch with the index of
+// the device, map ranges of ports to variants with map=first:last:variant, or
+// flash it on the selected device.
+const char *cache_cgi(int index, int num_params, char *params[], char *values[]) {
+  uint32_t image_size = 0;
+  uint32_t image_crc = 0;
+  bool begin = false, variant = false, end = false, flash = false;
+  uint32_t patches[IMAGE_CACHE_PATCHES];
+  size_t patch_count = 0;
+  image_manifest_entry_t manifest[IMAGE_CACHE_MANIFEST_SIZE];
+  size_t manifest_count = 0;
+  bool map = false;
+  for (int p = 0; p < num_params; p++) {
+    const char *param = params[p];
+    const char *value = values[p];
+    if (strcmp(param, "size") == 0) {
+      image_size = (uint32_t) strtoul(value, NULL, 10);
+      begin = true;
+    } else if (strcmp(param, "crc") == 0) {
+      image_crc = (uint32_t) strtoul(value, NULL, 10);
+    } else if (strcmp(param, "patch") == 0) {
+      if (patch_count < IMAGE_CACHE_PATCHES) {
+        patches[patch_count++] = (uint32_t) strtoul(value, NULL, 10);
+      }
+    } else if (strcmp(param, "variant") == 0) {
+      variant = atoi(value) != 0;
+    } else if (strcmp(param, "map") == 0) {
+      map = true;
+      if (manifest_count < IMAGE_CACHE_MANIFEST_SIZE) {
+        char *end;
+        image_manifest_entry_t *entry = &manifest[manifest_count++];
+        entry->first_port = (uint8_t) strtoul(value, &end, 10);
+        entry->last_port = (uint8_t) strtoul(*end ? end + 1 : end, &end, 10);
+        entry->variant = (uint8_t) strtoul(*end ? end + 1 : end, &end, 10);
+        entry->reserved = 0;
+      }
+    } else if (strcmp(param, "end") == 0) {
+      end = true;
+    } else if (strcmp(param, "flash") == 0) {
+      flash = true;
+    }
+  }
+  if (begin && variant) {
+    printf("Image cache: loading a variant of %lu bytes.\n", image_size);
+    image_cache_begin_variant(image_size, image_crc);
+  } else if (begin) {
+    printf("Image cache: loading %lu bytes.\n", image_size);
+    image_cache_begin(image_size, image_crc);
+  }
+  if (end) {
+    image_cache_end(patches, patch_count);
+  }
+  if (map) {
+    image_cache_set_manifest(manifest, manifest_count);
+  }
+  if (flash) {
+    printf("Queue USB flash_from_cache\n");
+    patch_next_device(selected_device);
+    queue_usb_task(&flash_from_cache, current_usb_context);
+  }
+  return "/cache.json";
+}
+
+// Save the cached image in the flash, load a stored image given its hash in
+// hexadecimal, or the latest one if the hash is 0, or flash the cached image on
+// a range of ports without any client.
+const char *store_cgi(int index, int num_params, char *params[], char *values[]) {
+  uint8_t first_port = 0;
+  uint8_t last_port = USB_DEVICES - 1;
+  bool run = false;
+  for (int p = 0; p < num_params; p++) {
+    const char *param = params[p];
+    const char *value = values[p];
+    if (strcmp(param, "save") == 0) {
+      printf("Queue image store save.\n");
+      image_store_save();
+    } else if (strcmp(param, "load") == 0) {
+      image_store_load(strtoull(value, NULL, 16));
+    } else if (strcmp(param, "first") == 0) {
+      first_port = (uint8_t) atoi(value);
+    } else if (strcmp(param, "last") == 0) {
+      last_port = (uint8_t) atoi(value);
+    } else if (strcmp(param, "run") == 0) {
+      run = true;
+    }
+  }
+  if (run) {
+    printf("Queue batch: ports %u-%u\n", first_port, last_port);
+    uintptr_t ports = first_port | ((uintptr_t) last_port << 8);
+    queue_usb_task(&run_batch_cb, (void*) ports);
+  }
+  return "/store.json";
+}
+
+// Set the table of values written by the board in the images for each device,
+// given the first serial number, the time of the batch and each patch as
+// `offset:kind:size`.
+const char *patch_cgi(int index, int num_params, char *params[], char *values[]) {
+  uint32_t serial_base = 0;
+  uint32_t timestamp = 0;
+  patch_t patches[PATCH_TABLE_SIZE];
+  size_t count = 0;
+  for (int p = 0; p < num_params; p++) {
+    const char *param = params[p];
+    const char *value = values[p];
+    if (strcmp(param, "serial") == 0) {
+      serial_base = (uint32_t) strtoul(value, NULL, 10);
+    } else if (strcmp(param, "time") == 0) {
+      timestamp = (uint32_t) strtoul(value, NULL, 10);
+    } else if (strcmp(param, "p") == 0 && count < PATCH_TABLE_SIZE) {
+      char *end;
+      patch_t *patch = &patches[count++];
+      patch->offset = (uint32_t) strtoul(value, &end, 10);
+      patch->kind = (uint8_t) strtoul(*end ? end + 1 : end, &end, 10);
+      patch->size = (uint8_t) strtoul(*end ? end + 1 : end, &end, 10);
+      patch->reserved = 0;
+    }
+  }
+  patch_set_table(patches, count, serial_base, timestamp);
+  return "/status.json";
+}
+
 // List of CGI handlers, used to map a resource name to a handler to process the
 // request.
 static const tCGI cgi_handlers[] = {
   { "/select.cgi", select_cgi },
-  { "/reboot.cgi", reboot_cgi }
+  { "/reboot.cgi", reboot_cgi },
+  { "/job.cgi", job_cgi },
+  { "/ports.cgi", ports_cgi },
+  { "/cache.cgi", cache_cgi },
+  { "/store.cgi", store_cgi },
+  { "/patch.cgi", patch_cgi },
+  { "/status.cgi", status_cgi }
 };
 
 void cgi_init() {
@@ -87,7 +322,12 @@ void cgi_init() {
 
 #define SSI_TAGS(_) \
   _(sts)            \
-  _(out)
+  _(out)            \
+  _(job)            \
+  _(prt)            \
+  _(cch)            \
+  _(sto)            \
+  _(chg)
 
 #define AS_STRING(name) #name ,
 const char *ssi_tags[] = {
@@ -113,29 +353,126 @@ uint16_t ssi_handler(int index, char *insert_at, int ins_len) {
     // Generate an array of integer where each index corresponds to one USB
     // device which can be selected by the USB host, and each value corresponds
     // of the last status code recorded while attempting to flash the device.
-    inc_len = snprintf(insert_at, insert_len, "[");
+    // The array is only rendered again once the status changed.
+    static char status_json[2 + USB_DEVICES * 4];
+    static uint32_t status_json_generation = 0;
+    if (status_json[0] == '\0' ||
+        status_json_generation != get_usb_status_generation()) {
+      usb_status_snapshot_t snapshot;
+      get_usb_status_snapshot(&snapshot);
+      size_t len = 0;
+      for (size_t device = 0; device < USB_DEVICES; device++) {
+        len += (size_t) snprintf(&status_json[len], sizeof(status_json) - len,
+                                 "%c%u", device ? ',' : '[',
+                                 snapshot.status[device]);
+      }
+      snprintf(&status_json[len], sizeof(status_json) - len, "]");
+      status_json_generation = snapshot.generation;
+    }
+    out_len = snprintf(insert_at, insert_len, "%s", status_json);
+    break;
+  }
+  // Used in changes.json
+  case SSI_TAG__chg: {
+    // Generate the ports whose status changed after the generation given to
+    // /status.cgi, as [port, status] pairs, along with the generation of the
+    // status and the time of its last change in ms since boot.
+    usb_status_snapshot_t snapshot;
+    get_usb_status_snapshot(&snapshot);
+    uint8_t changes[USB_DEVICES][2];
+    size_t count = get_usb_status_changes(&snapshot, status_since, changes);
+    inc_len = snprintf(insert_at, insert_len,
+                       "{\"generation\":%lu,\"time\":%lu,\"changes\":[",
+                       snapshot.generation, snapshot.changed_ms);
     out_len += inc_len;
     insert_at += inc_len;
     insert_len -= (size_t) inc_len;
-    size_t device = 0;
-    for (; device < USB_DEVICES - 1; device++) {
-      inc_len = snprintf(insert_at, insert_len, "%d,",
-                         get_usb_device_status(device));
+    for (size_t i = 0; i < count; i++) {
+      inc_len = snprintf(insert_at, insert_len, "%s[%u,%u]", i ? "," : "",
+                         changes[i][0], changes[i][1]);
       out_len += inc_len;
       insert_at += inc_len;
       insert_len -= (size_t) inc_len;
     }
-    inc_len = snprintf(insert_at, insert_len, "%d]",
-                       get_usb_device_status(device));
+    inc_len = snprintf(insert_at, insert_len, "]}");
     out_len += inc_len;
-    insert_at += inc_len;
-    insert_len -= (size_t) inc_len;
     break;
   }
   case SSI_TAG__out: {
     out_len = stdout_ssi(insert_at, ins_len);
     break;
   }
+  // Used in job.json
+  case SSI_TAG__job: {
+    job_info_t job;
+    journal_get_job(&job);
+    out_len = snprintf(insert_at, insert_len,
+                       "{\"state\":%d,\"first\":%u,\"last\":%u,"
+                       "\"resume\":%u,\"size\":%lu,\"crc\":%lu}",
+                       job.state, job.first_port, job.last_port,
+                       job.resume_port, job.image_size, job.image_crc);
+    break;
+  }
+  // Used in ports.json
+  case SSI_TAG__prt: {
+    // Generate an array with the statistics of each port, each being an array
+    // of: attempts, successes, empty, timeouts, consecutive failures, last
+    // outcome, bootsel ms, mount ms, flash ms, followed by the failures of
+    // each error class.
+    const char *sep = "[";
+    for (size_t port = 0; port < USB_DEVICES; port++) {
+      port_stats_t st;
+      port_stats_get(port, &st);
+      inc_len = snprintf(insert_at, insert_len,
+                         "%s[%u,%u,%u,%u,%u,%u,%u,%u,%lu", sep,
+                         st.attempts, st.successes, st.empty, st.timeouts,
+                         st.consecutive_failures, st.last_outcome,
+                         st.bootsel_ms, st.mount_ms, st.flash_ms);
+      out_len += inc_len;
+      insert_at += inc_len;
+      insert_len -= (size_t) inc_len;
+      for (size_t c = 0; c < PORT_ERROR_CLASSES; c++) {
+        inc_len = snprintf(insert_at, insert_len, ",%u", st.failures[c]);
+        out_len += inc_len;
+        insert_at += inc_len;
+        insert_len -= (size_t) inc_len;
+      }
+      inc_len = snprintf(insert_at, insert_len, "]");
+      out_len += inc_len;
+      insert_at += inc_len;
+      insert_len -= (size_t) inc_len;
+      sep = ",";
+    }
+    inc_len = snprintf(insert_at, insert_len, "]");
+    out_len += inc_len;
+    break;
+  }
+  // Used in cache.json
+  case SSI_TAG__cch: {
+    image_cache_info_t info;
+    image_cache_get_info(&info);
+    out_len = snprintf(insert_at, insert_len,
+                       "{\"state\":%d,\"blocks\":%u,\"size\":%lu,\"crc\":%lu,"
+                       "\"variants\":%u,\"pool_blocks\":%u,\"failed\":%d}",
+                       info.state, info.blocks, info.size, info.crc,
+                       info.variants, info.pool_blocks, info.load_failed);
+    break;
+  }
+  // Used in store.json
+  case SSI_TAG__sto: {
+    // The hash is given as an hexadecimal string, as it does not fit in the
+    // numbers of JavaScript.
+    image_store_info_t info;
+    image_store_get_info(&info);
+    out_len = snprintf(insert_at, insert_len,
+                       "{\"state\":%d,\"count\":%u,\"batch\":%d,"
+                       "\"blocks\":%u,\"size\":%lu,\"crc\":%lu,"
+                       "\"hash\":\"%08lx%08lx\"}",
+                       info.state, info.count, is_batch_running() ? 1 : 0,
+                       info.blocks, info.size, info.crc,
+                       (uint32_t) (info.hash >> 32), (uint32_t) info.hash);
+    break;
+  }
   default:
     return HTTPD_SSI_TAG_UNKNOWN;
   }
@@ -155,17 +492,116 @@ void ssi_init() {
 //  Uploading Large Content (POST)
 
 static void* current_connection = NULL;
+static bool posting_to_cache = false;
 static void* current_usb_context = NULL;
 static bool pending_usb_error_report = false;
 static bool pending_usb_request_flash = false;
 static size_t total_bytes_received = 0;
 
+// Images posted with `Content-Encoding: lz4` are decoded before being written.
+static bool posting_compressed = false;
+static decompress_t post_decoder;
+
+// Binaries posted with the `X-UF2-Base-Address` header are framed in UF2
+// blocks before being written.
+static bool posting_raw = false;
+static uf2_frame_t post_framer;
+
+// Validator of the posted image, once decoded.
+static uf2_check_t post_check;
+
+// Device being flashed, given to the USB tasks, which outlives the request as
+// the file is closed once the content is written.
+static void* flashing_usb_context = NULL;
+
+// Buffers given to the USB core to be written, and the ones which were written.
+static uint32_t buffers_queued = 0;
+static uint32_t buffers_freed = 0;
+
+// Buffers of a POST request given to the USB core, along with the received
+// bytes acknowledged to the sender once each one is written. The TCP window of
+// the request is only opened again then, such that the sender is throttled by
+// TCP instead of exhausting the pbufs and the heap shared by every connection.
+// At most POST_HELD_BUFFERS buffers are tracked, the received pbufs beyond are
+// copied and acknowledged at once.
+#define POST_HELD_BUFFERS (PBUF_POOL_SIZE / 2)
+typedef struct {
+  struct pbuf* p;
+  uint16_t ack;
+} post_held_t;
+static post_held_t held[POST_HELD_BUFFERS];
+static size_t held_count = 0;
+static void* held_connection = NULL;
+
+// The request was rejected, and is answered once every byte is acknowledged.
+static bool post_aborted = false;
+
+// Error callback of httpd, called once the POST connection is reset.
+static tcp_err_fn httpd_err = NULL;
+
+// Image flashed through the WebSocket, see below.
+static void socket_file_opened();
+static void socket_file_closed();
+static void socket_write_error();
+static void socket_buffers_freed();
+
+// Read the numerical value of a header of the request.
+static bool post_header_u32(const char* http_request, uint16_t http_request_len,
+                            const char* name, uint32_t* value)
+{
+  const char* header = lwip_strnstr(http_request, name, http_request_len);
+  if (header == NULL) {
+    return false;
+  }
+  char* end;
+  *value = strtoul(header + strlen(name), &end, 0);
+  return end != header + strlen(name);
+}
+
 void request_flash(void* arg)
 {
   pending_usb_request_flash = true;
   current_usb_context = arg;
 }
 
+// Forget the POST request, whose connection is freed by httpd. The buffers
+// being written are no longer acknowledged.
+static void post_reset()
+{
+  posting_to_cache = posting_compressed = posting_raw = false;
+  post_aborted = false;
+  current_connection = NULL;
+  held_connection = NULL;
+  held_count = 0;
+}
+
+// httpd frees the state of a connection reset by the client without calling
+// httpd_post_finished.
+static void post_err(void* arg, err_t err)
+{
+  if (arg != NULL && arg == current_connection) {
+    printf("POST connection lost (%d).\n", err);
+    if (!posting_to_cache && !post_aborted) {
+      queue_usb_task(&close_file, current_usb_context);
+      current_usb_context = NULL;
+    }
+    post_reset();
+  }
+  httpd_err(arg, err);
+}
+
+// Hook the error callback of the connection, which httpd gives as the
+// argument of its pcb.
+static void watch_post_connection(void* connection)
+{
+  for (struct tcp_pcb* pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
+    if (pcb->callback_arg == connection && pcb->errf != post_err) {
+      httpd_err = pcb->errf;
+      tcp_err(pcb, post_err);
+    }
+  }
+}
+
 // Enabling LWIP_HTTPD_SUPPORT_POST in lwipopts.h implies that we have to define
 // a few handlers which are expected by LwIP, namely httpd_post_begin,
 // httpd_post_receive_data and httpd_post_finished.
@@ -174,9 +610,6 @@ err_t httpd_post_begin(void* connection, const char* uri, const char* http_reque
                        uint16_t err_response_uri_len, uint8_t* post_auto_wnd)
 {
   printf("httpd_post_begin: %s\n", uri);
-  LWIP_UNUSED_ARG(http_request);
-  LWIP_UNUSED_ARG(http_request_len);
-  LWIP_UNUSED_ARG(content_len);
 
   if (current_connection != NULL) {
     // One POST connection is still in progress, reject this new one until the
@@ -186,6 +619,10 @@ err_t httpd_post_begin(void* connection, const char* uri, const char* http_reque
     return ERR_ABRT;
   }
   current_connection = connection;
+  held_connection = connection;
+  held_count = 0;
+  post_aborted = false;
+  watch_post_connection(connection);
 
 #if LWIP_HTTPD_POST_MANUAL_WND
   // The network is faster than the flash, and the RAM of the usb host is
@@ -196,6 +633,15 @@ err_t httpd_post_begin(void* connection, const char* uri, const char* http_reque
   *post_auto_wnd = 1;
 #endif
 
+  // Images uploaded to the image cache are loaded by this core, and flashed
+  // later on each device with /cache.cgi?flash=1.
+  posting_to_cache = strcmp(uri, "/cache") == 0;
+  if (posting_to_cache) {
+    printf("Preparing to load content in the image cache.\n");
+    total_bytes_received = 0;
+    return ERR_OK;
+  }
+
   // Match that the URI.
   if (strcmp(uri, "/flash") != 0) {
     printf("Abort: Unexpected URI.\n");
@@ -206,7 +652,31 @@ err_t httpd_post_begin(void* connection, const char* uri, const char* http_reque
   printf("Preparing to stream content to the USB mass storage.\n");
   // TODO: transfer meta data, such as content_len or the file names.
   total_bytes_received = 0;
+  posting_compressed =
+    lwip_strnstr(http_request, "Content-Encoding: lz4", http_request_len) != NULL;
+  if (posting_compressed) {
+    printf("Decompressing the content.\n");
+    decompress_init(&post_decoder);
+  }
+  uint32_t base_addr, family_id = UF2_FAMILY_RP2040;
+  posting_raw = post_header_u32(http_request, http_request_len,
+                                "X-UF2-Base-Address: ", &base_addr);
+  if (posting_raw) {
+    post_header_u32(http_request, http_request_len, "X-UF2-Family-ID: ",
+                    &family_id);
+    if (posting_compressed || content_len < 0 ||
+        !uf2_frame_init(&post_framer, base_addr, family_id, (uint32_t) content_len)) {
+      printf("Abort: Unexpected binary at 0x%08lx.\n", base_addr);
+      strncpy(err_response_uri, "/status.json", err_response_uri_len);
+      post_reset();
+      return ERR_ABRT;
+    }
+    printf("Framing %d bytes at 0x%08lx.\n", content_len, base_addr);
+  }
+  uf2_check_init(&post_check);
   pending_usb_error_report = false;
+  patch_next_device(selected_device);
+  flashing_usb_context = current_usb_context;
   queue_usb_task(&open_file, current_usb_context);
 #ifdef USE_STREAM_FILE_CONTENT
   queue_usb_task(&stream_file_content, current_usb_context);
@@ -218,6 +688,22 @@ err_t httpd_post_begin(void* connection, const char* uri, const char* http_reque
 void write_error(void* arg)
 {
   pending_usb_error_report = true;
+  socket_write_error();
+}
+
+void report_file_opened(void* arg)
+{
+  socket_file_opened();
+}
+
+void report_file_closed(void* arg)
+{
+  socket_file_closed();
+}
+
+void *get_postmsg_usb_info(void* arg)
+{
+  return flashing_usb_context;
 }
 
 uint8_t* get_postmsg_buffer(void* arg)
@@ -232,10 +718,180 @@ size_t get_postmsg_length(void* arg)
   return p->len;
 }
 
+// Acknowledge bytes of the POST request to the sender.
+static void post_ack(uint16_t len)
+{
+#if LWIP_HTTPD_POST_MANUAL_WND
+  if (held_connection && len) {
+    httpd_post_data_recved(held_connection, len);
+  }
+#endif
+}
+
+// Track a buffer given to the USB core, with no bytes to acknowledge yet.
+// Returns NULL if too many buffers are tracked.
+static post_held_t* post_hold(struct pbuf* p)
+{
+  if (held_count == POST_HELD_BUFFERS) {
+    return NULL;
+  }
+  post_held_t* h = &held[held_count++];
+  h->p = p;
+  h->ack = 0;
+  return h;
+}
+
 void free_postmsg(void* arg)
 {
   struct pbuf* p = (struct pbuf*) arg;
+  for (size_t i = 0; i < held_count; i++) {
+    if (held[i].p != p) {
+      continue;
+    }
+    uint16_t ack = held[i].ack;
+    held[i] = held[--held_count];
+    post_ack(ack);
+    break;
+  }
+  pbuf_free(p);
+  buffers_freed++;
+  socket_buffers_freed();
+}
+
+static void queue_write(struct pbuf* p)
+{
+  buffers_queued++;
+  queue_usb_task(&write_file_content, (void*) p);
+}
+
+// Queue the received pbufs to be written as they are, without copying their
+// content, one task per pbuf of the chain. Their bytes are acknowledged to the
+// sender once they are written, see free_postmsg.
+static void queue_chain(struct pbuf* p)
+{
+  while (p != NULL) {
+    struct pbuf* next = p->next;
+    if (next != NULL) {
+      // pbuf_dechain releases the reference of p to the rest of the chain.
+      pbuf_ref(next);
+      pbuf_dechain(p);
+    }
+    if (p->len == 0) {
+      pbuf_free(p);
+      p = next;
+      continue;
+    }
+    struct pbuf* q = p;
+    post_held_t* h = post_hold(p);
+    if (h) {
+      h->ack = p->len;
+    } else {
+      q = pbuf_clone(PBUF_TRANSPORT, PBUF_RAM, p);
+      post_ack(p->len);
+      pbuf_free(p);
+      if (!q) {
+        printf("POST: no buffer to copy the content.\n");
+        p = next;
+        continue;
+      }
+    }
+    patch_stream(q->payload, q->len, (uint32_t) total_bytes_received);
+    total_bytes_received += q->len;
+    queue_write(q);
+    p = next;
+  }
+}
+
+// Decode the compressed content or frame the binary of a POST request, and
+// forward it to the USB core in buffers of at most a block. The buffers of a
+// POST request are tracked, and the last one is given in `last`, or NULL if
+// none. Returns false if the content is corrupted or if no buffer can be
+// allocated.
+static bool post_decode(struct pbuf* p, post_held_t** last)
+{
+  if (last) {
+    *last = NULL;
+  }
+  for (struct pbuf* q = p; q != NULL; q = q->next) {
+    const uint8_t* in = (const uint8_t*) q->payload;
+    size_t left = q->len;
+    size_t len;
+    do {
+#ifdef USE_STREAM_FILE_CONTENT
+      static uint8_t out[DECOMPRESS_BLOCK_SIZE];
+#else
+      struct pbuf* buffer =
+        pbuf_alloc(PBUF_TRANSPORT, DECOMPRESS_BLOCK_SIZE, PBUF_RAM);
+      if (!buffer) {
+        printf("POST: no buffer to decompress the content.\n");
+        return false;
+      }
+      uint8_t* out = (uint8_t*) buffer->payload;
+#endif
+      size_t used;
+      if (posting_compressed) {
+        len = decompress_run(&post_decoder, in, left, &used, out,
+                             DECOMPRESS_BLOCK_SIZE);
+      } else {
+        len = uf2_frame_run(&post_framer, in, left, &used, out,
+                            DECOMPRESS_BLOCK_SIZE);
+      }
+      in += used;
+      left -= used;
+      if (!uf2_check_run(&post_check, out, len)) {
+#ifndef USE_STREAM_FILE_CONTENT
+        pbuf_free(buffer);
+#endif
+        return false;
+      }
+      patch_stream(out, len, (uint32_t) total_bytes_received);
+      total_bytes_received += len;
+#ifdef USE_STREAM_FILE_CONTENT
+      pipe_enqueue(out, len);
+#else
+      if (len) {
+        pbuf_realloc(buffer, (u16_t) len);
+        post_held_t* h = last ? post_hold(buffer) : NULL;
+        if (h) {
+          *last = h;
+        }
+        queue_write(buffer);
+      } else {
+        pbuf_free(buffer);
+      }
+#endif
+      // The bytes beyond the size of a binary are not consumed.
+      if (posting_compressed ? decompress_failed(&post_decoder)
+                             : left > 0 && used == 0 && len == 0) {
+        return false;
+      }
+      // A full buffer might leave part of a match to be decoded.
+    } while (left > 0 || len == DECOMPRESS_BLOCK_SIZE);
+  }
+  return true;
+}
+
+// Stop writing a rejected image, and close the file on the device. The rest of
+// the content is ignored, and httpd calls httpd_post_finished once every byte
+// received is acknowledged, including the ones of the buffers being written.
+static err_t post_abort(struct pbuf* p, const char* reason)
+{
+  if (reason == NULL) {
+    reason = post_check.error != UF2_CHECK_OK ? uf2_check_reason(&post_check)
+                                              : "cannot decode the content";
+  }
+  printf("POST aborted: %s.\n", reason);
+  queue_usb_task(&close_file, current_usb_context);
+  posting_compressed = posting_raw = false;
+  current_usb_context = NULL;
+  post_aborted = true;
+  for (size_t i = 0; i < held_count; i++) {
+    post_ack(held[i].ack);
+  }
+  held_count = 0;
+  post_ack(p->tot_len);
   pbuf_free(p);
+  return ERR_ABRT;
 }
 
 err_t httpd_post_receive_data(void* connection, struct pbuf* p)
@@ -244,27 +900,62 @@ err_t httpd_post_receive_data(void* connection, struct pbuf* p)
     printf("POST connection does not match.\n");
     return ERR_VAL;
   }
-  if (pending_usb_error_report) {
-    printf("POST connection aborted for USB error.\n");
+  if (posting_to_cache) {
+    for (struct pbuf* q = p; q != NULL; q = q->next) {
+      image_cache_write(q->payload, q->len);
+    }
+    total_bytes_received += p->tot_len;
+#if LWIP_HTTPD_POST_MANUAL_WND
+    httpd_post_data_recved(connection, p->tot_len);
+#endif
+    pbuf_free(p);
+    return ERR_OK;
+  }
+  if (post_aborted) {
+    post_ack(p->tot_len);
+    pbuf_free(p);
     return ERR_ABRT;
   }
+  if (pending_usb_error_report) {
+    return post_abort(p, "USB error");
+  }
+
+  if (posting_compressed || posting_raw) {
+    post_held_t* last;
+    if (!post_decode(p, &last)) {
+      return post_abort(p, NULL);
+    }
+    // The received bytes are acknowledged once decoded and written.
+    if (last) {
+      last->ack = p->tot_len;
+    } else {
+      post_ack(p->tot_len);
+    }
+    pbuf_free(p);
+    return ERR_OK;
+  }
+
+  for (struct pbuf* q = p; q != NULL; q = q->next) {
+    if (!uf2_check_run(&post_check, q->payload, q->len)) {
+      return post_abort(p, NULL);
+    }
+  }
 
 #ifdef USE_STREAM_FILE_CONTENT
   // Data would be dequeued by stream_file_content which is in charge of
   // writting it to the connected device.
+  patch_stream(p->payload, len, (uint32_t) total_bytes_received);
   pipe_enqueue(p->payload, len);
   total_bytes_received += len;
-#else
-  total_bytes_received += p->len;
-  struct pbuf* q = pbuf_clone(PBUF_TRANSPORT, PBUF_RAM, p);
-  queue_usb_task(&write_file_content, (void*) q);
-#endif
 
 #if LWIP_HTTPD_POST_MANUAL_WND
   // Update the TCP window to throttle data reception.
   httpd_post_data_recved(connection, (uint16_t) len);
 #endif
   pbuf_free(p);
+#else
+  queue_chain(p);
+#endif
   return ERR_OK;
 }
 
@@ -274,13 +965,860 @@ void httpd_post_finished(void* connection, char* response_uri, uint16_t response
     return;
   }
 
+  if (posting_to_cache) {
+    printf("POST finished: cached %u bytes.\n", total_bytes_received);
+    strncpy(response_uri, "/cache.json", response_uri_len);
+    post_reset();
+    return;
+  }
+  if (post_aborted) {
+    strncpy(response_uri, "/status.json", response_uri_len);
+    post_reset();
+    return;
+  }
+
   queue_usb_task(&close_file, current_usb_context);
   printf("POST finished: received %u bytes.\n", total_bytes_received);
+  if (posting_compressed && !decompress_is_complete(&post_decoder)) {
+    printf("POST finished: truncated compressed image.\n");
+  }
+  if (posting_raw && !uf2_frame_is_complete(&post_framer)) {
+    printf("POST finished: truncated binary.\n");
+  }
+  if (!uf2_check_end(&post_check)) {
+    printf("POST finished: %s.\n", uf2_check_reason(&post_check));
+  }
+  // Also called when the connection is closed before the end of the content,
+  // while buffers are being written.
+  post_reset();
+  current_usb_context = NULL;
 
   const char* return_to = "/status.json";
   strncpy(response_uri, return_to, response_uri_len);
+}
+
+// ---------------------------------------------------------
+//  Pushing Status and Output (Server-Sent Events)
+//
+// The httpd answers each request at once, thus the status of the devices and
+// the output of the board are pushed as they change on a separate port, to
+// the browsers which follow http://<board>:8080/events with an EventSource.
+// The events are:
+//
+//   event: status / data: <port>:<status>,...   Ports whose status changed
+//                                              since the previous event, all
+//                                              ports in the first one.
+//   event: out / data: <line> ...              Output of the board, with one
+//                                              data field per line.
+//
+// The same port accepts WebSocket connections, see below.
+
+#define EVENTS_PORT 8080
+
+// Number of browsers following the events or connected to the WebSocket at
+// once.
+#define EVENTS_MAX_CLIENTS 4
+
+// Bytes of output kept for the clients which did not receive them yet.
+#define EVENTS_LOG_SIZE 2048
+
+// Maximum bytes of output sent in a single event.
+#define EVENTS_OUT_SIZE 512
+
+// Delay between the checks for changes.
+#define EVENTS_PUSH_MS 50
+
+// Maximum size of the request, and of the frames received on the WebSocket.
+#define EVENTS_REQUEST_SIZE 1024
+#define SOCKET_FRAME_SIZE 8192
+
+typedef enum {
+  // Waiting for the end of the request.
+  EVENTS_REQUEST,
+  // Following the events.
+  EVENTS_STREAM,
+  // Exchanging messages on the WebSocket.
+  EVENTS_SOCKET,
+} events_mode_t;
+
+typedef struct {
+  // NULL when the slot is free.
+  struct tcp_pcb *pcb;
+  events_mode_t mode;
+  // Start of a request or a frame split between the segments received.
+  struct pbuf *pending;
+  // Position in the output log of the next bytes sent to the client, and the
+  // generation of the status last sent to it, 0 before the first one.
+  uint32_t stdout_read;
+  uint32_t status_generation;
+} event_client_t;
+
+static struct tcp_pcb *events_pcb = NULL;
+static event_client_t event_clients[EVENTS_MAX_CLIENTS];
+
+// Output read from stdio_web, shared by the clients, where event_log_end counts
+// the bytes ever read.
+static char event_log[EVENTS_LOG_SIZE];
+static uint32_t event_log_end = 0;
+static absolute_time_t events_next_push;
+
+static const char events_headers[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Content-Type: text/event-stream\r\n"
+  "Cache-Control: no-cache\r\n"
+  "Access-Control-Allow-Origin: *\r\n"
+  "\r\n"
+  "retry: 1000\n\n";
+
+static void socket_closed(event_client_t *client);
+
+// Last pcb aborted, for which the lwIP callbacks return ERR_ABRT.
+static struct tcp_pcb *events_aborted = NULL;
+
+static void events_close(event_client_t *client) {
+  if (client->mode == EVENTS_SOCKET) {
+    socket_closed(client);
+  }
+  if (client->pcb) {
+    tcp_arg(client->pcb, NULL);
+    tcp_recv(client->pcb, NULL);
+    tcp_err(client->pcb, NULL);
+    if (tcp_close(client->pcb) != ERR_OK) {
+      events_aborted = client->pcb;
+      tcp_abort(client->pcb);
+    }
+  }
+  if (client->pending) {
+    pbuf_free(client->pending);
+  }
+  client->pcb = NULL;
+  client->pending = NULL;
+  client->mode = EVENTS_REQUEST;
+}
+
+static bool events_send(event_client_t *client, const char *buf, size_t len) {
+  if (tcp_sndbuf(client->pcb) < len) {
+    return false;
+  }
+  if (tcp_write(client->pcb, buf, (u16_t) len, TCP_WRITE_FLAG_COPY) != ERR_OK) {
+    return false;
+  }
+  tcp_output(client->pcb);
+  return true;
+}
+
+// Move the output buffered by stdio_web to the log, without overwriting the
+// bytes which a client did not receive yet.
+static void events_pull_stdout() {
+  uint32_t lag = 0;
+  for (size_t i = 0; i < EVENTS_MAX_CLIENTS; i++) {
+    event_client_t *client = &event_clients[i];
+    if (client->pcb && client->mode != EVENTS_REQUEST &&
+        event_log_end - client->stdout_read > lag) {
+      lag = event_log_end - client->stdout_read;
+    }
+  }
+  uint32_t room = EVENTS_LOG_SIZE - lag;
+  while (room) {
+    uint32_t at = event_log_end % EVENTS_LOG_SIZE;
+    uint32_t len = EVENTS_LOG_SIZE - at < room ? EVENTS_LOG_SIZE - at : room;
+    len = stdout_ssi(&event_log[at], (int) len);
+    if (len == 0) {
+      return;
+    }
+    event_log_end += len;
+    room -= len;
+  }
+}
+
+// Bytes of the log which the client did not receive yet, skipping the ones
+// which got overwritten when the client was too slow.
+static uint32_t events_unread(event_client_t *client) {
+  if (event_log_end - client->stdout_read > EVENTS_LOG_SIZE) {
+    client->stdout_read = event_log_end - EVENTS_LOG_SIZE;
+  }
+  return event_log_end - client->stdout_read;
+}
+
+// Send the ports whose status changed since the last event sent to the client.
+static void events_push_status(event_client_t *client,
+                               const usb_status_snapshot_t *snapshot) {
+  if (client->status_generation == snapshot->generation) {
+    return;
+  }
+  uint8_t changes[USB_DEVICES][2];
+  size_t count = get_usb_status_changes(snapshot, client->status_generation,
+                                        changes);
+  char buffer[32 + USB_DEVICES * 8];
+  int len = snprintf(buffer, sizeof(buffer), "event: status\ndata: ");
+  for (size_t i = 0; i < count; i++) {
+    len += snprintf(&buffer[len], sizeof(buffer) - len, "%s%u:%u",
+                    i ? "," : "", changes[i][0], changes[i][1]);
+  }
+  len += snprintf(&buffer[len], sizeof(buffer) - len, "\n\n");
+  if (count == 0 || events_send(client, buffer, (size_t) len)) {
+    client->status_generation = snapshot->generation;
+  }
+}
+
+// Send the output which the client did not receive yet, with one data field
+// per line.
+static void events_push_stdout(event_client_t *client) {
+  char buffer[32 + EVENTS_OUT_SIZE];
+  size_t len = (size_t) snprintf(buffer, sizeof(buffer), "event: out\ndata: ");
+  uint32_t read = client->stdout_read;
+  // Keep room for a new data field and the end of the event.
+  for (; read != event_log_end && len + 9 <= sizeof(buffer); read++) {
+    char c = event_log[read % EVENTS_LOG_SIZE];
+    if (c == '\n') {
+      memcpy(&buffer[len], "\ndata: ", 7);
+      len += 7;
+    } else if (c != '\r') {
+      buffer[len++] = c;
+    }
+  }
+  if (read == client->stdout_read) {
+    return;
+  }
+  memcpy(&buffer[len], "\n\n", 2);
+  len += 2;
+  if (events_send(client, buffer, len)) {
+    client->stdout_read = read;
+  }
+}
+
+// Push the changes to the clients, from the snapshots shared by all of them.
+static void push_events() {
+  if (!time_reached(events_next_push)) {
+    return;
+  }
+  events_next_push = make_timeout_time_ms(EVENTS_PUSH_MS);
+
+  // The snapshot of the status is only taken once a client is behind it.
+  const uint32_t generation = get_usb_status_generation();
+  bool streaming = false, stale = false;
+  for (size_t i = 0; i < EVENTS_MAX_CLIENTS; i++) {
+    event_client_t *client = &event_clients[i];
+    if (client->mode == EVENTS_STREAM) {
+      streaming = true;
+      stale |= client->status_generation != generation;
+    }
+  }
+  if (!streaming) {
+    return;
+  }
+
+  usb_status_snapshot_t snapshot;
+  if (stale) {
+    get_usb_status_snapshot(&snapshot);
+  }
+  events_pull_stdout();
+
+  for (size_t i = 0; i < EVENTS_MAX_CLIENTS; i++) {
+    event_client_t *client = &event_clients[i];
+    if (client->mode != EVENTS_STREAM) {
+      continue;
+    }
+    events_unread(client);
+    if (stale) {
+      events_push_status(client, &snapshot);
+    }
+    events_push_stdout(client);
+  }
+}
+
+// ---------------------------------------------------------
+//  Flashing over a WebSocket
+//
+// The web page connects a WebSocket to ws://<board>:8080/control, which carries
+// the binary messages of the TCP server, see tcp_server.h, one or more in each
+// binary frame, such that images are flashed without a request per part:
+//
+//   REQUEST_STATUS, REQUEST_STATUS_SINCE, REQUEST_STDOUT, SELECT_DEVICE and
+//     SET_FAMILY.
+//   START_FLASH, START_FLASH_COMPRESSED or START_FLASH_RAW, once the device
+//     requested its image, answered with FLASH_START once the file is opened.
+//   WRITE_FLASH_PART [len u16, content], where the content is any slice of the
+//     image, compressed image or binary, answered with FLASH_PART_WRITTEN once
+//     it is written. Up to SOCKET_PARTS parts can be in flight.
+//   END_FLASH, answered with FLASH_END once the file is closed.
+//
+// A single image is flashed at a time, either by a WebSocket or by a POST
+// request, thus the state of the POST requests is shared.
+
+// Maximum number of parts sent and not acknowledged yet. Parts are copied in
+// the heap of lwIP (MEM_SIZE) until written, which holds a few parts of 1 KiB
+// along with the segments being sent. Keep in sync with SOCKET_PARTS in
+// module.index.js.
+#define SOCKET_PARTS 3
+
+static const char socket_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// Client flashing an image, whether the image got rejected, and the number of
+// buffers queued at the end of each part not acknowledged yet.
+static event_client_t *socket_flashing = NULL;
+static bool socket_rejected = false;
+static uint32_t socket_part_ends[SOCKET_PARTS];
+static uint8_t socket_first_part = 0;
+static uint8_t socket_parts = 0;
+
+// Content of the frame being decoded, once unmasked.
+static uint8_t socket_frame[SOCKET_FRAME_SIZE];
+
+static bool socket_send(event_client_t *client, const uint8_t *msg, size_t len) {
+  uint8_t header[4] = { 0x82 }; // Final binary frame.
+  size_t header_len = 2;
+  if (len < 126) {
+    header[1] = (uint8_t) len;
+  } else {
+    header[1] = 126;
+    header[2] = (uint8_t) (len >> 8);
+    header[3] = (uint8_t) len;
+    header_len = 4;
+  }
+  if (!client->pcb || tcp_sndbuf(client->pcb) < header_len + len) {
+    printf("WebSocket: no room to send %u bytes.\n", (unsigned) len);
+    return false;
+  }
+  tcp_write(client->pcb, header, (u16_t) header_len,
+            TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
+  tcp_write(client->pcb, msg, (u16_t) len, TCP_WRITE_FLAG_COPY);
+  tcp_output(client->pcb);
+  return true;
+}
+
+static void socket_ack(event_client_t *client, uint8_t ack) {
+  socket_send(client, &ack, 1);
+}
+
+static void put_u32(uint8_t *buffer, uint32_t value) {
+  buffer[0] = value & 0xff;
+  buffer[1] = (value >> 8) & 0xff;
+  buffer[2] = (value >> 16) & 0xff;
+  buffer[3] = (value >> 24) & 0xff;
+}
+
+static uint32_t get_u32(const uint8_t *buffer) {
+  return (uint32_t) buffer[0] | ((uint32_t) buffer[1] << 8) |
+         ((uint32_t) buffer[2] << 16) | ((uint32_t) buffer[3] << 24);
+}
+
+// Acknowledge the parts whose buffers were all written.
+static void socket_buffers_freed() {
+  while (socket_parts &&
+         (int32_t) (buffers_freed - socket_part_ends[socket_first_part]) >= 0) {
+    socket_first_part = (socket_first_part + 1) % SOCKET_PARTS;
+    socket_parts--;
+    if (socket_flashing) {
+      socket_ack(socket_flashing, FLASH_PART_WRITTEN);
+    }
+  }
+}
+
+static void socket_file_opened() {
+  if (socket_flashing) {
+    socket_ack(socket_flashing, FLASH_START);
+  }
+}
+
+static void socket_file_closed() {
+  if (!socket_flashing) {
+    return;
+  }
+  socket_ack(socket_flashing, FLASH_END);
+  socket_flashing = NULL;
   current_connection = NULL;
-  current_usb_context = NULL;
+}
+
+static void socket_write_error() {
+  if (socket_flashing) {
+    socket_ack(socket_flashing, FLASH_ERROR);
+  }
+}
+
+// Stop the image when the client disconnects, and close the file with what was
+// written.
+static void socket_closed(event_client_t *client) {
+  if (socket_flashing != client) {
+    return;
+  }
+  printf("WebSocket: closed while flashing.\n");
+  queue_usb_task(&close_file, flashing_usb_context);
+  posting_compressed = posting_raw = false;
+  socket_flashing = NULL;
+  current_connection = NULL;
+}
+
+static void socket_send_status(event_client_t *client) {
+  usb_status_snapshot_t snapshot;
+  get_usb_status_snapshot(&snapshot);
+  uint8_t buffer[3 + USB_DEVICES];
+  buffer[0] = UPDATE_STATUS;
+  buffer[1] = USB_DEVICES & 0xff;
+  buffer[2] = (USB_DEVICES >> 8) & 0xff;
+  memcpy(&buffer[3], snapshot.status, USB_DEVICES);
+  socket_send(client, buffer, sizeof(buffer));
+}
+
+static void socket_send_status_since(event_client_t *client, uint32_t since) {
+  usb_status_snapshot_t snapshot;
+  get_usb_status_snapshot(&snapshot);
+  uint8_t buffer[10 + 2 * USB_DEVICES];
+  size_t count = get_usb_status_changes(&snapshot, since,
+                                        (uint8_t (*)[2]) &buffer[10]);
+  buffer[0] = UPDATE_STATUS_CHANGES;
+  put_u32(&buffer[1], snapshot.generation);
+  put_u32(&buffer[5], snapshot.changed_ms);
+  buffer[9] = (uint8_t) count;
+  socket_send(client, buffer, 10 + 2 * count);
+}
+
+static void socket_send_stdout(event_client_t *client) {
+  uint8_t buffer[3 + EVENTS_OUT_SIZE];
+  events_pull_stdout();
+  uint32_t len = events_unread(client);
+  uint32_t at = client->stdout_read % EVENTS_LOG_SIZE;
+  if (len > EVENTS_LOG_SIZE - at) {
+    len = EVENTS_LOG_SIZE - at;
+  }
+  if (len > EVENTS_OUT_SIZE) {
+    len = EVENTS_OUT_SIZE;
+  }
+  buffer[0] = UPDATE_STDOUT;
+  buffer[1] = len & 0xff;
+  buffer[2] = (len >> 8) & 0xff;
+  memcpy(&buffer[3], &event_log[at], len);
+  if (socket_send(client, buffer, 3 + len)) {
+    client->stdout_read += len;
+  }
+}
+
+static void socket_start_flash(event_client_t *client, bool compressed, bool raw,
+                               uint32_t base_addr, uint32_t family_id,
+                               uint32_t size) {
+  if (current_connection != NULL) {
+    printf("WebSocket: another image is being flashed.\n");
+    socket_ack(client, FLASH_ERROR);
+    return;
+  }
+  if (raw && !uf2_frame_init(&post_framer, base_addr, family_id, size)) {
+    printf("WebSocket: unexpected binary at 0x%08lx.\n", base_addr);
+    socket_ack(client, FLASH_ERROR);
+    return;
+  }
+  printf("WebSocket: stream content to the USB mass storage.\n");
+  current_connection = client;
+  socket_flashing = client;
+  socket_rejected = false;
+  socket_parts = 0;
+  total_bytes_received = 0;
+  posting_compressed = compressed;
+  posting_raw = raw;
+  if (compressed) {
+    decompress_init(&post_decoder);
+  }
+  uf2_check_init(&post_check);
+  pending_usb_error_report = false;
+  patch_next_device(selected_device);
+  flashing_usb_context = current_usb_context;
+  queue_usb_task(&open_file, flashing_usb_context);
+}
+
+// Report why the image got rejected, once, and drop the next parts.
+static void socket_reject(event_client_t *client) {
+  socket_rejected = true;
+  if (post_check.error == UF2_CHECK_OK) {
+    printf("WebSocket: cannot decode the content.\n");
+    socket_ack(client, FLASH_ERROR);
+    return;
+  }
+  printf("WebSocket: image rejected: %s.\n", uf2_check_reason(&post_check));
+  uint8_t buffer[2 + sizeof(uint32_t)];
+  buffer[0] = IMAGE_REJECTED;
+  buffer[1] = (uint8_t) post_check.error;
+  put_u32(&buffer[2], uf2_check_failed_block(&post_check));
+  socket_send(client, buffer, sizeof(buffer));
+}
+
+static void socket_write_part(event_client_t *client, uint8_t *content,
+                              uint16_t len) {
+  if (socket_flashing != client || socket_parts == SOCKET_PARTS) {
+    socket_ack(client, FLASH_ERROR);
+    return;
+  }
+  if (!socket_rejected && !pending_usb_error_report) {
+    if (posting_compressed || posting_raw) {
+      struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_REF);
+      if (!p) {
+        socket_ack(client, FLASH_ERROR);
+        return;
+      }
+      p->payload = content;
+      if (!post_decode(p, NULL)) {
+        socket_reject(client);
+      }
+      pbuf_free(p);
+    } else if (!uf2_check_run(&post_check, content, len)) {
+      socket_reject(client);
+    } else if (len) {
+      struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+      if (!p) {
+        socket_ack(client, FLASH_ERROR);
+        return;
+      }
+      memcpy(p->payload, content, len);
+      patch_stream(p->payload, len, (uint32_t) total_bytes_received);
+      total_bytes_received += len;
+      queue_write(p);
+    }
+  }
+
+  // The part is acknowledged once the buffers queued so far are written.
+  socket_part_ends[(socket_first_part + socket_parts) % SOCKET_PARTS] =
+    buffers_queued;
+  socket_parts++;
+  socket_buffers_freed();
+}
+
+static void socket_end_flash(event_client_t *client) {
+  if (socket_flashing != client) {
+    socket_ack(client, FLASH_ERROR);
+    return;
+  }
+  printf("WebSocket: received %u bytes.\n", total_bytes_received);
+  if (posting_compressed && !decompress_is_complete(&post_decoder)) {
+    printf("WebSocket: truncated compressed image.\n");
+  }
+  if (posting_raw && !uf2_frame_is_complete(&post_framer)) {
+    printf("WebSocket: truncated binary.\n");
+  }
+  if (!socket_rejected && !uf2_check_end(&post_check)) {
+    socket_reject(client);
+  }
+  posting_compressed = posting_raw = false;
+  // FLASH_END is sent once the file is closed.
+  queue_usb_task(&close_file, flashing_usb_context);
+}
+
+// Decode the messages of a binary frame, which returns false when the frame
+// does not hold whole messages.
+static bool socket_recv_messages(event_client_t *client, uint8_t *msg,
+                                 size_t len) {
+  while (len) {
+    size_t used = 1;
+    switch (msg[0]) {
+    case REQUEST_STATUS:
+      socket_send_status(client);
+      break;
+    case REQUEST_STATUS_SINCE:
+      if (len < 5) {
+        return false;
+      }
+      used = 5;
+      socket_send_status_since(client, get_u32(&msg[1]));
+      break;
+    case REQUEST_STDOUT:
+      socket_send_stdout(client);
+      break;
+    case SELECT_DEVICE: {
+      if (len < 2) {
+        return false;
+      }
+      used = 2;
+      int8_t device = (int8_t) msg[1];
+      if (device >= 0) {
+        printf("Queue USB select_device: %d\n", device);
+        selected_device = (size_t) device;
+        queue_usb_task(&select_device_cb, (void*) (intptr_t) device);
+      } else {
+        printf("Queue reset all USB status\n");
+        queue_usb_task(&clear_usb_status_cb, (void*) 0);
+      }
+      break;
+    }
+    case SET_FAMILY:
+      if (len < 5) {
+        return false;
+      }
+      used = 5;
+      printf("Expect the family 0x%08lx.\n", get_u32(&msg[1]));
+      uf2_check_set_family(get_u32(&msg[1]));
+      break;
+    case START_FLASH:
+      socket_start_flash(client, false, false, 0, 0, 0);
+      break;
+    case START_FLASH_COMPRESSED:
+      socket_start_flash(client, true, false, 0, 0, 0);
+      break;
+    case START_FLASH_RAW:
+      if (len < 13) {
+        return false;
+      }
+      used = 13;
+      socket_start_flash(client, false, true, get_u32(&msg[1]),
+                         get_u32(&msg[5]), get_u32(&msg[9]));
+      break;
+    case WRITE_FLASH_PART: {
+      if (len < 3) {
+        return false;
+      }
+      uint16_t part_len = (uint16_t) (msg[1] | (msg[2] << 8));
+      if (len < 3u + part_len) {
+        return false;
+      }
+      used = 3u + part_len;
+      socket_write_part(client, &msg[3], part_len);
+      break;
+    }
+    case END_FLASH:
+      socket_end_flash(client);
+      break;
+    default:
+      socket_ack(client, DECODE_FAILURE);
+      return false;
+    }
+    msg += used;
+    len -= used;
+  }
+  return true;
+}
+
+// Decode a frame, and return the bytes it spans, or 0 until it is received.
+static uint16_t socket_recv_frame(event_client_t *client, struct pbuf *p,
+                                  uint16_t offset) {
+  uint8_t header[8];
+  uint16_t avail = p->tot_len - offset;
+  if (avail < 2) {
+    return 0;
+  }
+  pbuf_copy_partial(p, header, avail < sizeof(header) ? avail : sizeof(header),
+                    offset);
+  uint8_t opcode = header[0] & 0x0f;
+  bool masked = header[1] & 0x80;
+  size_t len = header[1] & 0x7f;
+  uint16_t header_len = 2;
+  if (len == 126) {
+    if (avail < 4) {
+      return 0;
+    }
+    len = (size_t) (header[2] << 8) | header[3];
+    header_len = 4;
+  } else if (len == 127) {
+    len = SOCKET_FRAME_SIZE + 1;
+  }
+  if (!(header[0] & 0x80) || len > SOCKET_FRAME_SIZE) {
+    printf("WebSocket: unsupported frame of %u bytes.\n", (unsigned) len);
+    events_close(client);
+    return 0;
+  }
+  uint8_t mask[4] = { 0 };
+  if (masked) {
+    if (avail < header_len + 4) {
+      return 0;
+    }
+    pbuf_copy_partial(p, mask, 4, offset + header_len);
+    header_len += 4;
+  }
+  if (avail < header_len + len) {
+    return 0;
+  }
+  pbuf_copy_partial(p, socket_frame, (u16_t) len, offset + header_len);
+  for (size_t i = 0; i < len; i++) {
+    socket_frame[i] ^= mask[i % 4];
+  }
+
+  switch (opcode) {
+  case 0x2: // Binary frame.
+    if (!socket_recv_messages(client, socket_frame, len)) {
+      printf("WebSocket: truncated message.\n");
+    }
+    break;
+  case 0x9: { // Ping, answered with a pong with the same payload.
+    uint8_t pong[2] = { 0x8a, (uint8_t) len };
+    if (len < 126 && tcp_sndbuf(client->pcb) >= 2 + len) {
+      tcp_write(client->pcb, pong, 2, TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
+      tcp_write(client->pcb, socket_frame, (u16_t) len, TCP_WRITE_FLAG_COPY);
+      tcp_output(client->pcb);
+    }
+    break;
+  }
+  case 0xa: // Pong.
+    break;
+  default: // Close, or text frames which are not expected.
+    events_close(client);
+    return 0;
+  }
+  return (uint16_t) (header_len + len);
+}
+
+// Answer the request of a new client, which either follows the events, or
+// upgrades its connection to a WebSocket. Returns the bytes of the request, or 0
+// until it is received.
+static uint16_t events_recv_request(event_client_t *client, struct pbuf *p) {
+  u16_t end = pbuf_memfind(p, "\r\n\r\n", 4, 0);
+  if (end == 0xffff) {
+    if (p->tot_len > EVENTS_REQUEST_SIZE) {
+      events_close(client);
+    }
+    return 0;
+  }
+  end += 4;
+
+  char request[EVENTS_REQUEST_SIZE + 1];
+  u16_t len = pbuf_copy_partial(p, request, end < EVENTS_REQUEST_SIZE
+                                ? end : EVENTS_REQUEST_SIZE, 0);
+  request[len] = '\0';
+  const char key_header[] = "Sec-WebSocket-Key: ";
+  char *key = strstr(request, key_header);
+  if (!key) {
+    if (events_send(client, events_headers, sizeof(events_headers) - 1)) {
+      client->mode = EVENTS_STREAM;
+      client->status_generation = 0;
+      events_next_push = get_absolute_time();
+    }
+    return end;
+  }
+
+  // Accept the WebSocket with the base64 of the SHA-1 of the key and the GUID.
+  key += sizeof(key_header) - 1;
+  size_t key_len = strcspn(key, "\r\n");
+  char accept_input[64 + sizeof(socket_guid)];
+  if (key_len > 64) {
+    events_close(client);
+    return 0;
+  }
+  memcpy(accept_input, key, key_len);
+  memcpy(&accept_input[key_len], socket_guid, sizeof(socket_guid) - 1);
+  uint8_t digest[SHA1_SIZE];
+  sha1(accept_input, key_len + sizeof(socket_guid) - 1, digest);
+
+  static const char base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char accept[29];
+  for (size_t i = 0, o = 0; i < SHA1_SIZE; i += 3, o += 4) {
+    uint32_t bits = (uint32_t) digest[i] << 16;
+    bits |= i + 1 < SHA1_SIZE ? (uint32_t) digest[i + 1] << 8 : 0;
+    bits |= i + 2 < SHA1_SIZE ? digest[i + 2] : 0;
+    accept[o] = base64[(bits >> 18) & 0x3f];
+    accept[o + 1] = base64[(bits >> 12) & 0x3f];
+    accept[o + 2] = i + 1 < SHA1_SIZE ? base64[(bits >> 6) & 0x3f] : '=';
+    accept[o + 3] = i + 2 < SHA1_SIZE ? base64[bits & 0x3f] : '=';
+  }
+  accept[28] = '\0';
+
+  char response[160];
+  int response_len = snprintf(response, sizeof(response),
+                              "HTTP/1.1 101 Switching Protocols\r\n"
+                              "Upgrade: websocket\r\n"
+                              "Connection: Upgrade\r\n"
+                              "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+  if (!events_send(client, response, (size_t) response_len)) {
+    events_close(client);
+    return 0;
+  }
+  printf("WebSocket connected.\n");
+  client->mode = EVENTS_SOCKET;
+  return end;
+}
+
+static err_t events_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p,
+                            err_t err) {
+  event_client_t *client = (event_client_t*) arg;
+  events_aborted = NULL;
+  if (!p) {
+    events_close(client);
+    return events_aborted == tpcb ? ERR_ABRT : ERR_OK;
+  }
+  if (client->pending) {
+    pbuf_cat(client->pending, p);
+    p = client->pending;
+    client->pending = NULL;
+  }
+
+  uint16_t used = 0;
+  if (client->mode == EVENTS_REQUEST) {
+    used = events_recv_request(client, p);
+  }
+  while (client->mode == EVENTS_SOCKET && used < p->tot_len) {
+    uint16_t frame = socket_recv_frame(client, p, used);
+    if (frame == 0) {
+      break;
+    }
+    used += frame;
+  }
+  // Nothing else is expected from the clients following the events.
+  if (client->mode == EVENTS_STREAM) {
+    used = p->tot_len;
+  }
+
+  if (!client->pcb) {
+    pbuf_free(p);
+    // lwIP must not use the pcb once aborted.
+    return events_aborted == tpcb ? ERR_ABRT : ERR_OK;
+  }
+  tcp_recved(tpcb, used);
+  if (used < p->tot_len) {
+    client->pending = pbuf_free_header(p, used);
+  } else {
+    pbuf_free(p);
+  }
+  return ERR_OK;
+}
+
+static void events_err_cb(void *arg, err_t err) {
+  event_client_t *client = (event_client_t*) arg;
+  client->pcb = NULL;
+  events_close(client);
+}
+
+static err_t events_accept_cb(void *arg, struct tcp_pcb *client_pcb, err_t err) {
+  if (err != ERR_OK || client_pcb == NULL) {
+    return ERR_VAL;
+  }
+  event_client_t *client = NULL;
+  for (size_t i = 0; i < EVENTS_MAX_CLIENTS && !client; i++) {
+    if (!event_clients[i].pcb) {
+      client = &event_clients[i];
+    }
+  }
+  if (!client) {
+    printf("Too many event clients\n");
+    tcp_abort(client_pcb);
+    return ERR_ABRT;
+  }
+  client->pcb = client_pcb;
+  client->mode = EVENTS_REQUEST;
+  // The output buffered before the client connected is still sent to it, as it
+  // only gets moved to the log once read.
+  client->stdout_read = event_log_end;
+
+  // Notice the browsers which went away without closing the connection.
+  ip_set_option(client_pcb, SOF_KEEPALIVE);
+  client_pcb->keep_idle = 5000; // 5000ms
+  client_pcb->keep_intvl = 1000; // 1000ms
+  client_pcb->keep_cnt = 5;
+  tcp_arg(client_pcb, client);
+  tcp_recv(client_pcb, events_recv_cb);
+  tcp_err(client_pcb, events_err_cb);
+  return ERR_OK;
+}
+
+static bool events_init() {
+  struct tcp_pcb *pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
+  if (!pcb) {
+    return false;
+  }
+  if (tcp_bind(pcb, NULL, EVENTS_PORT) != ERR_OK) {
+    tcp_close(pcb);
+    return false;
+  }
+  events_pcb = tcp_listen_with_backlog(pcb, EVENTS_MAX_CLIENTS);
+  if (!events_pcb) {
+    tcp_close(pcb);
+    return false;
+  }
+  tcp_accept(events_pcb, events_accept_cb);
+  return true;
 }
 
 // ---------------------------------------------------------
@@ -313,6 +1851,9 @@ bool web_server_setup() {
   httpd_init();
   ssi_init();
   cgi_init();
+  if (!events_init()) {
+    printf("Failure to listen for event streams on port %u.\n", EVENTS_PORT);
+  }
   printf("HTTPD initialized.\n");
   return true;
 }
@@ -321,6 +1862,8 @@ void web_server_loop() {
   while (true) {
     cyw43_arch_poll();
     exec_web_task();
+    push_events();
+    usb_host_supervise();
   }
 }
 
@@ -6,6 +6,7 @@
 // Functions which are used to manipulate internal pbuf.
 uint8_t* get_postmsg_buffer(void* arg);
 size_t get_postmsg_length(void* arg);
+void* get_postmsg_usb_info(void* arg);
 void free_postmsg(void* arg);
 
 // Setup the web server which then uses IRQ to interrut and call the signal
@@ -27,6 +28,9 @@ void web_server_loop();
 // Ask the web client to send the uf2 images back to us.
 void request_flash(void*);
 
+void report_file_opened(void*);
+void report_file_closed(void*);
+
 // Report any error to write on the USB device.
 void write_error(void*);
 